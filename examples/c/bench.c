@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined __linux__ || defined __APPLE__
+#include <time.h>
+#define UNUSED __attribute__ ((unused))
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#define UNUSED
+#endif
+
+#include "spotflow.h"
+
+// Measures the overhead of calling the Device SDK through its C interface: the time of each call as seen from C is
+// compared with the time the Rust code reports for the same calls in the client metrics.
+
+#define DB_PATH "c/bench.db"
+#define DEFAULT_DEVICE_ID "test-device-c-bench"
+#define STREAM_GROUP "device-sdk"
+#define STREAM "c"
+#define MESSAGE_COUNT 10000
+
+#define APPROVE_OPERATION_PYTHON_CMD_FORMAT "python -c \"from python.spotflow_cloud import approve_registration; approve_registration('%s')\""
+
+static const size_t payload_sizes[] = { 64, 1024, 16 * 1024 };
+
+void print_error()
+{
+    size_t len = SPOTFLOW_ERROR_MAX_LENGTH;
+    char* buf = malloc(len);
+    spotflow_read_last_error_message(buf, len);
+    printf("ERROR: %s\n", buf);
+    free(buf);
+}
+
+void display_and_approve_provisioning_operation(const spotflow_provisioning_operation_t* operation, UNUSED void* ctx)
+{
+    printf("Operation ID: %s\n", operation->id);
+    printf("Verification Code: %s\n", operation->verification_code);
+    printf("Approving the operation...\n");
+
+    // Approve the operation so that this code can run automatically (the device wouldn't have the right to do that in real settings).
+    // Use external Python code so that we don't need to reimplement the approval in C.
+    char* cmd = malloc(strlen(APPROVE_OPERATION_PYTHON_CMD_FORMAT) + strlen(operation->id) + 1);
+    sprintf(cmd, APPROVE_OPERATION_PYTHON_CMD_FORMAT, operation->id);
+    system(cmd);
+    free(cmd);
+}
+
+// A monotonic timestamp in microseconds
+double now_us()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e6 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+#endif
+}
+
+int get_metrics(spotflow_client_t* client, spotflow_metrics_t* metrics)
+{
+    if (spotflow_client_get_metrics(client, metrics))
+    {
+        printf("Unable to get the client metrics\n");
+        print_error();
+        return 1;
+    }
+    return 0;
+}
+
+// The baseline cost of crossing the C interface with a call that does almost no work in Rust
+void bench_context_roundtrip()
+{
+    spotflow_message_context_t* context;
+    int i;
+
+    double start = now_us();
+    for (i = 0; i < MESSAGE_COUNT; i++)
+    {
+        spotflow_message_context_create(&context, STREAM_GROUP, STREAM);
+        spotflow_message_context_destroy(context);
+    }
+    double elapsed = now_us() - start;
+
+    printf("context create+destroy: %.3f us per pair\n", elapsed / MESSAGE_COUNT);
+}
+
+int bench_enqueue(spotflow_client_t* client, size_t payload_size)
+{
+    spotflow_message_context_t* context;
+    spotflow_message_context_create(&context, STREAM_GROUP, STREAM);
+
+    uint8_t* data = calloc(payload_size, 1);
+    spotflow_metrics_t* before = malloc(sizeof(spotflow_metrics_t));
+    spotflow_metrics_t* after = malloc(sizeof(spotflow_metrics_t));
+    int i, result = 1;
+
+    if (get_metrics(client, before))
+        goto cleanup;
+
+    double start = now_us();
+    for (i = 0; i < MESSAGE_COUNT; i++)
+    {
+        if (spotflow_client_enqueue_message(client, context, NULL, NULL, data, payload_size))
+        {
+            printf("Error during enqueuing a message\n");
+            print_error();
+            goto cleanup;
+        }
+    }
+    double elapsed = now_us() - start;
+
+    if (spotflow_client_wait_enqueued_messages_sent(client))
+    {
+        printf("Error during waiting for the messages to be sent\n");
+        print_error();
+        goto cleanup;
+    }
+
+    if (get_metrics(client, after))
+        goto cleanup;
+
+    uint64_t calls = after->enqueue_latency.count - before->enqueue_latency.count;
+    double rust_us = (double)(after->enqueue_latency.sum_us - before->enqueue_latency.sum_us);
+    double c_mean = elapsed / MESSAGE_COUNT;
+    double rust_mean = calls > 0 ? rust_us / (double)calls : 0.0;
+
+    printf(
+        "enqueue %6lu B: %.3f us per call from C, %.3f us in Rust, FFI overhead %.3f us\n",
+        (unsigned long)payload_size,
+        c_mean,
+        rust_mean,
+        c_mean - rust_mean);
+
+    result = 0;
+
+cleanup:
+    free(before);
+    free(after);
+    free(data);
+    spotflow_message_context_destroy(context);
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    // The program accepts one optional parameter - Device ID
+    char* device_id = (argc >= 2) ? argv[1] : DEFAULT_DEVICE_ID;
+    size_t i;
+
+    spotflow_set_log_level(SPOTFLOW_LOG_WARN);
+#ifdef _WIN32
+    setvbuf (stdout, NULL, _IONBF, 0);
+#endif
+
+    const char* instance = getenv("SPOTFLOW_DEVICE_SDK_TEST_INSTANCE");
+    if (instance == NULL)
+    {
+        instance = "api.eu1.spotflow.io";
+    }
+
+    const char* provisioning_token = getenv("SPOTFLOW_DEVICE_SDK_TEST_PROVISIONING_TOKEN");
+    if (provisioning_token == NULL)
+    {
+        printf("The SPOTFLOW_DEVICE_SDK_TEST_PROVISIONING_TOKEN environment variable must be set to run this benchmark\n");
+        return 1;
+    }
+
+    spotflow_client_options_t* options;
+    spotflow_client_options_create(&options, device_id, provisioning_token, DB_PATH);
+    spotflow_client_options_set_instance(options, instance);
+    spotflow_client_options_set_display_provisioning_operation_callback(options, display_and_approve_provisioning_operation, NULL);
+
+    spotflow_client_t* client;
+    if (spotflow_client_start(&client, options))
+    {
+        printf("Unable to start the client\n");
+        print_error();
+        return 1;
+    }
+
+    bench_context_roundtrip();
+
+    int result = 0;
+    for (i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); i++)
+    {
+        if (bench_enqueue(client, payload_sizes[i]))
+        {
+            result = 1;
+            break;
+        }
+    }
+
+    spotflow_client_destroy(client);
+    spotflow_client_options_destroy(options);
+
+    return result;
+}
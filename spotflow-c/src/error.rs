@@ -19,6 +19,8 @@ pub enum CResult {
     SpotflowInsufficientBuffer,
     /// The client cannot provide the response because it is not connected to the platform.
     SpotflowNotReady,
+    /// The queue is full, the function didn't do anything and can be called again later.
+    SpotflowQueueFull,
     // This can be extended to accomodate more specific errors
 }
 
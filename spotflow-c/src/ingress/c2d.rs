@@ -1,12 +1,12 @@
-use std::panic::AssertUnwindSafe;
+use std::{cell::RefCell, panic::AssertUnwindSafe};
 
 use libc::{c_char, c_void, size_t};
 use spotflow::{CloudToDeviceMessage, DeviceClient};
 
 use crate::{
-    call_safe_with_result, drop_str_ptr, ensure_logging,
+    call_safe_with_result, ensure_logging,
     error::{update_last_error, CResult},
-    ptr_to_ref, string_to_ptr,
+    ptr_to_ref,
 };
 
 /// The callback to process an incoming Cloud-to-Device Message. The callback is called only if you have configured it
@@ -22,6 +22,19 @@ use crate::{
 #[allow(non_camel_case_types)]
 pub type C2dCallback = extern "C" fn(msg: *const C2dMessage, context: *mut c_void);
 
+/// The callback to process a batch of incoming Cloud-to-Device Messages. The callback is called only if you have
+/// configured it using @ref spotflow_client_register_c2d_batch_callback. It works like @ref spotflow_c2d_callback_t,
+/// but it receives all the Messages that were already received (up to 64) at once, in the order they were received.
+/// When the callback returns, all the Messages of the batch are deleted together. If the callback does not return, all
+/// of them will be delivered again on subsequent runs.
+///
+/// @param msgs The array of the Cloud-to-Device Messages. See @ref spotflow_c2d_message_t for details.
+/// @param count The number of the Messages in `msgs`, at least 1.
+/// @param context The optional context that was configured in @ref spotflow_client_register_c2d_batch_callback.
+#[allow(non_camel_case_types)]
+pub type C2dBatchCallback =
+    extern "C" fn(msgs: *const C2dMessage, count: size_t, context: *mut c_void);
+
 /// A Cloud-to-Device Message. This object is managed by the Device SDK and its contents must not be modified.
 /// It's referenced from @ref spotflow_c2d_callback_t and the lifetime of @ref spotflow_c2d_message_t is the same as the
 /// lifetime of the callback. If you need to keep the message for longer, copy it to your own memory.
@@ -90,33 +103,69 @@ unsafe extern "C" fn spotflow_client_register_c2d_callback(
     };
     let context = Context(context);
 
+    let arena = RefCell::new(MarshallArena::default());
+
     let callback = move |msg: &CloudToDeviceMessage| {
-        let mut properties = Vec::with_capacity(msg.properties.len());
-        for (key, value) in msg.properties.iter() {
-            let key = string_to_ptr(key.clone());
-            let value = string_to_ptr(value.clone());
-            let property = C2dProperty { name: key, value };
-            properties.push(property);
-        }
-        let c_msg = C2dMessage {
-            content_length: msg.content.len(),
-            content: msg.content.as_ptr(),
-            properties_count: msg.properties.len(),
-            properties: properties.as_ptr(),
-        };
+        let mut arena = arena.borrow_mut();
+        let c_msgs = arena.marshall(std::slice::from_ref(msg));
 
         // Disjoint capture -- we need the whole object because it implements Send while the *mut c_void contained therein does not (https://doc.rust-lang.org/edition-guide/rust-2021/disjoint-capture-in-closures.html)
         // *mut c_void does not implement Send and without this we get errors about that since only the pointer is captured
         _ = &context;
-        callback(&c_msg, context.0);
+        callback(c_msgs.as_ptr(), context.0);
+    };
 
-        for property in properties {
-            drop_str_ptr(property.name as *mut c_char);
-            drop_str_ptr(property.value as *mut c_char);
+    match client.process_c2d(callback) {
+        Ok(_) => CResult::SpotflowOk,
+        Err(e) => {
+            update_last_error(e);
+            CResult::SpotflowError
         }
+    }
+}
+
+/// Register a function that will be invoked with batches of Cloud-to-Device Messages received by the device. It
+/// replaces @ref spotflow_client_register_c2d_callback when the device receives many Messages at once, because the
+/// Messages are loaded from the local database file and deleted from it together. Only one of these two functions can
+/// be called for a client. See @ref spotflow_c2d_batch_callback_t for details.
+///
+/// @param client The @ref spotflow_client_t object to register the callback for.
+/// @param callback The callback to invoke for every batch of Cloud-to-Device Messages.
+/// @param context (Optional) The context to pass to the callback. The data referenced by the pointer must be valid
+///                until @ref spotflow_client_destroy is called. Use `NULL` if you don't need to pass any data.
+/// @return @ref SPOTFLOW_OK if the callback was registered successfully, @ref SPOTFLOW_ERROR otherwise.
+#[no_mangle]
+#[allow(deprecated)] // We'll use the current interface until it's stabilized
+                     /*pub*/
+unsafe extern "C" fn spotflow_client_register_c2d_batch_callback(
+    client: *mut DeviceClient,
+    callback: C2dBatchCallback,
+    context: *mut c_void,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+    let result = call_safe_with_result(|| {
+        ensure_logging();
+
+        ptr_to_ref(*client)
+    });
+    let client = match result {
+        Ok(ingress) => ingress,
+        Err(e) => return e,
     };
+    let context = Context(context);
 
-    match client.process_c2d(callback) {
+    let arena = RefCell::new(MarshallArena::default());
+
+    let callback = move |msgs: &[CloudToDeviceMessage]| {
+        let mut arena = arena.borrow_mut();
+        let c_msgs = arena.marshall(msgs);
+
+        // See the disjoint capture in `spotflow_client_register_c2d_callback`
+        _ = &context;
+        callback(c_msgs.as_ptr(), c_msgs.len(), context.0);
+    };
+
+    match client.process_c2d_batch(callback) {
         Ok(_) => CResult::SpotflowOk,
         Err(e) => {
             update_last_error(e);
@@ -124,3 +173,159 @@ unsafe extern "C" fn spotflow_client_register_c2d_callback(
         }
     }
 }
+
+/// The memory of the marshalled messages, reused by all the invocations of a callback so that they don't allocate
+/// once the buffers are large enough. All the property names and values are stored one after another in a single
+/// buffer as null-terminated strings.
+#[derive(Default)]
+struct MarshallArena {
+    strings: Vec<u8>,
+    // The offsets of the name and the value of each property in `strings`
+    offsets: Vec<(usize, usize)>,
+    properties: Vec<C2dProperty>,
+    messages: Vec<C2dMessage>,
+}
+
+// The pointers in the arena point only to its own buffers and to the messages that are being marshalled, they're never
+// used after the callback returns
+unsafe impl Send for MarshallArena {}
+
+impl MarshallArena {
+    /// Lay out the messages in the arena. The returned messages are valid until the next call.
+    fn marshall(&mut self, msgs: &[CloudToDeviceMessage]) -> &[C2dMessage] {
+        self.strings.clear();
+        self.offsets.clear();
+        self.properties.clear();
+        self.messages.clear();
+
+        // All the strings are written before any pointers are taken because the buffer can be reallocated meanwhile
+        for msg in msgs {
+            for (name, value) in &msg.properties {
+                let name = self.push_str(name);
+                let value = self.push_str(value);
+                self.offsets.push((name, value));
+            }
+        }
+
+        let strings = self.strings.as_ptr();
+        self.properties
+            .extend(self.offsets.iter().map(|&(name, value)| C2dProperty {
+                name: strings.wrapping_add(name).cast(),
+                value: strings.wrapping_add(value).cast(),
+            }));
+
+        let mut properties = self.properties.as_ptr();
+        for msg in msgs {
+            self.messages.push(C2dMessage {
+                content_length: msg.content.len(),
+                content: msg.content.as_ptr(),
+                properties_count: msg.properties.len(),
+                properties,
+            });
+            properties = properties.wrapping_add(msg.properties.len());
+        }
+
+        &self.messages
+    }
+
+    // Returns the offset of the string in the buffer. Strings containing a null character are cut short by it because
+    // C couldn't read the rest anyway.
+    fn push_str(&mut self, s: &str) -> usize {
+        let offset = self.strings.len();
+        let bytes = s.as_bytes();
+        let length = bytes.iter().position(|&b| b == 0).unwrap_or(bytes.len());
+        self.strings.extend_from_slice(&bytes[..length]);
+        self.strings.push(0);
+        offset
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{collections::HashMap, ffi::CStr};
+
+    use super::*;
+
+    fn message(content: &[u8], properties: &[(&str, &str)]) -> CloudToDeviceMessage {
+        CloudToDeviceMessage::new(
+            content.to_vec(),
+            properties
+                .iter()
+                .map(|(name, value)| ((*name).to_owned(), (*value).to_owned()))
+                .collect(),
+        )
+    }
+
+    // Read the marshalled message the way the C code does
+    unsafe fn read(msg: &C2dMessage) -> (Vec<u8>, HashMap<String, String>) {
+        let content = std::slice::from_raw_parts(msg.content, msg.content_length).to_vec();
+        let properties = (0..msg.properties_count)
+            .map(|i| {
+                let property = &*msg.properties.add(i);
+                let name = CStr::from_ptr(property.name).to_str().unwrap();
+                let value = CStr::from_ptr(property.value).to_str().unwrap();
+                (name.to_owned(), value.to_owned())
+            })
+            .collect();
+        (content, properties)
+    }
+
+    fn expected(content: &[u8], properties: &[(&str, &str)]) -> (Vec<u8>, HashMap<String, String>) {
+        let msg = message(content, properties);
+        (msg.content, msg.properties)
+    }
+
+    #[test]
+    fn marshalled_messages_point_to_their_own_properties() {
+        let msgs = [
+            message(b"first", &[("a", "1"), ("b", "2")]),
+            message(b"", &[]),
+            // C reads the strings only up to the first null character, the content is binary
+            message(
+                b"third\0binary",
+                &[
+                    ("name\0hidden", "value"),
+                    ("c", "before\0after"),
+                    ("d", "4"),
+                ],
+            ),
+        ];
+
+        let mut arena = MarshallArena::default();
+        let marshalled = arena.marshall(&msgs);
+
+        assert_eq!(marshalled.len(), 3);
+        let received = marshalled
+            .iter()
+            .map(|msg| unsafe { read(msg) })
+            .collect::<Vec<_>>();
+        assert_eq!(
+            received,
+            [
+                expected(b"first", &[("a", "1"), ("b", "2")]),
+                expected(b"", &[]),
+                expected(
+                    b"third\0binary",
+                    &[("name", "value"), ("c", "before"), ("d", "4")]
+                ),
+            ]
+        );
+    }
+
+    #[test]
+    fn arena_is_reused_for_the_following_messages() {
+        let mut arena = MarshallArena::default();
+        let long = "x".repeat(1000);
+        arena.marshall(&[message(b"large", &[("a", long.as_str())])]);
+
+        let msgs = [message(b"", &[]), message(b"small", &[("b", "2")])];
+        let marshalled = arena.marshall(&msgs);
+
+        assert_eq!(marshalled.len(), 2);
+        assert_eq!(unsafe { read(&marshalled[0]) }, expected(b"", &[]));
+        assert_eq!(
+            unsafe { read(&marshalled[1]) },
+            expected(b"small", &[("b", "2")])
+        );
+    }
+}
@@ -0,0 +1,181 @@
+use std::{ffi::CString, time::Duration};
+
+use anyhow::Result;
+use libc::{c_char, c_void, size_t};
+use spotflow::{DeviceClient, DeviceClientBuilder};
+
+use crate::{
+    buffer_to_slice, call_safe_with_unit_result, ensure_logging, error::CResult, ptr_to_mut,
+};
+
+use super::ClientOptions;
+
+/// The callback to be called for each [Direct Method](https://docs.spotflow.io/configure-devices/#direct-methods) call
+/// received by the device. The callback is called only if you have configured it by
+/// @ref spotflow_client_options_set_method_handler. The callback is called on one of the threads of the pool
+/// configured by @ref spotflow_client_options_set_method_handler_concurrency, so several calls can run at the same
+/// time.
+///
+/// All the pointers are valid only until the callback returns.
+///
+/// @param method_name The name of the called method as a null-terminated string encoded in UTF-8.
+/// @param payload The payload of the call.
+/// @param payload_length The length of the payload in bytes.
+/// @param response The @ref spotflow_method_response_t object to which the callback can write the payload of the
+///                 response using @ref spotflow_method_response_set_payload.
+/// @param context The optional context that was configured by @ref spotflow_client_options_set_method_handler.
+/// @return The status of the call that is returned to the caller, for example, 200 if the call succeeded.
+pub type MethodHandlerCallback = Option<
+    extern "C" fn(
+        method_name: *const c_char,
+        payload: *const u8,
+        payload_length: size_t,
+        response: *mut MethodResponse,
+        context: *mut c_void,
+    ) -> i32,
+>;
+
+/// The response to a [Direct Method](https://docs.spotflow.io/configure-devices/#direct-methods) call. This object is
+/// managed by the Device SDK and it's valid only during the call of @ref spotflow_method_handler_callback_t.
+pub struct MethodResponse {
+    payload: Vec<u8>,
+}
+
+pub(super) struct MethodHandlerCallbackHolder {
+    // This definition must be kept in sync with `MethodHandlerCallback` until
+    // https://github.com/mozilla/cbindgen/issues/326 is fixed (we'll be able to remove the `Option` then)
+    pub(super) callback: extern "C" fn(
+        method_name: *const c_char,
+        payload: *const u8,
+        payload_length: size_t,
+        response: *mut MethodResponse,
+        context: *mut c_void,
+    ) -> i32,
+    pub(super) context: *mut c_void,
+}
+
+// It's the responsibility of the caller to synchronize access to the context
+unsafe impl Send for MethodHandlerCallbackHolder {}
+unsafe impl Sync for MethodHandlerCallbackHolder {}
+
+impl MethodHandlerCallbackHolder {
+    pub(super) fn handle(&self, method_name: String, payload: &[u8]) -> (i32, Vec<u8>) {
+        let mut response = MethodResponse {
+            payload: Vec::new(),
+        };
+
+        // MQTT topics cannot contain null characters, so the method name cannot either
+        let method_name = CString::new(method_name).unwrap_or_default();
+        let status = (self.callback)(
+            method_name.as_ptr(),
+            payload.as_ptr(),
+            payload.len(),
+            &mut response,
+            self.context,
+        );
+
+        (status, response.payload)
+    }
+
+    #[allow(deprecated)] // We'll use the current interface until it's stabilized
+    pub(super) fn build_client(self, builder: DeviceClientBuilder) -> Result<DeviceClient> {
+        builder
+            .with_method_handler(move |method_name, payload: &[u8]| {
+                self.handle(method_name, payload)
+            })
+            .build()
+    }
+}
+
+/// Set the function that is called for each [Direct Method](https://docs.spotflow.io/configure-devices/#direct-methods)
+/// call received by the device. The function is called in a separate thread, so make sure that you properly
+/// synchronize access to your shared resources. The network communication of the client continues while the
+/// function runs.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param callback (Optional) The function that is called for each Direct Method call. Use `NULL` if you don't want
+///                 to handle Direct Methods.
+/// @param context (Optional) The context that will be passed to `callback`. It will be used from different threads,
+///                so make sure that it's properly synchronized. Use `NULL` if you don't want to specify it.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_method_handler(
+    options: *mut ClientOptions,
+    callback: MethodHandlerCallback,
+    context: *mut c_void,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.method_handler_callback = callback;
+        options.method_handler_context = context;
+
+        Ok(())
+    })
+}
+
+/// Set how many [Direct Method](https://docs.spotflow.io/configure-devices/#direct-methods) calls are handled at the
+/// same time, each of them on a separate thread (1 by default, at least 1). The calls that arrive while all the
+/// threads are busy wait for a free one.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param concurrency The maximum number of Direct Method calls handled at the same time.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_method_handler_concurrency(
+    options: *mut ClientOptions,
+    concurrency: size_t,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.method_handler_concurrency = Some(concurrency);
+        Ok(())
+    })
+}
+
+/// Set how long the function configured by @ref spotflow_client_options_set_method_handler can run (no limit by
+/// default). When the time runs out, the call is answered with the status 504 and the result of the function is
+/// discarded once it returns.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param timeout_ms The longest time in milliseconds a Direct Method call can be handled.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_method_handler_timeout(
+    options: *mut ClientOptions,
+    timeout_ms: u32,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.method_handler_timeout = Some(Duration::from_millis(timeout_ms.into()));
+        Ok(())
+    })
+}
+
+/// Set the payload of the response to a [Direct Method](https://docs.spotflow.io/configure-devices/#direct-methods)
+/// call. The payload is copied, so the buffer can be freed right after this function returns.
+///
+/// @param response The @ref spotflow_method_response_t object passed to @ref spotflow_method_handler_callback_t.
+/// @param buffer The buffer that contains the payload, usually a JSON document.
+/// @param length The length of the buffer in bytes.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_method_response_set_payload(
+    response: *mut MethodResponse,
+    buffer: *const u8,
+    length: size_t,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let response = unsafe { ptr_to_mut(response) }?;
+        let payload = unsafe { buffer_to_slice(buffer, length) }?;
+        response.payload = payload.to_vec();
+        Ok(())
+    })
+}
@@ -0,0 +1,150 @@
+use std::panic::AssertUnwindSafe;
+use std::time::Duration;
+
+use libc::size_t;
+use spotflow::{CompressionStatistics, DeviceClient, LatencyHistogram};
+
+use crate::{
+    call_safe_with_result, ensure_logging, error::CResult, ptr_to_ref, store_to_ptr,
+    SPOTFLOW_METRICS_HISTOGRAM_BUCKETS,
+};
+
+/// The distribution of durations measured by the Device SDK. The bucket with index `i` counts the durations shorter
+/// than `2^i` microseconds that don't fit into the previous buckets, the last bucket counts all the longer durations.
+#[repr(C)]
+pub struct Histogram {
+    /// The number of recorded durations.
+    pub count: u64,
+    /// The sum of the recorded durations in microseconds.
+    pub sum_us: u64,
+    /// The number of recorded durations in each bucket.
+    pub buckets: [u64; SPOTFLOW_METRICS_HISTOGRAM_BUCKETS],
+}
+
+/// The statistics of compressing the [Messages](https://docs.spotflow.io/send-data/#message) with one compression
+/// level.
+#[repr(C)]
+pub struct CompressionMetrics {
+    /// The number of compressed [Messages](https://docs.spotflow.io/send-data/#message).
+    pub messages: u64,
+    /// The total size of the Messages before compression in bytes.
+    pub uncompressed_bytes: u64,
+    /// The total size of the Messages after compression in bytes. The Messages that wouldn't get smaller are sent
+    /// uncompressed and count with their original size.
+    pub compressed_bytes: u64,
+    /// How long the compression of each Message took.
+    pub duration: Histogram,
+}
+
+/// The snapshot of the metrics of a @ref spotflow_client_t since it was started. Obtain it using
+/// @ref spotflow_client_get_metrics.
+#[repr(C)]
+pub struct Metrics {
+    /// The number of [Messages](https://docs.spotflow.io/send-data/#message) waiting to be sent.
+    pub pending_messages: size_t,
+    /// How long the calls enqueuing Messages took, one sample per call.
+    pub enqueue_latency: Histogram,
+    /// How long the Messages waited in the local database file before they were sent. Only the Messages stored since
+    /// the client was started are measured, and only if fewer than 4096 Messages were stored while they waited.
+    pub time_in_queue: Histogram,
+    /// How long it took the Platform to acknowledge the sent Messages.
+    pub puback_round_trip: Histogram,
+    /// How long the statements storing, reading, and removing Messages in the local database file took.
+    pub sqlite_statement_latency: Histogram,
+    /// The compression of the Messages using @ref SPOTFLOW_COMPRESSION_FASTEST.
+    pub compression_fastest: CompressionMetrics,
+    /// The compression of the Messages using @ref SPOTFLOW_COMPRESSION_SMALLEST_SIZE.
+    pub compression_smallest_size: CompressionMetrics,
+    /// The compression of the Messages using @ref SPOTFLOW_COMPRESSION_SMALL_MESSAGES.
+    pub compression_small_messages: CompressionMetrics,
+    /// The number of MQTT messages published to the Platform. Messages packed together by
+    /// @ref spotflow_client_options_set_message_coalescing count as one.
+    pub messages_sent: u64,
+    /// The number of bytes of the topics and the payloads of the published MQTT messages.
+    pub bytes_sent: u64,
+    /// The number of times the client connected again after losing the connection.
+    pub reconnects: u64,
+    /// The number of connection attempts that failed, including the ones before the first connection.
+    pub failed_connection_attempts: u64,
+    /// How long the client was disconnected the last time it lost the connection in milliseconds, 0 if it never
+    /// reconnected.
+    pub last_outage_ms: u64,
+    /// How long the client was disconnected in total in milliseconds, not including the time before the first
+    /// connection.
+    pub total_outage_ms: u64,
+}
+
+/// Get the snapshot of the metrics of the client since it was started, such as the latencies of enqueuing and sending
+/// [Messages](https://docs.spotflow.io/send-data/#message), the efficiency of their compression, and the statistics
+/// of the reconnections to the Platform.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param metrics (Output) The @ref spotflow_metrics_t structure to fill with the metrics.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub extern "C" fn spotflow_client_get_metrics(
+    client: *const DeviceClient,
+    metrics: *mut Metrics,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+
+    let result = call_safe_with_result(|| {
+        ensure_logging();
+
+        let client = unsafe { ptr_to_ref(*client) }?;
+        Ok(client.metrics())
+    });
+
+    match result {
+        Err(e) => e,
+        Ok(snapshot) => {
+            let reconnects = snapshot.reconnects;
+            let snapshot = Metrics {
+                pending_messages: snapshot.pending_messages,
+                enqueue_latency: Histogram::from(&snapshot.enqueue_latency),
+                time_in_queue: Histogram::from(&snapshot.time_in_queue),
+                puback_round_trip: Histogram::from(&snapshot.puback_round_trip),
+                sqlite_statement_latency: Histogram::from(&snapshot.sqlite_statement_latency),
+                compression_fastest: CompressionMetrics::from(&snapshot.compression_fastest),
+                compression_smallest_size: CompressionMetrics::from(
+                    &snapshot.compression_smallest_size,
+                ),
+                compression_small_messages: CompressionMetrics::from(
+                    &snapshot.compression_small_messages,
+                ),
+                messages_sent: snapshot.messages_sent,
+                bytes_sent: snapshot.bytes_sent,
+                reconnects: reconnects.reconnects,
+                failed_connection_attempts: reconnects.failed_attempts,
+                last_outage_ms: reconnects.last_outage.map_or(0, millis),
+                total_outage_ms: millis(reconnects.total_outage),
+            };
+            unsafe { store_to_ptr(metrics, snapshot) }
+        }
+    }
+}
+
+impl From<&LatencyHistogram> for Histogram {
+    fn from(histogram: &LatencyHistogram) -> Self {
+        Self {
+            count: histogram.count,
+            sum_us: u64::try_from(histogram.sum.as_micros()).unwrap_or(u64::MAX),
+            buckets: histogram.buckets,
+        }
+    }
+}
+
+impl From<&CompressionStatistics> for CompressionMetrics {
+    fn from(statistics: &CompressionStatistics) -> Self {
+        Self {
+            messages: statistics.messages,
+            uncompressed_bytes: statistics.uncompressed_bytes,
+            compressed_bytes: statistics.compressed_bytes,
+            duration: Histogram::from(&statistics.duration),
+        }
+    }
+}
+
+fn millis(duration: Duration) -> u64 {
+    u64::try_from(duration.as_millis()).unwrap_or(u64::MAX)
+}
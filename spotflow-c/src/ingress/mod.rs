@@ -1,6 +1,7 @@
 use std::ffi::CString;
 use std::panic::AssertUnwindSafe;
 use std::ptr::null_mut;
+use std::time::Duration;
 
 use anyhow::{anyhow, bail, Result};
 use libc::{c_char, c_void, size_t};
@@ -11,14 +12,20 @@ use spotflow::{
 use crate::dps::{DisplayProvisioningOperationCallback, ProvisioningOperation};
 use crate::error::{update_last_error, CResult};
 use crate::marshall::Marshall;
+use crate::runtime::Runtime;
 use crate::{
     buffer_to_slice, call_safe_with_result, call_safe_with_unit_result, drop_ptr, ensure_logging,
     obj_to_ptr, ptr_to_mut, ptr_to_ref, ptr_to_str, ptr_to_str_option, store_to_ptr,
 };
 
+use self::methods::{MethodHandlerCallback, MethodHandlerCallbackHolder};
+use self::submission::{EnqueueCompletedCallback, EnqueueCompletedCallbackHolder};
 use self::twins::DesiredPropertiesUpdatedCallback;
 
 mod c2d;
+mod methods;
+mod metrics;
+mod submission;
 mod twins;
 
 /// The compression to use for sending [Messages](https://docs.spotflow.io/send-data/#message).
@@ -32,6 +39,11 @@ pub enum Compression {
     /// Beware that this may be significantly slower than the fastest compression.
     /// We recommend to test the performance of your application with this setting before using it in production.
     SpotflowCompressionSmallestSize,
+    /// Compress the message using the algorithm settings tuned for short textual messages such as JSON telemetry with
+    /// the same keys in every message. These settings use the dictionary of common words and tokens built into the
+    /// compression algorithm, which the fastest compression skips, while being faster than the smallest size
+    /// compression.
+    SpotflowCompressionSmallMessages,
 }
 
 impl Compression {
@@ -42,10 +54,77 @@ impl Compression {
             Compression::SpotflowCompressionSmallestSize => {
                 Some(spotflow::Compression::SmallestSize)
             }
+            Compression::SpotflowCompressionSmallMessages => {
+                Some(spotflow::Compression::SmallMessages)
+            }
         }
     }
 }
 
+/// Specifies how the outgoing [Messages](https://docs.spotflow.io/send-data/#message) are written to the local database
+/// file and how they are handed over to the background thread that sends them to the Platform.
+#[repr(C)]
+pub enum Durability {
+    /// Each Message is written to the local database file before the enqueue function returns. The background thread
+    /// then reads it back from the file before sending it.
+    SpotflowDurabilityFull = 0,
+    /// Each Message is written to the local database file before the enqueue function returns, but the background thread
+    /// receives it directly from memory. The file is read only after a restart or when too many Messages are waiting
+    /// to be sent. The enqueue functions copy the buffer into memory.
+    SpotflowDurabilityInMemoryHandoff,
+    /// The Messages are kept in memory and written to the local database file in a single transaction once enough of them
+    /// accumulate or the oldest of them has waited for too long. The enqueue functions return before the Messages are
+    /// written, so the Messages from this window are lost if the process crashes.
+    /// See @ref spotflow_client_options_set_group_commit for the size of the window.
+    SpotflowDurabilityGroupCommit,
+}
+
+/// Specifies how the local database file is configured.
+#[repr(C)]
+pub enum StorageProfile {
+    /// The local database file uses the rollback journal with the `FULL` synchronization level, which are the default
+    /// settings of SQLite, even if it used write-ahead logging before. Every transaction is fully written to the disk
+    /// before it's committed, and a single connection to the local database file is shared by all the operations.
+    SpotflowStorageProfileDurable = 0,
+    /// The local database file uses write-ahead logging with the `NORMAL` synchronization level and a larger page
+    /// cache. Reading the Messages to be sent uses a separate connection, so enqueuing Messages doesn't wait for it.
+    ///
+    /// The local database file cannot become corrupted, but the transactions committed shortly before a power loss
+    /// might be rolled back. The write-ahead log is stored in additional files next to the local database file.
+    SpotflowStorageProfileThroughput,
+}
+
+/// The priority of a [Message](https://docs.spotflow.io/send-data/#message).
+#[repr(C)]
+pub enum MessagePriority {
+    /// The Messages are sent only when there are no Messages with higher priority waiting to be sent, for example,
+    /// bulk telemetry that can be delayed.
+    SpotflowMessagePriorityLow = 0,
+    /// The priority of the Messages unless specified otherwise.
+    SpotflowMessagePriorityNormal,
+    /// The Messages are sent before all the Messages with lower priority waiting to be sent, for example, alarms.
+    SpotflowMessagePriorityHigh,
+}
+
+/// Specifies what happens when a [Message](https://docs.spotflow.io/send-data/#message) is enqueued but the limit set by
+/// @ref spotflow_client_options_set_queue_limit has been reached.
+#[repr(C)]
+pub enum OverflowPolicy {
+    /// Remove the oldest Messages waiting to be sent to make room for the new one.
+    SpotflowOverflowPolicyDropOldest = 0,
+    /// Discard the new Message.
+    SpotflowOverflowPolicyDropNewest,
+    /// Fail to enqueue the new Message with @ref SPOTFLOW_ERROR.
+    SpotflowOverflowPolicyReject,
+    /// Remove every other of the oldest Messages waiting to be sent to the same Stream as the new one, so that the
+    /// Stream keeps covering the whole period with a lower resolution. If there are no such Messages, the oldest
+    /// Messages are removed instead.
+    SpotflowOverflowPolicyDownsample,
+}
+
+const DEFAULT_GROUP_COMMIT_MAX_DELAY_MS: u32 = 100;
+const DEFAULT_GROUP_COMMIT_MAX_MESSAGES: usize = 100;
+
 /// A set of options for sending [Messages](https://docs.spotflow.io/send-data/#message) to
 /// a [Stream](https://docs.spotflow.io/send-data/#stream). This object is
 /// managed by the Device SDK. Create its instance using @ref spotflow_message_context_create and delete it using
@@ -54,6 +133,23 @@ pub struct MessageContext {
     inner: spotflow::MessageContext,
 }
 
+/// A description of a [Message](https://docs.spotflow.io/send-data/#message) to be enqueued using
+/// @ref spotflow_client_enqueue_messages. The Device SDK doesn't take ownership of any of the pointers, they must
+/// stay valid only until the function returns.
+#[repr(C)]
+pub struct OutgoingMessage {
+    /// (Optional) The ID of the [Batch](https://docs.spotflow.io/send-data/#batch) the
+    /// [Message](https://docs.spotflow.io/send-data/#message) is a part of. Use `NULL` if you don't want to specify it.
+    pub batch_id: *const c_char,
+    /// (Optional) The ID of the [Message](https://docs.spotflow.io/send-data/#message).
+    /// Use `NULL` if you don't want to specify it.
+    pub message_id: *const c_char,
+    /// The buffer that contains the [Message](https://docs.spotflow.io/send-data/#message).
+    pub buffer: *const u8,
+    /// The length of the buffer in bytes.
+    pub length: size_t,
+}
+
 /// A set of options that specify how to connect to the Platform. This object is managed by the Device SDK.
 /// Create its instance using @ref spotflow_client_options_create and delete it using @ref spotflow_client_options_destroy.
 /// After you configure all the options, pass the address of @ref spotflow_client_options_t to
@@ -68,6 +164,23 @@ pub struct ClientOptions {
     display_provisioning_operation_context: *mut c_void,
     desired_properties_updated_callback: DesiredPropertiesUpdatedCallback,
     desired_properties_updated_context: *mut c_void,
+    durability: spotflow::Durability,
+    storage_profile: spotflow::StorageProfile,
+    queue_limit: Option<spotflow::QueueLimit>,
+    reconnect_policy: spotflow::ReconnectPolicy,
+    max_inflight_messages: u16,
+    compress_on_enqueue: bool,
+    max_coalescing_delay: Option<Duration>,
+    runtime: Option<tokio::runtime::Handle>,
+    worker_threads: Option<usize>,
+    warm_start: bool,
+    submission_queue_capacity: Option<usize>,
+    enqueue_completed_callback: EnqueueCompletedCallback,
+    enqueue_completed_context: *mut c_void,
+    method_handler_callback: MethodHandlerCallback,
+    method_handler_context: *mut c_void,
+    method_handler_concurrency: Option<usize>,
+    method_handler_timeout: Option<Duration>,
 }
 
 struct DisplayProvisioningOperationCallbackHolder {
@@ -120,6 +233,21 @@ impl spotflow::DesiredPropertiesUpdatedCallback for DesiredPropertiesUpdatedCall
 ///      spotflow_client_options_set_device_id
 ///      spotflow_client_options_set_instance
 ///      spotflow_client_options_set_display_provisioning_operation_callback
+///      spotflow_client_options_set_durability
+/// @see spotflow_client_options_set_storage_profile
+/// @see spotflow_client_options_set_queue_limit
+/// @see spotflow_client_options_set_reconnect_policy
+/// @see spotflow_client_options_set_max_inflight_messages
+/// @see spotflow_client_options_set_compression_on_enqueue
+/// @see spotflow_client_options_set_message_coalescing
+/// @see spotflow_client_options_set_runtime
+/// @see spotflow_client_options_set_worker_threads
+/// @see spotflow_client_options_set_warm_start
+/// @see spotflow_client_options_set_submission_queue_capacity
+/// @see spotflow_client_options_set_enqueue_completed_callback
+/// @see spotflow_client_options_set_method_handler
+/// @see spotflow_client_options_set_method_handler_concurrency
+/// @see spotflow_client_options_set_method_handler_timeout
 ///
 /// @param options (Output) The pointer to the @ref spotflow_client_options_t object that will be created by this function.
 /// @param device_id (Optional) The [ID of the Device](https://docs.spotflow.io/connect-devices/#device-id) you
@@ -154,6 +282,23 @@ pub extern "C" fn spotflow_client_options_create(
             display_provisioning_operation_context: null_mut(),
             desired_properties_updated_callback: None,
             desired_properties_updated_context: null_mut(),
+            durability: spotflow::Durability::default(),
+            storage_profile: spotflow::StorageProfile::default(),
+            queue_limit: None,
+            reconnect_policy: spotflow::ReconnectPolicy::default(),
+            max_inflight_messages: 1,
+            compress_on_enqueue: false,
+            max_coalescing_delay: None,
+            runtime: None,
+            worker_threads: None,
+            warm_start: false,
+            submission_queue_capacity: None,
+            enqueue_completed_callback: None,
+            enqueue_completed_context: null_mut(),
+            method_handler_callback: None,
+            method_handler_context: null_mut(),
+            method_handler_concurrency: None,
+            method_handler_timeout: None,
         };
 
         Ok(options)
@@ -348,6 +493,327 @@ pub unsafe extern "C" fn spotflow_client_options_set_desired_properties_updated_
     })
 }
 
+/// Set how the outgoing [Messages](https://docs.spotflow.io/send-data/#message) are written to the local database
+/// file and handed over to the background thread that sends them to the Platform (@ref SPOTFLOW_DURABILITY_FULL by default).
+///
+/// @ref SPOTFLOW_DURABILITY_GROUP_COMMIT writes the Messages at least every 100 ms or every 100 Messages. Use
+/// @ref spotflow_client_options_set_group_commit to choose different limits.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param durability The way of writing the outgoing Messages to the local database file.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_durability(
+    options: *mut ClientOptions,
+    durability: Durability,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.durability = match durability {
+            Durability::SpotflowDurabilityFull => spotflow::Durability::Full,
+            Durability::SpotflowDurabilityInMemoryHandoff => spotflow::Durability::InMemoryHandoff,
+            Durability::SpotflowDurabilityGroupCommit => spotflow::Durability::GroupCommit {
+                max_delay: Duration::from_millis(DEFAULT_GROUP_COMMIT_MAX_DELAY_MS.into()),
+                max_messages: DEFAULT_GROUP_COMMIT_MAX_MESSAGES,
+            },
+        };
+        Ok(())
+    })
+}
+
+/// Write the outgoing [Messages](https://docs.spotflow.io/send-data/#message) to the local database file in groups
+/// (see @ref SPOTFLOW_DURABILITY_GROUP_COMMIT) with the provided limits.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param max_delay_ms The longest time in milliseconds a Message can wait in memory before it's written to the local
+///                     database file.
+/// @param max_messages The number of Messages that are written to the local database file at once.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_group_commit(
+    options: *mut ClientOptions,
+    max_delay_ms: u32,
+    max_messages: size_t,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+
+        if max_messages == 0 {
+            bail!("The number of Messages written at once must be positive.");
+        }
+
+        options.durability = spotflow::Durability::GroupCommit {
+            max_delay: Duration::from_millis(max_delay_ms.into()),
+            max_messages,
+        };
+        Ok(())
+    })
+}
+
+/// Set how the local database file is configured (@ref SPOTFLOW_STORAGE_PROFILE_DURABLE by default).
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param storage_profile The configuration of the local database file.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_storage_profile(
+    options: *mut ClientOptions,
+    storage_profile: StorageProfile,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.storage_profile = match storage_profile {
+            StorageProfile::SpotflowStorageProfileDurable => spotflow::StorageProfile::Durable,
+            StorageProfile::SpotflowStorageProfileThroughput => {
+                spotflow::StorageProfile::Throughput
+            }
+        };
+        Ok(())
+    })
+}
+
+/// Limit how many [Messages](https://docs.spotflow.io/send-data/#message) can wait in the local database file to be
+/// sent to the Platform, for example while the device is offline. There is no limit by default.
+///
+/// When the byte limit is set, the space freed by removing Messages is returned to the file system if the local
+/// database file was created by this version of the SDK. Older files reuse the freed space for new Messages instead.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param max_messages The maximum number of Messages waiting to be sent, 0 for no limit.
+/// @param max_bytes The maximum total size in bytes of the payloads of the Messages waiting to be sent, 0 for no limit.
+///                  The local database file is larger by the properties of the Messages, the indexes, and the rest of
+///                  the data of the client.
+/// @param policy What happens to the Messages that don't fit into the limit.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_queue_limit(
+    options: *mut ClientOptions,
+    max_messages: size_t,
+    max_bytes: u64,
+    policy: OverflowPolicy,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+
+        if max_messages == 0 && max_bytes == 0 {
+            options.queue_limit = None;
+            return Ok(());
+        }
+
+        options.queue_limit = Some(spotflow::QueueLimit {
+            max_messages: (max_messages != 0).then_some(max_messages),
+            max_bytes: (max_bytes != 0).then_some(max_bytes),
+            policy: match policy {
+                OverflowPolicy::SpotflowOverflowPolicyDropOldest => {
+                    spotflow::OverflowPolicy::DropOldest
+                }
+                OverflowPolicy::SpotflowOverflowPolicyDropNewest => {
+                    spotflow::OverflowPolicy::DropNewest
+                }
+                OverflowPolicy::SpotflowOverflowPolicyReject => spotflow::OverflowPolicy::Reject,
+                OverflowPolicy::SpotflowOverflowPolicyDownsample => {
+                    spotflow::OverflowPolicy::Downsample
+                }
+            },
+        });
+        Ok(())
+    })
+}
+
+/// Set the maximum number of [Messages](https://docs.spotflow.io/send-data/#message) that can be sent to the Platform
+/// without waiting for the acknowledgment of the previous ones (1 by default). The following Messages are prepared for
+/// sending while the previous ones are being sent.
+///
+/// Higher values increase the throughput on connections with high latency. However, if the connection breaks, the
+/// Messages that were sent but not acknowledged are sent again, so their duplicates don't have to directly follow the
+/// original Messages.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param max_inflight_messages The maximum number of Messages waiting for the acknowledgment, must be positive.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_max_inflight_messages(
+    options: *mut ClientOptions,
+    max_inflight_messages: u16,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+
+        if max_inflight_messages == 0 {
+            bail!("The maximum number of Messages in flight must be positive.");
+        }
+
+        options.max_inflight_messages = max_inflight_messages;
+        Ok(())
+    })
+}
+
+/// Set how the client reconnects to the Platform after the connection is lost. The delay before each attempt grows
+/// exponentially from @p initial_delay_ms up to @p max_delay_ms until the client connects again. By default, the first
+/// attempt is made immediately and the following ones after a delay growing from 1 second up to 1 minute, randomly
+/// shortened by up to a half.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param immediate_first_retry Whether the first attempt is made right after the connection is lost.
+/// @param initial_delay_ms The delay in milliseconds before the first delayed attempt, doubled after each failed attempt.
+/// @param max_delay_ms The longest delay in milliseconds between two attempts.
+/// @param jitter Whether each delay is randomly shortened by up to a half, so that many Devices losing the connection
+///               at the same time don't try to reconnect all at once.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_reconnect_policy(
+    options: *mut ClientOptions,
+    immediate_first_retry: bool,
+    initial_delay_ms: u32,
+    max_delay_ms: u32,
+    jitter: bool,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.reconnect_policy = spotflow::ReconnectPolicy {
+            immediate_first_retry,
+            initial_delay: Duration::from_millis(initial_delay_ms.into()),
+            max_delay: Duration::from_millis(max_delay_ms.into()),
+            jitter,
+        };
+        Ok(())
+    })
+}
+
+/// Set whether the [Messages](https://docs.spotflow.io/send-data/#message) are compressed when they're enqueued instead
+/// of when they're sent (disabled by default). See @ref spotflow_message_context_set_compression.
+///
+/// The compressed Messages are written to the local database file, so they're compressed only once even if they have
+/// to be sent again, for example, after the connection breaks. The Messages enqueued together by
+/// @ref spotflow_client_enqueue_messages are compressed in parallel. On the other hand, enqueuing a Message takes
+/// longer because the calling thread waits for the compression to finish.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param compress_on_enqueue Whether to compress the Messages when they're enqueued.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_compression_on_enqueue(
+    options: *mut ClientOptions,
+    compress_on_enqueue: bool,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.compress_on_enqueue = compress_on_enqueue;
+        Ok(())
+    })
+}
+
+/// Set whether @ref spotflow_client_start returns without waiting for the Platform to confirm that the
+/// [Registration Token](https://docs.spotflow.io/connect-devices/#registration-token) stored in the local database
+/// file is still valid (disabled by default). If the stored Registration Token hasn't expired yet, the client starts
+/// without any network round trip and accepts [Messages](https://docs.spotflow.io/send-data/#message) immediately
+/// while it connects to the Platform in the background. This shortens the startup of Devices that run only for short
+/// periods, for example, on battery.
+///
+/// Because the validity is checked only in the background, a Registration Token that was revoked in the Platform
+/// doesn't trigger [Device Provisioning](https://docs.spotflow.io/connect-devices/#device-provisioning). The client
+/// keeps trying to register until it's destroyed, so you need to start it again without the warm start.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param warm_start Whether to skip waiting for the validation of the stored Registration Token.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_warm_start(
+    options: *mut ClientOptions,
+    warm_start: bool,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.warm_start = warm_start;
+        Ok(())
+    })
+}
+
+/// Pack consecutive [Messages](https://docs.spotflow.io/send-data/#message) into a single Message before sending them
+/// to the Platform (disabled by default). The payloads of the packed Messages are separated by new lines, so use this
+/// option only for [Streams](https://docs.spotflow.io/send-data/#stream) that accept newline-delimited records, such
+/// as JSON Lines.
+///
+/// Only the Messages with the same @ref spotflow_message_context_t, Batch ID, and Batch Slice ID and without any
+/// Message ID are packed together, up to the size limit of a single Message. Messages whose payloads contain a new line
+/// are always sent on their own so that their records aren't split.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param max_delay_ms The longest time in milliseconds a Message can wait for the following ones before it's sent.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_message_coalescing(
+    options: *mut ClientOptions,
+    max_delay_ms: u32,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.max_coalescing_delay = Some(Duration::from_millis(max_delay_ms.into()));
+        Ok(())
+    })
+}
+
+/// Run the background work of the client on the threads of a shared @ref spotflow_runtime_t object instead of
+/// creating a separate pool of threads for the client. This way, many clients in one process don't need many threads.
+///
+/// The @ref spotflow_runtime_t object must not be destroyed before the @ref spotflow_client_t objects that use it.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param runtime The @ref spotflow_runtime_t object created by @ref spotflow_runtime_create.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_runtime(
+    options: *mut ClientOptions,
+    runtime: *const Runtime,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        let runtime = unsafe { ptr_to_ref(runtime) }?;
+        options.runtime = Some(runtime.inner.handle().clone());
+        Ok(())
+    })
+}
+
+/// Set the number of threads in the pool that the client creates for its background work (2 by default, which is
+/// also the minimum). Ignored if the client uses a shared runtime set by @ref spotflow_client_options_set_runtime.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param worker_threads The number of threads.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_worker_threads(
+    options: *mut ClientOptions,
+    worker_threads: size_t,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.worker_threads = Some(worker_threads);
+        Ok(())
+    })
+}
+
 /// Destroy the @ref spotflow_client_options_t object.
 ///
 /// @param options The @ref spotflow_client_options_t object to destroy.
@@ -397,6 +863,43 @@ pub extern "C" fn spotflow_client_start(
             builder = builder.with_instance(instance.clone());
         };
 
+        builder = builder.with_durability(options.durability);
+        builder = builder.with_storage_profile(options.storage_profile);
+        if let Some(queue_limit) = options.queue_limit {
+            builder = builder.with_queue_limit(queue_limit);
+        }
+        builder = builder.with_reconnect_policy(options.reconnect_policy);
+        builder = builder.with_max_inflight_messages(options.max_inflight_messages);
+        builder = builder.with_compression_on_enqueue(options.compress_on_enqueue);
+        builder = builder.with_warm_start(options.warm_start);
+
+        if let Some(max_coalescing_delay) = options.max_coalescing_delay {
+            builder = builder.with_message_coalescing(max_coalescing_delay);
+        }
+
+        if let Some(runtime) = &options.runtime {
+            builder = builder.with_runtime(runtime.clone());
+        }
+
+        if let Some(worker_threads) = options.worker_threads {
+            builder = builder.with_worker_threads(worker_threads);
+        }
+
+        if let Some(capacity) = options.submission_queue_capacity {
+            builder = builder.with_submission_queue_capacity(capacity);
+        }
+
+        if let Some(callback) = options.enqueue_completed_callback {
+            let callback = EnqueueCompletedCallbackHolder {
+                callback,
+                context: options.enqueue_completed_context,
+            };
+
+            let callback = Box::new(callback) as Box<dyn spotflow::EnqueueCompletedCallback>;
+
+            builder = builder.with_enqueue_completed_callback(callback);
+        }
+
         if let Some(callback) = options.display_provisioning_operation_callback {
             let callback = DisplayProvisioningOperationCallbackHolder {
                 callback,
@@ -420,7 +923,25 @@ pub extern "C" fn spotflow_client_start(
             builder = builder.with_desired_properties_updated_callback(callback);
         }
 
-        builder.build()
+        if let Some(concurrency) = options.method_handler_concurrency {
+            builder = builder.with_method_handler_concurrency(concurrency);
+        }
+
+        if let Some(timeout) = options.method_handler_timeout {
+            builder = builder.with_method_handler_timeout(timeout);
+        }
+
+        match options.method_handler_callback {
+            None => builder.build(),
+            Some(callback) => {
+                let holder = MethodHandlerCallbackHolder {
+                    callback,
+                    context: options.method_handler_context,
+                };
+
+                holder.build_client(builder)
+            }
+        }
     });
 
     match result {
@@ -443,6 +964,7 @@ pub extern "C" fn spotflow_client_start(
 /// @see spotflow_message_context_set_stream_group
 ///      spotflow_message_context_set_stream
 ///      spotflow_message_context_set_compression
+///      spotflow_message_context_set_priority
 ///
 /// @param message_context (Output) The pointer to the @ref spotflow_message_context_t object that will be created by this function.
 /// @param stream_group (Optional) The [Stream Group](https://docs.spotflow.io/send-data/#stream-group)
@@ -552,6 +1074,34 @@ pub unsafe extern "C" fn spotflow_message_context_set_compression(
     })
 }
 
+/// Set the priority of the [Messages](https://docs.spotflow.io/send-data/#message) (@ref SPOTFLOW_MESSAGE_PRIORITY_NORMAL
+/// by default). The Messages waiting to be sent are sent in the order of their priority, the Messages with the same
+/// priority are sent in the order in which they were enqueued.
+///
+/// @param message_context The @ref spotflow_message_context_t object.
+/// @param priority The priority of the [Messages](https://docs.spotflow.io/send-data/#message).
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_message_context_set_priority(
+    message_context: *mut MessageContext,
+    priority: MessagePriority,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let message_context = unsafe { ptr_to_mut(message_context) }?;
+        let priority = match priority {
+            MessagePriority::SpotflowMessagePriorityLow => spotflow::Priority::Low,
+            MessagePriority::SpotflowMessagePriorityNormal => spotflow::Priority::Normal,
+            MessagePriority::SpotflowMessagePriorityHigh => spotflow::Priority::High,
+        };
+
+        message_context.inner.set_priority(priority);
+
+        Ok(())
+    })
+}
+
 /// Destroy the @ref spotflow_message_context_t object.
 ///
 /// @param message_context The @ref spotflow_message_context_t object to destroy.
@@ -607,7 +1157,7 @@ pub extern "C" fn spotflow_client_enqueue_message(
             let message_context = unsafe { ptr_to_ref(message_context) }?;
             let batch_id = unsafe { ptr_to_str_option(batch_id) }?.map(str::to_owned);
             let message_id = unsafe { ptr_to_str_option(message_id) }?.map(str::to_owned);
-            let payload = unsafe { buffer_to_slice(buffer, length)?.to_vec() };
+            let payload = unsafe { buffer_to_slice(buffer, length) }?;
 
             client.enqueue_message(&message_context.inner, batch_id, message_id, payload)
         })
@@ -670,7 +1220,7 @@ pub extern "C" fn spotflow_client_enqueue_message_advanced(
             let batch_slice_id = unsafe { ptr_to_str_option(batch_slice_id) }?.map(str::to_owned);
             let message_id = unsafe { ptr_to_str_option(message_id) }?.map(str::to_owned);
             let chunk_id = unsafe { ptr_to_str_option(chunk_id) }?.map(str::to_owned);
-            let payload = unsafe { buffer_to_slice(buffer, length)?.to_vec() };
+            let payload = unsafe { buffer_to_slice(buffer, length) }?;
 
             client.enqueue_message_advanced(
                 &message_context.inner,
@@ -684,6 +1234,109 @@ pub extern "C" fn spotflow_client_enqueue_message_advanced(
     }
 }
 
+/// Enqueue a [Message](https://docs.spotflow.io/send-data/#message) with the content of a file to
+/// be sent to the Platform.
+///
+/// The same requirements on `batch_id` and `message_id` apply as in @ref spotflow_client_enqueue_message.
+///
+/// Only the path to the file is saved to the queue in the local database file, the file is read when the Message is
+/// being sent. Because the content is streamed directly from the file to the Platform, the file can be larger than
+/// the available memory. The file must not be changed or removed until the Message is sent, see
+/// @ref spotflow_client_wait_enqueued_messages_sent. If the file cannot be found when the Message is being sent, the
+/// Message is skipped.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param message_context The options that specify how to send the [Message](https://docs.spotflow.io/send-data/#message).
+///                        The compression is ignored, the file is sent as it is.
+/// @param batch_id (Optional) The ID of the [Batch](https://docs.spotflow.io/send-data/#batch) the
+///                 [Message](https://docs.spotflow.io/send-data/#message) is a part of.
+///                 Use `NULL` if you don't want to specify it.
+/// @param message_id (Optional) The ID of the [Message](https://docs.spotflow.io/send-data/#message).
+///                   Use `NULL` if you don't want to specify it.
+/// @param path The path to the file with the content of the [Message](https://docs.spotflow.io/send-data/#message).
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid, the file doesn't
+///              exist, or there is an error in persisting the message.
+#[no_mangle]
+pub extern "C" fn spotflow_client_enqueue_file(
+    client: *mut DeviceClient,
+    message_context: *const MessageContext,
+    batch_id: *const c_char,
+    message_id: *const c_char,
+    path: *const c_char,
+) -> CResult {
+    {
+        let client = AssertUnwindSafe(client);
+
+        call_safe_with_unit_result(|| {
+            ensure_logging();
+
+            let client = unsafe { ptr_to_ref(*client) }?;
+            let message_context = unsafe { ptr_to_ref(message_context) }?;
+            let batch_id = unsafe { ptr_to_str_option(batch_id) }?.map(str::to_owned);
+            let message_id = unsafe { ptr_to_str_option(message_id) }?.map(str::to_owned);
+            let path = unsafe { ptr_to_str(path) }?;
+
+            client.enqueue_file(&message_context.inner, batch_id, message_id, path)
+        })
+    }
+}
+
+/// Enqueue multiple [Messages](https://docs.spotflow.io/send-data/#message) to
+/// be sent to the Platform.
+///
+/// All the Messages are sent using the same `message_context` and in the given order. The same requirements on
+/// @ref spotflow_message_t::batch_id and @ref spotflow_message_t::message_id apply as in @ref spotflow_client_enqueue_message.
+///
+/// The method returns right after it saves all the [Messages](https://docs.spotflow.io/send-data/#message) to
+/// the queue in the local database file. Because the Messages are saved in a single transaction, this is considerably
+/// faster than calling @ref spotflow_client_enqueue_message for each of them. Either all the Messages are saved or none
+/// of them, which also applies when they don't fit into the limit set by @ref spotflow_client_options_set_queue_limit
+/// together. A background thread asynchronously sends the messages from the queue to the Platform.
+/// You can check the number of pending messages in the queue using @ref spotflow_client_get_pending_messages_count.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param message_context The options that specify how to send the [Messages](https://docs.spotflow.io/send-data/#message).
+/// @param messages The array of @ref spotflow_message_t objects that describe the individual Messages.
+/// @param count The number of items in `messages`.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid or there is an error in
+///              persisting the messages.
+#[no_mangle]
+pub extern "C" fn spotflow_client_enqueue_messages(
+    client: *mut DeviceClient,
+    message_context: *const MessageContext,
+    messages: *const OutgoingMessage,
+    count: size_t,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let client = unsafe { ptr_to_ref(*client) }?;
+        let message_context = unsafe { ptr_to_ref(message_context) }?;
+
+        if count == 0 {
+            return Ok(());
+        }
+
+        let messages = unsafe { buffer_to_slice(messages, count) }?
+            .iter()
+            .map(|message| {
+                let batch_id = unsafe { ptr_to_str_option(message.batch_id) }?.map(str::to_owned);
+                let message_id =
+                    unsafe { ptr_to_str_option(message.message_id) }?.map(str::to_owned);
+                let payload = unsafe { buffer_to_slice(message.buffer, message.length) }?;
+
+                Ok(spotflow::OutgoingMessage::new(
+                    batch_id, message_id, payload,
+                ))
+            })
+            .collect::<Result<Vec<_>>>()?;
+
+        client.enqueue_messages(&message_context.inner, messages)
+    })
+}
+
 /// Enqueue the manual completion of the current [Batch](https://docs.spotflow.io/send-data/#batch) to
 /// be sent to the Platform.
 ///
@@ -791,6 +1444,34 @@ pub extern "C" fn spotflow_client_wait_enqueued_messages_sent(
     }
 }
 
+/// Block the current thread until all the [Messages](https://docs.spotflow.io/send-data/#message) that
+/// have been previously enqueued are sent to the Platform or until the timeout elapses.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param timeout_ms The maximum time to wait in milliseconds.
+/// @param all_sent (Output) Whether all the Messages were sent before the timeout elapsed.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub extern "C" fn spotflow_client_wait_enqueued_messages_sent_timeout(
+    client: *mut DeviceClient,
+    timeout_ms: u32,
+    all_sent: *mut bool,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+
+    let result = call_safe_with_result(|| {
+        ensure_logging();
+
+        let client = unsafe { ptr_to_ref(*client) }?;
+        client.wait_enqueued_messages_sent_timeout(Duration::from_millis(u64::from(timeout_ms)))
+    });
+
+    match result {
+        Err(e) => e,
+        Ok(value) => unsafe { store_to_ptr(all_sent, value) },
+    }
+}
+
 /// Send a [Message](https://docs.spotflow.io/send-data/#message) to
 /// the Platform.
 ///
@@ -837,7 +1518,7 @@ pub extern "C" fn spotflow_client_send_message(
             let message_context = unsafe { ptr_to_ref(message_context) }?;
             let batch_id = unsafe { ptr_to_str_option(batch_id) }?.map(str::to_owned);
             let message_id = unsafe { ptr_to_str_option(message_id) }?.map(str::to_owned);
-            let payload = unsafe { buffer_to_slice(buffer, length)?.to_vec() };
+            let payload = unsafe { buffer_to_slice(buffer, length) }?;
 
             client.send_message(&message_context.inner, batch_id, message_id, payload)
         })
@@ -899,7 +1580,7 @@ pub extern "C" fn spotflow_client_send_message_advanced(
             let batch_slice_id = unsafe { ptr_to_str_option(batch_slice_id) }?.map(str::to_owned);
             let message_id = unsafe { ptr_to_str_option(message_id) }?.map(str::to_owned);
             let chunk_id = unsafe { ptr_to_str_option(chunk_id) }?.map(str::to_owned);
-            let payload = unsafe { buffer_to_slice(buffer, length)?.to_vec() };
+            let payload = unsafe { buffer_to_slice(buffer, length) }?;
 
             client.send_message_advanced(
                 &message_context.inner,
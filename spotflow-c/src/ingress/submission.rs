@@ -0,0 +1,193 @@
+use std::panic::AssertUnwindSafe;
+
+use anyhow::anyhow;
+use libc::{c_char, c_void, size_t};
+use spotflow::{DeviceClient, SubmissionQueueFull};
+
+use crate::{
+    buffer_to_slice, call_safe_with_result, call_safe_with_unit_result, ensure_logging,
+    error::{update_last_error, CResult},
+    ptr_to_mut, ptr_to_ref, ptr_to_str_option, store_to_ptr,
+};
+
+use super::{ClientOptions, MessageContext};
+
+/// The callback to be called when a [Message](https://docs.spotflow.io/send-data/#message) enqueued by
+/// @ref spotflow_client_try_enqueue_message is saved to the local database file or fails to be saved.
+/// The callback is called only if you have configured it by @ref spotflow_client_options_set_enqueue_completed_callback.
+/// The callback is called on a dedicated background thread, so a slow callback delays only the following callbacks,
+/// not saving or sending the Messages. The Messages dropped or rejected because of the queue limit fail to be saved.
+///
+/// @param sequence The sequence number of the Message returned by @ref spotflow_client_try_enqueue_message.
+/// @param result @ref SPOTFLOW_OK if the Message was saved, @ref SPOTFLOW_ERROR otherwise. Call
+///               @ref spotflow_read_last_error_message from the callback to obtain the error message.
+/// @param context The optional context that was configured by @ref spotflow_client_options_set_enqueue_completed_callback.
+pub type EnqueueCompletedCallback =
+    Option<extern "C" fn(sequence: u64, result: CResult, context: *mut c_void)>;
+
+pub(super) struct EnqueueCompletedCallbackHolder {
+    // This definition must be kept in sync with `EnqueueCompletedCallback` until
+    // https://github.com/mozilla/cbindgen/issues/326 is fixed (we'll be able to remove the `Option` then)
+    pub(super) callback: extern "C" fn(sequence: u64, result: CResult, context: *mut c_void),
+    pub(super) context: *mut c_void,
+}
+
+// It's the responsibility of the caller to synchronize access to the context
+unsafe impl Send for EnqueueCompletedCallbackHolder {}
+unsafe impl Sync for EnqueueCompletedCallbackHolder {}
+
+impl spotflow::EnqueueCompletedCallback for EnqueueCompletedCallbackHolder {
+    fn enqueue_completed(&self, sequence: u64, error: Option<&anyhow::Error>) {
+        let result = match error {
+            None => CResult::SpotflowOk,
+            Some(e) => {
+                // The error is stored for the thread running the callback, so that the callback can read it
+                update_last_error(anyhow!("{e:#}"));
+                CResult::SpotflowError
+            }
+        };
+
+        (self.callback)(sequence, result, self.context);
+    }
+}
+
+/// Set how many [Messages](https://docs.spotflow.io/send-data/#message) enqueued by
+/// @ref spotflow_client_try_enqueue_message can wait in memory to be saved to the local database file (1024 by
+/// default, at least 1).
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param capacity The maximum number of Messages waiting in memory.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_submission_queue_capacity(
+    options: *mut ClientOptions,
+    capacity: size_t,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.submission_queue_capacity = Some(capacity);
+        Ok(())
+    })
+}
+
+/// Set the function that is called after each [Message](https://docs.spotflow.io/send-data/#message) enqueued by
+/// @ref spotflow_client_try_enqueue_message is saved to the local database file or fails to be saved. The function
+/// is called in a separate thread, so make sure that you properly synchronize access to your shared resources.
+///
+/// A slow function doesn't delay sending the Messages. However, once it falls behind by about as many Messages as the
+/// capacity set by @ref spotflow_client_options_set_submission_queue_capacity, the enqueued Messages stop being saved
+/// until it catches up, and @ref spotflow_client_try_enqueue_message eventually returns @ref SPOTFLOW_QUEUE_FULL.
+///
+/// @param options The @ref spotflow_client_options_t object.
+/// @param callback (Optional) The function that is called for each Message. Use `NULL` if you don't want to specify it.
+/// @param context (Optional) The context that will be passed to `callback`. It will be used from a different thread,
+///                so make sure that it's properly synchronized. Use `NULL` if you don't want to specify it.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_options_set_enqueue_completed_callback(
+    options: *mut ClientOptions,
+    callback: EnqueueCompletedCallback,
+    context: *mut c_void,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let options = unsafe { ptr_to_mut(options) }?;
+        options.enqueue_completed_callback = callback;
+        options.enqueue_completed_context = context;
+
+        Ok(())
+    })
+}
+
+/// Enqueue a [Message](https://docs.spotflow.io/send-data/#message) to be sent to the Platform without waiting for
+/// it to be saved to the local database file.
+///
+/// The same requirements on `batch_id` and `message_id` apply as in @ref spotflow_client_enqueue_message.
+///
+/// The function copies the Message into a bounded queue in memory and returns immediately, so it never waits for
+/// the disk. A background thread saves the queued Messages in batches. Use
+/// @ref spotflow_client_options_set_enqueue_completed_callback to learn whether each Message was saved, or poll
+/// @ref spotflow_client_get_completed_enqueue_sequence. The Messages still waiting in the queue are saved by
+/// @ref spotflow_client_destroy.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param message_context The options that specify how to send the [Message](https://docs.spotflow.io/send-data/#message).
+/// @param batch_id (Optional) The ID of the [Batch](https://docs.spotflow.io/send-data/#batch) the
+///                 [Message](https://docs.spotflow.io/send-data/#message) is a part of.
+///                 Use `NULL` if you don't want to specify it.
+/// @param message_id (Optional) The ID of the [Message](https://docs.spotflow.io/send-data/#message).
+///                   Use `NULL` if you don't want to specify it.
+/// @param buffer The buffer that contains the [Message](https://docs.spotflow.io/send-data/#message).
+/// @param length The length of the buffer in bytes.
+/// @param sequence (Optional, Output) The sequence number of the Message. Use `NULL` if you don't need it.
+/// @return @ref SPOTFLOW_OK if the Message was enqueued, @ref SPOTFLOW_QUEUE_FULL if too many Messages are already
+///         waiting in memory (see @ref spotflow_client_options_set_submission_queue_capacity) and the Message was
+///         not enqueued, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub extern "C" fn spotflow_client_try_enqueue_message(
+    client: *mut DeviceClient,
+    message_context: *const MessageContext,
+    batch_id: *const c_char,
+    message_id: *const c_char,
+    buffer: *const u8,
+    length: size_t,
+    sequence: *mut u64,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+
+    let result = call_safe_with_result(|| {
+        ensure_logging();
+
+        let client = unsafe { ptr_to_ref(*client) }?;
+        let message_context = unsafe { ptr_to_ref(message_context) }?;
+        let batch_id = unsafe { ptr_to_str_option(batch_id) }?.map(str::to_owned);
+        let message_id = unsafe { ptr_to_str_option(message_id) }?.map(str::to_owned);
+        let payload = unsafe { buffer_to_slice(buffer, length) }?.to_vec();
+
+        match client.try_enqueue_message(&message_context.inner, batch_id, message_id, payload) {
+            Ok(sequence) => Ok(Some(sequence)),
+            Err(e) if e.is::<SubmissionQueueFull>() => {
+                update_last_error(e);
+                Ok(None)
+            }
+            Err(e) => Err(e),
+        }
+    });
+
+    match result {
+        Err(e) => e,
+        Ok(None) => CResult::SpotflowQueueFull,
+        Ok(Some(_)) if sequence.is_null() => CResult::SpotflowOk,
+        Ok(Some(value)) => unsafe { store_to_ptr(sequence, value) },
+    }
+}
+
+/// Get the highest sequence number returned by @ref spotflow_client_try_enqueue_message for which the
+/// [Message](https://docs.spotflow.io/send-data/#message) and all the Messages with lower sequence numbers were
+/// either saved to the local database file or failed to be saved. The value is 0 if no such Message exists yet.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param sequence (Output) The sequence number.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub extern "C" fn spotflow_client_get_completed_enqueue_sequence(
+    client: *const DeviceClient,
+    sequence: *mut u64,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+
+    let result = call_safe_with_result(|| {
+        ensure_logging();
+
+        let client = unsafe { ptr_to_ref(*client) }?;
+        Ok(client.completed_enqueue_sequence())
+    });
+
+    match result {
+        Err(e) => e,
+        Ok(value) => unsafe { store_to_ptr(sequence, value) },
+    }
+}
@@ -1,13 +1,13 @@
-use std::{cmp::min, panic::AssertUnwindSafe};
+use std::{cmp::min, ffi::CString, panic::AssertUnwindSafe};
 
-use anyhow::anyhow;
+use anyhow::{anyhow, bail, Context};
 use libc::{c_char, c_void, size_t};
-use spotflow::DeviceClient;
+use spotflow::{DesiredPropertiesChange, DeviceClient, SharedDesiredProperties};
 
 use crate::{
-    call_safe_with_result, call_safe_with_unit_result, ensure_logging,
+    call_safe_with_result, call_safe_with_unit_result, drop_ptr, ensure_logging,
     error::{update_last_error, CResult},
-    ptr_to_ref, ptr_to_str, SPOTFLOW_PROPERTIES_VERSION_ANY,
+    obj_to_ptr, ptr_to_mut, ptr_to_ref, ptr_to_str, store_to_ptr, SPOTFLOW_PROPERTIES_VERSION_ANY,
 };
 
 /// The callback to be called when the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties)
@@ -21,6 +21,192 @@ use crate::{
 pub type DesiredPropertiesUpdatedCallback =
     Option<extern "C" fn(desired_properties: *const c_char, version: u64, context: *mut c_void)>;
 
+/// The callback to be called when the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties)
+/// change. The callback is called only if you have subscribed to the changes by
+/// @ref spotflow_client_subscribe_desired_properties_changes. The callback is called on a background thread.
+///
+/// All the pointers are valid only until the callback returns.
+///
+/// @param changed_paths The array of the JSON Pointers of the properties that were added, changed, or removed, for
+///                      example `/sensors/temperature/unit`. Each of them is a null-terminated string encoded in UTF-8.
+/// @param changed_paths_count The number of items in `changed_paths`.
+/// @param desired_properties The new Desired Properties represented as a JSON string encoded in UTF-8. The string is
+///                           **not** null-terminated.
+/// @param desired_properties_length The length of `desired_properties` in bytes.
+/// @param version The version of the new Desired Properties.
+/// @param context The optional context that was configured by @ref spotflow_client_subscribe_desired_properties_changes.
+pub type DesiredPropertiesChangedCallback = Option<
+    extern "C" fn(
+        changed_paths: *const *const c_char,
+        changed_paths_count: size_t,
+        desired_properties: *const c_char,
+        desired_properties_length: size_t,
+        version: u64,
+        context: *mut c_void,
+    ),
+>;
+
+struct DesiredPropertiesChangedCallbackHolder {
+    // This definition must be kept in sync with `DesiredPropertiesChangedCallback` until
+    // https://github.com/mozilla/cbindgen/issues/326 is fixed (we'll be able to remove the `Option` then)
+    callback: extern "C" fn(
+        changed_paths: *const *const c_char,
+        changed_paths_count: size_t,
+        desired_properties: *const c_char,
+        desired_properties_length: size_t,
+        version: u64,
+        context: *mut c_void,
+    ),
+    context: *mut c_void,
+}
+
+// It's the responsibility of the caller to synchronize access to the context
+unsafe impl Send for DesiredPropertiesChangedCallbackHolder {}
+unsafe impl Sync for DesiredPropertiesChangedCallbackHolder {}
+
+impl spotflow::DesiredPropertiesChangedCallback for DesiredPropertiesChangedCallbackHolder {
+    fn properties_changed(&self, change: DesiredPropertiesChange) -> anyhow::Result<()> {
+        let paths = change
+            .changed_paths
+            .into_iter()
+            .map(CString::new)
+            .collect::<Result<Vec<_>, _>>()
+            .context("The path of a changed property contains a null character")?;
+        let path_ptrs = paths.iter().map(|path| path.as_ptr()).collect::<Vec<_>>();
+        let values = &change.properties.values;
+
+        (self.callback)(
+            path_ptrs.as_ptr(),
+            path_ptrs.len(),
+            values.as_ptr().cast(),
+            values.len(),
+            change.properties.version,
+            self.context,
+        );
+
+        Ok(())
+    }
+}
+
+/// A read-only copy of the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties)
+/// that isn't changed when newer versions are received. This object is managed by the Device SDK. Obtain its
+/// instance using @ref spotflow_client_get_desired_properties_snapshot and delete it using
+/// @ref spotflow_desired_properties_snapshot_destroy.
+pub struct DesiredPropertiesSnapshot {
+    inner: SharedDesiredProperties,
+}
+
+/// Subscribe to the changes of the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
+///
+/// The function `callback` is called for each new version of the Desired Properties that changes any property,
+/// together with the paths of the changed properties, so there's no need to poll the Desired Properties and compare
+/// them. Only the changes received after the subscription are reported. A new subscription replaces the previous one.
+/// The function is called in a separate thread, so make sure that you properly synchronize access to your shared
+/// resources.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param callback The function that is called when the Desired Properties change.
+/// @param context (Optional) The context that will be passed to `callback`. The data referenced by the pointer must be
+///                valid until @ref spotflow_client_destroy is called. Use `NULL` if you don't need to pass any data.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_subscribe_desired_properties_changes(
+    client: *const DeviceClient,
+    callback: DesiredPropertiesChangedCallback,
+    context: *mut c_void,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let client = ptr_to_ref(*client)?;
+        let Some(callback) = callback else {
+            bail!("The callback must not be NULL");
+        };
+
+        client.subscribe_desired_properties_changes(Box::new(
+            DesiredPropertiesChangedCallbackHolder { callback, context },
+        ));
+
+        Ok(())
+    })
+}
+
+/// Obtain the current [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties) without
+/// copying them.
+///
+/// Unlike @ref spotflow_client_get_desired_properties, this function doesn't need a buffer and never fails because it
+/// is too small. The properties are serialized only once for each version and the snapshot shares the serialization,
+/// so it's cheap to call this function often. Use @ref spotflow_desired_properties_snapshot_get to read the
+/// properties.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param snapshot (Output) The @ref spotflow_desired_properties_snapshot_t object with the current properties. Delete
+///                 it using @ref spotflow_desired_properties_snapshot_destroy.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub extern "C" fn spotflow_client_get_desired_properties_snapshot(
+    client: *const DeviceClient,
+    snapshot: *mut *mut DesiredPropertiesSnapshot,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+    let result = call_safe_with_result(|| {
+        ensure_logging();
+
+        let client = unsafe { ptr_to_ref(*client) }?;
+        client.shared_desired_properties()
+    });
+
+    match result {
+        Err(e) => e,
+        Ok(inner) => unsafe {
+            store_to_ptr(snapshot, obj_to_ptr(DesiredPropertiesSnapshot { inner }))
+        },
+    }
+}
+
+/// Read the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties) from the snapshot.
+///
+/// @param snapshot The @ref spotflow_desired_properties_snapshot_t object.
+/// @param desired_properties (Output) The pointer to the Desired Properties represented as a JSON string encoded in
+///                           UTF-8. The string is **not** null-terminated. It's valid until
+///                           @ref spotflow_desired_properties_snapshot_destroy is called.
+/// @param desired_properties_length (Output) The length of the JSON string in bytes.
+/// @param version (Optional, Output) The version of the properties. Use `NULL` if you don't need it.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_desired_properties_snapshot_get(
+    snapshot: *const DesiredPropertiesSnapshot,
+    desired_properties: *mut *const c_char,
+    desired_properties_length: *mut size_t,
+    version: *mut u64,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let snapshot = ptr_to_ref(snapshot)?;
+        let values = &snapshot.inner.values;
+
+        *ptr_to_mut(desired_properties)? = values.as_ptr().cast();
+        *ptr_to_mut(desired_properties_length)? = values.len();
+        if !version.is_null() {
+            *version = snapshot.inner.version;
+        }
+
+        Ok(())
+    })
+}
+
+/// Destroy the @ref spotflow_desired_properties_snapshot_t object.
+///
+/// @param snapshot The @ref spotflow_desired_properties_snapshot_t object to destroy.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_desired_properties_snapshot_destroy(
+    snapshot: *mut DesiredPropertiesSnapshot,
+) {
+    drop_ptr(snapshot);
+}
+
 /// Write the current [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties)
 /// into the provided buffer and obtain their version. The content is a JSON string encoded in UTF-8.
 ///
@@ -267,6 +453,59 @@ pub unsafe extern "C" fn spotflow_client_update_reported_properties(
     })
 }
 
+/// Enqueue an update of a single [Reported Property](https://docs.spotflow.io/configure-devices/#reported-properties)
+/// to be sent to the Platform.
+///
+/// Unlike @ref spotflow_client_update_reported_properties, this function doesn't need to compare the whole Reported
+/// Properties to find out what changed, so prefer it when you update only a few properties at a time. The objects on
+/// the path are created if they don't exist. The updates that are waiting to be sent are merged together and sent at
+/// once. To be sure that the update has been sent to the Platform, call
+/// @ref spotflow_client_get_any_pending_reported_properties_updates.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param path The JSON Pointer to the property encoded in UTF-8, for example `/sensors/temperature/unit`.
+/// @param value The JSON string encoded in UTF-8 containing the new value of the property.
+/// @return @ref SPOTFLOW_OK if the update was enqueued successfully, @ref SPOTFLOW_ERROR
+///         if any argument is invalid or there was an error in accessing the local database file.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_set_reported_property(
+    client: *const DeviceClient,
+    path: *const c_char,
+    value: *const c_char,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let client = ptr_to_ref(*client)?;
+        let path = ptr_to_str(path)?;
+        let value = ptr_to_str(value)?;
+        client.set_reported_property(path, value)
+    })
+}
+
+/// Enqueue a removal of a single [Reported Property](https://docs.spotflow.io/configure-devices/#reported-properties)
+/// to be sent to the Platform.
+///
+/// @param client The @ref spotflow_client_t object.
+/// @param path The JSON Pointer to the property encoded in UTF-8, see @ref spotflow_client_set_reported_property.
+/// @return @ref SPOTFLOW_OK if the removal was enqueued successfully, @ref SPOTFLOW_ERROR
+///         if any argument is invalid or there was an error in accessing the local database file.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_client_remove_reported_property(
+    client: *const DeviceClient,
+    path: *const c_char,
+) -> CResult {
+    let client = AssertUnwindSafe(client);
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let client = ptr_to_ref(*client)?;
+        let path = ptr_to_str(path)?;
+        client.remove_reported_property(path)
+    })
+}
+
 /// Enqueue a patch of the Reported Properties to be sent to the Platform.
 ///
 /// This method saves these reported properties persistently in the state file.
@@ -5,17 +5,18 @@
 use std::ffi::{CStr, CString};
 use std::panic::{self, UnwindSafe};
 use std::slice;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Once;
 
 use anyhow::{bail, Error, Result};
 use error::{update_last_error, update_last_error_with_panic, CResult};
 use libc::{c_char, size_t};
-use simple_logger::SimpleLogger;
 
 pub mod dps;
 pub mod error;
 pub mod ingress;
+pub mod logging;
 pub(crate) mod marshall;
+pub mod runtime;
 
 /// The maximum number of bytes of any [Device ID](https://docs.spotflow.io/connect-devices/#device-id) string
 /// including the trailing NUL character.
@@ -31,6 +32,9 @@ pub const SPOTFLOW_ERROR_MAX_LENGTH: usize = 1024;
 /// A special value that instructs @ref spotflow_client_get_desired_properties_if_newer to always return the current version.
 pub const SPOTFLOW_PROPERTIES_VERSION_ANY: u64 = 0;
 
+/// The number of buckets of each @ref spotflow_histogram_t.
+pub const SPOTFLOW_METRICS_HISTOGRAM_BUCKETS: usize = 32;
+
 /// The verbosity levels of logging.
 #[repr(C)]
 pub enum LogLevel {
@@ -48,7 +52,24 @@ pub enum LogLevel {
     SpotflowLogTrace = 5,
 }
 
-/// Set the verbosity level of logging (@ref SPOTFLOW_LOG_WARN by default).
+impl From<LogLevel> for log::LevelFilter {
+    fn from(level: LogLevel) -> Self {
+        match level {
+            LogLevel::SpotflowLogOff => log::LevelFilter::Off,
+            LogLevel::SpotflowLogError => log::LevelFilter::Error,
+            LogLevel::SpotflowLogWarn => log::LevelFilter::Warn,
+            LogLevel::SpotflowLogInfo => log::LevelFilter::Info,
+            LogLevel::SpotflowLogDebug => log::LevelFilter::Debug,
+            LogLevel::SpotflowLogTrace => log::LevelFilter::Trace,
+        }
+    }
+}
+
+/// Set the verbosity level of logging (@ref SPOTFLOW_LOG_WARN by default). Use
+/// @ref spotflow_set_subsystem_log_level to override it for individual subsystems of the Device SDK.
+///
+/// The trace messages are not available if the library was built with the feature `release-max-level-debug`, which
+/// removes them from the code for the best performance.
 ///
 /// @param level The verbosity level of logging.
 /// @return @ref SPOTFLOW_OK if successful, @ref SPOTFLOW_ERROR otherwise.
@@ -57,16 +78,7 @@ pub extern "C" fn spotflow_set_log_level(level: LogLevel) -> CResult {
     call_safe_with_unit_result(|| {
         ensure_logging();
 
-        let level = match level {
-            LogLevel::SpotflowLogOff => log::LevelFilter::Off,
-            LogLevel::SpotflowLogError => log::LevelFilter::Error,
-            LogLevel::SpotflowLogWarn => log::LevelFilter::Warn,
-            LogLevel::SpotflowLogInfo => log::LevelFilter::Info,
-            LogLevel::SpotflowLogDebug => log::LevelFilter::Debug,
-            LogLevel::SpotflowLogTrace => log::LevelFilter::Trace,
-        };
-
-        log::set_max_level(level);
+        logging::set_level(level.into());
 
         Ok(())
     })
@@ -78,26 +90,10 @@ pub extern "C" fn spotflow_set_log_level(level: LogLevel) -> CResult {
 /// Must be run as the first step of all the public functions in this library apart from `*_destroy` functions.
 /// (These functions have no way to signalize that the logging was not initialized, so they would panic if it wasn't.)
 fn ensure_logging() {
-    // Make sure that the logger is initialized only once
-    static INIT: AtomicBool = AtomicBool::new(false);
-    if INIT
-        .compare_exchange(false, true, Ordering::AcqRel, Ordering::Relaxed)
-        .is_ok()
-    {
-        // The logger will write all messages it receives to stderr, the verbosity of external modules
-        // is reduced to warnings and errors
-        SimpleLogger::new()
-            .with_level(log::LevelFilter::Trace)
-            .with_module_level("sqlx", log::LevelFilter::Warn)
-            .with_module_level("ureq", log::LevelFilter::Warn)
-            .with_module_level("rumqttc", log::LevelFilter::Warn)
-            .with_module_level("mio", log::LevelFilter::Warn)
-            .init()
-            .unwrap();
-
-        // We'll limit the verbosity of the messages that the logger will receive to warnings and errors by default
-        log::set_max_level(log::LevelFilter::Warn);
-    }
+    // Make sure that the logger is initialized only once, the following calls only check an atomic flag. The
+    // verbosity of the messages that the logger receives is limited to warnings and errors by default.
+    static INIT: Once = Once::new();
+    INIT.call_once(logging::init);
 }
 
 fn string_to_ptr(s: String) -> *const c_char {
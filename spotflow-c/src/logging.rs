@@ -0,0 +1,312 @@
+use std::sync::atomic::{AtomicU32, AtomicU64, AtomicUsize, Ordering};
+
+use log::{LevelFilter, Log, Metadata, Record};
+use simple_logger::SimpleLogger;
+
+use crate::{call_safe_with_unit_result, ensure_logging, error::CResult, LogLevel};
+
+/// The parts of the Device SDK whose logging can be configured separately using
+/// @ref spotflow_set_subsystem_log_level and @ref spotflow_set_subsystem_log_sampling.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub enum LogSubsystem {
+    /// Enqueueing [Messages](https://docs.spotflow.io/send-data/#message) and the other public functions of the client.
+    SpotflowLogSubsystemEnqueue = 0,
+    /// The local database file, including storing the enqueued Messages and reading them back to be sent.
+    SpotflowLogSubsystemStorage = 1,
+    /// The compression of Messages.
+    SpotflowLogSubsystemCompression = 2,
+    /// Publishing the Messages to the Platform.
+    SpotflowLogSubsystemPublish = 3,
+    /// The connection to the Platform, including the acknowledgments of the published Messages and the processing of
+    /// the received packets.
+    SpotflowLogSubsystemConnection = 4,
+    /// [Device Provisioning](https://docs.spotflow.io/connect-devices/#device-provisioning) and the other
+    /// communication with the Platform over HTTP.
+    SpotflowLogSubsystemProvisioning = 5,
+}
+
+const SUBSYSTEMS: usize = 6;
+
+// The targets of the log records are the paths of the modules that create them. The more specific prefixes must come
+// first, the first matching one determines the subsystem of the record.
+const SUBSYSTEM_TARGETS: [(&str, LogSubsystem); SUBSYSTEMS] = [
+    (
+        "spotflow::persistence::compression",
+        LogSubsystem::SpotflowLogSubsystemCompression,
+    ),
+    (
+        "spotflow::iothub::sender",
+        LogSubsystem::SpotflowLogSubsystemPublish,
+    ),
+    (
+        "spotflow::persistence",
+        LogSubsystem::SpotflowLogSubsystemStorage,
+    ),
+    (
+        "spotflow::iothub",
+        LogSubsystem::SpotflowLogSubsystemConnection,
+    ),
+    (
+        "spotflow::ingress",
+        LogSubsystem::SpotflowLogSubsystemEnqueue,
+    ),
+    (
+        "spotflow::cloud",
+        LogSubsystem::SpotflowLogSubsystemProvisioning,
+    ),
+];
+
+// The subsystem uses the level set by `spotflow_set_log_level`
+const LEVEL_UNSET: usize = usize::MAX;
+
+static GLOBAL_LEVEL: AtomicUsize = AtomicUsize::new(LevelFilter::Warn as usize);
+
+static SUBSYSTEM_LEVELS: [AtomicUsize; SUBSYSTEMS] = [
+    AtomicUsize::new(LEVEL_UNSET),
+    AtomicUsize::new(LEVEL_UNSET),
+    AtomicUsize::new(LEVEL_UNSET),
+    AtomicUsize::new(LEVEL_UNSET),
+    AtomicUsize::new(LEVEL_UNSET),
+    AtomicUsize::new(LEVEL_UNSET),
+];
+
+static SUBSYSTEM_SAMPLING: [AtomicU32; SUBSYSTEMS] = [
+    AtomicU32::new(1),
+    AtomicU32::new(1),
+    AtomicU32::new(1),
+    AtomicU32::new(1),
+    AtomicU32::new(1),
+    AtomicU32::new(1),
+];
+
+static SUBSYSTEM_COUNTERS: [AtomicU64; SUBSYSTEMS] = [
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+];
+
+/// Filters the records by the levels of their subsystems and samples their debug and trace records before passing
+/// them to the logger writing to stderr. The configuration is read without locking, so it can change at any time.
+struct SubsystemLogger {
+    inner: SimpleLogger,
+}
+
+impl SubsystemLogger {
+    fn subsystem(target: &str) -> Option<usize> {
+        SUBSYSTEM_TARGETS
+            .iter()
+            .find(|(prefix, _)| {
+                target
+                    .strip_prefix(prefix)
+                    .is_some_and(|rest| rest.is_empty() || rest.starts_with("::"))
+            })
+            .map(|(_, subsystem)| *subsystem as usize)
+    }
+
+    fn level(subsystem: Option<usize>) -> LevelFilter {
+        let level = subsystem
+            .map(|subsystem| SUBSYSTEM_LEVELS[subsystem].load(Ordering::Relaxed))
+            .filter(|level| *level != LEVEL_UNSET)
+            .unwrap_or_else(|| GLOBAL_LEVEL.load(Ordering::Relaxed));
+
+        level_from_usize(level)
+    }
+
+    // Errors, warnings, and information are never sampled out
+    fn sampled(subsystem: Option<usize>, record: &Record) -> bool {
+        let Some(subsystem) = subsystem else {
+            return true;
+        };
+        if record.level() <= log::Level::Info {
+            return true;
+        }
+
+        let every = SUBSYSTEM_SAMPLING[subsystem].load(Ordering::Relaxed);
+        every <= 1
+            || SUBSYSTEM_COUNTERS[subsystem].fetch_add(1, Ordering::Relaxed) % u64::from(every) == 0
+    }
+}
+
+impl Log for SubsystemLogger {
+    fn enabled(&self, metadata: &Metadata) -> bool {
+        metadata.level() <= Self::level(Self::subsystem(metadata.target()))
+            && self.inner.enabled(metadata)
+    }
+
+    fn log(&self, record: &Record) {
+        let subsystem = Self::subsystem(record.target());
+        if record.level() > Self::level(subsystem) || !Self::sampled(subsystem, record) {
+            return;
+        }
+
+        self.inner.log(record);
+    }
+
+    fn flush(&self) {
+        self.inner.flush();
+    }
+}
+
+fn level_from_usize(level: usize) -> LevelFilter {
+    match level {
+        0 => LevelFilter::Off,
+        1 => LevelFilter::Error,
+        2 => LevelFilter::Warn,
+        3 => LevelFilter::Info,
+        4 => LevelFilter::Debug,
+        _ => LevelFilter::Trace,
+    }
+}
+
+/// Register the logger writing to stderr. Must be called only once.
+pub(crate) fn init() {
+    // The verbosity of external modules is reduced to warnings and errors
+    let inner = SimpleLogger::new()
+        .with_level(LevelFilter::Trace)
+        .with_module_level("sqlx", LevelFilter::Warn)
+        .with_module_level("ureq", LevelFilter::Warn)
+        .with_module_level("rumqttc", LevelFilter::Warn)
+        .with_module_level("mio", LevelFilter::Warn);
+
+    log::set_boxed_logger(Box::new(SubsystemLogger { inner })).unwrap();
+
+    update_max_level();
+}
+
+pub(crate) fn set_level(level: LevelFilter) {
+    GLOBAL_LEVEL.store(level as usize, Ordering::Relaxed);
+    update_max_level();
+}
+
+// The records above the maximum level are discarded by the logging macros without being formatted, so the maximum
+// level is kept as low as the most verbose subsystem allows
+fn update_max_level() {
+    let global = GLOBAL_LEVEL.load(Ordering::Relaxed);
+    let max = SUBSYSTEM_LEVELS
+        .iter()
+        .map(|level| level.load(Ordering::Relaxed))
+        .filter(|level| *level != LEVEL_UNSET)
+        .fold(global, usize::max);
+
+    log::set_max_level(level_from_usize(max));
+}
+
+/// Set the verbosity level of logging of a single subsystem of the Device SDK, overriding the level set by
+/// @ref spotflow_set_log_level for it. The level can be changed at any time, for example, to investigate an issue
+/// with the connection without turning on the verbose logging of the other subsystems.
+///
+/// The trace messages are not available if the library was built with the feature `release-max-level-debug`.
+///
+/// @param subsystem The subsystem whose verbosity level to set.
+/// @param level The verbosity level of logging of the subsystem.
+/// @return @ref SPOTFLOW_OK if successful, @ref SPOTFLOW_ERROR otherwise.
+#[no_mangle]
+pub extern "C" fn spotflow_set_subsystem_log_level(
+    subsystem: LogSubsystem,
+    level: LogLevel,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        let level: LevelFilter = level.into();
+        SUBSYSTEM_LEVELS[subsystem as usize].store(level as usize, Ordering::Relaxed);
+        update_max_level();
+
+        Ok(())
+    })
+}
+
+/// Log only every `every`-th debug and trace message of a subsystem of the Device SDK (1 by default, which logs all
+/// of them). Errors, warnings, and information are always logged. Use this to keep an eye on the busy subsystems,
+/// such as @ref SPOTFLOW_LOG_SUBSYSTEM_PUBLISH, without slowing the Device down by logging every Message.
+///
+/// @param subsystem The subsystem whose messages to sample.
+/// @param every The ratio of the logged messages, 0 is treated as 1.
+/// @return @ref SPOTFLOW_OK if successful, @ref SPOTFLOW_ERROR otherwise.
+#[no_mangle]
+pub extern "C" fn spotflow_set_subsystem_log_sampling(
+    subsystem: LogSubsystem,
+    every: u32,
+) -> CResult {
+    call_safe_with_unit_result(|| {
+        ensure_logging();
+
+        SUBSYSTEM_SAMPLING[subsystem as usize].store(every.max(1), Ordering::Relaxed);
+
+        Ok(())
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use log::Level;
+
+    use super::*;
+
+    fn subsystem(target: &str) -> Option<usize> {
+        SubsystemLogger::subsystem(target)
+    }
+
+    fn sampled(subsystem: LogSubsystem, level: Level) -> bool {
+        SubsystemLogger::sampled(
+            Some(subsystem as usize),
+            &Record::builder()
+                .level(level)
+                .args(format_args!("message"))
+                .build(),
+        )
+    }
+
+    #[test]
+    fn more_specific_prefixes_take_precedence() {
+        assert_eq!(
+            subsystem("spotflow::persistence::compression::x"),
+            Some(LogSubsystem::SpotflowLogSubsystemCompression as usize)
+        );
+        assert_eq!(
+            subsystem("spotflow::persistence::sqlite"),
+            Some(LogSubsystem::SpotflowLogSubsystemStorage as usize)
+        );
+        assert_eq!(
+            subsystem("spotflow::iothub::sender"),
+            Some(LogSubsystem::SpotflowLogSubsystemPublish as usize)
+        );
+        assert_eq!(
+            subsystem("spotflow::iothub::eventloop"),
+            Some(LogSubsystem::SpotflowLogSubsystemConnection as usize)
+        );
+    }
+
+    #[test]
+    fn prefixes_match_only_whole_modules() {
+        assert_eq!(
+            subsystem("spotflow::ingress"),
+            Some(LogSubsystem::SpotflowLogSubsystemEnqueue as usize)
+        );
+        assert_eq!(subsystem("spotflow::ingressx"), None);
+        assert_eq!(subsystem("sqlx::sqlite"), None);
+    }
+
+    #[test]
+    fn sampling_keeps_every_nth_debug_record() {
+        // No other test uses the sampling of this subsystem
+        let provisioning = LogSubsystem::SpotflowLogSubsystemProvisioning;
+        SUBSYSTEM_SAMPLING[provisioning as usize].store(3, Ordering::Relaxed);
+        SUBSYSTEM_COUNTERS[provisioning as usize].store(0, Ordering::Relaxed);
+
+        let kept = (0..9)
+            .filter(|_| sampled(provisioning, Level::Debug))
+            .count();
+        assert_eq!(kept, 3);
+
+        for level in [Level::Error, Level::Warn, Level::Info] {
+            assert!((0..3).all(|_| sampled(provisioning, level)));
+        }
+
+        SUBSYSTEM_SAMPLING[provisioning as usize].store(1, Ordering::Relaxed);
+    }
+}
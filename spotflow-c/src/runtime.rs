@@ -0,0 +1,120 @@
+use anyhow::{bail, Result};
+use libc::size_t;
+use spotflow::MIN_WORKER_THREADS;
+
+use crate::error::CResult;
+use crate::{
+    buffer_to_slice, call_safe_with_result, drop_ptr, ensure_logging, obj_to_ptr, store_to_ptr,
+};
+
+/// A pool of threads that runs the background work of one or more @ref spotflow_client_t objects, such as maintaining
+/// the connection to the Platform and sending [Messages](https://docs.spotflow.io/send-data/#message). This object is
+/// managed by the Device SDK. Create its instance using @ref spotflow_runtime_create, share it between clients using
+/// @ref spotflow_client_options_set_runtime, and delete it using @ref spotflow_runtime_destroy after all the clients
+/// that use it are destroyed.
+pub struct Runtime {
+    pub(crate) inner: tokio::runtime::Runtime,
+}
+
+/// Create a pool of threads that can be shared by multiple @ref spotflow_client_t objects. Without it, each client
+/// creates its own pool with the number of threads set by @ref spotflow_client_options_set_worker_threads.
+///
+/// @param runtime (Output) The pointer to the @ref spotflow_runtime_t object that will be created by this function.
+/// @param worker_threads The number of threads in the pool, at least 2.
+/// @param cpu_ids (Optional) The IDs of the CPUs the threads are allowed to run on. Use `NULL` if the threads can run on
+///                any CPU. Supported only on Linux.
+/// @param cpu_ids_count The number of items in @p cpu_ids.
+/// @return @ref SPOTFLOW_OK if the function succeeds, @ref SPOTFLOW_ERROR if any argument is invalid or the threads
+///         cannot be started.
+#[no_mangle]
+pub extern "C" fn spotflow_runtime_create(
+    runtime: *mut *mut Runtime,
+    worker_threads: size_t,
+    cpu_ids: *const size_t,
+    cpu_ids_count: size_t,
+) -> CResult {
+    let result = call_safe_with_result(|| {
+        ensure_logging();
+
+        if worker_threads < MIN_WORKER_THREADS {
+            bail!("The runtime needs at least {MIN_WORKER_THREADS} worker threads.");
+        }
+
+        let cpu_ids = if cpu_ids.is_null() {
+            Vec::new()
+        } else {
+            unsafe { buffer_to_slice(cpu_ids, cpu_ids_count) }?.to_vec()
+        };
+
+        let mut builder = tokio::runtime::Builder::new_multi_thread();
+        builder
+            .worker_threads(worker_threads)
+            .thread_name("spotflow-worker")
+            .enable_all();
+
+        if !cpu_ids.is_empty() {
+            let cpu_set = cpu_set(&cpu_ids)?;
+            builder.on_thread_start(move || pin_current_thread(&cpu_set));
+        }
+
+        Ok(Runtime {
+            inner: builder.build()?,
+        })
+    });
+
+    match result {
+        Err(err) => err,
+        Ok(new_runtime) => {
+            let new_runtime_ptr = obj_to_ptr(new_runtime);
+            unsafe { store_to_ptr(runtime, new_runtime_ptr) }
+        }
+    }
+}
+
+/// Stop the threads and destroy the @ref spotflow_runtime_t object. All the @ref spotflow_client_t objects using
+/// the runtime must be destroyed first.
+///
+/// @param runtime The @ref spotflow_runtime_t object to destroy.
+#[no_mangle]
+pub unsafe extern "C" fn spotflow_runtime_destroy(runtime: *mut Runtime) {
+    drop_ptr(runtime);
+}
+
+#[cfg(target_os = "linux")]
+fn cpu_set(cpu_ids: &[size_t]) -> Result<libc::cpu_set_t> {
+    // SAFETY: `cpu_set_t` is a plain bit mask, for which all zeroes is the valid empty set
+    let mut cpu_set: libc::cpu_set_t = unsafe { std::mem::zeroed() };
+    let max_cpus = 8 * std::mem::size_of::<libc::cpu_set_t>();
+
+    for &cpu_id in cpu_ids {
+        if cpu_id >= max_cpus {
+            bail!(
+                "The CPU ID {cpu_id} is out of range, the maximum is {}.",
+                max_cpus - 1
+            );
+        }
+        unsafe { libc::CPU_SET(cpu_id, &mut cpu_set) };
+    }
+
+    Ok(cpu_set)
+}
+
+#[cfg(target_os = "linux")]
+fn pin_current_thread(cpu_set: &libc::cpu_set_t) {
+    let result =
+        unsafe { libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), cpu_set) };
+    if result != 0 {
+        log::warn!(
+            "Unable to set the CPU affinity of a worker thread: {}",
+            std::io::Error::last_os_error()
+        );
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn cpu_set(_cpu_ids: &[size_t]) -> Result<()> {
+    bail!("Setting the CPU affinity of the worker threads is supported only on Linux.")
+}
+
+#[cfg(not(target_os = "linux"))]
+fn pin_current_thread(_cpu_set: &()) {}
@@ -1,5 +1,5 @@
 import enum
-from typing import Optional, Callable
+from typing import Awaitable, Callable, Iterable, Optional, Tuple, Union
 
 class SpotflowError(Exception):
     pass
@@ -20,6 +20,7 @@ class Compression(enum.Enum):
     UNCOMPRESSED = 0
     FASTEST = 1
     SMALLEST_SIZE = 2
+    SMALL_MESSAGES = 3
 
 class DeviceClient:
     @staticmethod
@@ -28,7 +29,10 @@ class DeviceClient:
               db: str,
               instance: Optional[str] = None,
               display_provisioning_operation_callback: Optional[Callable[[ProvisioningOperation], None]] = None,
-              desired_properties_updated_callback: Optional[Callable[[DesiredProperties], None]] = None) -> DeviceClient:
+              desired_properties_updated_callback: Optional[Callable[[DesiredProperties], None]] = None,
+              method_handler: Optional[Callable[[str, bytes], Tuple[int, Union[str, bytes]]]] = None,
+              method_handler_concurrency: Optional[int] = None,
+              method_handler_timeout: Optional[float] = None) -> DeviceClient:
          ...
 
     @property
@@ -46,7 +50,9 @@ class DeviceClient:
     @property
     def pending_messages_count(self) -> int: ...
 
-    def wait_enqueued_messages_sent(self) -> None: ...
+    def get_metrics(self) -> dict: ...
+
+    def wait_enqueued_messages_sent(self, timeout: Optional[int] = None) -> bool: ...
 
     def get_desired_properties(self) -> DesiredProperties: ...
 
@@ -59,7 +65,7 @@ class DeviceClient:
 
 class StreamSender:
     def send_message(self, 
-                     payload: str | bytes,
+                     payload: Union[bytes, bytearray, memoryview],
                      batch_id: Optional[str] = None,
                      message_id: Optional[str] = None,
                      batch_slice_id: Optional[str] = None,
@@ -67,17 +73,91 @@ class StreamSender:
         ...
 
     def enqueue_message(self, 
-                     payload: str | bytes,
+                     payload: Union[bytes, bytearray, memoryview],
                      batch_id: Optional[str] = None,
                      message_id: Optional[str] = None,
                      batch_slice_id: Optional[str] = None,
                      chunk_id: Optional[str] = None) -> None:
         ...
 
+    def enqueue_messages(self,
+                         payloads: Iterable[Union[bytes, bytearray, memoryview]],
+                         batch_id: Optional[str] = None) -> None:
+        ...
+
     def enqueue_batch_completion(self, batch_id: str) -> None: ...
 
     def enqueue_message_completion(self, batch_id: str, message_id: str) -> None: ...
 
+class AsyncDeviceClient:
+    @staticmethod
+    def start(device_id: Optional[str],
+              provisioning_token: str,
+              db: str,
+              instance: Optional[str] = None,
+              display_provisioning_operation_callback: Optional[Callable[[ProvisioningOperation], None]] = None,
+              desired_properties_updated_callback: Optional[Callable[[DesiredProperties], None]] = None,
+              method_handler: Optional[Callable[[str, bytes], Tuple[int, Union[str, bytes]]]] = None,
+              method_handler_concurrency: Optional[int] = None,
+              method_handler_timeout: Optional[float] = None) -> Awaitable[AsyncDeviceClient]:
+         ...
+
+    def __aenter__(self) -> Awaitable[AsyncDeviceClient]: ...
+
+    def __aexit__(self, exception_type, exception_value, traceback) -> Awaitable[None]: ...
+
+    def close(self) -> Awaitable[None]: ...
+
+    def workspace_id(self) -> Awaitable[str]: ...
+
+    def device_id(self) -> Awaitable[str]: ...
+
+    def create_stream_sender(self,
+                             stream_group: Optional[str] = None,
+                             stream: Optional[str] = None,
+                             compression: Optional[Compression] = Compression.UNCOMPRESSED) -> AsyncStreamSender:
+        ...
+
+    def pending_messages_count(self) -> Awaitable[int]: ...
+
+    def get_metrics(self) -> dict: ...
+
+    def wait_enqueued_messages_sent(self, timeout: Optional[int] = None) -> Awaitable[bool]: ...
+
+    def get_desired_properties(self) -> Awaitable[DesiredProperties]: ...
+
+    def get_desired_properties_if_newer(self, version: Optional[int] = None) -> Awaitable[Optional[DesiredProperties]]: ...
+
+    def update_reported_properties(self, properties: dict) -> Awaitable[None]: ...
+
+    def any_pending_reported_properties_updates(self) -> Awaitable[bool]: ...
+
+class AsyncStreamSender:
+    def send_message(self,
+                     payload: Union[bytes, bytearray, memoryview],
+                     batch_id: Optional[str] = None,
+                     message_id: Optional[str] = None,
+                     batch_slice_id: Optional[str] = None,
+                     chunk_id: Optional[str] = None) -> Awaitable[None]:
+        ...
+
+    def enqueue_message(self,
+                        payload: Union[bytes, bytearray, memoryview],
+                        batch_id: Optional[str] = None,
+                        message_id: Optional[str] = None,
+                        batch_slice_id: Optional[str] = None,
+                        chunk_id: Optional[str] = None) -> Awaitable[None]:
+        ...
+
+    def enqueue_messages(self,
+                         payloads: Iterable[Union[bytes, bytearray, memoryview]],
+                         batch_id: Optional[str] = None) -> Awaitable[None]:
+        ...
+
+    def enqueue_batch_completion(self, batch_id: str) -> Awaitable[None]: ...
+
+    def enqueue_message_completion(self, batch_id: str, message_id: str) -> Awaitable[None]: ...
+
 class DesiredProperties:
     @property
     def version(self) -> int: ...
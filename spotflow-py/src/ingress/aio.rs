@@ -0,0 +1,453 @@
+use std::sync::{Mutex, OnceLock};
+use std::time::Duration;
+
+use pyo3::exceptions::PyException;
+use pyo3::prelude::*;
+use pyo3::types::{PyDict, PyTraceback, PyType};
+use spotflow::{MessageContext, OutgoingMessage};
+use tokio::runtime::Runtime;
+
+use crate::SpotflowError;
+
+use super::twins::DesiredProperties;
+use super::{extract_payload, metrics_to_dict, Compression, StartOptions};
+
+// Shared by all the asynchronous clients, so that they don't need threads of their own
+static RUNTIME: OnceLock<Runtime> = OnceLock::new();
+
+fn runtime() -> PyResult<&'static Runtime> {
+    if let Some(runtime) = RUNTIME.get() {
+        return Ok(runtime);
+    }
+
+    let runtime = tokio::runtime::Builder::new_multi_thread()
+        // The same number of worker threads as the runtime of each `DeviceClient` has by default
+        .worker_threads(spotflow::MIN_WORKER_THREADS)
+        .enable_all()
+        .build()
+        .map_err(|e| SpotflowError::new_err(format!("Unable to build tokio runtime: {e}")))?;
+
+    // If another thread built its runtime in the meantime, this one is dropped
+    Ok(RUNTIME.get_or_init(|| runtime))
+}
+
+/// Run the blocking `operation` on the blocking threads of the runtime shared by the asynchronous clients and return
+/// an `asyncio.Future` of the running event loop that is resolved with the result. The GIL is released while the
+/// operation runs.
+fn spawn<T, F>(py: Python<'_>, operation: F) -> PyResult<&PyAny>
+where
+    F: FnOnce() -> PyResult<T> + Send + 'static,
+    T: IntoPy<PyObject> + Send + 'static,
+{
+    let runtime = runtime()?;
+    let event_loop = py.import("asyncio")?.call_method0("get_running_loop")?;
+    let future = event_loop.call_method0("create_future")?;
+
+    let event_loop: PyObject = event_loop.into();
+    let resolve: PyObject = wrap_pyfunction!(resolve_future, py)?.into();
+    let target: PyObject = future.into();
+
+    runtime.spawn_blocking(move || {
+        let result = operation();
+
+        Python::with_gil(|py| {
+            let (value, failed) = match result {
+                Ok(value) => (value.into_py(py), false),
+                Err(e) => (e.into_py(py), true),
+            };
+
+            // The future can be resolved only from the thread of its event loop
+            let args = (resolve, target, value, failed);
+            if let Err(e) = event_loop.call_method1(py, "call_soon_threadsafe", args) {
+                // The event loop has been closed in the meantime, so nobody awaits the result anymore
+                log::debug!("Unable to pass the result of an asynchronous operation: {e}");
+            }
+        });
+    });
+
+    Ok(future)
+}
+
+#[pyfunction]
+fn resolve_future(future: &PyAny, value: PyObject, failed: bool) -> PyResult<()> {
+    // The application might have cancelled the future in the meantime
+    if future.call_method0("done")?.is_true()? {
+        return Ok(());
+    }
+
+    let method = if failed {
+        "set_exception"
+    } else {
+        "set_result"
+    };
+    future.call_method1(method, (value,))?;
+    Ok(())
+}
+
+fn to_py_err(e: anyhow::Error) -> PyErr {
+    SpotflowError::new_err(e.to_string())
+}
+
+/// An [asyncio](https://docs.python.org/3/library/asyncio.html) client communicating with the Platform.
+/// Create its instance using `await AsyncDeviceClient.start(...)`.
+///
+/// The client offers the same functionality as `DeviceClient`, but its methods that could block return awaitables
+/// instead. The operations run on the background threads of the Device SDK without holding the GIL, so the event loop
+/// can run other tasks in the meantime. Use the client as an asynchronous context manager (`async with`) or call
+/// `close` to stop it.
+#[pyclass]
+pub struct AsyncDeviceClient {
+    inner: Mutex<Option<spotflow::DeviceClient>>,
+}
+
+impl AsyncDeviceClient {
+    fn client(&self) -> PyResult<spotflow::DeviceClient> {
+        self.inner
+            .lock()
+            .unwrap()
+            .clone()
+            .ok_or_else(|| SpotflowError::new_err("Connection has already been shut down"))
+    }
+}
+
+#[pymethods]
+impl AsyncDeviceClient {
+    /// Start communicating with the Platform. The options are the same as in `DeviceClient.start`.
+    ///
+    /// The returned awaitable completes once the client is started, which might require the approval of the
+    /// [Provisioning Operation](https://docs.spotflow.io/connect-devices/#provisioning-operation).
+    #[classmethod]
+    #[pyo3(signature = (device_id, provisioning_token, db, instance=None, display_provisioning_operation_callback=None, desired_properties_updated_callback=None, method_handler=None, method_handler_concurrency=None, method_handler_timeout=None))]
+    #[allow(clippy::too_many_arguments)]
+    fn start<'py>(
+        _cls: &PyType,
+        py: Python<'py>,
+        device_id: Option<String>,
+        provisioning_token: String,
+        db: String,
+        instance: Option<String>,
+        display_provisioning_operation_callback: Option<PyObject>,
+        desired_properties_updated_callback: Option<PyObject>,
+        method_handler: Option<PyObject>,
+        method_handler_concurrency: Option<usize>,
+        method_handler_timeout: Option<f64>,
+    ) -> PyResult<&'py PyAny> {
+        let options = StartOptions {
+            device_id,
+            provisioning_token,
+            db,
+            instance,
+            display_provisioning_operation_callback,
+            desired_properties_updated_callback,
+            method_handler,
+            method_handler_concurrency,
+            method_handler_timeout,
+        };
+        let runtime = runtime()?.handle().clone();
+
+        spawn(py, move || {
+            options.build(Some(runtime)).map(|inner| AsyncDeviceClient {
+                inner: Mutex::new(Some(inner)),
+            })
+        })
+    }
+
+    #[pyo3(name = "__aenter__")]
+    fn aenter(slf: Py<Self>, py: Python<'_>) -> PyResult<&PyAny> {
+        spawn(py, move || Ok(slf))
+    }
+
+    #[pyo3(name = "__aexit__")]
+    fn aexit<'py>(
+        &self,
+        py: Python<'py>,
+        _exception_type: Option<&PyType>,
+        _exception_value: Option<&PyException>,
+        _traceback: Option<&PyTraceback>,
+    ) -> PyResult<&'py PyAny> {
+        self.close(py)
+    }
+
+    /// Stop the client. The returned awaitable completes once the Messages waiting in memory are saved to the local
+    /// database file. No methods should be called on the client afterwards.
+    fn close<'py>(&self, py: Python<'py>) -> PyResult<&'py PyAny> {
+        let client = self.inner.lock().unwrap().take();
+        spawn(py, move || {
+            drop(client);
+            Ok(())
+        })
+    }
+
+    /// Get the ID of the [Workspace](https://docs.spotflow.io/manage-access/workspaces/) to which the
+    /// [Device](https://docs.spotflow.io/connect-devices/#device) belongs.
+    fn workspace_id<'py>(&self, py: Python<'py>) -> PyResult<&'py PyAny> {
+        let client = self.client()?;
+        spawn(py, move || client.workspace_id().map_err(to_py_err))
+    }
+
+    /// Get the [Device ID](https://docs.spotflow.io/connect-devices/#device-id), see `DeviceClient.device_id`.
+    fn device_id<'py>(&self, py: Python<'py>) -> PyResult<&'py PyAny> {
+        let client = self.client()?;
+        spawn(py, move || client.device_id().map_err(to_py_err))
+    }
+
+    /// Create an `AsyncStreamSender` for sending [Messages](https://docs.spotflow.io/send-data/#message) to
+    /// a [Stream](https://docs.spotflow.io/send-data/#stream), see `DeviceClient.create_stream_sender`.
+    fn create_stream_sender(
+        &self,
+        stream_group: Option<String>,
+        stream: Option<String>,
+        compression: Option<Compression>,
+    ) -> PyResult<AsyncStreamSender> {
+        let compression = compression.unwrap_or(Compression::Uncompressed);
+
+        let mut message_context = MessageContext::new(stream_group, stream);
+        message_context.set_compression(compression.to_ingress_compression_option());
+
+        Ok(AsyncStreamSender {
+            connection: self.client()?,
+            message_context,
+        })
+    }
+
+    /// Get the number of [Messages](https://docs.spotflow.io/send-data/#message) that
+    /// have been persisted in the local database file but haven't been sent to the Platform yet.
+    fn pending_messages_count<'py>(&self, py: Python<'py>) -> PyResult<&'py PyAny> {
+        let client = self.client()?;
+        spawn(py, move || {
+            client.pending_messages_count().map_err(to_py_err)
+        })
+    }
+
+    /// Get the metrics of the client as a `dict`, see `DeviceClient.get_metrics`. Collecting the metrics doesn't block.
+    fn get_metrics(&self, py: Python<'_>) -> PyResult<Py<PyDict>> {
+        metrics_to_dict(py, &self.client()?.metrics())
+    }
+
+    /// Wait until all the [Messages](https://docs.spotflow.io/send-data/#message) that have been previously enqueued
+    /// are sent to the Platform.
+    ///
+    /// If `timeout` (in seconds) is provided, stop waiting once it elapses. The awaitable results in `True` if all
+    /// the Messages were sent and `False` if the timeout elapsed first.
+    fn wait_enqueued_messages_sent<'py>(
+        &self,
+        py: Python<'py>,
+        timeout: Option<u64>,
+    ) -> PyResult<&'py PyAny> {
+        let client = self.client()?;
+        spawn(py, move || {
+            match timeout {
+                Some(timeout) => {
+                    client.wait_enqueued_messages_sent_timeout(Duration::from_secs(timeout))
+                }
+                None => client.wait_enqueued_messages_sent().map(|()| true),
+            }
+            .map_err(to_py_err)
+        })
+    }
+
+    /// Get the current [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
+    ///
+    /// Only the latest version is returned, any versions between the last obtained one and the current one are skipped.
+    fn get_desired_properties<'py>(&self, py: Python<'py>) -> PyResult<&'py PyAny> {
+        let client = self.client()?;
+        spawn(py, move || {
+            let desired = client.desired_properties().map_err(to_py_err)?;
+            Python::with_gil(|py| DesiredProperties::new(py, desired.version, &desired.values))
+        })
+    }
+
+    /// Get the current [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties)
+    /// if their version is higher than `version` or if `version` is `None`. Otherwise, the awaitable results in `None`.
+    fn get_desired_properties_if_newer<'py>(
+        &self,
+        py: Python<'py>,
+        version: Option<u64>,
+    ) -> PyResult<&'py PyAny> {
+        let client = self.client()?;
+        spawn(py, move || {
+            let desired = match version {
+                Some(version) => client.desired_properties_if_newer(version),
+                None => Some(client.desired_properties().map_err(to_py_err)?),
+            };
+
+            Python::with_gil(|py| {
+                desired
+                    .map(|desired| DesiredProperties::new(py, desired.version, &desired.values))
+                    .transpose()
+            })
+        })
+    }
+
+    /// Enqueue an update of the [Reported Properties](https://docs.spotflow.io/configure-devices/#reported-properties)
+    /// to be sent to the Platform, see `DeviceClient.update_reported_properties`.
+    fn update_reported_properties<'py>(
+        &self,
+        py: Python<'py>,
+        properties: &PyDict,
+    ) -> PyResult<&'py PyAny> {
+        let json = PyModule::import(py, "json")?;
+        let reported: String = json.getattr("dumps")?.call1((properties,))?.extract()?;
+
+        let client = self.client()?;
+        spawn(py, move || {
+            client
+                .update_reported_properties(&reported)
+                .map_err(to_py_err)
+        })
+    }
+
+    /// Get whether there are any updates to [Reported Properties](https://docs.spotflow.io/configure-devices/#reported-properties)
+    /// that are yet to be sent to the Platform.
+    fn any_pending_reported_properties_updates<'py>(
+        &self,
+        py: Python<'py>,
+    ) -> PyResult<&'py PyAny> {
+        let client = self.client()?;
+        spawn(py, move || {
+            client
+                .any_pending_reported_properties_updates()
+                .map_err(to_py_err)
+        })
+    }
+}
+
+/// An [asyncio](https://docs.python.org/3/library/asyncio.html) sender of
+/// [Messages](https://docs.spotflow.io/send-data/#message) to a [Stream](https://docs.spotflow.io/send-data/#stream).
+///
+/// Create it with `AsyncDeviceClient.create_stream_sender`. The methods are the same as in `StreamSender`, but they
+/// return awaitables. The payloads are copied once before the methods return, so the buffers can be reused right away.
+#[pyclass]
+pub struct AsyncStreamSender {
+    connection: spotflow::DeviceClient,
+    message_context: MessageContext,
+}
+
+#[pymethods]
+impl AsyncStreamSender {
+    /// Send a [Message](https://docs.spotflow.io/send-data/#message) to the Platform, see `StreamSender.send_message`.
+    ///
+    /// The awaitable completes once the Message (and all the Messages enqueued before it) is sent to the Platform.
+    fn send_message<'py>(
+        &self,
+        py: Python<'py>,
+        payload: &PyAny,
+        batch_id: Option<String>,
+        message_id: Option<String>,
+        batch_slice_id: Option<String>,
+        chunk_id: Option<String>,
+    ) -> PyResult<&'py PyAny> {
+        let payload = extract_payload(payload)?.into_owned();
+        let connection = self.connection.clone();
+        let message_context = self.message_context.clone();
+
+        spawn(py, move || {
+            connection
+                .send_message_advanced(
+                    &message_context,
+                    batch_id,
+                    batch_slice_id,
+                    message_id,
+                    chunk_id,
+                    payload,
+                )
+                .map_err(to_py_err)
+        })
+    }
+
+    /// Enqueue a [Message](https://docs.spotflow.io/send-data/#message) to be sent to the Platform, see
+    /// `StreamSender.enqueue_message`.
+    ///
+    /// The awaitable completes once the Message is saved to the queue in the local database file.
+    fn enqueue_message<'py>(
+        &self,
+        py: Python<'py>,
+        payload: &PyAny,
+        batch_id: Option<String>,
+        message_id: Option<String>,
+        batch_slice_id: Option<String>,
+        chunk_id: Option<String>,
+    ) -> PyResult<&'py PyAny> {
+        let payload = extract_payload(payload)?.into_owned();
+        let connection = self.connection.clone();
+        let message_context = self.message_context.clone();
+
+        spawn(py, move || {
+            connection
+                .enqueue_message_advanced(
+                    &message_context,
+                    batch_id,
+                    batch_slice_id,
+                    message_id,
+                    chunk_id,
+                    payload,
+                )
+                .map_err(to_py_err)
+        })
+    }
+
+    /// Enqueue multiple [Messages](https://docs.spotflow.io/send-data/#message) with the payloads from the
+    /// iterable `payloads` to be sent to the Platform, see `StreamSender.enqueue_messages`.
+    ///
+    /// The awaitable completes once all the Messages are saved to the queue in the local database file.
+    fn enqueue_messages<'py>(
+        &self,
+        py: Python<'py>,
+        payloads: &PyAny,
+        batch_id: Option<String>,
+    ) -> PyResult<&'py PyAny> {
+        let messages = payloads
+            .iter()?
+            .map(|payload| {
+                Ok(OutgoingMessage {
+                    batch_id: batch_id.clone(),
+                    message_id: None,
+                    payload: extract_payload(payload?)?.into_owned().into(),
+                })
+            })
+            .collect::<PyResult<Vec<_>>>()?;
+        let connection = self.connection.clone();
+        let message_context = self.message_context.clone();
+
+        spawn(py, move || {
+            connection
+                .enqueue_messages(&message_context, messages)
+                .map_err(to_py_err)
+        })
+    }
+
+    /// Enqueue the manual completion of the current [Batch](https://docs.spotflow.io/send-data/#batch) to
+    /// be sent to the Platform, see `StreamSender.enqueue_batch_completion`.
+    fn enqueue_batch_completion<'py>(
+        &self,
+        py: Python<'py>,
+        batch_id: String,
+    ) -> PyResult<&'py PyAny> {
+        let connection = self.connection.clone();
+        let message_context = self.message_context.clone();
+
+        spawn(py, move || {
+            connection
+                .enqueue_batch_completion(&message_context, batch_id)
+                .map_err(to_py_err)
+        })
+    }
+
+    /// Enqueue the manual completion of the current [Message](https://docs.spotflow.io/send-data/#message) to
+    /// be sent to the Platform, see `StreamSender.enqueue_message_completion`.
+    fn enqueue_message_completion<'py>(
+        &self,
+        py: Python<'py>,
+        batch_id: String,
+        message_id: String,
+    ) -> PyResult<&'py PyAny> {
+        let connection = self.connection.clone();
+        let message_context = self.message_context.clone();
+
+        spawn(py, move || {
+            connection
+                .enqueue_message_completion(&message_context, batch_id, message_id)
+                .map_err(to_py_err)
+        })
+    }
+}
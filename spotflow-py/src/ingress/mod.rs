@@ -1,4 +1,5 @@
 use anyhow::{anyhow, Result};
+use std::borrow::Cow;
 use std::panic::RefUnwindSafe;
 use std::sync::Mutex;
 use std::time::Duration;
@@ -7,9 +8,10 @@ use pyo3::exceptions::PyException;
 use pyo3::types::{PyBytes, PyDict, PyTraceback, PyTuple};
 use pyo3::{prelude::*, types::PyType};
 use spotflow::{
-    DesiredPropertiesUpdatedCallback, DeviceClientBuilder, MessageContext,
+    DesiredPropertiesUpdatedCallback, DeviceClientBuilder, MessageContext, OutgoingMessage,
     ProvisioningOperationDisplayHandler,
 };
+use tokio::runtime::Handle;
 
 use crate::dps::ProvisioningOperation;
 use crate::{PythonProcessSignalsSource, SpotflowError};
@@ -17,6 +19,7 @@ use crate::{PythonProcessSignalsSource, SpotflowError};
 use self::c2d::CloudToDeviceMessage;
 use self::twins::DesiredProperties;
 
+pub mod aio;
 pub mod c2d;
 pub mod twins;
 
@@ -28,6 +31,9 @@ pub mod twins;
 /// - `SMALLEST_SIZE` - Compress the message using the algorithm settings that produce the smallest size.
 ///   Beware that this may be significantly slower than the fastest compression. We recommend to test the
 ///   performance of your application with this setting before using it in production.
+/// - `SMALL_MESSAGES` - Compress the message using the algorithm settings tuned for short textual messages such as JSON
+///   telemetry with the same keys in every message. These settings use the dictionary of common words and tokens
+///   built into the compression algorithm, which the fastest compression skips.
 #[pyclass]
 #[derive(Clone)]
 pub enum Compression {
@@ -37,6 +43,8 @@ pub enum Compression {
     Fastest,
     #[pyo3(name = "SMALLEST_SIZE")]
     SmallestSize,
+    #[pyo3(name = "SMALL_MESSAGES")]
+    SmallMessages,
 }
 
 impl Compression {
@@ -45,6 +53,7 @@ impl Compression {
             Compression::Uncompressed => None,
             Compression::Fastest => Some(spotflow::Compression::Fastest),
             Compression::SmallestSize => Some(spotflow::Compression::SmallestSize),
+            Compression::SmallMessages => Some(spotflow::Compression::SmallMessages),
         }
     }
 }
@@ -87,6 +96,109 @@ impl DesiredPropertiesUpdatedCallback for DesiredPropertiesUpdatedCallable {
     }
 }
 
+struct MethodHandlerCallable {
+    callable: PyObject,
+}
+
+impl RefUnwindSafe for MethodHandlerCallable {}
+
+impl MethodHandlerCallable {
+    fn handle(&self, method_name: String, payload: &[u8]) -> (i32, Vec<u8>) {
+        Python::with_gil(|py| -> PyResult<(i32, Vec<u8>)> {
+            let args = PyTuple::new(
+                py,
+                &[
+                    method_name.into_py(py),
+                    PyBytes::new(py, payload).into_py(py),
+                ],
+            );
+            let (status, response): (i32, PyObject) = self.callable.call1(py, args)?.extract(py)?;
+            let response = if let Ok(response) = response.extract::<&str>(py) {
+                response.as_bytes().to_vec()
+            } else {
+                response.extract::<Vec<u8>>(py)?
+            };
+            Ok((status, response))
+        })
+        .unwrap_or_else(|e| {
+            log::error!("Direct method handler failed: {e}");
+            (
+                500,
+                br#"{"error":"The direct method handler failed."}"#.to_vec(),
+            )
+        })
+    }
+
+    #[allow(deprecated)] // We'll use the current interface until it's stabilized
+    fn build_client(self, builder: DeviceClientBuilder) -> Result<spotflow::DeviceClient> {
+        builder
+            .with_method_handler(move |method_name, payload: &[u8]| {
+                self.handle(method_name, payload)
+            })
+            .build()
+    }
+}
+
+/// The arguments of `DeviceClient.start` and `AsyncDeviceClient.start`.
+pub(crate) struct StartOptions {
+    pub(crate) device_id: Option<String>,
+    pub(crate) provisioning_token: String,
+    pub(crate) db: String,
+    pub(crate) instance: Option<String>,
+    pub(crate) display_provisioning_operation_callback: Option<PyObject>,
+    pub(crate) desired_properties_updated_callback: Option<PyObject>,
+    pub(crate) method_handler: Option<PyObject>,
+    pub(crate) method_handler_concurrency: Option<usize>,
+    pub(crate) method_handler_timeout: Option<f64>,
+}
+
+impl StartOptions {
+    /// Build the client, running its background tasks on `runtime` if it's provided. The blocking methods of a client
+    /// with a provided runtime don't check the Python signals because they aren't called from the main thread.
+    pub(crate) fn build(self, runtime: Option<Handle>) -> PyResult<spotflow::DeviceClient> {
+        let mut builder =
+            DeviceClientBuilder::new(self.device_id, self.provisioning_token, self.db);
+
+        if let Some(instance) = self.instance {
+            builder = builder.with_instance(instance);
+        }
+
+        if let Some(callback) = self.display_provisioning_operation_callback {
+            builder = builder.with_display_provisioning_operation_callback(Box::new(
+                ProvisioningOperationDisplayCallable { callable: callback },
+            ));
+        }
+
+        if let Some(callback) = self.desired_properties_updated_callback {
+            builder = builder.with_desired_properties_updated_callback(Box::new(
+                DesiredPropertiesUpdatedCallable { callable: callback },
+            ));
+        }
+
+        if let Some(concurrency) = self.method_handler_concurrency {
+            builder = builder.with_method_handler_concurrency(concurrency);
+        }
+
+        if let Some(timeout) = self.method_handler_timeout {
+            let timeout = Duration::try_from_secs_f64(timeout).map_err(|e| {
+                SpotflowError::new_err(format!("Invalid method handler timeout: {e}"))
+            })?;
+            builder = builder.with_method_handler_timeout(timeout);
+        }
+
+        builder = match runtime {
+            Some(runtime) => builder.with_runtime(runtime),
+            None => builder.with_signals_source(Box::<PythonProcessSignalsSource>::default()),
+        };
+
+        match self.method_handler {
+            None => builder.build(),
+            Some(callable) => MethodHandlerCallable { callable }.build_client(builder),
+        }
+        .map_err(|e| SpotflowError::new_err(e.to_string()))
+    }
+}
+
 /// A client communicating with the Platform. Create its instance using `DeviceClient.start`.
 ///
 /// The client stores all outgoing communication to the local database file and then sends it in a background thread asynchronously.
@@ -100,6 +212,16 @@ pub struct DeviceClient {
 }
 
 impl DeviceClient {
+    /// Get the inner client without holding the lock during the following call, so that a long blocking call doesn't
+    /// block the other Python threads using the same client.
+    fn client(&self) -> PyResult<spotflow::DeviceClient> {
+        self.inner
+            .lock()
+            .unwrap()
+            .clone()
+            .ok_or_else(|| SpotflowError::new_err("Connection has already been shut down"))
+    }
+
     /// Disposes of the inner structures of the class that could prevent shutdown of the layers communicating over the Internet.
     /// The actual shutdown may not happen right after this call as some other classes held in Python may still prevent it.
     /// After this invocation no functions should be called again on this class and any invocation may throw an error.
@@ -137,6 +259,14 @@ impl DeviceClient {
     ///   from the Platform. The [Device configuration tutorial](https://docs.spotflow.io/configure-devices/tutorial-configure-device#1-start-device)
     ///   shows how to use this option. The function is called in a separate thread, so make sure that you properly synchronize
     ///   access to your shared resources. The whole interface of the Device SDK is thread-safe, so it's safe to use it in the function.
+    /// - **method_handler**: The function that is called with the name and the payload (`bytes`) of each
+    ///   [Direct Method](https://docs.spotflow.io/configure-devices/#direct-methods) call. It returns a tuple of the
+    ///   status and the payload of the response (`str` or `bytes`). If it raises an exception, the call is answered
+    ///   with the status 500. The function is called in a separate thread.
+    /// - **method_handler_concurrency**: How many Direct Method calls are handled at the same time, each of them on
+    ///   a separate thread (1 by default). Each call holds the GIL while `method_handler` runs Python code.
+    /// - **method_handler_timeout**: How long in seconds `method_handler` can run before the call is answered with the
+    ///   status 504 (no limit by default).
     ///
     /// If the [Device](https://docs.spotflow.io/connect-devices/#device) is
     /// not yet registered in the Platform, or its
@@ -149,7 +279,7 @@ impl DeviceClient {
     /// the last run is still valid, this method succeeds even without the connection to the Internet. The Device SDK will
     /// store all outgoing communication in the local database file and send it once it connects to the Platform.
     #[classmethod]
-    #[pyo3(signature = (device_id, provisioning_token, db, instance=None, display_provisioning_operation_callback=None, desired_properties_updated_callback=None))]
+    #[pyo3(signature = (device_id, provisioning_token, db, instance=None, display_provisioning_operation_callback=None, desired_properties_updated_callback=None, method_handler=None, method_handler_concurrency=None, method_handler_timeout=None))]
     #[allow(clippy::too_many_arguments)]
     fn start(
         _cls: &PyType,
@@ -160,34 +290,27 @@ impl DeviceClient {
         instance: Option<String>,
         display_provisioning_operation_callback: Option<PyObject>,
         desired_properties_updated_callback: Option<PyObject>,
+        method_handler: Option<PyObject>,
+        method_handler_concurrency: Option<usize>,
+        method_handler_timeout: Option<f64>,
     ) -> PyResult<DeviceClient> {
-        py.allow_threads(|| {
-            let mut builder = DeviceClientBuilder::new(device_id, provisioning_token, db);
-
-            if let Some(instance) = instance {
-                builder = builder.with_instance(instance);
-            }
-
-            if let Some(callback) = display_provisioning_operation_callback {
-                builder = builder.with_display_provisioning_operation_callback(Box::new(
-                    ProvisioningOperationDisplayCallable { callable: callback },
-                ));
-            }
-
-            if let Some(callback) = desired_properties_updated_callback {
-                builder = builder.with_desired_properties_updated_callback(Box::new(
-                    DesiredPropertiesUpdatedCallable { callable: callback },
-                ));
-            }
+        let options = StartOptions {
+            device_id,
+            provisioning_token,
+            db,
+            instance,
+            display_provisioning_operation_callback,
+            desired_properties_updated_callback,
+            method_handler,
+            method_handler_concurrency,
+            method_handler_timeout,
+        };
 
-            builder
-                .with_signals_source(Box::<PythonProcessSignalsSource>::default())
-                .build()
-                .map(|inner| DeviceClient {
-                    inner: Mutex::new(Some(inner)),
-                    site_id: None,
-                })
-                .map_err(|e| SpotflowError::new_err(e.to_string()))
+        py.allow_threads(|| {
+            options.build(None).map(|inner| DeviceClient {
+                inner: Mutex::new(Some(inner)),
+                site_id: None,
+            })
         })
     }
 
@@ -212,11 +335,7 @@ impl DeviceClient {
     #[getter]
     fn workspace_id(&self, py: Python<'_>) -> PyResult<String> {
         py.allow_threads(|| {
-            self.inner
-                .lock()
-                .unwrap()
-                .as_ref()
-                .unwrap()
+            self.client()?
                 .workspace_id()
                 .map_err(|e| SpotflowError::new_err(e.to_string()))
         })
@@ -228,11 +347,7 @@ impl DeviceClient {
     #[getter]
     fn device_id(&self, py: Python<'_>) -> PyResult<String> {
         py.allow_threads(|| {
-            self.inner
-                .lock()
-                .unwrap()
-                .as_ref()
-                .unwrap()
+            self.client()?
                 .device_id()
                 .map_err(|e| SpotflowError::new_err(e.to_string()))
         })
@@ -255,10 +370,7 @@ impl DeviceClient {
         let compression = compression.unwrap_or(Compression::Uncompressed);
 
         py.allow_threads(|| {
-            let connection =
-                self.inner.lock().unwrap().clone().ok_or_else(|| {
-                    SpotflowError::new_err("Connection has already been shut down")
-                })?;
+            let connection = self.client()?;
 
             let mut message_context = MessageContext::new(stream_group, stream);
             message_context.set_compression(compression.to_ingress_compression_option());
@@ -275,27 +387,42 @@ impl DeviceClient {
     #[getter]
     fn pending_messages_count(&self, py: Python<'_>) -> PyResult<usize> {
         py.allow_threads(|| {
-            self.inner
-                .lock()
-                .unwrap()
-                .as_ref()
-                .unwrap()
+            self.client()?
                 .pending_messages_count()
                 .map_err(|e| SpotflowError::new_err(e.to_string()))
         })
     }
 
+    /// Get the metrics of the client since it was started as a `dict`, such as the latency histograms of enqueuing
+    /// [Messages](https://docs.spotflow.io/send-data/#message), their time in the queue, and the acknowledgment round
+    /// trip, the efficiency of the compression, and the statistics of the reconnections to the Platform.
+    ///
+    /// Each histogram is a `dict` with the `count` of the recorded durations, their sum `sum_us` in microseconds, and
+    /// the list of `buckets`, where the bucket with index `i` counts the durations shorter than `2^i` microseconds
+    /// that don't fit into the previous buckets and the last bucket counts all the longer durations.
+    fn get_metrics(&self, py: Python<'_>) -> PyResult<Py<PyDict>> {
+        let client = self.client()?;
+        let metrics = py.allow_threads(|| client.metrics());
+
+        metrics_to_dict(py, &metrics)
+    }
+
     /// Block the current thread until all the [Messages](https://docs.spotflow.io/send-data/#message) that
     /// have been previously enqueued are sent to the Platform.
-    fn wait_enqueued_messages_sent(&self, py: Python<'_>) -> PyResult<()> {
+    ///
+    /// If `timeout` (in seconds) is provided, stop waiting once it elapses. Return `True` if all the Messages were
+    /// sent and `False` if the timeout elapsed first.
+    fn wait_enqueued_messages_sent(&self, py: Python<'_>, timeout: Option<u64>) -> PyResult<bool> {
         py.allow_threads(|| {
-            self.inner
-                .lock()
-                .unwrap()
-                .as_ref()
-                .unwrap()
-                .wait_enqueued_messages_sent()
-                .map_err(|e| SpotflowError::new_err(e.to_string()))
+            let client = self.client()?;
+
+            match timeout {
+                Some(timeout) => {
+                    client.wait_enqueued_messages_sent_timeout(Duration::from_secs(timeout))
+                }
+                None => client.wait_enqueued_messages_sent().map(|()| true),
+            }
+            .map_err(|e| SpotflowError::new_err(e.to_string()))
         })
     }
 
@@ -315,14 +442,8 @@ impl DeviceClient {
             }
         };
 
-        let desired = py.allow_threads(|| {
-            self.inner
-                .lock()
-                .unwrap()
-                .as_ref()
-                .unwrap()
-                .desired_properties_if_newer(version)
-        });
+        let client = self.client()?;
+        let desired = py.allow_threads(|| client.desired_properties_if_newer(version));
 
         desired
             .map(|desired| DesiredProperties::new(py, desired.version, &desired.values))
@@ -333,15 +454,9 @@ impl DeviceClient {
     ///
     /// Only the latest version is returned, any versions between the last obtained one and the current one are skipped.
     fn get_desired_properties(&self, py: Python<'_>) -> PyResult<DesiredProperties> {
+        let client = self.client()?;
         let desired = py
-            .allow_threads(|| {
-                self.inner
-                    .lock()
-                    .unwrap()
-                    .as_ref()
-                    .unwrap()
-                    .desired_properties()
-            })
+            .allow_threads(|| client.desired_properties())
             .map_err(|e| SpotflowError::new_err(e.to_string()))?;
 
         DesiredProperties::new(py, desired.version, &desired.values)
@@ -360,15 +475,9 @@ impl DeviceClient {
 
         let reported = dumps.call1((properties,))?.extract()?;
 
-        py.allow_threads(|| {
-            self.inner
-                .lock()
-                .unwrap()
-                .as_ref()
-                .unwrap()
-                .update_reported_properties(reported)
-        })
-        .map_err(|e| SpotflowError::new_err(e.to_string()))
+        let client = self.client()?;
+        py.allow_threads(|| client.update_reported_properties(reported))
+            .map_err(|e| SpotflowError::new_err(e.to_string()))
     }
 
     /// (Read-only) Whether are there any updates to [Reported Properties](https://docs.spotflow.io/configure-devices/#reported-properties)
@@ -376,11 +485,7 @@ impl DeviceClient {
     #[getter]
     fn any_pending_reported_properties_updates(&self, py: Python<'_>) -> PyResult<bool> {
         py.allow_threads(|| {
-            self.inner
-                .lock()
-                .unwrap()
-                .as_ref()
-                .unwrap()
+            self.client()?
                 .any_pending_reported_properties_updates()
                 .map_err(|e| SpotflowError::new_err(e.to_string()))
         })
@@ -394,17 +499,11 @@ impl DeviceClient {
     /// that were last enqueued to be sent to the Platform.
     fn get_reported_properties(&self, py: Python<'_>) -> PyResult<Py<PyAny>> {
         let reported = py.allow_threads(|| {
-            self.inner
-                .lock()
-                .unwrap()
-                .as_ref()
-                .unwrap()
-                .reported_properties()
-                .ok_or_else(|| {
-                    SpotflowError::new_err(
-                        "Reported properties were expected to be ready, but are not.",
-                    )
-                })
+            self.client()?.reported_properties().ok_or_else(|| {
+                SpotflowError::new_err(
+                    "Reported properties were expected to be ready, but are not.",
+                )
+            })
         })?;
 
         let json = PyModule::import(py, "json")?;
@@ -418,11 +517,9 @@ impl DeviceClient {
     /// (Read-only) The number of Cloud-to-Device Messages that have been received by the client but were not consumed by the user-code yet.
     // #[getter]
     fn unread_c2d_messages_count(&self, py: Python<'_>) -> PyResult<usize> {
-        let connection = self.inner.lock().unwrap();
+        let connection = self.client()?;
         py.allow_threads(|| {
             connection
-                .as_ref()
-                .unwrap()
                 .pending_c2d()
                 .map_err(|e| SpotflowError::new_err(e.to_string()))
         })
@@ -439,11 +536,9 @@ impl DeviceClient {
         py: Python<'_>,
         timeout: Option<u64>,
     ) -> PyResult<CloudToDeviceMessage> {
-        let connection = self.inner.lock().unwrap();
+        let connection = self.client()?;
         let message = py.allow_threads(|| {
             connection
-                .as_ref()
-                .unwrap()
                 .get_c2d(timeout.map(Duration::from_secs).unwrap_or(Duration::MAX))
                 .map_err(|e| SpotflowError::new_err(e.to_string()))
         })?;
@@ -473,6 +568,106 @@ impl DeviceClient {
     }
 }
 
+/// Convert the metrics to the `dict` returned by `DeviceClient.get_metrics` and `AsyncDeviceClient.get_metrics`.
+pub(crate) fn metrics_to_dict(py: Python<'_>, metrics: &spotflow::Metrics) -> PyResult<Py<PyDict>> {
+    let reconnects = PyDict::new(py);
+    reconnects.set_item("reconnects", metrics.reconnects.reconnects)?;
+    reconnects.set_item("failed_attempts", metrics.reconnects.failed_attempts)?;
+    reconnects.set_item(
+        "last_outage_ms",
+        metrics
+            .reconnects
+            .last_outage
+            .map(|outage| saturate(outage.as_millis())),
+    )?;
+    reconnects.set_item(
+        "total_outage_ms",
+        saturate(metrics.reconnects.total_outage.as_millis()),
+    )?;
+
+    let dict = PyDict::new(py);
+    dict.set_item("pending_messages", metrics.pending_messages)?;
+    dict.set_item(
+        "enqueue_latency",
+        histogram_to_dict(py, &metrics.enqueue_latency)?,
+    )?;
+    dict.set_item(
+        "time_in_queue",
+        histogram_to_dict(py, &metrics.time_in_queue)?,
+    )?;
+    dict.set_item(
+        "puback_round_trip",
+        histogram_to_dict(py, &metrics.puback_round_trip)?,
+    )?;
+    dict.set_item(
+        "sqlite_statement_latency",
+        histogram_to_dict(py, &metrics.sqlite_statement_latency)?,
+    )?;
+    dict.set_item(
+        "compression_fastest",
+        compression_to_dict(py, &metrics.compression_fastest)?,
+    )?;
+    dict.set_item(
+        "compression_smallest_size",
+        compression_to_dict(py, &metrics.compression_smallest_size)?,
+    )?;
+    dict.set_item(
+        "compression_small_messages",
+        compression_to_dict(py, &metrics.compression_small_messages)?,
+    )?;
+    dict.set_item("messages_sent", metrics.messages_sent)?;
+    dict.set_item("bytes_sent", metrics.bytes_sent)?;
+    dict.set_item("reconnects", reconnects)?;
+
+    Ok(dict.into())
+}
+
+fn histogram_to_dict<'py>(
+    py: Python<'py>,
+    histogram: &spotflow::LatencyHistogram,
+) -> PyResult<&'py PyDict> {
+    let dict = PyDict::new(py);
+    dict.set_item("count", histogram.count)?;
+    dict.set_item("sum_us", saturate(histogram.sum.as_micros()))?;
+    dict.set_item("buckets", histogram.buckets.to_vec())?;
+    Ok(dict)
+}
+
+fn compression_to_dict<'py>(
+    py: Python<'py>,
+    statistics: &spotflow::CompressionStatistics,
+) -> PyResult<&'py PyDict> {
+    let dict = PyDict::new(py);
+    dict.set_item("messages", statistics.messages)?;
+    dict.set_item("uncompressed_bytes", statistics.uncompressed_bytes)?;
+    dict.set_item("compressed_bytes", statistics.compressed_bytes)?;
+    dict.set_item("duration", histogram_to_dict(py, &statistics.duration)?)?;
+    Ok(dict)
+}
+
+/// Get the payload of a Message. The content of `bytes` is borrowed, so it's copied only by the database driver while
+/// it's written to the local database file. Other objects supporting the buffer protocol, such as `bytearray` or `memoryview`, are copied once
+/// because the stable ABI used by the package doesn't allow borrowing their buffers.
+pub(crate) fn extract_payload(payload: &PyAny) -> PyResult<Cow<'_, [u8]>> {
+    if let Ok(bytes) = payload.downcast::<PyBytes>() {
+        return Ok(Cow::Borrowed(bytes.as_bytes()));
+    }
+
+    let memoryview = payload.py().import("builtins")?.getattr("memoryview")?;
+    match memoryview.call1((payload,)) {
+        Ok(view) => {
+            let bytes: &PyBytes = view.call_method0("tobytes")?.downcast()?;
+            Ok(Cow::Borrowed(bytes.as_bytes()))
+        }
+        // Sequences of integers are still accepted for backward compatibility
+        Err(_) => payload.extract::<Vec<u8>>().map(Cow::Owned),
+    }
+}
+
+fn saturate(value: u128) -> u64 {
+    u64::try_from(value).unwrap_or(u64::MAX)
+}
+
 /// A sender of [Messages](https://docs.spotflow.io/send-data/#message) to
 /// a [Stream](https://docs.spotflow.io/send-data/#stream).
 ///
@@ -506,12 +701,14 @@ impl StreamSender {
     fn send_message(
         &mut self,
         py: Python<'_>,
-        payload: Vec<u8>,
+        payload: &PyAny,
         batch_id: Option<String>,
         message_id: Option<String>,
         batch_slice_id: Option<String>,
         chunk_id: Option<String>,
     ) -> PyResult<()> {
+        let payload = extract_payload(payload)?;
+
         py.allow_threads(|| {
             self.connection
                 .send_message_advanced(
@@ -546,12 +743,14 @@ impl StreamSender {
     fn enqueue_message(
         &mut self,
         py: Python<'_>,
-        payload: Vec<u8>,
+        payload: &PyAny,
         batch_id: Option<String>,
         message_id: Option<String>,
         batch_slice_id: Option<String>,
         chunk_id: Option<String>,
     ) -> PyResult<()> {
+        let payload = extract_payload(payload)?;
+
         py.allow_threads(|| {
             self.connection
                 .enqueue_message_advanced(
@@ -566,6 +765,41 @@ impl StreamSender {
         })
     }
 
+    /// Enqueue multiple [Messages](https://docs.spotflow.io/send-data/#message) with the payloads from the
+    /// iterable `payloads` to be sent to the Platform.
+    ///
+    /// All the Messages belong to the [Batch](https://docs.spotflow.io/send-data/#batch) `batch_id` and their IDs are
+    /// filled in by the [Message ID Autofill Pattern](https://docs.spotflow.io/send-data/#message-id-autofill-pattern)
+    /// of the [Stream](https://docs.spotflow.io/send-data/#stream).
+    ///
+    /// The method returns right after it saves all the Messages to the queue in the local database file. Because
+    /// the Messages are saved in a single transaction, this is considerably faster than enqueueing them one by one.
+    /// Either all the Messages are saved or none of them, which also applies when they don't fit into the queue limit
+    /// together. The payloads of type `bytes` are copied only once, while they're saved.
+    fn enqueue_messages(
+        &mut self,
+        py: Python<'_>,
+        payloads: &PyAny,
+        batch_id: Option<String>,
+    ) -> PyResult<()> {
+        let messages = payloads
+            .iter()?
+            .map(|payload| {
+                Ok(OutgoingMessage {
+                    batch_id: batch_id.clone(),
+                    message_id: None,
+                    payload: extract_payload(payload?)?,
+                })
+            })
+            .collect::<PyResult<Vec<_>>>()?;
+
+        py.allow_threads(|| {
+            self.connection
+                .enqueue_messages(&self.message_context, messages)
+                .map_err(|e| SpotflowError::new_err(e.to_string()))
+        })
+    }
+
     /// Enqueue the manual completion of the current [Batch](https://docs.spotflow.io/send-data/#batch) to
     /// be sent to the Platform.
     ///
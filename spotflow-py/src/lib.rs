@@ -1,5 +1,6 @@
 use anyhow::Result;
 use dps::ProvisioningOperation;
+use ingress::aio::{AsyncDeviceClient, AsyncStreamSender};
 use ingress::twins::DesiredProperties;
 use ingress::{Compression, DeviceClient, StreamSender};
 use log::LevelFilter;
@@ -78,6 +79,25 @@ create_exception!(
 ///     time.sleep(5)
 /// ```
 ///
+/// ## Asynchronous Usage
+///
+/// Use `AsyncDeviceClient` in applications based on [asyncio](https://docs.python.org/3/library/asyncio.html).
+/// Its methods that could block return awaitables, the operations run on the background threads of the package
+/// without holding the GIL:
+///
+/// ```
+/// import asyncio
+/// from spotflow_device import AsyncDeviceClient
+///
+/// async def main():
+///     async with await AsyncDeviceClient.start(device_id="my-device", provisioning_token="<Your Provisioning Token>", db="spotflow.db") as client:
+///         sender = client.create_stream_sender(stream_group = "default-stream-group", stream = "default-stream")
+///         await sender.enqueue_message(b'{"temperatureCelsius": 21}')
+///         await client.wait_enqueued_messages_sent()
+///
+/// asyncio.run(main())
+/// ```
+///
 /// ## Logging
 ///
 /// The package uses the [standard Python logging](https://docs.python.org/3/howto/logging.html).
@@ -107,6 +127,8 @@ fn spotflow_device(py: Python, m: &PyModule) -> PyResult<()> {
     m.add_class::<Compression>()?;
     m.add_class::<DeviceClient>()?;
     m.add_class::<StreamSender>()?;
+    m.add_class::<AsyncDeviceClient>()?;
+    m.add_class::<AsyncStreamSender>()?;
     m.add_class::<DesiredProperties>()?;
     // m.add_class::<CloudToDeviceMessage>()?;
     Ok(())
@@ -0,0 +1,366 @@
+//! Benchmarks of the path of the Messages from enqueuing to the acknowledgment by the Platform.
+//!
+//! Run them with `cargo bench --features bench`. The end-to-end benchmarks connect to an in-process fake MQTT broker,
+//! so they don't need a Workspace in the Platform.
+
+use std::{
+    fs,
+    path::{Path, PathBuf},
+    time::{Duration, Instant},
+};
+
+use criterion::{criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion, Throughput};
+use spotflow::{
+    bench::{self, FakeBroker, Store},
+    Compression, DeviceClient, DeviceClientBuilder, LatencyHistogram, MessageContext,
+    OutgoingMessage,
+};
+
+const PAYLOAD_SIZES: [usize; 3] = [64, 1024, 16 * 1024];
+const BATCH_SIZE: usize = 100;
+
+const COMPRESSIONS: [(&str, Option<Compression>); 4] = [
+    ("uncompressed", None),
+    ("fastest", Some(Compression::Fastest)),
+    ("smallest_size", Some(Compression::SmallestSize)),
+    ("small_messages", Some(Compression::SmallMessages)),
+];
+
+#[derive(Clone, Copy)]
+enum Database {
+    // A new local database file
+    Cold,
+    // A local database file that has already stored, sent, and removed many Messages
+    Warm,
+}
+
+impl Database {
+    const ALL: [Database; 2] = [Database::Cold, Database::Warm];
+
+    fn name(self) -> &'static str {
+        match self {
+            Database::Cold => "cold",
+            Database::Warm => "warm",
+        }
+    }
+}
+
+/// A directory for the local database files of one benchmark, removed when the benchmark ends.
+struct TempDir(PathBuf);
+
+impl TempDir {
+    fn new() -> Self {
+        let path = std::env::temp_dir().join(format!("spotflow-bench-{}", uuid::Uuid::new_v4()));
+        fs::create_dir_all(&path).expect("Unable to create a temporary directory");
+        Self(path)
+    }
+
+    fn new_file(&self) -> PathBuf {
+        self.0.join(format!("{}.db", uuid::Uuid::new_v4()))
+    }
+}
+
+impl Drop for TempDir {
+    fn drop(&mut self) {
+        _ = fs::remove_dir_all(&self.0);
+    }
+}
+
+// JSON telemetry similar to what the devices usually send, so that the compression has something to work with
+fn payload(size: usize) -> Vec<u8> {
+    let mut payload = String::with_capacity(size + 64);
+    let mut i = 0u32;
+    payload.push('[');
+    while payload.len() < size {
+        payload.push_str(&format!(
+            r#"{{"timestamp":"2024-01-01T00:00:{:02}Z","temperature":{}.{},"humidity":{}}},"#,
+            i % 60,
+            20 + i % 7,
+            i % 10,
+            40 + i % 13
+        ));
+        i += 1;
+    }
+    payload.truncate(size.saturating_sub(1));
+    payload.push(']');
+    payload.into_bytes()
+}
+
+fn warm_store(path: &Path) -> Store {
+    let store = Store::open(path).expect("Unable to open the local database file");
+    let payloads = vec![payload(1024); BATCH_SIZE];
+    for _ in 0..100 {
+        let ids = store.store_messages(&payloads, None).unwrap();
+        store.remove_messages_until(*ids.last().unwrap()).unwrap();
+    }
+    store
+}
+
+fn store_message(c: &mut Criterion) {
+    let dir = TempDir::new();
+    let mut group = c.benchmark_group("store_message");
+
+    for size in PAYLOAD_SIZES {
+        let payload = payload(size);
+        let batch = vec![payload.clone(); BATCH_SIZE];
+
+        group.throughput(Throughput::Bytes(size as u64));
+        group.bench_with_input(
+            BenchmarkId::new("single/cold", size),
+            &payload,
+            |b, payload| {
+                b.iter_batched(
+                    || Store::open(&dir.new_file()).unwrap(),
+                    |store| store.store_message(payload, None).unwrap(),
+                    BatchSize::PerIteration,
+                );
+            },
+        );
+
+        let store = warm_store(&dir.new_file());
+        group.bench_with_input(
+            BenchmarkId::new("single/warm", size),
+            &payload,
+            |b, payload| {
+                b.iter_custom(|iters| {
+                    let start = Instant::now();
+                    let mut last = 0;
+                    for _ in 0..iters {
+                        last = store.store_message(payload, None).unwrap();
+                    }
+                    let elapsed = start.elapsed();
+                    store.remove_messages_until(last).unwrap();
+                    elapsed
+                });
+            },
+        );
+
+        group.throughput(Throughput::Bytes((size * BATCH_SIZE) as u64));
+        group.bench_with_input(BenchmarkId::new("batch/cold", size), &batch, |b, batch| {
+            b.iter_batched(
+                || Store::open(&dir.new_file()).unwrap(),
+                |store| store.store_messages(batch, None).unwrap(),
+                BatchSize::PerIteration,
+            );
+        });
+
+        group.bench_with_input(BenchmarkId::new("batch/warm", size), &batch, |b, batch| {
+            b.iter_custom(|iters| {
+                let start = Instant::now();
+                let mut last = 0;
+                for _ in 0..iters {
+                    last = *store.store_messages(batch, None).unwrap().last().unwrap();
+                }
+                let elapsed = start.elapsed();
+                store.remove_messages_until(last).unwrap();
+                elapsed
+            });
+        });
+    }
+
+    group.finish();
+}
+
+fn list_messages_after(c: &mut Criterion) {
+    let dir = TempDir::new();
+    let mut group = c.benchmark_group("list_messages_after");
+
+    for size in PAYLOAD_SIZES {
+        let store = Store::open(&dir.new_file()).unwrap();
+        let batch = vec![payload(size); BATCH_SIZE];
+        for _ in 0..10 {
+            store.store_messages(&batch, None).unwrap();
+        }
+
+        // One page of the Messages is read at a time
+        group.throughput(Throughput::Bytes((size * 100) as u64));
+        group.bench_function(BenchmarkId::from_parameter(size), |b| {
+            b.iter(|| store.list_messages_after(0).unwrap());
+        });
+    }
+
+    group.finish();
+}
+
+fn compress_message(c: &mut Criterion) {
+    let mut group = c.benchmark_group("compress_message");
+
+    for size in PAYLOAD_SIZES {
+        let payload = payload(size);
+        group.throughput(Throughput::Bytes(size as u64));
+
+        for (name, compression) in COMPRESSIONS {
+            let Some(compression) = compression else {
+                continue;
+            };
+            group.bench_with_input(BenchmarkId::new(name, size), &payload, |b, payload| {
+                b.iter(|| bench::compress(payload, compression).unwrap());
+            });
+        }
+    }
+
+    group.finish();
+}
+
+fn prepare_message(c: &mut Criterion) {
+    let mut group = c.benchmark_group("prepare_message");
+
+    for size in PAYLOAD_SIZES {
+        let payload = payload(size);
+        group.throughput(Throughput::Bytes(size as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &payload, |b, payload| {
+            b.iter(|| bench::prepare_message(payload).unwrap());
+        });
+    }
+
+    group.finish();
+}
+
+fn json_diff(c: &mut Criterion) {
+    let mut group = c.benchmark_group("json_diff");
+
+    for properties in [10, 100, 1000] {
+        let object = |changed: u32| {
+            let map = (0..properties)
+                .map(|i| {
+                    let value = if i == properties / 2 { changed } else { i };
+                    (
+                        format!("property{i}"),
+                        serde_json::json!({ "value": value, "unit": "C" }),
+                    )
+                })
+                .collect::<serde_json::Map<_, _>>();
+            serde_json::Value::Object(map).to_string()
+        };
+        let original = object(0);
+        let desired = object(1);
+
+        group.bench_function(BenchmarkId::from_parameter(properties), |b| {
+            b.iter(|| bench::json_diff(&original, &desired).unwrap());
+        });
+    }
+
+    group.finish();
+}
+
+fn start_client(broker: &FakeBroker, path: &Path) -> DeviceClient {
+    let builder =
+        DeviceClientBuilder::new(None, String::from("bench"), path).with_max_inflight_messages(20);
+    bench::build_client(builder, broker).expect("Unable to start the client")
+}
+
+fn prepare_database(broker: &FakeBroker, path: &Path, database: Database) {
+    if let Database::Warm = database {
+        let client = start_client(broker, path);
+        let context = MessageContext::new(Some(String::from("bench")), None);
+        let messages = (0..1000)
+            .map(|_| OutgoingMessage::new(None, None, payload(1024)))
+            .collect();
+        client.enqueue_messages(&context, messages).unwrap();
+        client.wait_enqueued_messages_sent().unwrap();
+    }
+}
+
+fn percentile(histogram: &LatencyHistogram, quantile: f64) -> String {
+    let target = (histogram.count as f64 * quantile).ceil() as u64;
+    let mut seen = 0;
+    for (index, count) in histogram.buckets.iter().enumerate() {
+        seen += count;
+        if seen >= target.max(1) {
+            return match LatencyHistogram::bucket_upper_bound(index) {
+                Some(bound) => format!("<{bound:?}"),
+                None => String::from("overflow"),
+            };
+        }
+    }
+    String::from("-")
+}
+
+fn print_percentiles(name: &str, histogram: &LatencyHistogram) {
+    println!(
+        "    {name}: p50 {}, p90 {}, p99 {} ({} samples)",
+        percentile(histogram, 0.5),
+        percentile(histogram, 0.9),
+        percentile(histogram, 0.99),
+        histogram.count
+    );
+}
+
+fn end_to_end(c: &mut Criterion) {
+    let broker = FakeBroker::start().expect("Unable to start the fake broker");
+    let dir = TempDir::new();
+
+    let mut group = c.benchmark_group("end_to_end");
+    group.sample_size(10);
+    group.measurement_time(Duration::from_secs(10));
+
+    for database in Database::ALL {
+        for (compression_name, compression) in COMPRESSIONS {
+            for size in PAYLOAD_SIZES {
+                for batched in [false, true] {
+                    let path = dir.new_file();
+                    prepare_database(&broker, &path, database);
+                    let client = start_client(&broker, &path);
+
+                    let mut context = MessageContext::new(Some(String::from("bench")), None);
+                    context.set_compression(compression);
+                    let payload = payload(size);
+
+                    let name = format!(
+                        "{}/{}/{}",
+                        database.name(),
+                        compression_name,
+                        if batched { "batch" } else { "single" }
+                    );
+
+                    group.throughput(Throughput::Elements(BATCH_SIZE as u64));
+                    group.bench_function(BenchmarkId::new(&name, size), |b| {
+                        b.iter_custom(|iters| {
+                            let start = Instant::now();
+                            for _ in 0..iters {
+                                if batched {
+                                    let messages = (0..BATCH_SIZE)
+                                        .map(|_| OutgoingMessage::new(None, None, &payload[..]))
+                                        .collect();
+                                    client.enqueue_messages(&context, messages).unwrap();
+                                } else {
+                                    for _ in 0..BATCH_SIZE {
+                                        client
+                                            .enqueue_message(&context, None, None, &payload[..])
+                                            .unwrap();
+                                    }
+                                }
+                            }
+                            client.wait_enqueued_messages_sent().unwrap();
+                            start.elapsed()
+                        });
+                    });
+
+                    let metrics = client.metrics();
+                    println!("{name}/{size}:");
+                    print_percentiles("enqueue", &metrics.enqueue_latency);
+                    print_percentiles("enqueue to send", &metrics.time_in_queue);
+                    print_percentiles("send to PUBACK", &metrics.puback_round_trip);
+                    print_percentiles("SQLite statements", &metrics.sqlite_statement_latency);
+                }
+            }
+        }
+    }
+
+    group.finish();
+    println!(
+        "The fake broker received {} Messages",
+        broker.received_messages()
+    );
+}
+
+criterion_group!(
+    benches,
+    store_message,
+    list_messages_after,
+    compress_message,
+    prepare_message,
+    json_diff,
+    end_to_end
+);
+criterion_main!(benches);
@@ -1,19 +1,34 @@
 PRAGMA foreign_keys = ON;
 
-CREATE TABLE IF NOT EXISTS Messages (
-    id                  INTEGER PRIMARY KEY AUTOINCREMENT,
+-- Each combination of the site and the stream is stored only once and the Messages refer to it
+CREATE TABLE IF NOT EXISTS Streams (
+    id                  INTEGER PRIMARY KEY,
     site_id             TEXT,
     stream_group        TEXT,
-    stream              TEXT,
+    stream              TEXT
+) STRICT;
+
+CREATE INDEX IF NOT EXISTS StreamsByName ON Streams (stream_group, stream, site_id);
+
+CREATE TABLE IF NOT EXISTS Messages (
+    id                  INTEGER PRIMARY KEY AUTOINCREMENT,
+    stream_id           INTEGER NOT NULL,
     batch_id            TEXT,
     message_id          TEXT,
     content             BLOB NOT NULL,
-    close_option        TEXT NOT NULL,
-    compression         TEXT NOT NULL,
+    close_option        INTEGER NOT NULL, -- CloseOption enum
+    compression         INTEGER NOT NULL, -- Compression enum
     batch_slice_id      TEXT,
-    chunk_id            TEXT
+    chunk_id            TEXT,
+    file_path           TEXT, -- The payload is read from this file instead of the content when it's sent
+    priority            INTEGER NOT NULL DEFAULT 1, -- Priority enum, higher values are sent first
+
+    FOREIGN KEY(stream_id) REFERENCES Streams(id)
 ) STRICT;
 
+CREATE INDEX IF NOT EXISTS MessagesInSendOrder ON Messages (priority, id);
+CREATE INDEX IF NOT EXISTS MessagesByStream ON Messages (stream_id, id);
+
 CREATE TABLE IF NOT EXISTS CloudToDeviceMessages (
     id INTEGER PRIMARY KEY AUTOINCREMENT,
     content BLOB NOT NULL
@@ -34,6 +49,8 @@ CREATE TABLE IF NOT EXISTS Twins (
     properties          TEXT NOT NULL -- JSON
 ) STRICT;
 
+CREATE INDEX IF NOT EXISTS TwinsByType ON Twins (type, id);
+
 CREATE TABLE IF NOT EXISTS ReportedPropertiesUpdates (
     id                  INTEGER PRIMARY KEY AUTOINCREMENT,
     update_type         TEXT NOT NULL, -- UpdateType enum
@@ -0,0 +1,372 @@
+//! The internals of the Device SDK used by the benchmarks in `benches/`. They're available only with the `bench`
+//! feature and they aren't a part of the stable interface.
+
+use std::{
+    borrow::Cow,
+    io::{self, Read, Write},
+    net::{SocketAddr, TcpListener, TcpStream},
+    path::Path,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+    thread,
+};
+
+use anyhow::{Context, Result};
+use rumqttc::Transport;
+use serde_json::json;
+use tokio::runtime::Runtime;
+
+use crate::cloud::{
+    dps::{ProvisioningToken, RegistrationToken},
+    drs::RegistrationResponse,
+};
+use crate::metrics::MetricsRegistry;
+use crate::persistence::{
+    compression,
+    sqlite::{SdkConfiguration, SqliteStore},
+    CloseOption, DeviceMessage, NewDeviceMessage, Priority,
+};
+use crate::{Compression, DeviceClient, DeviceClientBuilder, StorageProfile};
+
+const WORKSPACE_ID: &str = "bench-workspace";
+const DEVICE_ID: &str = "bench-device";
+const STREAM_GROUP: &str = "bench-stream-group";
+const STREAM: &str = "bench-stream";
+
+// The Device Twin returned by the fake broker, the properties are irrelevant for the benchmarks
+const TWINS: &str = r#"{"desired":{"$version":1},"reported":{"$version":1}}"#;
+
+/// The local database file opened without the rest of the client, so that its statements can be measured alone.
+pub struct Store {
+    runtime: Runtime,
+    store: SqliteStore,
+}
+
+impl Store {
+    /// Open the local database file, creating it and its schema if it doesn't exist.
+    pub fn open(path: &Path) -> Result<Self> {
+        let runtime = tokio::runtime::Builder::new_current_thread()
+            .enable_all()
+            .build()?;
+
+        let config = SdkConfiguration {
+            instance_url: "https://localhost".parse()?,
+            provisioning_token: ProvisioningToken {
+                token: String::from("bench"),
+            },
+            registration_token: RegistrationToken {
+                token: String::from("bench"),
+                expiration: None,
+            },
+            requested_device_id: None,
+            workspace_id: String::from(WORKSPACE_ID),
+            device_id: String::from(DEVICE_ID),
+            site_id: None,
+        };
+
+        let store = runtime.block_on(SqliteStore::init(
+            path,
+            None,
+            &config,
+            StorageProfile::default(),
+            Arc::new(MetricsRegistry::new()),
+        ))?;
+
+        Ok(Self { runtime, store })
+    }
+
+    /// Store one Message in its own transaction and return its ID.
+    pub fn store_message(&self, payload: &[u8], compression: Option<Compression>) -> Result<i32> {
+        self.runtime
+            .block_on(self.store.store_message(&new_message(payload, compression)))
+    }
+
+    /// Store all the Messages in a single transaction and return their IDs.
+    pub fn store_messages(
+        &self,
+        payloads: &[Vec<u8>],
+        compression: Option<Compression>,
+    ) -> Result<Vec<i32>> {
+        let msgs = payloads
+            .iter()
+            .map(|payload| new_message(payload, compression))
+            .collect::<Vec<_>>();
+        self.runtime.block_on(self.store.store_messages(&msgs))
+    }
+
+    /// Read the next page of the Messages stored after the one with the provided ID and return their number.
+    pub fn list_messages_after(&self, after: i32) -> Result<usize> {
+        self.runtime
+            .block_on(self.store.list_messages_after(Priority::Normal, after))
+            .map(|msgs| msgs.len())
+    }
+
+    /// Remove all the Messages up to the one with the provided ID.
+    pub fn remove_messages_until(&self, id: i32) -> Result<()> {
+        self.runtime
+            .block_on(self.store.remove_messages_until(Priority::Normal, id))
+    }
+
+    /// The number of the stored Messages.
+    #[must_use]
+    pub fn message_count(&self) -> usize {
+        self.store.message_count()
+    }
+}
+
+/// Compress the content the same way as the Messages enqueued with the provided compression.
+pub fn compress(content: &[u8], compression: Compression) -> Result<Option<Vec<u8>>> {
+    compression::compress(
+        content,
+        Compression::to_persisted_compression(&Some(compression)),
+        &MetricsRegistry::new(),
+    )
+}
+
+/// Turn a stored Message with the provided content into the topic and the content of its MQTT publish packet.
+pub fn prepare_message(payload: &[u8]) -> Result<(String, Vec<u8>)> {
+    let msg = DeviceMessage {
+        id: Some(1),
+        site_id: None,
+        stream_group: Some(String::from(STREAM_GROUP)),
+        stream: Some(String::from(STREAM)),
+        batch_id: None,
+        message_id: None,
+        content: payload.to_vec(),
+        close_option: CloseOption::None,
+        compression: Compression::to_persisted_compression(&None),
+        batch_slice_id: None,
+        chunk_id: None,
+        file_path: None,
+        priority: Priority::Normal,
+    };
+
+    crate::iothub::prepare_message(
+        &format!("{WORKSPACE_ID}:{DEVICE_ID}"),
+        msg,
+        Arc::new(MetricsRegistry::new()),
+    )
+}
+
+/// Compute the JSON merge patch turning the `original` Reported Properties into the `desired` ones.
+pub fn json_diff(original: &str, desired: &str) -> Result<String> {
+    crate::iothub::json_diff(original, desired)
+}
+
+/// Build the client connected to the provided fake broker instead of the Platform. The Device Provisioning and
+/// the registration are skipped.
+pub fn build_client(builder: DeviceClientBuilder, broker: &FakeBroker) -> Result<DeviceClient> {
+    builder.build_with_registration(broker.registration_response()?)
+}
+
+/// The MQTT endpoint of the fake broker encoded in the IoT Hub host name, `None` for a real IoT Hub.
+pub(crate) fn fake_broker_endpoint(iothub: &str) -> Option<(&str, u16, Transport)> {
+    let (host, port) = iothub.rsplit_once(':')?;
+    Some((host, port.parse().ok()?, Transport::Tcp))
+}
+
+/// An in-process MQTT broker that behaves like IoT Hub just enough for the client to work: it accepts every
+/// connection and subscription, acknowledges every published Message, and answers the Device Twin requests.
+pub struct FakeBroker {
+    address: SocketAddr,
+    received_messages: Arc<AtomicU64>,
+}
+
+impl FakeBroker {
+    /// Start the broker on a random local port, it's stopped when the process exits.
+    pub fn start() -> Result<Self> {
+        let listener = TcpListener::bind("127.0.0.1:0")?;
+        let address = listener.local_addr()?;
+        let received_messages = Arc::new(AtomicU64::new(0));
+
+        let counter = Arc::clone(&received_messages);
+        thread::Builder::new()
+            .name(String::from("fake-broker"))
+            .spawn(move || {
+                for stream in listener.incoming().flatten() {
+                    let counter = Arc::clone(&counter);
+                    thread::spawn(move || {
+                        if let Err(e) = serve(stream, &counter) {
+                            log::debug!("Fake broker closed the connection: {e}");
+                        }
+                    });
+                }
+            })?;
+
+        Ok(Self {
+            address,
+            received_messages,
+        })
+    }
+
+    /// The number of device-to-cloud Messages received from all the clients.
+    #[must_use]
+    pub fn received_messages(&self) -> u64 {
+        self.received_messages.load(Ordering::Relaxed)
+    }
+
+    fn registration_response(&self) -> Result<RegistrationResponse> {
+        let host_name = self.address.to_string();
+        serde_json::from_value(json!({
+            "connectionString": format!(
+                "HostName={host_name};DeviceId={WORKSPACE_ID}:{DEVICE_ID};SharedAccessSignature=SharedAccessSignature sr=bench"
+            ),
+            "iotHubHostName": host_name,
+            "connectionStringType": "SharedAccessSignature",
+            "connectionStringExpiration": "9999-12-31T23:59:59Z",
+        }))
+        .context("Unable to create the registration response of the fake broker")
+    }
+}
+
+fn new_message(payload: &[u8], compression: Option<Compression>) -> NewDeviceMessage<'_> {
+    NewDeviceMessage {
+        site_id: None,
+        stream_group: Some(String::from(STREAM_GROUP)),
+        stream: Some(String::from(STREAM)),
+        batch_id: None,
+        message_id: None,
+        content: Cow::Borrowed(payload),
+        close_option: CloseOption::None,
+        compression: Compression::to_persisted_compression(&compression),
+        batch_slice_id: None,
+        chunk_id: None,
+        file_path: None,
+        priority: Priority::Normal,
+    }
+}
+
+// Handle the MQTT 3.1.1 packets of one connection until the client disconnects
+fn serve(mut stream: TcpStream, received_messages: &AtomicU64) -> io::Result<()> {
+    stream.set_nodelay(true)?;
+
+    loop {
+        let (header, body) = read_packet(&mut stream)?;
+        match header >> 4 {
+            // CONNECT
+            1 => stream.write_all(&[0x20, 2, 0, 0])?,
+            // PUBLISH
+            3 => {
+                let qos = (header >> 1) & 0b11;
+                let topic_length = usize::from(read_u16(&body, 0)?);
+                let topic = body
+                    .get(2..2 + topic_length)
+                    .map(String::from_utf8_lossy)
+                    .ok_or_else(malformed)?;
+
+                if qos > 0 {
+                    let packet_id = read_u16(&body, 2 + topic_length)?;
+                    let [high, low] = packet_id.to_be_bytes();
+                    stream.write_all(&[0x40, 2, high, low])?;
+                }
+
+                if topic.starts_with("$iothub/twin/GET/") {
+                    let rid = request_id(&topic);
+                    write_publish(
+                        &mut stream,
+                        &format!("$iothub/twin/res/200/?$rid={rid}"),
+                        TWINS.as_bytes(),
+                    )?;
+                } else if topic.starts_with("$iothub/twin/PATCH/properties/reported/") {
+                    let rid = request_id(&topic);
+                    write_publish(
+                        &mut stream,
+                        &format!("$iothub/twin/res/204/?$rid={rid}&$version=2"),
+                        &[],
+                    )?;
+                } else if topic.contains("/messages/events/") {
+                    received_messages.fetch_add(1, Ordering::Relaxed);
+                }
+            }
+            // SUBSCRIBE
+            8 => {
+                let packet_id = read_u16(&body, 0)?;
+                let mut granted = Vec::new();
+                let mut position = 2;
+                while position < body.len() {
+                    position += 2 + usize::from(read_u16(&body, position)?) + 1;
+                    granted.push(1);
+                }
+
+                let [high, low] = packet_id.to_be_bytes();
+                let mut packet = vec![0x90];
+                write_remaining_length(&mut packet, 2 + granted.len());
+                packet.extend_from_slice(&[high, low]);
+                packet.extend_from_slice(&granted);
+                stream.write_all(&packet)?;
+            }
+            // PINGREQ
+            12 => stream.write_all(&[0xD0, 0])?,
+            // DISCONNECT
+            14 => return Ok(()),
+            // PUBACK of the packets sent by the broker and everything else
+            _ => {}
+        }
+    }
+}
+
+fn read_packet(stream: &mut TcpStream) -> io::Result<(u8, Vec<u8>)> {
+    let mut byte = [0];
+    stream.read_exact(&mut byte)?;
+    let header = byte[0];
+
+    let mut remaining_length = 0;
+    let mut shift = 0;
+    loop {
+        stream.read_exact(&mut byte)?;
+        remaining_length |= usize::from(byte[0] & 0x7F) << shift;
+        if byte[0] & 0x80 == 0 {
+            break;
+        }
+        shift += 7;
+        if shift > 21 {
+            return Err(malformed());
+        }
+    }
+
+    let mut body = vec![0; remaining_length];
+    stream.read_exact(&mut body)?;
+    Ok((header, body))
+}
+
+fn write_publish(stream: &mut TcpStream, topic: &str, payload: &[u8]) -> io::Result<()> {
+    let topic_length = u16::try_from(topic.len()).map_err(|_| malformed())?;
+
+    let mut packet = vec![0x30];
+    write_remaining_length(&mut packet, 2 + topic.len() + payload.len());
+    packet.extend_from_slice(&topic_length.to_be_bytes());
+    packet.extend_from_slice(topic.as_bytes());
+    packet.extend_from_slice(payload);
+    stream.write_all(&packet)
+}
+
+fn write_remaining_length(packet: &mut Vec<u8>, mut length: usize) {
+    loop {
+        let byte = u8::try_from(length % 128).expect("The remainder always fits into a byte");
+        length /= 128;
+        if length == 0 {
+            packet.push(byte);
+            return;
+        }
+        packet.push(byte | 0x80);
+    }
+}
+
+fn read_u16(body: &[u8], position: usize) -> io::Result<u16> {
+    match body.get(position..position + 2) {
+        Some(&[high, low]) => Ok(u16::from_be_bytes([high, low])),
+        _ => Err(malformed()),
+    }
+}
+
+fn request_id(topic: &str) -> &str {
+    topic
+        .split_once("$rid=")
+        .map_or("", |(_, rest)| rest.split('&').next().unwrap_or_default())
+}
+
+fn malformed() -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, "Malformed MQTT packet")
+}
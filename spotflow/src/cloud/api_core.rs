@@ -1,4 +1,7 @@
-use std::{sync::Arc, time::Duration};
+use std::{
+    sync::{Arc, OnceLock},
+    time::Duration,
+};
 
 use anyhow::{anyhow, Context, Result};
 use http::{
@@ -56,6 +59,18 @@ pub(crate) fn post(
     send(&http::Method::POST, base_uri, relative_uri, token, data)
 }
 
+// Shared by all the clients in the process so that the TLS configuration is loaded only once and the connections to
+// the Platform are kept alive between the requests
+static AGENT: OnceLock<ureq::Agent> = OnceLock::new();
+
+pub(crate) fn agent() -> &'static ureq::Agent {
+    AGENT.get_or_init(|| {
+        let connector =
+            Arc::new(native_tls::TlsConnector::new().expect("Unable to build TLS connector"));
+        ureq::AgentBuilder::new().tls_connector(connector).build()
+    })
+}
+
 pub(crate) fn send(
     method: &http::Method,
     base_uri: &Uri,
@@ -82,9 +97,7 @@ pub(crate) fn send(
 
     let auth_header = format!("DeviceToken {}", token.as_ref());
 
-    let connector =
-        Arc::new(native_tls::TlsConnector::new().expect("Unable to build TLS connector"));
-    let agent = ureq::AgentBuilder::new().tls_connector(connector).build();
+    let agent = agent();
 
     let request = match *method {
         http::Method::POST => agent.post(&uri.to_string()),
@@ -1,4 +1,4 @@
-mod api_core;
+pub(crate) mod api_core;
 pub mod dps;
 pub mod drs;
 mod duration_wrapper;
@@ -1,4 +1,4 @@
-use std::panic::RefUnwindSafe;
+use std::{panic::RefUnwindSafe, sync::Arc};
 
 use anyhow::Result;
 use async_trait::async_trait;
@@ -12,6 +12,33 @@ pub struct DesiredProperties {
     pub values: String,
 }
 
+/// A shared read-only copy of the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
+///
+/// The properties are serialized to JSON only once for each version, so obtaining this object doesn't copy them.
+#[derive(Clone, Debug)]
+pub struct SharedDesiredProperties {
+    /// The version of the properties.
+    pub version: u64,
+    /// The values of the individual properties encoded in JSON.
+    pub values: Arc<str>,
+}
+
+/// A change of the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
+#[derive(Clone, Debug)]
+pub struct DesiredPropertiesChange {
+    /// The JSON Pointers (RFC 6901) of the properties that were added, changed, or removed, for example
+    /// `/sensors/temperature/unit`.
+    pub changed_paths: Vec<String>,
+    /// The Desired Properties after the change.
+    pub properties: SharedDesiredProperties,
+}
+
+/// Handles changes of the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
+pub trait DesiredPropertiesChangedCallback: Send + Sync + RefUnwindSafe {
+    /// Handle the change of the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
+    fn properties_changed(&self, change: DesiredPropertiesChange) -> Result<()>;
+}
+
 /// Handles updates of the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
 pub trait DesiredPropertiesUpdatedCallback: Send + Sync + RefUnwindSafe {
     /// Handle the updated version of the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
@@ -25,8 +52,16 @@ pub trait TwinsClient: Send + Sync {
     async fn get_reported_properties(&self) -> Option<String>;
     async fn set_reported_properties(&self, patch: &str) -> Result<()>;
     async fn patch_reported_properties(&self, patch: &str) -> Result<()>;
+    // The path is a JSON Pointer to the property and the value is encoded in JSON
+    async fn set_reported_property(&self, path: &str, value: &str) -> Result<()>;
+    async fn remove_reported_property(&self, path: &str) -> Result<()>;
     async fn get_desired_properties(&self) -> Result<DesiredProperties>;
     async fn get_desired_properties_if_newer(&self, version: u64) -> Option<DesiredProperties>;
+    async fn get_shared_desired_properties(&self) -> Result<SharedDesiredProperties>;
+    async fn subscribe_desired_properties_changes(
+        &self,
+        callback: Box<dyn DesiredPropertiesChangedCallback>,
+    );
     async fn desired_properties_changed(&self) -> Result<DesiredProperties>;
     // Whether there are any Reported Properties that have not yet been sent upstream
     async fn pending_reported_properties_updates(&self) -> Result<bool>;
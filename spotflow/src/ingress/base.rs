@@ -1,52 +1,82 @@
 use core::str;
 use std::{
+    borrow::Cow,
     panic::RefUnwindSafe,
     path::Path,
+    slice,
     sync::{
         atomic::{AtomicBool, Ordering},
         Arc,
     },
-    thread::{self, JoinHandle},
-    time::Duration,
+    time::{Duration, Instant},
 };
 
 use crate::{
     connection::{
-        twins::{DesiredProperties, DesiredPropertiesUpdatedCallback, TwinsClient},
+        twins::{
+            DesiredProperties, DesiredPropertiesChangedCallback, DesiredPropertiesUpdatedCallback,
+            SharedDesiredProperties, TwinsClient,
+        },
         ConnectionImplementation,
     },
     ProcessSignalsSource,
 };
 use anyhow::{bail, Context, Result};
+use sqlx::SqliteConnection;
 use tokio::{
-    runtime::Runtime,
+    runtime::{Handle, Runtime},
+    select,
     sync::{mpsc, watch, Mutex},
+    task::JoinHandle,
 };
 use tokio_util::sync::CancellationToken;
 
 use crate::cloud::drs::RegistrationResponse;
+use crate::metrics::{Metrics, MetricsRegistry};
 use crate::persistence::{
-    self, sqlite::SdkConfiguration, sqlite_channel, CloseOption, CloudToDeviceMessage,
-    ConfigurationStore, DeviceMessage, Producer, Store,
+    self, compression::CompressionPool, sqlite::SdkConfiguration, sqlite_channel, CloseOption,
+    CloudToDeviceMessage, ConfigurationStore, NewDeviceMessage, Producer, Store,
 };
 
 use crate::iothub::{
     token_handler::{RegistrationCommand, TokenHandler},
     twins::IotHubTwinsClient,
-    IotHubConnection,
+    IotHubConnection, MethodOptions, SenderOptions,
 };
 
-use super::{c2d::CloudToDeviceMessageGuard, Compression, MessageContext};
+use super::{
+    c2d::CloudToDeviceMessageGuard, submission::SubmissionQueue, ClientOptions, Compression,
+    MessageContext, OutgoingMessage,
+};
+
+/// The minimum number of worker threads of a tokio runtime that runs the background work of
+/// [`DeviceClient`](crate::DeviceClient)s, because the connection to the Platform and the sending of
+/// [Messages](https://docs.spotflow.io/send-data/#message) must be able to run at the same time.
+pub const MIN_WORKER_THREADS: usize = 2;
+
+// The maximum number of cloud to device messages passed to the callback at once
+const C2D_BATCH_SIZE: usize = 64;
+
+// How often the process signals are checked while waiting for the enqueued messages to be sent
+const SIGNALS_CHECK_INTERVAL: Duration = Duration::from_millis(200);
 
 pub struct BaseConnection<T: ?Sized + Send + Sync> {
     configuration_store: ConfigurationStore,
     twins_client: IotHubTwinsClient,
-    d2c_producer: Producer,
+    d2c_producer: Arc<Producer>,
+    // Dropped before the task storing the submitted messages is awaited so that the task can finish
+    submission_queue: Option<SubmissionQueue>,
+    submission_task: Option<JoinHandle<()>>,
     c2d_consumer: Arc<Mutex<sqlite_channel::Receiver<CloudToDeviceMessage>>>,
     c2d_handler_registered: AtomicBool,
     signals_src: Option<Box<dyn ProcessSignalsSource>>,
-    thread: Option<JoinHandle<()>>,
-    runtime: Runtime,
+    // `None` unless the messages are compressed when they're enqueued
+    compression: Option<Arc<CompressionPool>>,
+    connection_task: Option<JoinHandle<()>>,
+    metrics: Arc<MetricsRegistry>,
+    runtime: Handle,
+    // Shut down when the last connection using it is dropped, `None` if the runtime is managed by the application
+    _owned_runtime: Option<Arc<Runtime>>,
     implementation: Option<Box<T>>,
     cancellation: CancellationToken,
 }
@@ -54,9 +84,12 @@ pub struct BaseConnection<T: ?Sized + Send + Sync> {
 impl<F: Send + Sync> BaseConnection<IotHubConnection<F>> {
     // Startup
     // ================================================================================
+    #[allow(clippy::too_many_arguments)]
     pub(super) fn init_ingress(
         config: SdkConfiguration,
         store_path: &Path,
+        store_connection: Option<SqliteConnection>,
+        options: ClientOptions,
         method_handler: Option<F>,
         desired_properties_updated_callback: Option<Box<dyn DesiredPropertiesUpdatedCallback>>,
         signals_src: Option<Box<dyn ProcessSignalsSource>>,
@@ -65,58 +98,79 @@ impl<F: Send + Sync> BaseConnection<IotHubConnection<F>> {
     where
         F: Fn(String, &[u8]) -> (i32, Vec<u8>) + RefUnwindSafe + 'static,
     {
-        // One thread is currently not enough, `runtime::Builder::new_current_thread` deadlocks when reconnect example is run.
-        // We also force the number of threads to be at least 2 -- one worker thread plus one thread we spawn ourselves
-        let rt = tokio::runtime::Builder::new_multi_thread()
-            .worker_threads(1)
-            .enable_all()
-            .build()
-            .context("Unable to build tokio runtime")?;
+        let (rt, owned_runtime) = match (&options.gateway_runtime, &options.runtime) {
+            (Some(runtime), _) => (runtime.handle().clone(), Some(Arc::clone(runtime))),
+            (None, Some(runtime)) => (runtime.clone(), None),
+            (None, None) => {
+                // One thread is currently not enough, `runtime::Builder::new_current_thread` deadlocks when reconnect
+                // example is run. We also force the number of threads to be at least 2.
+                let runtime = tokio::runtime::Builder::new_multi_thread()
+                    .worker_threads(options.worker_threads.max(MIN_WORKER_THREADS))
+                    .thread_name("spotflow-worker")
+                    .enable_all()
+                    .build()
+                    .context("Unable to build tokio runtime")?;
+                (runtime.handle().clone(), Some(Arc::new(runtime)))
+            }
+        };
 
         let cancellation = CancellationToken::new();
+        let metrics = Arc::new(MetricsRegistry::new());
 
         let store = rt.block_on(persistence::create(
             store_path,
+            store_connection,
             &config,
+            options.durability,
+            options.storage_profile,
+            options.queue_limit,
+            Arc::clone(&metrics),
             cancellation.clone(),
         ))?;
 
-        let (registration_watch, registration_command_sender) = rt.block_on(TokenHandler::init(
+        let (registration_watch, registration_command_sender) = TokenHandler::init(
+            &rt,
             config.instance_url,
             config.provisioning_token,
             config.registration_token,
             store.configuration_store.clone(),
             initial_registration_response,
-        ))?;
+        );
 
         Ok(Self::start(
             rt,
+            owned_runtime,
             store,
             registration_watch,
             registration_command_sender,
             method_handler,
             desired_properties_updated_callback,
             signals_src,
+            &options,
+            metrics,
             cancellation,
         ))
     }
 
     #[allow(clippy::too_many_arguments)]
     fn start(
-        rt: Runtime,
+        rt: Handle,
+        owned_runtime: Option<Arc<Runtime>>,
         store: Store,
         registration_watch: watch::Receiver<Option<RegistrationResponse>>,
         registration_command_sender: mpsc::UnboundedSender<RegistrationCommand>,
         method_handler: Option<F>,
         desired_properties_updated_callback: Option<Box<dyn DesiredPropertiesUpdatedCallback>>,
         signals_src: Option<Box<dyn ProcessSignalsSource>>,
+        options: &ClientOptions,
+        metrics: Arc<MetricsRegistry>,
         cancellation: CancellationToken,
     ) -> BaseConnection<dyn ConnectionImplementation + Send + Sync>
     where
         F: Fn(String, &[u8]) -> (i32, Vec<u8>) + RefUnwindSafe + 'static,
     {
         let mut iothub = IotHubConnection::create(
-            rt.handle().clone(),
+            rt.clone(),
             store.store,
             store.d2c_consumer,
             store.d2c_acknowledger,
@@ -125,49 +179,70 @@ impl<F: Send + Sync> BaseConnection<IotHubConnection<F>> {
             registration_watch,
             registration_command_sender,
             method_handler,
+            MethodOptions {
+                concurrency: options.method_concurrency,
+                timeout: options.method_timeout,
+            },
             desired_properties_updated_callback,
+            SenderOptions {
+                max_inflight_messages: options.max_inflight_messages,
+                max_coalescing_delay: options.max_coalescing_delay,
+            },
+            options.reconnect_policy,
+            Arc::clone(&metrics),
             cancellation.clone(),
         );
 
+        let d2c_producer = Arc::new(store.d2c_producer);
+        let compression = options
+            .compress_on_enqueue
+            .then(|| Arc::new(CompressionPool::new(Arc::clone(&metrics))));
+        let (submission_queue, submission_task) = SubmissionQueue::start(
+            &rt,
+            options.submission_queue_capacity,
+            Arc::clone(&d2c_producer),
+            compression.clone(),
+            options.enqueue_completed_callback.clone(),
+        );
+
         let connection_task = iothub.connect();
 
-        let tokio_thread = thread::Builder::new()
-            .name("Tokio MQTT thread".into())
-            .spawn({
-                let rt = rt.handle().clone();
-                move || {
-                    log::debug!("Tokio MQTT thread is starting.");
-
-                    rt.block_on(async move {
-                        let tasks = match connection_task.await {
-                            Ok(tasks) => tasks,
-                            Err(e) => {
-                                log::error!("Failed setting up connection: {}", e);
-                                return;
-                            }
-                        };
-                        log::debug!("Connection is set up.");
-                        for task in tasks {
-                            if let Err(cause) = task.await {
-                                log::error!("Task failed: {:?}", cause);
-                            }
-                        }
-                    });
-                    log::debug!("Tokio MQTT thread has finished.");
+        // The connection runs as a task so that the clients sharing a runtime don't need a thread each
+        let connection_task = rt.spawn(async move {
+            log::debug!("MQTT connection task is starting.");
+
+            let tasks = match connection_task.await {
+                Ok(tasks) => tasks,
+                Err(e) => {
+                    log::error!("Failed setting up connection: {}", e);
+                    return;
                 }
-            })
-            .expect("Unable to spawn thread");
+            };
+            log::debug!("Connection is set up.");
+            for task in tasks {
+                if let Err(cause) = task.await {
+                    log::error!("Task failed: {:?}", cause);
+                }
+            }
+
+            log::debug!("MQTT connection task has finished.");
+        });
 
         BaseConnection {
-            d2c_producer: store.d2c_producer,
+            d2c_producer,
+            submission_queue: Some(submission_queue),
+            submission_task: Some(submission_task),
             c2d_consumer: Arc::new(Mutex::new(store.c2d_consumer)),
             twins_client: iothub.twins_client().unwrap(),
             configuration_store: store.configuration_store,
             implementation: Some(Box::new(iothub)),
             c2d_handler_registered: AtomicBool::new(false),
             signals_src,
-            thread: Some(tokio_thread),
+            compression,
+            connection_task: Some(connection_task),
+            metrics,
             runtime: rt,
+            _owned_runtime: owned_runtime,
             cancellation,
         }
     }
@@ -192,7 +267,11 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
     }
 
     pub fn pending_messages_count(&self) -> Result<usize> {
-        self.runtime.block_on(self.d2c_producer.count())
+        Ok(self.d2c_producer.count())
+    }
+
+    pub fn metrics(&self) -> Metrics {
+        self.metrics.snapshot(self.d2c_producer.count())
     }
 
     // Potentially useful method, but the interface must be stabilized first
@@ -209,10 +288,9 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
         message_context: &MessageContext,
         batch_id: Option<String>,
         message_id: Option<String>,
-        payload: Vec<u8>,
+        payload: Cow<'_, [u8]>,
     ) -> Result<()> {
-        let message = DeviceMessage {
-            id: None,
+        let message = NewDeviceMessage {
             site_id: self.site_id(),
             stream_group: message_context.stream_group.clone(),
             stream: message_context.stream.clone(),
@@ -223,11 +301,47 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
             compression: Compression::to_persisted_compression(&message_context.compression),
             batch_slice_id: None,
             chunk_id: None,
+            file_path: None,
+            priority: message_context.priority,
         };
 
         self.publish_message(message)
     }
 
+    pub fn try_enqueue_message(
+        &self,
+        message_context: &MessageContext,
+        batch_id: Option<String>,
+        message_id: Option<String>,
+        payload: Vec<u8>,
+    ) -> Result<u64> {
+        let message = NewDeviceMessage {
+            site_id: self.site_id(),
+            stream_group: message_context.stream_group.clone(),
+            stream: message_context.stream.clone(),
+            batch_id,
+            message_id,
+            content: Cow::Owned(payload),
+            close_option: CloseOption::None,
+            compression: Compression::to_persisted_compression(&message_context.compression),
+            batch_slice_id: None,
+            chunk_id: None,
+            file_path: None,
+            priority: message_context.priority,
+        };
+
+        self.submission_queue
+            .as_ref()
+            .expect("The submission queue is dropped only with the connection")
+            .try_submit(message)
+    }
+
+    pub fn completed_enqueue_sequence(&self) -> u64 {
+        self.submission_queue
+            .as_ref()
+            .map_or(0, SubmissionQueue::completed_sequence)
+    }
+
     pub fn enqueue_message_advanced(
         &self,
         message_context: &MessageContext,
@@ -235,10 +349,9 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
         batch_slice_id: Option<String>,
         message_id: Option<String>,
         chunk_id: Option<String>,
-        payload: Vec<u8>,
+        payload: Cow<'_, [u8]>,
     ) -> Result<()> {
-        let message = DeviceMessage {
-            id: None,
+        let message = NewDeviceMessage {
             site_id: self.site_id(),
             stream_group: message_context.stream_group.clone(),
             stream: message_context.stream.clone(),
@@ -249,28 +362,112 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
             compression: Compression::to_persisted_compression(&message_context.compression),
             batch_slice_id,
             chunk_id,
+            file_path: None,
+            priority: message_context.priority,
         };
 
         self.publish_message(message)
     }
 
+    pub fn enqueue_messages(
+        &self,
+        message_context: &MessageContext,
+        messages: Vec<OutgoingMessage<'_>>,
+    ) -> Result<()> {
+        let start = Instant::now();
+        let site_id = self.site_id();
+        let compression = Compression::to_persisted_compression(&message_context.compression);
+
+        let mut messages = messages
+            .into_iter()
+            .map(|message| NewDeviceMessage {
+                site_id: site_id.clone(),
+                stream_group: message_context.stream_group.clone(),
+                stream: message_context.stream.clone(),
+                batch_id: message.batch_id,
+                message_id: message.message_id,
+                content: message.payload,
+                close_option: CloseOption::None,
+                compression,
+                batch_slice_id: None,
+                chunk_id: None,
+                file_path: None,
+                priority: message_context.priority,
+            })
+            .collect::<Vec<_>>();
+
+        let count = messages.len();
+        let result = self.runtime.block_on(async {
+            if let Some(compression) = &self.compression {
+                compression.compress_messages(&mut messages).await?;
+            }
+            let stored = self.d2c_producer.add_all(messages).await?;
+            self.d2c_producer.overflow(count - stored)
+        });
+        self.metrics.enqueue_latency.record_since(start);
+        log::trace!("Enqueued {count} messages in {:?}", start.elapsed());
+        result
+    }
+
+    pub fn enqueue_file(
+        &self,
+        message_context: &MessageContext,
+        batch_id: Option<String>,
+        message_id: Option<String>,
+        path: &Path,
+    ) -> Result<()> {
+        // The file is read only when it's sent, the current directory might be different then
+        let path = path
+            .canonicalize()
+            .with_context(|| format!("Unable to find file {}", path.display()))?;
+        if !path.is_file() {
+            bail!("Path {} doesn't point to a file", path.display());
+        }
+        let file_path = path
+            .to_str()
+            .with_context(|| format!("Path {} is not valid UTF-8", path.display()))?
+            .to_owned();
+
+        let message = NewDeviceMessage {
+            site_id: self.site_id(),
+            stream_group: message_context.stream_group.clone(),
+            stream: message_context.stream.clone(),
+            batch_id,
+            message_id,
+            content: Cow::Borrowed(&[]),
+            close_option: CloseOption::None,
+            // The file is streamed as it is
+            compression: persistence::Compression::None,
+            batch_slice_id: None,
+            chunk_id: None,
+            file_path: Some(file_path),
+            priority: message_context.priority,
+        };
+
+        let start = Instant::now();
+        let result = self.runtime.block_on(self.d2c_producer.add(message));
+        self.metrics.enqueue_latency.record_since(start);
+        result
+    }
+
     pub fn enqueue_batch_completion(
         &self,
         message_context: &MessageContext,
         batch_id: String,
     ) -> Result<()> {
-        let message = DeviceMessage {
-            id: None,
+        let message = NewDeviceMessage {
             site_id: self.site_id(),
             stream_group: message_context.stream_group.clone(),
             stream: message_context.stream.clone(),
             batch_id: Some(batch_id),
             message_id: None,
-            content: Vec::new(),
+            content: Cow::Borrowed(&[]),
             close_option: CloseOption::CloseOnly,
             compression: persistence::Compression::None,
             batch_slice_id: None,
             chunk_id: None,
+            file_path: None,
+            priority: message_context.priority,
         };
 
         self.publish_message(message)
@@ -282,41 +479,64 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
         batch_id: String,
         message_id: String,
     ) -> Result<()> {
-        let message = DeviceMessage {
-            id: None,
+        let message = NewDeviceMessage {
             site_id: self.site_id(),
             stream_group: message_context.stream_group.clone(),
             stream: message_context.stream.clone(),
             batch_id: Some(batch_id),
             message_id: Some(message_id),
-            content: Vec::new(),
+            content: Cow::Borrowed(&[]),
             close_option: CloseOption::CloseMessageOnly,
             compression: persistence::Compression::None,
             batch_slice_id: None,
             chunk_id: None,
+            file_path: None,
+            priority: message_context.priority,
         };
 
         self.publish_message(message)
     }
 
     pub fn wait_enqueued_messages_sent(&self) -> Result<()> {
+        self.wait_enqueued_messages_sent_until(None).map(|_| ())
+    }
+
+    pub fn wait_enqueued_messages_sent_timeout(&self, timeout: Duration) -> Result<bool> {
+        self.wait_enqueued_messages_sent_until(Some(timeout))
+    }
+
+    // Returns `false` if the timeout elapsed before all the messages were sent
+    fn wait_enqueued_messages_sent_until(&self, timeout: Option<Duration>) -> Result<bool> {
         self.runtime.block_on(async {
-            loop {
-                let cnt = self.d2c_producer.count().await?;
+            let wait = async {
+                let all_removed = self.d2c_producer.wait_all_removed();
+                tokio::pin!(all_removed);
 
-                if cnt == 0 {
-                    break;
-                }
+                let Some(signals_src) = &self.signals_src else {
+                    all_removed.await;
+                    return Ok(true);
+                };
 
-                if let Some(signals_src) = &self.signals_src {
+                // The signals must still be checked periodically, the messages are awaited in the meantime
+                loop {
                     signals_src.check_signals()?;
+
+                    if tokio::time::timeout(SIGNALS_CHECK_INTERVAL, &mut all_removed)
+                        .await
+                        .is_ok()
+                    {
+                        return Ok::<bool, anyhow::Error>(true);
+                    }
                 }
+            };
 
-                tokio::time::sleep(Duration::from_millis(200)).await;
+            match timeout {
+                Some(timeout) => tokio::time::timeout(timeout, wait)
+                    .await
+                    .unwrap_or(Ok(false)),
+                None => wait.await,
             }
-            Ok::<(), anyhow::Error>(())
-        })?;
-        Ok(())
+        })
     }
 
     pub fn send_message(
@@ -324,7 +544,7 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
         message_context: &MessageContext,
         batch_id: Option<String>,
         message_id: Option<String>,
-        payload: Vec<u8>,
+        payload: Cow<'_, [u8]>,
     ) -> Result<()> {
         self.enqueue_message(message_context, batch_id, message_id, payload)?;
         self.wait_enqueued_messages_sent()
@@ -337,7 +557,7 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
         batch_slice_id: Option<String>,
         message_id: Option<String>,
         chunk_id: Option<String>,
-        payload: Vec<u8>,
+        payload: Cow<'_, [u8]>,
     ) -> Result<()> {
         self.enqueue_message_advanced(
             message_context,
@@ -350,8 +570,19 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
         self.wait_enqueued_messages_sent()
     }
 
-    fn publish_message(&self, message: DeviceMessage) -> Result<()> {
-        self.runtime.block_on(self.d2c_producer.add(message))
+    fn publish_message(&self, mut message: NewDeviceMessage<'_>) -> Result<()> {
+        let start = Instant::now();
+        let result = self.runtime.block_on(async {
+            if let Some(compression) = &self.compression {
+                compression
+                    .compress_messages(slice::from_mut(&mut message))
+                    .await?;
+            }
+            self.d2c_producer.add(message).await
+        });
+        self.metrics.enqueue_latency.record_since(start);
+        log::trace!("Enqueued a message in {:?}", start.elapsed());
+        result
     }
 
     // Cloud to Device Messages
@@ -359,6 +590,17 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
     pub fn process_c2d<G>(&self, callback: G) -> Result<()>
     where
         G: Fn(&CloudToDeviceMessage) + Send + 'static,
+    {
+        self.process_c2d_batch(move |msgs: &[CloudToDeviceMessage]| {
+            for msg in msgs {
+                callback(msg);
+            }
+        })
+    }
+
+    pub fn process_c2d_batch<G>(&self, callback: G) -> Result<()>
+    where
+        G: Fn(&[CloudToDeviceMessage]) + Send + 'static,
     {
         if self
             .c2d_handler_registered
@@ -369,37 +611,49 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
         }
 
         let consumer = self.c2d_consumer.clone();
-        let runtime = self.runtime.handle().clone();
         let cancellation = self.cancellation.clone();
-        // TODO clean this up
-        // This eventually panics on shutdown
-        thread::spawn(move || {
-            runtime.block_on(async {
-                // TODO Make this correct
-                let mut consumer = consumer.lock().await;
-                loop {
-                    if cancellation.is_cancelled() {
-                        break;
-                    }
-                    let msg = match consumer.recv(&None).await {
-                        Ok(msg) => msg,
-                        Err(e) => {
-                            log::warn!("Processing of C2D messages failed: {:?}", e);
-                            // If there is a transient issue a retry might help
-                            // If there is a persistent issue let's not retry too aggressively
-                            tokio::time::sleep(Duration::from_secs(30)).await;
-                            continue;
-                        }
-                    };
-                    callback(&msg);
-                    if let Err(e) = consumer.ack(&msg).await {
-                        // TODO add some retrying here, possibly prevent further processing
-                        // We cannot remove the message from the store -- this will result in the message being retrieved again in the next iteration and subsequent restarts
-                        log::warn!("Unable to remove C2D message to prevent duplicate processing, it will be processed again: {:?}", e);
+        self.runtime.spawn(async move {
+            let mut callback = callback;
+            let mut consumer = consumer.lock().await;
+            loop {
+                let received = select! {
+                    () = cancellation.cancelled() => break,
+                    received = consumer.recv_batch(C2D_BATCH_SIZE, &None) => received,
+                };
+                let msgs = match received {
+                    Ok(msgs) => msgs,
+                    Err(e) => {
+                        log::warn!("Processing of C2D messages failed: {:?}", e);
+                        // If there is a transient issue a retry might help
+                        // If there is a persistent issue let's not retry too aggressively
                         tokio::time::sleep(Duration::from_secs(30)).await;
+                        continue;
                     }
+                };
+                // The callback can block, so it runs on the blocking thread pool shared with the other clients
+                let processed = tokio::task::spawn_blocking(move || {
+                    callback(&msgs);
+                    (callback, msgs)
+                })
+                .await;
+                let msgs = match processed {
+                    Ok((returned_callback, msgs)) => {
+                        callback = returned_callback;
+                        msgs
+                    }
+                    Err(e) => {
+                        log::error!("Processing of C2D messages stopped because the callback failed: {:?}", e);
+                        break;
+                    }
+                };
+                // All the messages of the batch are removed in one transaction
+                if let Err(e) = consumer.ack_many(&msgs).await {
+                    // TODO add some retrying here, possibly prevent further processing
+                    // We cannot remove the messages from the store -- this will result in the messages being retrieved again in subsequent restarts
+                    log::warn!("Unable to remove {} C2D messages to prevent duplicate processing, they will be processed again: {:?}", msgs.len(), e);
+                    tokio::time::sleep(Duration::from_secs(30)).await;
                 }
-            });
+            }
         });
         Ok(())
     }
@@ -431,7 +685,7 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
 
         Ok(CloudToDeviceMessageGuard::new(
             msg,
-            self.runtime.handle(),
+            &self.runtime,
             self.c2d_consumer.clone(),
         ))
     }
@@ -455,6 +709,21 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
             .block_on(self.twins_client.get_reported_properties())
     }
 
+    pub fn shared_desired_properties(&self) -> Result<SharedDesiredProperties> {
+        self.runtime
+            .block_on(self.twins_client.get_shared_desired_properties())
+    }
+
+    pub fn subscribe_desired_properties_changes(
+        &self,
+        callback: Box<dyn DesiredPropertiesChangedCallback>,
+    ) {
+        self.runtime.block_on(
+            self.twins_client
+                .subscribe_desired_properties_changes(callback),
+        );
+    }
+
     pub fn wait_desired_properties_changed(&self) -> Result<DesiredProperties> {
         self.runtime
             .block_on(self.twins_client.desired_properties_changed())
@@ -470,6 +739,16 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
             .block_on(self.twins_client.patch_reported_properties(patch))
     }
 
+    pub fn set_reported_property(&self, path: &str, value: &str) -> Result<()> {
+        self.runtime
+            .block_on(self.twins_client.set_reported_property(path, value))
+    }
+
+    pub fn remove_reported_property(&self, path: &str) -> Result<()> {
+        self.runtime
+            .block_on(self.twins_client.remove_reported_property(path))
+    }
+
     pub fn any_pending_reported_properties_updates(&self) -> Result<bool> {
         self.runtime
             .block_on(self.twins_client.pending_reported_properties_updates())
@@ -484,12 +763,30 @@ impl BaseConnection<dyn ConnectionImplementation + Send + Sync> {
 impl<T: ?Sized + Send + Sync> Drop for BaseConnection<T> {
     fn drop(&mut self) {
         log::debug!("Base connection is being dropped");
+
+        // Messages that were submitted without waiting must be handed over to the producer first
+        drop(self.submission_queue.take());
+        if let Some(submission_task) = self.submission_task.take() {
+            if let Err(cause) = self.runtime.block_on(submission_task) {
+                log::error!("Task storing the submitted messages failed: {:?}", cause);
+            }
+        }
+
+        // Messages that are still waiting in memory must be written to the local database file so that they are sent later
+        if let Err(e) = self.runtime.block_on(self.d2c_producer.flush()) {
+            log::warn!("Unable to store all the enqueued messages before shutdown: {e:?}");
+        }
+
         drop(self.implementation.take());
 
-        // Join the thread where all async tasks were run and other processor threads (such as c2d)
-        // Only the MQTT loop and Sender are blocking the join of the main thread, other tasks will be dropped (possibly while they're awaiting) when these two finish and the thread is joined.
-        log::debug!("Waiting for the execution thread to be joined");
-        crate::utils::thread::join(&mut self.thread);
+        // Wait for the task running the MQTT loop and Sender, other tasks are dropped (possibly while they're awaiting)
+        // when the runtime is shut down or they notice the cancellation if the runtime is shared
+        log::debug!("Waiting for the connection task to finish");
+        if let Some(connection_task) = self.connection_task.take() {
+            if let Err(cause) = self.runtime.block_on(connection_task) {
+                log::error!("Connection task failed: {:?}", cause);
+            }
+        }
 
         log::debug!("Base connection is dropped");
     }
@@ -8,9 +8,12 @@ use chrono::{DateTime, Utc};
 use std::{
     panic::RefUnwindSafe,
     path::{Path, PathBuf},
+    sync::Arc,
+    time::Duration,
 };
 
 use http::Uri;
+use tokio::runtime::{Handle, Runtime, RuntimeFlavor};
 
 use crate::cloud::{
     dps::{
@@ -22,7 +25,10 @@ use crate::cloud::{
 
 use crate::{EmptyProcessSignalsSource, ProcessSignalsSource};
 
-use super::DeviceClient;
+use super::{
+    submission::CompletionCallback, ClientOptions, DeviceClient, Durability,
+    EnqueueCompletedCallback, QueueLimit, ReconnectPolicy, StorageProfile, MIN_WORKER_THREADS,
+};
 
 // Defining a super-trait for what traits must the handler implement Fn(...) + Send + RefUnwindSafe + 'static
 pub trait Handler:
@@ -85,6 +91,8 @@ pub struct DeviceClientBuilder {
     display_provisioning_operation_callback: Option<Box<dyn ProvisioningOperationDisplayHandler>>,
     desired_properties_updated_callback: Option<Box<dyn DesiredPropertiesUpdatedCallback>>,
     signals_src: Option<Box<dyn ProcessSignalsSource>>,
+    warm_start: bool,
+    options: ClientOptions,
 }
 
 impl DeviceClientBuilder {
@@ -117,6 +125,8 @@ impl DeviceClientBuilder {
             display_provisioning_operation_callback: None,
             desired_properties_updated_callback: None,
             signals_src: None,
+            warm_start: false,
+            options: ClientOptions::default(),
         }
     }
 
@@ -139,6 +149,22 @@ impl DeviceClientBuilder {
         self
     }
 
+    /// Start without waiting for the Platform to confirm that the
+    /// [Registration Token](https://docs.spotflow.io/connect-devices/#registration-token) stored in the local database
+    /// file is still valid (disabled by default). If the stored Registration Token hasn't expired yet,
+    /// [`DeviceClientBuilder::build`] returns without any network round trip and the client accepts
+    /// [Messages](https://docs.spotflow.io/send-data/#message) immediately while it connects to the Platform in the
+    /// background. This shortens the startup of Devices that run only for short periods, for example, on battery.
+    ///
+    /// Because the validity is checked only in the background, a Registration Token that was revoked in the Platform
+    /// doesn't trigger [Device Provisioning](https://docs.spotflow.io/connect-devices/#device-provisioning). The client
+    /// keeps trying to register until it's dropped, so you need to start it again without the warm start.
+    #[must_use]
+    pub fn with_warm_start(mut self, warm_start: bool) -> DeviceClientBuilder {
+        self.warm_start = warm_start;
+        self
+    }
+
     /// Set the callback to display the details of the
     /// [Provisioning Operation](https://docs.spotflow.io/connect-devices/#provisioning-operation)
     /// when [`DeviceClientBuilder::build`] is performing [Device Provisioning](https://docs.spotflow.io/connect-devices/#device-provisioning).
@@ -172,6 +198,160 @@ impl DeviceClientBuilder {
         self
     }
 
+    /// Set how the outgoing [Messages](https://docs.spotflow.io/send-data/#message) are written to the local database
+    /// file and handed over to the background thread that sends them to the Platform.
+    ///
+    /// The default value is [`Durability::Full`]. See [`Durability`] for the trade-offs of the other options.
+    #[must_use]
+    pub fn with_durability(mut self, durability: Durability) -> DeviceClientBuilder {
+        self.options.durability = durability;
+        self
+    }
+
+    /// Set how the local database file is configured, see [`StorageProfile`] (`StorageProfile::Durable` by default).
+    #[must_use]
+    pub fn with_storage_profile(mut self, storage_profile: StorageProfile) -> DeviceClientBuilder {
+        self.options.storage_profile = storage_profile;
+        self
+    }
+
+    /// Run the background tasks of the client on the provided tokio runtime instead of creating a new one. This way,
+    /// multiple clients in the same process can share one executor sized for all of them.
+    ///
+    /// The runtime must be multi-threaded with at least [`MIN_WORKER_THREADS`] worker threads and have both the I/O and
+    /// the time drivers enabled, otherwise [`DeviceClientBuilder::build`] fails. It must keep running until the client is dropped. The methods of the client block the calling thread,
+    /// so they must not be called from the tasks of the runtime.
+    #[must_use]
+    pub fn with_runtime(mut self, runtime: Handle) -> DeviceClientBuilder {
+        self.options.runtime = Some(runtime);
+        self
+    }
+
+    #[must_use]
+    pub(crate) fn with_gateway_runtime(mut self, runtime: Arc<Runtime>) -> DeviceClientBuilder {
+        self.options.gateway_runtime = Some(runtime);
+        self
+    }
+
+    /// Set the number of worker threads of the tokio runtime created for the client (2 by default, which is also the
+    /// minimum). Ignored if a shared runtime is provided using [`DeviceClientBuilder::with_runtime`].
+    #[must_use]
+    pub fn with_worker_threads(mut self, worker_threads: usize) -> DeviceClientBuilder {
+        self.options.worker_threads = worker_threads;
+        self
+    }
+
+    /// Set how many [Messages](https://docs.spotflow.io/send-data/#message) submitted using
+    /// [`DeviceClient::try_enqueue_message`] can wait in memory to be saved to the local database file (1024 by
+    /// default, at least 1).
+    #[must_use]
+    pub fn with_submission_queue_capacity(mut self, capacity: usize) -> DeviceClientBuilder {
+        self.options.submission_queue_capacity = capacity;
+        self
+    }
+
+    /// Set the callback that is called after each [Message](https://docs.spotflow.io/send-data/#message) submitted
+    /// using [`DeviceClient::try_enqueue_message`] is saved to the local database file or fails to be saved, including
+    /// the Messages that are dropped or rejected because of the [`QueueLimit`]. The callback is called from a dedicated
+    /// background thread, so a slow callback doesn't delay sending the Messages. However, once the callback falls behind
+    /// by about as many Messages as the submission queue capacity, the submitted Messages stop being saved until it
+    /// catches up and [`DeviceClient::try_enqueue_message`] eventually fails with
+    /// [`SubmissionQueueFull`](crate::SubmissionQueueFull).
+    #[must_use]
+    pub fn with_enqueue_completed_callback(
+        mut self,
+        callback: Box<dyn EnqueueCompletedCallback>,
+    ) -> DeviceClientBuilder {
+        self.options.enqueue_completed_callback = Some(CompletionCallback::new(callback));
+        self
+    }
+
+    /// Set how the client reconnects to the Platform after the connection is lost, see [`ReconnectPolicy`]. By default,
+    /// the first attempt is made immediately and the following ones after a delay growing from 1 second up to
+    /// 1 minute, randomly shortened by up to a half.
+    #[must_use]
+    pub fn with_reconnect_policy(
+        mut self,
+        reconnect_policy: ReconnectPolicy,
+    ) -> DeviceClientBuilder {
+        self.options.reconnect_policy = reconnect_policy;
+        self
+    }
+
+    /// Limit how many [Messages](https://docs.spotflow.io/send-data/#message) can wait in the local database file to be
+    /// sent to the Platform, see [`QueueLimit`]. There is no limit by default.
+    #[must_use]
+    pub fn with_queue_limit(mut self, queue_limit: QueueLimit) -> DeviceClientBuilder {
+        self.options.queue_limit = Some(queue_limit);
+        self
+    }
+
+    /// Set the maximum number of [Messages](https://docs.spotflow.io/send-data/#message) that can be sent to the Platform
+    /// without waiting for the acknowledgment of the previous ones. The following Messages are prepared for sending
+    /// (including their compression) while the previous ones are being sent.
+    ///
+    /// The default value is 1. Higher values increase the throughput on connections with high latency. However, if the
+    /// connection breaks, the Messages that were sent but not acknowledged are sent again, so their duplicates
+    /// don't have to directly follow the original Messages.
+    #[must_use]
+    pub fn with_max_inflight_messages(mut self, max_inflight_messages: u16) -> DeviceClientBuilder {
+        self.options.max_inflight_messages = max_inflight_messages.max(1);
+        self
+    }
+
+    /// Compress the [Messages](https://docs.spotflow.io/send-data/#message) when they're enqueued instead of when
+    /// they're sent (disabled by default). See [`MessageContext::set_compression`](crate::MessageContext::set_compression).
+    ///
+    /// The compressed Messages are written to the local database file, so they're compressed only once even if they
+    /// have to be sent again, for example, after the connection breaks. The Messages are compressed on a background
+    /// thread pool with one thread per available core, so the Messages enqueued together by
+    /// [`DeviceClient::enqueue_messages`] are compressed in parallel. On the other hand, enqueuing a Message takes
+    /// longer because the calling thread waits for the compression to finish.
+    #[must_use]
+    pub fn with_compression_on_enqueue(mut self, compress_on_enqueue: bool) -> DeviceClientBuilder {
+        self.options.compress_on_enqueue = compress_on_enqueue;
+        self
+    }
+
+    /// Pack consecutive [Messages](https://docs.spotflow.io/send-data/#message) into a single Message before sending
+    /// them to the Platform (disabled by default). The payloads of the packed Messages are separated by new lines, so
+    /// use this option only for [Streams](https://docs.spotflow.io/send-data/#stream) that accept newline-delimited
+    /// records, such as JSON Lines.
+    ///
+    /// Only the Messages with the same [`MessageContext`](crate::MessageContext), Batch ID, and Batch Slice ID and
+    /// without any Message ID are packed together, up to the size limit of a single Message. Messages whose payloads
+    /// contain a new line are always sent on their own so that their records aren't split. A Message waits for the
+    /// following ones at most `max_delay` before it's sent.
+    ///
+    /// Packing many small Messages decreases the number of sent Messages and the size of their headers.
+    #[must_use]
+    pub fn with_message_coalescing(mut self, max_delay: Duration) -> DeviceClientBuilder {
+        self.options.max_coalescing_delay = Some(max_delay);
+        self
+    }
+
+    /// **Warning**: Don't use, the interface for Direct Methods hasn't been finalized yet.
+    ///
+    /// Set how many Direct Method calls are handled at the same time, each of them on a separate thread (1 by default,
+    /// at least 1). The calls that arrive while all the threads are busy wait for a free one.
+    #[doc(hidden)]
+    #[must_use]
+    pub fn with_method_handler_concurrency(mut self, concurrency: usize) -> DeviceClientBuilder {
+        self.options.method_concurrency = concurrency;
+        self
+    }
+
+    /// **Warning**: Don't use, the interface for Direct Methods hasn't been finalized yet.
+    ///
+    /// Set how long the handler of a Direct Method call can run (no limit by default). When the time runs out, the
+    /// call is answered with the status 504 and the result of the handler is discarded once it returns.
+    #[doc(hidden)]
+    #[must_use]
+    pub fn with_method_handler_timeout(mut self, timeout: Duration) -> DeviceClientBuilder {
+        self.options.method_timeout = Some(timeout);
+        self
+    }
+
     /// **Warning**: Don't use, the interface for Cloud-to-Device Messages hasn't been finalized yet.
     #[deprecated]
     #[doc(hidden)]
@@ -201,6 +381,36 @@ impl DeviceClientBuilder {
         self.build_impl(None::<NoneHandler>)
     }
 
+    /// Build the client that connects using the provided registration response instead of performing the Device
+    /// Provisioning and the registration, see [`crate::bench::build_client`].
+    #[cfg(feature = "bench")]
+    pub(crate) fn build_with_registration(
+        self,
+        registration_response: RegistrationResponse,
+    ) -> Result<DeviceClient> {
+        DeviceClient::new(
+            SdkConfiguration {
+                instance_url: Uri::from_static("https://localhost"),
+                provisioning_token: self.provisioning_token,
+                registration_token: RegistrationToken {
+                    token: String::from("bench"),
+                    expiration: None,
+                },
+                requested_device_id: self.device_id,
+                workspace_id: registration_response.workspace_id()?.to_owned(),
+                device_id: registration_response.device_id()?.to_owned(),
+                site_id: self.site_id,
+            },
+            &self.database_file,
+            None,
+            self.options,
+            None::<NoneHandler>,
+            self.desired_properties_updated_callback,
+            self.signals_src,
+            Some(registration_response),
+        )
+    }
+
     fn build_impl<F>(self, method_handler: Option<F>) -> Result<DeviceClient>
     where
         F: Handler,
@@ -209,20 +419,26 @@ impl DeviceClientBuilder {
         if self.database_file.as_os_str().is_empty() {
             bail!("The path to the local database file cannot be empty; provide a value.");
         }
+        if let Some(runtime) = &self.options.runtime {
+            check_shared_runtime(runtime)?;
+        }
 
-        // Look up the last stored configuration from the local database file
-        let db_config = if self.database_file.exists() {
-            // Process the communication with SQLite on the current thread
-            let runtime = tokio::runtime::Builder::new_current_thread()
+        // Look up the last stored configuration from the local database file, the file is then kept open for the client
+        let (db_config, db_connection) = if self.database_file.exists() {
+            let loading = SqliteStore::load_available_configuration(&self.database_file);
+            if let Some(runtime) = self.options.shared_runtime() {
+                runtime.block_on(loading)
+            } else {
+                // Process the communication with SQLite on the current thread
+                let runtime = tokio::runtime::Builder::new_current_thread()
                     .enable_all()
                     .build()
                     .map_err(|e| anyhow!("Unable to create a tokio single-threaded runtime for loading data from the local database file: {e}"))?;
 
-            runtime.block_on(SqliteStore::load_available_configuration(
-                &self.database_file,
-            ))
+                runtime.block_on(loading)
+            }
         } else {
-            SdkConfigurationFragment::default()
+            (SdkConfigurationFragment::default(), None)
         };
 
         // Compute the URL of the Platform instance
@@ -266,6 +482,8 @@ impl DeviceClientBuilder {
                 site_id: self.site_id,
             },
             &self.database_file,
+            db_connection,
+            self.options,
             method_handler,
             self.desired_properties_updated_callback,
             self.signals_src,
@@ -306,6 +524,14 @@ impl DeviceClientBuilder {
                 && db_config.requested_device_id.eq(&self.device_id)
                 && !db_registration_token.is_expired()
             {
+                if self.warm_start {
+                    log::info!(
+                        "Reusing the unexpired Registration Token stored in the local database file, \
+                        its validity will be checked in the background. Skipping Device Provisioning."
+                    );
+                    return Ok((db_registration_token, db_workspace_id, db_device_id, None));
+                }
+
                 // Check if the registration token is still valid and optionally update the current Device ID
                 let (is_considered_valid, registration_response) =
                     register_if_connected(&db_registration_token, instance_url);
@@ -439,6 +665,20 @@ fn register_if_connected(
     }
 }
 
+// The client blocks on the runtime and runs blocking work on it, which deadlocks on a single-threaded runtime
+fn check_shared_runtime(runtime: &Handle) -> Result<()> {
+    if runtime.runtime_flavor() != RuntimeFlavor::MultiThread {
+        bail!("The shared tokio runtime must be multi-threaded; build it using `tokio::runtime::Builder::new_multi_thread`.");
+    }
+
+    let worker_threads = runtime.metrics().num_workers();
+    if worker_threads < MIN_WORKER_THREADS {
+        bail!("The shared tokio runtime has {worker_threads} worker threads but it must have at least {MIN_WORKER_THREADS}.");
+    }
+
+    Ok(())
+}
+
 fn init_operation(
     provisioning: &mut Provisioning,
     signals_src: &dyn ProcessSignalsSource,
@@ -566,3 +806,28 @@ where
         self.builder.build_impl(Some(self.method_handler))
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::check_shared_runtime;
+
+    #[test]
+    fn shared_runtime_must_be_multi_threaded() {
+        let runtime = tokio::runtime::Builder::new_current_thread()
+            .build()
+            .unwrap();
+        assert!(check_shared_runtime(runtime.handle()).is_err());
+
+        let runtime = tokio::runtime::Builder::new_multi_thread()
+            .worker_threads(1)
+            .build()
+            .unwrap();
+        assert!(check_shared_runtime(runtime.handle()).is_err());
+
+        let runtime = tokio::runtime::Builder::new_multi_thread()
+            .worker_threads(2)
+            .build()
+            .unwrap();
+        assert!(check_shared_runtime(runtime.handle()).is_ok());
+    }
+}
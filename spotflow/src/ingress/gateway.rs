@@ -0,0 +1,131 @@
+use std::{
+    fmt::Write,
+    fs,
+    num::NonZeroUsize,
+    path::{Path, PathBuf},
+    sync::Arc,
+    thread,
+};
+
+use anyhow::{Context, Result};
+use tokio::runtime::Runtime;
+
+use super::{DeviceClientBuilder, MIN_WORKER_THREADS};
+
+/// A gateway that connects many [Devices](https://docs.spotflow.io/connect-devices/#device) to the Platform from
+/// a single process, for example, the downstream sensors without their own connection to the Internet.
+///
+/// All the [`DeviceClient`](crate::DeviceClient)s created from the builders returned by [`Gateway::device`] run on
+/// the same pool of worker threads instead of creating their own, so the gateway needs the same number of threads
+/// regardless of the number of Devices. Each Device runs as independent tasks on the shared tokio runtime, and a
+/// Device waiting for the Platform, for example, for the acknowledgments of its
+/// [Messages](https://docs.spotflow.io/send-data/#message), doesn't occupy a thread meanwhile. The Device SDK also
+/// reuses the connections and the TLS configuration for
+/// [Device Provisioning](https://docs.spotflow.io/connect-devices/#device-provisioning) between the Devices.
+///
+/// The Platform authenticates every connection as a single Device, so each Device still keeps its own connection
+/// and its own local database file. The files are stored in the directory of the gateway and named after the
+/// [Device IDs](https://docs.spotflow.io/connect-devices/#device-id).
+///
+/// The worker threads stop once the gateway and all the clients created from it are dropped.
+pub struct Gateway {
+    directory: PathBuf,
+    runtime: Arc<Runtime>,
+}
+
+impl Gateway {
+    /// Create a gateway that stores the local database files of the Devices in `directory`, creating it if it
+    /// doesn't exist, and runs their communication with the Platform on `worker_threads` threads (at least 2).
+    /// Use `None` to create one thread per available CPU core.
+    pub fn new(directory: impl AsRef<Path>, worker_threads: Option<usize>) -> Result<Self> {
+        let directory = directory.as_ref().to_path_buf();
+        fs::create_dir_all(&directory).with_context(|| {
+            format!(
+                "Unable to create the directory '{}' for the local database files of the gateway",
+                directory.display()
+            )
+        })?;
+
+        let worker_threads = worker_threads
+            .unwrap_or_else(|| thread::available_parallelism().map_or(1, NonZeroUsize::get))
+            .max(MIN_WORKER_THREADS);
+
+        let runtime = tokio::runtime::Builder::new_multi_thread()
+            .worker_threads(worker_threads)
+            .thread_name("spotflow-gateway")
+            .enable_all()
+            .build()
+            .context("Unable to build tokio runtime")?;
+
+        Ok(Self {
+            directory,
+            runtime: Arc::new(runtime),
+        })
+    }
+
+    /// Create a [`DeviceClientBuilder`] for the Device with the provided
+    /// [Device ID](https://docs.spotflow.io/connect-devices/#device-id) that uses the local database file and
+    /// the worker threads of the gateway. See [`DeviceClientBuilder::new`] for the description of the arguments.
+    /// The rest of the options can be configured on the returned builder as usual.
+    pub fn device(
+        &self,
+        device_id: impl Into<String>,
+        provisioning_token: impl Into<String>,
+    ) -> DeviceClientBuilder {
+        let device_id = device_id.into();
+        let database_file = self.database_file(&device_id);
+
+        DeviceClientBuilder::new(Some(device_id), provisioning_token.into(), database_file)
+            .with_gateway_runtime(Arc::clone(&self.runtime))
+    }
+
+    /// The path to the local database file of the Device with the provided
+    /// [Device ID](https://docs.spotflow.io/connect-devices/#device-id).
+    #[must_use]
+    pub fn database_file(&self, device_id: &str) -> PathBuf {
+        self.directory
+            .join(format!("{}.db", file_name_from_device_id(device_id)))
+    }
+}
+
+// Keep the characters that are safe in file names on all platforms and percent-encode the rest, so that two Device IDs
+// never map to the same file. Uppercase letters are encoded too because Device IDs differing only in case would map to
+// the same file on case-insensitive file systems, which are the default on Windows and macOS.
+fn file_name_from_device_id(device_id: &str) -> String {
+    let mut file_name = String::with_capacity(device_id.len());
+    for byte in device_id.bytes() {
+        if byte.is_ascii_lowercase() || byte.is_ascii_digit() || byte == b'-' || byte == b'_' {
+            file_name.push(char::from(byte));
+        } else {
+            write!(file_name, "%{byte:02X}").expect("Writing to a String cannot fail");
+        }
+    }
+    file_name
+}
+
+#[cfg(test)]
+mod tests {
+    use super::file_name_from_device_id;
+
+    #[test]
+    fn file_name_keeps_safe_characters() {
+        assert_eq!(file_name_from_device_id("sensor-01_a"), "sensor-01_a");
+    }
+
+    #[test]
+    fn file_name_encodes_other_characters() {
+        assert_eq!(
+            file_name_from_device_id("site/sensor:1"),
+            "site%2Fsensor%3A1"
+        );
+        assert_eq!(file_name_from_device_id("a%2F"), "a%252%46");
+    }
+
+    #[test]
+    fn file_names_differ_in_more_than_case() {
+        let upper = file_name_from_device_id("Sensor");
+        let lower = file_name_from_device_id("sensor");
+        assert_eq!(upper, "%53ensor");
+        assert_ne!(upper.to_lowercase(), lower.to_lowercase());
+    }
+}
@@ -1,3 +1,4 @@
+use std::borrow::Cow;
 use std::panic::RefUnwindSafe;
 use std::time::Duration;
 use std::{path::Path, sync::Arc};
@@ -5,20 +6,35 @@ use std::{path::Path, sync::Arc};
 use anyhow::Result;
 use base::BaseConnection;
 use c2d::CloudToDeviceMessageGuard;
+use sqlx::SqliteConnection;
+use tokio::runtime::{Handle, Runtime};
 
 use crate::cloud::drs::RegistrationResponse;
 pub use crate::connection::twins::DesiredProperties;
 pub use crate::connection::twins::DesiredPropertiesUpdatedCallback;
+pub use crate::connection::twins::{
+    DesiredPropertiesChange, DesiredPropertiesChangedCallback, SharedDesiredProperties,
+};
+use crate::iothub::DEFAULT_METHOD_CONCURRENCY;
+pub use crate::iothub::{ReconnectPolicy, ReconnectStatistics};
+use crate::metrics::Metrics;
 use crate::persistence::sqlite::SdkConfiguration;
+pub use crate::persistence::{Durability, OverflowPolicy, Priority, QueueLimit, StorageProfile};
 
 mod base;
 mod builder;
 pub mod c2d;
+mod gateway;
+mod submission;
 
+pub use base::MIN_WORKER_THREADS;
 pub use builder::DeviceClientBuilder;
 pub use builder::ProvisioningOperation;
 pub use builder::ProvisioningOperationDisplayHandler;
 pub use c2d::CloudToDeviceMessage;
+pub use gateway::Gateway;
+use submission::{CompletionCallback, DEFAULT_SUBMISSION_QUEUE_CAPACITY};
+pub use submission::{EnqueueCompletedCallback, SubmissionQueueFull};
 
 use crate::connection::ConnectionImplementation;
 
@@ -33,13 +49,21 @@ pub enum Compression {
     /// Beware that this may be significantly slower than the fastest compression.
     /// We recommend to test the performance of your application with this setting before using it in production.
     SmallestSize,
+    /// Compress the message using the algorithm settings tuned for short textual messages such as JSON telemetry with
+    /// the same keys in every message. These settings use the dictionary of common words and tokens built into the
+    /// compression algorithm, which the fastest compression skips, while being faster than the smallest size
+    /// compression.
+    SmallMessages,
 }
 
 impl Compression {
-    fn to_persisted_compression(compression: &Option<Compression>) -> persistence::Compression {
+    pub(crate) fn to_persisted_compression(
+        compression: &Option<Compression>,
+    ) -> persistence::Compression {
         match compression {
             Some(Compression::Fastest) => persistence::Compression::BrotliFastest,
             Some(Compression::SmallestSize) => persistence::Compression::BrotliSmallestSize,
+            Some(Compression::SmallMessages) => persistence::Compression::BrotliSmallMessages,
             None => persistence::Compression::None,
         }
     }
@@ -52,6 +76,7 @@ pub struct MessageContext {
     stream_group: Option<String>,
     stream: Option<String>,
     compression: Option<Compression>,
+    priority: Priority,
 }
 
 impl MessageContext {
@@ -63,6 +88,7 @@ impl MessageContext {
             stream_group,
             stream,
             compression: None,
+            priority: Priority::default(),
         }
     }
 
@@ -102,6 +128,98 @@ impl MessageContext {
     pub fn set_compression(&mut self, compression: Option<Compression>) {
         self.compression = compression;
     }
+
+    /// Get the priority of the [Messages](https://docs.spotflow.io/send-data/#message).
+    #[must_use]
+    pub fn priority(&self) -> Priority {
+        self.priority
+    }
+
+    /// Set the priority of the [Messages](https://docs.spotflow.io/send-data/#message), see [`Priority`]
+    /// ([`Priority::Normal`] by default).
+    pub fn set_priority(&mut self, priority: Priority) {
+        self.priority = priority;
+    }
+}
+
+/// A [Message](https://docs.spotflow.io/send-data/#message) that can be enqueued together with other Messages
+/// using [`DeviceClient::enqueue_messages`].
+#[derive(Clone, Debug, Default)]
+pub struct OutgoingMessage<'a> {
+    /// The ID of the [Batch](https://docs.spotflow.io/send-data/#batch) the Message is a part of.
+    pub batch_id: Option<String>,
+    /// The ID of the [Message](https://docs.spotflow.io/send-data/#message).
+    pub message_id: Option<String>,
+    /// The content of the Message. If it's borrowed, the SDK doesn't copy it before passing it to the database driver,
+    /// which copies it only once while writing it to the local database file.
+    pub payload: Cow<'a, [u8]>,
+}
+
+impl<'a> OutgoingMessage<'a> {
+    /// Create a new instance of [`OutgoingMessage`].
+    #[must_use]
+    pub fn new(
+        batch_id: Option<String>,
+        message_id: Option<String>,
+        payload: impl Into<Cow<'a, [u8]>>,
+    ) -> Self {
+        Self {
+            batch_id,
+            message_id,
+            payload: payload.into(),
+        }
+    }
+}
+
+/// The options tuning the behavior of [`DeviceClient`] that are collected by [`DeviceClientBuilder`].
+#[derive(Clone, Debug)]
+pub(crate) struct ClientOptions {
+    pub(crate) durability: Durability,
+    pub(crate) storage_profile: StorageProfile,
+    pub(crate) max_inflight_messages: u16,
+    pub(crate) compress_on_enqueue: bool,
+    pub(crate) max_coalescing_delay: Option<Duration>,
+    pub(crate) queue_limit: Option<QueueLimit>,
+    pub(crate) reconnect_policy: ReconnectPolicy,
+    pub(crate) runtime: Option<Handle>,
+    // Kept alive by every client of a `Gateway`, so that the runtime isn't shut down while any of them exists
+    pub(crate) gateway_runtime: Option<Arc<Runtime>>,
+    pub(crate) worker_threads: usize,
+    pub(crate) submission_queue_capacity: usize,
+    pub(crate) enqueue_completed_callback: Option<CompletionCallback>,
+    pub(crate) method_concurrency: usize,
+    pub(crate) method_timeout: Option<Duration>,
+}
+
+impl Default for ClientOptions {
+    fn default() -> Self {
+        Self {
+            durability: Durability::default(),
+            storage_profile: StorageProfile::default(),
+            max_inflight_messages: 1,
+            compress_on_enqueue: false,
+            max_coalescing_delay: None,
+            queue_limit: None,
+            reconnect_policy: ReconnectPolicy::default(),
+            runtime: None,
+            gateway_runtime: None,
+            worker_threads: 2,
+            submission_queue_capacity: DEFAULT_SUBMISSION_QUEUE_CAPACITY,
+            enqueue_completed_callback: None,
+            method_concurrency: DEFAULT_METHOD_CONCURRENCY,
+            method_timeout: None,
+        }
+    }
+}
+
+impl ClientOptions {
+    /// The handle of the runtime shared with other clients, `None` if the client should create its own runtime.
+    pub(crate) fn shared_runtime(&self) -> Option<Handle> {
+        self.gateway_runtime
+            .as_ref()
+            .map(|runtime| runtime.handle().clone())
+            .or_else(|| self.runtime.clone())
+    }
 }
 
 /// A client communicating with the Platform.
@@ -120,9 +238,12 @@ pub struct DeviceClient {
 impl DeviceClient {
     /// Starts an ingress and saves the provided tokens and URLs to a state file. If the provided file does not exist this function creates it.
     /// It also makes sure that both desired and reported properties of the Device Twin are available.
+    #[allow(clippy::too_many_arguments)]
     fn new<F>(
         config: SdkConfiguration,
         path: &Path,
+        store_connection: Option<SqliteConnection>,
+        options: ClientOptions,
         method_handler: Option<F>,
         desired_properties_updated_callback: Option<Box<dyn DesiredPropertiesUpdatedCallback>>,
         signals_src: Option<Box<dyn ProcessSignalsSource>>,
@@ -134,6 +255,8 @@ impl DeviceClient {
         let connection = BaseConnection::init_ingress(
             config,
             path,
+            store_connection,
+            options,
             method_handler,
             desired_properties_updated_callback,
             signals_src,
@@ -176,15 +299,91 @@ impl DeviceClient {
     /// The method returns right after it saves the [Message](https://docs.spotflow.io/send-data/#message) to
     /// the queue in the local database file. A background thread asynchronously sends the messages from the queue to the Platform.
     /// You can check the number of pending messages in the queue using [`DeviceClient::pending_messages_count`].
-    pub fn enqueue_message(
+    ///
+    /// The `payload` can be either owned or borrowed. A borrowed payload isn't copied by the SDK, only the database
+    /// driver copies it once while writing it to the local database file.
+    pub fn enqueue_message<'a>(
+        &self,
+        message_context: &MessageContext,
+        batch_id: Option<String>,
+        message_id: Option<String>,
+        payload: impl Into<Cow<'a, [u8]>>,
+    ) -> Result<()> {
+        self.connection
+            .enqueue_message(message_context, batch_id, message_id, payload.into())
+    }
+
+    /// Enqueue a [Message](https://docs.spotflow.io/send-data/#message) to be sent to the Platform without waiting
+    /// for it to be saved to the local database file.
+    ///
+    /// The same requirements on `batch_id` and `message_id` apply as in [`DeviceClient::enqueue_message`].
+    ///
+    /// The method only puts the Message into a bounded queue in memory and returns its sequence number, so it never
+    /// waits for the local database file. A background task saves the queued Messages in batches. If the queue is full
+    /// (see [`DeviceClientBuilder::with_submission_queue_capacity`]), the method fails with [`SubmissionQueueFull`]
+    /// and the Message is not enqueued.
+    ///
+    /// Use [`DeviceClientBuilder::with_enqueue_completed_callback`] to learn whether each Message was saved, or poll
+    /// [`DeviceClient::completed_enqueue_sequence`]. The Messages still waiting in the queue are saved when the client
+    /// is dropped.
+    pub fn try_enqueue_message(
         &self,
         message_context: &MessageContext,
         batch_id: Option<String>,
         message_id: Option<String>,
         payload: Vec<u8>,
+    ) -> Result<u64> {
+        self.connection
+            .try_enqueue_message(message_context, batch_id, message_id, payload)
+    }
+
+    /// Get the highest sequence number returned by [`DeviceClient::try_enqueue_message`] for which the Message and all
+    /// the Messages with lower sequence numbers were either saved to the local database file or failed to be saved.
+    /// Returns 0 if no such Message exists yet.
+    #[must_use]
+    pub fn completed_enqueue_sequence(&self) -> u64 {
+        self.connection.completed_enqueue_sequence()
+    }
+
+    /// Enqueue multiple [Messages](https://docs.spotflow.io/send-data/#message) to
+    /// be sent to the Platform.
+    ///
+    /// All the Messages are sent using the same `message_context` and in the given order. The same requirements on
+    /// `batch_id` and `message_id` apply as in [`DeviceClient::enqueue_message`].
+    ///
+    /// The method returns right after it saves all the Messages to the queue in the local database file. Because
+    /// the Messages are saved in a single transaction, this is considerably faster than enqueueing them one by one.
+    /// Either all the Messages are saved or none of them, which also applies when they don't fit into the limit set by
+    /// [`DeviceClientBuilder::with_queue_limit`] together. A background thread asynchronously sends the messages from
+    /// the queue to the Platform.
+    /// You can check the number of pending messages in the queue using [`DeviceClient::pending_messages_count`].
+    pub fn enqueue_messages(
+        &self,
+        message_context: &MessageContext,
+        messages: Vec<OutgoingMessage<'_>>,
+    ) -> Result<()> {
+        self.connection.enqueue_messages(message_context, messages)
+    }
+
+    /// Enqueue a [Message](https://docs.spotflow.io/send-data/#message) with the content of a file to
+    /// be sent to the Platform.
+    ///
+    /// The same requirements on `batch_id` and `message_id` apply as in [`DeviceClient::enqueue_message`].
+    ///
+    /// Only the path to the file is saved to the queue in the local database file, the file is read when the
+    /// Message is being sent. Because the content is streamed directly from the file to the Platform, the file
+    /// can be larger than the available memory. The file must not be changed or removed until the Message is sent,
+    /// see [`DeviceClient::wait_enqueued_messages_sent`]. If the file cannot be found when the Message is being sent,
+    /// the Message is skipped.
+    pub fn enqueue_file(
+        &self,
+        message_context: &MessageContext,
+        batch_id: Option<String>,
+        message_id: Option<String>,
+        path: impl AsRef<Path>,
     ) -> Result<()> {
         self.connection
-            .enqueue_message(message_context, batch_id, message_id, payload)
+            .enqueue_file(message_context, batch_id, message_id, path.as_ref())
     }
 
     /// Enqueue a [Message](https://docs.spotflow.io/send-data/#message) to
@@ -204,14 +403,17 @@ impl DeviceClient {
     /// The method returns right after it saves the [Message](https://docs.spotflow.io/send-data/#message) to
     /// the queue in the local database file. A background thread asynchronously sends the messages from the queue to the Platform.
     /// You can check the number of pending messages in the queue using [`DeviceClient::pending_messages_count`].
-    pub fn enqueue_message_advanced(
+    ///
+    /// The `payload` can be either owned or borrowed. A borrowed payload isn't copied by the SDK, only the database
+    /// driver copies it once while writing it to the local database file.
+    pub fn enqueue_message_advanced<'a>(
         &self,
         message_context: &MessageContext,
         batch_id: Option<String>,
         batch_slice_id: Option<String>,
         message_id: Option<String>,
         chunk_id: Option<String>,
-        payload: Vec<u8>,
+        payload: impl Into<Cow<'a, [u8]>>,
     ) -> Result<()> {
         self.connection.enqueue_message_advanced(
             message_context,
@@ -219,7 +421,7 @@ impl DeviceClient {
             batch_slice_id,
             message_id,
             chunk_id,
-            payload,
+            payload.into(),
         )
     }
 
@@ -273,15 +475,18 @@ impl DeviceClient {
     /// [Batch ID Autofill Pattern](https://docs.spotflow.io/send-data/#batch-id-autofill-pattern),
     /// you must provide `batch_id`. See [User Guide](https://docs.spotflow.io/send-data/) for
     /// more details.
-    pub fn send_message(
+    ///
+    /// The `payload` can be either owned or borrowed. A borrowed payload isn't copied by the SDK, only the database
+    /// driver copies it once while writing it to the local database file.
+    pub fn send_message<'a>(
         &self,
         message_context: &MessageContext,
         batch_id: Option<String>,
         message_id: Option<String>,
-        payload: Vec<u8>,
+        payload: impl Into<Cow<'a, [u8]>>,
     ) -> Result<()> {
         self.connection
-            .send_message(message_context, batch_id, message_id, payload)
+            .send_message(message_context, batch_id, message_id, payload.into())
     }
 
     /// Send a [Message](https://docs.spotflow.io/send-data/#message) to
@@ -300,14 +505,17 @@ impl DeviceClient {
     /// you must provide `batch_id`. See [User Guide](https://docs.spotflow.io/send-data/) for
     /// more details.
     /// Optionally, you can provide also `batch_slice_id` to use Batch Slices and `chunk_id` to use Message Chunking.
-    pub fn send_message_advanced(
+    ///
+    /// The `payload` can be either owned or borrowed. A borrowed payload isn't copied by the SDK, only the database
+    /// driver copies it once while writing it to the local database file.
+    pub fn send_message_advanced<'a>(
         &self,
         message_context: &MessageContext,
         batch_id: Option<String>,
         batch_slice_id: Option<String>,
         message_id: Option<String>,
         chunk_id: Option<String>,
-        payload: Vec<u8>,
+        payload: impl Into<Cow<'a, [u8]>>,
     ) -> Result<()> {
         self.connection.send_message_advanced(
             message_context,
@@ -315,7 +523,7 @@ impl DeviceClient {
             batch_slice_id,
             message_id,
             chunk_id,
-            payload,
+            payload.into(),
         )
     }
 
@@ -325,12 +533,28 @@ impl DeviceClient {
         self.connection.pending_messages_count()
     }
 
+    /// Get the snapshot of the metrics of the client since it was started, such as the latencies of enqueuing and
+    /// sending [Messages](https://docs.spotflow.io/send-data/#message), the efficiency of their compression, and the
+    /// statistics of the reconnections to the Platform. Collecting the metrics is cheap enough to be always enabled.
+    #[must_use]
+    pub fn metrics(&self) -> Metrics {
+        self.connection.metrics()
+    }
+
     /// Block the current thread until all the [Messages](https://docs.spotflow.io/send-data/#message) that
     /// have been previously enqueued are sent to the Platform.
     pub fn wait_enqueued_messages_sent(&self) -> Result<()> {
         self.connection.wait_enqueued_messages_sent()
     }
 
+    /// Block the current thread until all the [Messages](https://docs.spotflow.io/send-data/#message) that
+    /// have been previously enqueued are sent to the Platform or until the timeout elapses.
+    ///
+    /// Returns `true` if all the Messages were sent and `false` if the timeout elapsed first.
+    pub fn wait_enqueued_messages_sent_timeout(&self, timeout: Duration) -> Result<bool> {
+        self.connection.wait_enqueued_messages_sent_timeout(timeout)
+    }
+
     /// Get the current [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
     ///
     /// Only the latest version is returned, any versions between the last obtained one and the current one are skipped.
@@ -347,6 +571,29 @@ impl DeviceClient {
         self.connection.desired_properties_if_newer(version)
     }
 
+    /// Get the current [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties) without
+    /// copying them.
+    ///
+    /// The returned object shares the JSON serialization of the properties that is created only once for each
+    /// version, so it's cheap to call this method often.
+    pub fn shared_desired_properties(&self) -> Result<SharedDesiredProperties> {
+        self.connection.shared_desired_properties()
+    }
+
+    /// Subscribe to the changes of the [Desired Properties](https://docs.spotflow.io/configure-devices/#desired-properties).
+    ///
+    /// The `callback` is called in a separate thread for each new version of the Desired Properties that changes any
+    /// property, together with the paths of the changed properties, so there's no need to poll the Desired Properties
+    /// and compare them. Only the changes received after the subscription are reported. A new subscription replaces
+    /// the previous one.
+    pub fn subscribe_desired_properties_changes(
+        &self,
+        callback: Box<dyn DesiredPropertiesChangedCallback>,
+    ) {
+        self.connection
+            .subscribe_desired_properties_changes(callback);
+    }
+
     /// Enqueue an update of the [Reported Properties](https://docs.spotflow.io/configure-devices/#reported-properties)
     /// to be sent to the Platform.
     ///
@@ -358,6 +605,28 @@ impl DeviceClient {
         self.connection.update_reported_properties(properties)
     }
 
+    /// Enqueue an update of a single [Reported Property](https://docs.spotflow.io/configure-devices/#reported-properties)
+    /// to be sent to the Platform.
+    ///
+    /// The `path` is a JSON Pointer to the property, for example `/sensors/temperature/unit`, and `value` is the new
+    /// value of the property encoded in JSON. The objects on the path are created if they don't exist. Unlike
+    /// [`DeviceClient::update_reported_properties`], the method doesn't need to compare the whole Reported Properties
+    /// to find out what changed. The updates that are waiting to be sent are merged together and sent at once.
+    ///
+    /// The update is saved persistently in the local database file and sent the same way as by
+    /// [`DeviceClient::update_reported_properties`].
+    pub fn set_reported_property(&self, path: &str, value: &str) -> Result<()> {
+        self.connection.set_reported_property(path, value)
+    }
+
+    /// Enqueue a removal of a single [Reported Property](https://docs.spotflow.io/configure-devices/#reported-properties)
+    /// to be sent to the Platform.
+    ///
+    /// The `path` is a JSON Pointer to the property, see [`DeviceClient::set_reported_property`].
+    pub fn remove_reported_property(&self, path: &str) -> Result<()> {
+        self.connection.remove_reported_property(path)
+    }
+
     /// Get whether are there any updates to [Reported Properties](https://docs.spotflow.io/configure-devices/#reported-properties)
     /// that are yet to be sent to the Platform.
     pub fn any_pending_reported_properties_updates(&self) -> Result<bool> {
@@ -374,6 +643,19 @@ impl DeviceClient {
         self.connection.process_c2d(callback)
     }
 
+    /// **Warning**: Don't use, the interface for Cloud-to-Device Messages hasn't been finalized yet.
+    ///
+    /// Works like [`DeviceClient::process_c2d`], but passes all the Messages that are already received at once (up to
+    /// 64) to the callback and removes them from the local database file together after the callback returns.
+    #[deprecated]
+    #[doc(hidden)]
+    pub fn process_c2d_batch<G>(&self, callback: G) -> Result<()>
+    where
+        G: Fn(&[CloudToDeviceMessage]) + Send + 'static,
+    {
+        self.connection.process_c2d_batch(callback)
+    }
+
     /// **Warning**: Don't use, the interface for Cloud-to-Device Messages hasn't been finalized yet.
     #[deprecated]
     #[doc(hidden)]
@@ -0,0 +1,356 @@
+use std::{
+    collections::BTreeSet,
+    fmt,
+    panic::{catch_unwind, AssertUnwindSafe, RefUnwindSafe},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+    thread,
+};
+
+use anyhow::{Error, Result};
+use tokio::{
+    runtime::Handle,
+    sync::mpsc::{self, error::TryRecvError},
+    task::JoinHandle,
+};
+
+use crate::persistence::{compression::CompressionPool, NewDeviceMessage, Producer, QueueFull};
+
+/// The default number of [Messages](https://docs.spotflow.io/send-data/#message) that can wait in memory to be
+/// stored after they were submitted using [`DeviceClient::try_enqueue_message`](crate::DeviceClient::try_enqueue_message).
+pub(super) const DEFAULT_SUBMISSION_QUEUE_CAPACITY: usize = 1024;
+
+// The submitted messages are stored in transactions of at most this many messages
+const MAX_DRAINED_MESSAGES: usize = 256;
+
+/// Handles the completion of storing the [Messages](https://docs.spotflow.io/send-data/#message) submitted using
+/// [`DeviceClient::try_enqueue_message`](crate::DeviceClient::try_enqueue_message).
+pub trait EnqueueCompletedCallback: Send + Sync + RefUnwindSafe {
+    /// Handle the Message with the provided sequence number being stored to the local database file, or failing to be
+    /// stored with the provided `error`. The Messages are completed in the order of their sequence numbers unless they
+    /// were submitted from multiple threads at the same time.
+    fn enqueue_completed(&self, sequence: u64, error: Option<&Error>);
+}
+
+/// The error returned by [`DeviceClient::try_enqueue_message`](crate::DeviceClient::try_enqueue_message) when there
+/// are too many [Messages](https://docs.spotflow.io/send-data/#message) waiting in memory to be stored. No Message
+/// was enqueued, try again later.
+#[derive(Debug, thiserror::Error)]
+#[error("Unable to enqueue the message because {capacity} submitted messages are already waiting to be stored")]
+pub struct SubmissionQueueFull {
+    capacity: usize,
+}
+
+#[derive(Clone)]
+pub(crate) struct CompletionCallback(Arc<dyn EnqueueCompletedCallback>);
+
+impl CompletionCallback {
+    pub(crate) fn new(callback: Box<dyn EnqueueCompletedCallback>) -> Self {
+        Self(Arc::from(callback))
+    }
+}
+
+impl fmt::Debug for CompletionCallback {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.write_str("CompletionCallback")
+    }
+}
+
+struct Submission {
+    sequence: u64,
+    message: NewDeviceMessage<'static>,
+}
+
+/// A bounded queue of the messages that were submitted without waiting for them to be stored. Submitting a message
+/// only reserves a slot in the queue, a background task stores the messages in batches.
+pub(super) struct SubmissionQueue {
+    sender: mpsc::Sender<Submission>,
+    capacity: usize,
+    next_sequence: AtomicU64,
+    completed: Arc<AtomicU64>,
+}
+
+impl SubmissionQueue {
+    pub(super) fn start(
+        runtime: &Handle,
+        capacity: usize,
+        producer: Arc<Producer>,
+        compression: Option<Arc<CompressionPool>>,
+        callback: Option<CompletionCallback>,
+    ) -> (Self, JoinHandle<()>) {
+        let capacity = capacity.max(1);
+        let (sender, receiver) = mpsc::channel(capacity);
+        let completed = Arc::new(AtomicU64::new(0));
+
+        let task = runtime.spawn(drain(
+            receiver,
+            producer,
+            compression,
+            callback,
+            capacity,
+            Arc::clone(&completed),
+        ));
+
+        let queue = Self {
+            sender,
+            capacity,
+            next_sequence: AtomicU64::new(1),
+            completed,
+        };
+
+        (queue, task)
+    }
+
+    /// Put the message into the queue without waiting and return its sequence number.
+    pub(super) fn try_submit(&self, message: NewDeviceMessage<'static>) -> Result<u64> {
+        // The sequence number is taken only after the slot is reserved so that every number is eventually completed
+        let Ok(permit) = self.sender.try_reserve() else {
+            return Err(SubmissionQueueFull {
+                capacity: self.capacity,
+            }
+            .into());
+        };
+
+        let sequence = self.next_sequence.fetch_add(1, Ordering::Relaxed);
+        permit.send(Submission { sequence, message });
+
+        Ok(sequence)
+    }
+
+    /// All the messages with this or a lower sequence number were either stored or failed to be stored.
+    pub(super) fn completed_sequence(&self) -> u64 {
+        self.completed.load(Ordering::Acquire)
+    }
+}
+
+async fn drain(
+    mut receiver: mpsc::Receiver<Submission>,
+    producer: Arc<Producer>,
+    compression: Option<Arc<CompressionPool>>,
+    callback: Option<CompletionCallback>,
+    capacity: usize,
+    completed: Arc<AtomicU64>,
+) {
+    let mut watermark = Watermark::default();
+    // At most as many completions wait for the callback as messages can wait in the queue
+    let batches = capacity.div_ceil(MAX_DRAINED_MESSAGES);
+    let dispatcher = callback.map(|callback| CompletionDispatcher::start(callback, batches));
+
+    // Finishes once the queue is dropped and all the submitted messages are processed
+    while let Some(first) = receiver.recv().await {
+        let mut submissions = vec![first];
+        while submissions.len() < MAX_DRAINED_MESSAGES {
+            match receiver.try_recv() {
+                Ok(submission) => submissions.push(submission),
+                Err(TryRecvError::Empty | TryRecvError::Disconnected) => break,
+            }
+        }
+
+        let (sequences, mut messages): (Vec<_>, Vec<_>) = submissions
+            .into_iter()
+            .map(|submission| (submission.sequence, submission.message))
+            .unzip();
+
+        let result = match &compression {
+            Some(compression) => compression.compress_messages(&mut messages).await,
+            None => Ok(()),
+        };
+        let result = match result {
+            Ok(()) => producer.add_many(messages).await,
+            Err(e) => Err(e),
+        };
+
+        // The messages that didn't fit into the queue limit are reported as failed whether they were dropped or rejected
+        let (stored, error) = match result {
+            Ok(stored) if stored == sequences.len() => (stored, None),
+            Ok(stored) => (stored, Some(Arc::new(Error::from(QueueFull)))),
+            Err(e) => {
+                log::error!(
+                    "Unable to store {} submitted device to cloud messages: {e:?}",
+                    sequences.len()
+                );
+                (0, Some(Arc::new(e)))
+            }
+        };
+
+        if let Some(dispatcher) = &dispatcher {
+            let completions = sequences
+                .iter()
+                .enumerate()
+                .map(|(index, &sequence)| (sequence, error.clone().filter(|_| index >= stored)))
+                .collect();
+            dispatcher.dispatch(completions).await;
+        }
+
+        completed.store(watermark.complete(sequences), Ordering::Release);
+    }
+
+    if let Some(dispatcher) = dispatcher {
+        dispatcher.finish().await;
+    }
+}
+
+type Completion = (u64, Option<Arc<Error>>);
+
+/// Calls the callback from a dedicated thread so that a slow callback doesn't block the workers of the runtime, which
+/// also send the messages. Once the callback falls behind by the given number of batches, the submitted messages stop
+/// being stored until it catches up, so the submission queue eventually fills up instead of the completions piling up
+/// in memory.
+struct CompletionDispatcher {
+    sender: mpsc::Sender<Vec<Completion>>,
+    thread: thread::JoinHandle<()>,
+}
+
+impl CompletionDispatcher {
+    fn start(callback: CompletionCallback, batches: usize) -> Self {
+        let (sender, mut receiver) = mpsc::channel::<Vec<Completion>>(batches.max(1));
+
+        let thread = thread::spawn(move || {
+            while let Some(completions) = receiver.blocking_recv() {
+                for (sequence, error) in completions {
+                    let result = catch_unwind(AssertUnwindSafe(|| {
+                        callback.0.enqueue_completed(sequence, error.as_deref());
+                    }));
+                    if result.is_err() {
+                        log::error!(
+                            "Enqueue completed callback panicked for the Message {sequence}"
+                        );
+                    }
+                }
+            }
+        });
+
+        Self { sender, thread }
+    }
+
+    // Waits without blocking the worker while the callback is behind
+    async fn dispatch(&self, completions: Vec<Completion>) {
+        if self.sender.send(completions).await.is_err() {
+            log::error!(
+                "Unable to report the completed Messages because the callback thread has stopped"
+            );
+        }
+    }
+
+    // Waits for all the dispatched completions to be reported
+    async fn finish(self) {
+        drop(self.sender);
+        let thread = self.thread;
+        let joined = tokio::task::spawn_blocking(move || thread.join().is_ok()).await;
+        if !joined.unwrap_or(false) {
+            log::error!("Failed joining the thread calling the enqueue completed callback");
+        }
+    }
+}
+
+/// Tracks the highest sequence number up to which all the messages were completed. The messages submitted from
+/// multiple threads at the same time might reach the queue in a different order than their sequence numbers.
+#[derive(Debug, Default)]
+struct Watermark {
+    completed: u64,
+    out_of_order: BTreeSet<u64>,
+}
+
+impl Watermark {
+    fn complete(&mut self, sequences: impl IntoIterator<Item = u64>) -> u64 {
+        self.out_of_order.extend(sequences);
+        while self.out_of_order.remove(&(self.completed + 1)) {
+            self.completed += 1;
+        }
+        self.completed
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Mutex;
+
+    use super::*;
+
+    #[derive(Default)]
+    struct RecordingCallback {
+        completed: Mutex<Vec<(u64, bool)>>,
+    }
+
+    impl EnqueueCompletedCallback for RecordingCallback {
+        fn enqueue_completed(&self, sequence: u64, error: Option<&Error>) {
+            self.completed
+                .lock()
+                .unwrap()
+                .push((sequence, error.is_some()));
+        }
+    }
+
+    #[tokio::test]
+    async fn dispatcher_reports_completions_before_finishing() {
+        let callback = Arc::new(RecordingCallback::default());
+        let dispatcher = CompletionDispatcher::start(CompletionCallback(callback.clone()), 1);
+
+        let error = Arc::new(Error::from(QueueFull));
+        dispatcher.dispatch(vec![(1, None), (2, None)]).await;
+        dispatcher
+            .dispatch(vec![(3, Some(error.clone())), (4, Some(error))])
+            .await;
+        dispatcher.finish().await;
+
+        assert_eq!(
+            *callback.completed.lock().unwrap(),
+            [(1, false), (2, false), (3, true), (4, true)]
+        );
+    }
+
+    struct BlockedCallback {
+        release: Mutex<std::sync::mpsc::Receiver<()>>,
+    }
+
+    impl EnqueueCompletedCallback for BlockedCallback {
+        fn enqueue_completed(&self, _sequence: u64, _error: Option<&Error>) {
+            _ = self.release.lock().unwrap().recv();
+        }
+    }
+
+    #[tokio::test]
+    async fn slow_callback_holds_back_dispatching() {
+        let (release, blocked) = std::sync::mpsc::channel();
+        let callback = BlockedCallback {
+            release: Mutex::new(blocked),
+        };
+        let dispatcher = CompletionDispatcher::start(CompletionCallback(Arc::new(callback)), 1);
+
+        // The first batch is taken by the blocked callback and the second one fills the channel
+        dispatcher.dispatch(vec![(1, None)]).await;
+        dispatcher.dispatch(vec![(2, None)]).await;
+        let third = dispatcher.dispatch(vec![(3, None)]);
+        tokio::pin!(third);
+        assert!(
+            tokio::time::timeout(std::time::Duration::from_millis(100), third.as_mut())
+                .await
+                .is_err()
+        );
+
+        for _ in 0..3 {
+            release.send(()).unwrap();
+        }
+        third.await;
+        dispatcher.finish().await;
+    }
+
+    #[test]
+    fn watermark_advances_in_order() {
+        let mut watermark = Watermark::default();
+        assert_eq!(watermark.complete([1, 2, 3]), 3);
+        assert_eq!(watermark.complete([4]), 4);
+    }
+
+    #[test]
+    fn watermark_waits_for_gaps() {
+        let mut watermark = Watermark::default();
+        assert_eq!(watermark.complete([2, 3]), 0);
+        assert_eq!(watermark.complete([5]), 0);
+        assert_eq!(watermark.complete([1]), 3);
+        assert_eq!(watermark.complete([4]), 5);
+        assert!(watermark.out_of_order.is_empty());
+    }
+}
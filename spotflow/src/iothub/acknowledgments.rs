@@ -0,0 +1,271 @@
+use std::{
+    collections::{BTreeSet, HashMap},
+    time::Instant,
+};
+
+use crate::persistence::Priority;
+
+/// A device-to-cloud message acknowledged by a PUBACK.
+#[derive(Debug)]
+pub(super) struct Acknowledged {
+    pub(super) id: i32,
+    pub(super) priority: Priority,
+    /// The time when the message was first sent.
+    pub(super) sent: Instant,
+    /// The ID until which the messages with the same priority can be removed, `None` if it didn't change.
+    pub(super) removable: Option<i32>,
+}
+
+/// A change of a device-to-cloud message whose content is uploaded as a file before the message is published.
+#[derive(Debug)]
+pub(super) enum Upload {
+    /// The upload started, the message is published once it finishes.
+    Started(Priority, i32),
+    /// The upload cannot succeed, so the message was removed without being published.
+    Skipped(Priority, i32),
+}
+
+/// Tracks the device-to-cloud messages waiting for their PUBACKs so that the acknowledged ones can be removed from
+/// the database in the order in which they were stored.
+#[derive(Debug, Default)]
+pub(super) struct D2cAcknowledgments {
+    // Packet IDs of the sent device-to-cloud messages mapped to their priorities, IDs in the database, and the times
+    // when they were first sent
+    pending: HashMap<u16, (Priority, i32, Instant)>,
+    // Each priority is sent and removed independently of the others
+    lanes: HashMap<Priority, Lane>,
+}
+
+#[derive(Debug, Default)]
+struct Lane {
+    // IDs of the pending device-to-cloud messages, including the ones whose files are being uploaded
+    pending: BTreeSet<i32>,
+    // IDs of the acknowledged device-to-cloud messages that cannot be removed yet because some older ones are pending
+    acknowledged: BTreeSet<i32>,
+}
+
+impl D2cAcknowledgments {
+    pub(super) fn len(&self) -> usize {
+        self.pending.len()
+    }
+
+    /// Whether the message with the packet ID is waiting for its PUBACK, which is the case of the messages resent
+    /// after a reconnect because they keep their packet IDs.
+    pub(super) fn is_pending(&self, pkid: u16) -> bool {
+        self.pending.contains_key(&pkid)
+    }
+
+    pub(super) fn sent(&mut self, pkid: u16, priority: Priority, id: i32) {
+        self.pending.insert(pkid, (priority, id, Instant::now()));
+        self.lanes.entry(priority).or_default().pending.insert(id);
+    }
+
+    /// Record the upload of a message so that the following messages with the same priority aren't removed before it,
+    /// which keeps it stored if the upload fails or the client stops. Returns the ID until which the messages with the
+    /// same priority can be removed if a skipped upload no longer holds them back.
+    pub(super) fn upload(&mut self, upload: Upload) -> Option<(Priority, i32)> {
+        match upload {
+            Upload::Started(priority, id) => {
+                self.lanes.entry(priority).or_default().pending.insert(id);
+                None
+            }
+            Upload::Skipped(priority, id) => {
+                let lane = self.lanes.entry(priority).or_default();
+                lane.pending.remove(&id);
+                lane.acknowledged.insert(id);
+                lane.removable().map(|removable| (priority, removable))
+            }
+        }
+    }
+
+    /// Record the PUBACK of the packet ID, `None` if it doesn't belong to a device-to-cloud message. The packet ID can
+    /// be reused by the following messages afterwards.
+    pub(super) fn acknowledge(&mut self, pkid: u16) -> Option<Acknowledged> {
+        let (priority, id, sent) = self.pending.remove(&pkid)?;
+
+        let lane = self.lanes.entry(priority).or_default();
+        lane.pending.remove(&id);
+        lane.acknowledged.insert(id);
+
+        Some(Acknowledged {
+            id,
+            priority,
+            sent,
+            removable: lane.removable(),
+        })
+    }
+}
+
+impl Lane {
+    // Acknowledgments can arrive out of order and the messages with higher priority overtake the older ones with lower
+    // priority, so only the messages older than all the pending ones with the same priority can be removed
+    fn removable(&mut self) -> Option<i32> {
+        let removable = match self.pending.first() {
+            Some(&oldest_pending) => self.acknowledged.range(..oldest_pending).next_back(),
+            None => self.acknowledged.last(),
+        }
+        .copied();
+
+        if let Some(removable) = removable {
+            self.acknowledged = self.acknowledged.split_off(&(removable + 1));
+        }
+
+        removable
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{D2cAcknowledgments, Upload};
+    use crate::persistence::Priority;
+
+    fn removable(acknowledgments: &mut D2cAcknowledgments, pkid: u16) -> Option<i32> {
+        acknowledgments
+            .acknowledge(pkid)
+            .expect("The packet ID must be pending")
+            .removable
+    }
+
+    #[test]
+    fn out_of_order_pubacks_remove_only_older_messages() {
+        let mut acknowledgments = D2cAcknowledgments::default();
+        for (pkid, id) in [(1, 10), (2, 11), (3, 12), (4, 13)] {
+            acknowledgments.sent(pkid, Priority::Normal, id);
+        }
+
+        assert_eq!(removable(&mut acknowledgments, 3), None);
+        assert_eq!(removable(&mut acknowledgments, 1), Some(10));
+        assert_eq!(removable(&mut acknowledgments, 4), None);
+        assert_eq!(removable(&mut acknowledgments, 2), Some(13));
+        assert_eq!(acknowledgments.len(), 0);
+    }
+
+    #[test]
+    fn acknowledgments_never_advance_other_priorities() {
+        let mut acknowledgments = D2cAcknowledgments::default();
+        acknowledgments.sent(1, Priority::Normal, 1);
+        acknowledgments.sent(2, Priority::High, 2);
+        acknowledgments.sent(3, Priority::Normal, 3);
+        acknowledgments.sent(4, Priority::Low, 4);
+        acknowledgments.sent(5, Priority::High, 5);
+
+        // The newer High messages are removed although the older Normal one is pending
+        let acknowledged = acknowledgments.acknowledge(5).unwrap();
+        assert_eq!(acknowledged.priority, Priority::High);
+        assert_eq!(acknowledged.removable, None);
+        let acknowledged = acknowledgments.acknowledge(2).unwrap();
+        assert_eq!(acknowledged.priority, Priority::High);
+        assert_eq!(acknowledged.removable, Some(5));
+
+        // Only the Normal lane is held back by its pending message, the Low message newer than it is still removed
+        assert_eq!(removable(&mut acknowledgments, 3), None);
+        let acknowledged = acknowledgments.acknowledge(4).unwrap();
+        assert_eq!(acknowledged.priority, Priority::Low);
+        assert_eq!(acknowledged.removable, Some(4));
+
+        let acknowledged = acknowledgments.acknowledge(1).unwrap();
+        assert_eq!(acknowledged.priority, Priority::Normal);
+        assert_eq!(acknowledged.removable, Some(3));
+    }
+
+    #[test]
+    fn unknown_packet_ids_are_ignored() {
+        let mut acknowledgments = D2cAcknowledgments::default();
+        acknowledgments.sent(1, Priority::Normal, 10);
+
+        assert!(acknowledgments.acknowledge(2).is_none());
+        assert_eq!(removable(&mut acknowledgments, 1), Some(10));
+        // A duplicate PUBACK doesn't remove anything again
+        assert!(acknowledgments.acknowledge(1).is_none());
+    }
+
+    #[test]
+    fn packet_ids_are_reused_after_wrap_around() {
+        let mut acknowledgments = D2cAcknowledgments::default();
+        let mut id = 0;
+        for pkid in 1..=u16::MAX {
+            id += 1;
+            acknowledgments.sent(pkid, Priority::Normal, id);
+            if pkid > 2 {
+                let acknowledged = pkid - 2;
+                let expected = Some(i32::from(acknowledged));
+                assert_eq!(removable(&mut acknowledgments, acknowledged), expected);
+            }
+        }
+
+        // The packet IDs start from 1 again while the last messages are still pending
+        for pkid in 1..=2 {
+            id += 1;
+            assert!(!acknowledgments.is_pending(pkid));
+            acknowledgments.sent(pkid, Priority::Normal, id);
+        }
+
+        // The reused packet IDs belong to the newer messages, which cannot be removed before the older ones
+        assert_eq!(removable(&mut acknowledgments, 2), None);
+        assert_eq!(removable(&mut acknowledgments, 1), None);
+        assert_eq!(removable(&mut acknowledgments, u16::MAX), None);
+        assert_eq!(removable(&mut acknowledgments, u16::MAX - 1), Some(id));
+        assert_eq!(acknowledgments.len(), 0);
+    }
+
+    #[test]
+    fn pending_messages_survive_reconnect() {
+        let mut acknowledgments = D2cAcknowledgments::default();
+        for (pkid, id) in [(1, 10), (2, 11), (3, 12)] {
+            acknowledgments.sent(pkid, Priority::Normal, id);
+        }
+        assert_eq!(removable(&mut acknowledgments, 1), Some(10));
+
+        // The messages resent after the reconnect keep their packet IDs, so they're not tracked again
+        for pkid in [2, 3] {
+            assert!(acknowledgments.is_pending(pkid));
+        }
+        assert!(!acknowledgments.is_pending(1));
+        acknowledgments.sent(1, Priority::Normal, 13);
+        assert_eq!(acknowledgments.len(), 3);
+
+        assert_eq!(removable(&mut acknowledgments, 3), None);
+        assert_eq!(removable(&mut acknowledgments, 2), Some(12));
+        assert_eq!(removable(&mut acknowledgments, 1), Some(13));
+    }
+
+    #[test]
+    fn uploading_message_holds_back_later_acknowledgments() {
+        let mut acknowledgments = D2cAcknowledgments::default();
+        acknowledgments.sent(1, Priority::Normal, 10);
+        assert_eq!(
+            acknowledgments.upload(Upload::Started(Priority::Normal, 11)),
+            None
+        );
+        acknowledgments.sent(2, Priority::Normal, 12);
+        acknowledgments.sent(3, Priority::High, 13);
+
+        // The PUBACKs arrive while the file of message 11 is still being uploaded
+        assert_eq!(removable(&mut acknowledgments, 2), None);
+        assert_eq!(removable(&mut acknowledgments, 1), Some(10));
+        assert_eq!(removable(&mut acknowledgments, 3), Some(13));
+
+        // The message with the link is published once the upload finishes
+        acknowledgments.sent(4, Priority::Normal, 11);
+        assert_eq!(removable(&mut acknowledgments, 4), Some(12));
+        assert_eq!(acknowledgments.len(), 0);
+    }
+
+    #[test]
+    fn skipped_upload_releases_later_acknowledgments() {
+        let mut acknowledgments = D2cAcknowledgments::default();
+        acknowledgments.upload(Upload::Started(Priority::Normal, 10));
+        acknowledgments.upload(Upload::Started(Priority::Normal, 11));
+        acknowledgments.sent(1, Priority::Normal, 12);
+        assert_eq!(removable(&mut acknowledgments, 1), None);
+
+        assert_eq!(
+            acknowledgments.upload(Upload::Skipped(Priority::Normal, 11)),
+            None
+        );
+        assert_eq!(
+            acknowledgments.upload(Upload::Skipped(Priority::Normal, 10)),
+            Some((Priority::Normal, 12))
+        );
+    }
+}
@@ -1,8 +1,4 @@
-use std::{
-    collections::HashSet,
-    sync::Arc,
-    time::{Duration, Instant},
-};
+use std::{collections::HashMap, sync::Arc, time::Instant};
 
 use anyhow::{anyhow, Result};
 use rumqttc::{
@@ -11,13 +7,17 @@ use rumqttc::{
 };
 use tokio::{
     select,
-    sync::{broadcast, watch},
+    sync::{broadcast, mpsc, watch},
+    task::JoinHandle,
 };
 use tokio_util::sync::CancellationToken;
 
+use super::acknowledgments::{D2cAcknowledgments, Upload};
+use super::reconnect::{Backoff, ReconnectPolicy};
 use super::token_handler::{RegistrationCommand, RegistrationCommandSender, RegistrationWatch};
 use super::topics;
-use crate::persistence::Acknowledger;
+use crate::metrics::MetricsRegistry;
+use crate::persistence::{Acknowledger, Priority};
 
 use super::{
     handlers::{AsyncHandler, Handler},
@@ -48,11 +48,21 @@ impl SubscriptionTask {
 pub(super) struct EventLoop {
     device_id: String,
     state: watch::Sender<State>,
-    pending_d2c: HashSet<u16>,
+    pending_d2c: D2cAcknowledgments,
+    // Priorities and IDs of the device-to-cloud messages in the order in which they're passed to rumqttc
+    published_d2c: mpsc::UnboundedReceiver<(Priority, i32)>,
+    // Device-to-cloud messages whose files are uploaded before they're published
+    uploads_d2c: mpsc::UnboundedReceiver<Upload>,
+    removable_d2c: Option<watch::Sender<HashMap<Priority, i32>>>,
     suback_sender: broadcast::Sender<usize>,
     registration_watch: RegistrationWatch,
     registration_command_sender: RegistrationCommandSender,
-    acknowledger: Acknowledger,
+    acknowledger: Option<Acknowledger>,
+    backoff: Backoff,
+    metrics: Arc<MetricsRegistry>,
+    // Set when an established connection is lost, `None` while connected or before the first connection
+    disconnected_since: Option<Instant>,
+    connected: bool,
     cancellation: CancellationToken,
     rumqttc_eventloop: rumqttc::EventLoop,
     publish_handlers: Vec<Box<dyn Handler + Send + Sync>>,
@@ -65,6 +75,10 @@ impl EventLoop {
         registration_watch: RegistrationWatch,
         registration_command_sender: RegistrationCommandSender,
         acknowledger: Acknowledger,
+        published_d2c: mpsc::UnboundedReceiver<(Priority, i32)>,
+        uploads_d2c: mpsc::UnboundedReceiver<Upload>,
+        reconnect_policy: ReconnectPolicy,
+        metrics: Arc<MetricsRegistry>,
         cancellation: CancellationToken,
     ) -> Self {
         let (suback_sender, _) = broadcast::channel(10);
@@ -84,11 +98,18 @@ impl EventLoop {
             state: state_sender,
             suback_sender,
 
-            pending_d2c: HashSet::new(),
+            pending_d2c: D2cAcknowledgments::default(),
+            published_d2c,
+            uploads_d2c,
+            removable_d2c: None,
             publish_handlers: Vec::new(),
             async_publish_handlers: Vec::new(),
 
-            acknowledger,
+            acknowledger: Some(acknowledger),
+            backoff: Backoff::new(reconnect_policy),
+            metrics,
+            disconnected_since: None,
+            connected: false,
             rumqttc_eventloop,
             registration_watch,
             registration_command_sender,
@@ -139,6 +160,8 @@ impl EventLoop {
     }
 
     pub(super) async fn run(&mut self) {
+        let remover_task = self.start_remover();
+
         loop {
             select! {
                 () = self.cancellation.cancelled() => {
@@ -146,8 +169,25 @@ impl EventLoop {
                     break;
                 },
                 notification = self.rumqttc_eventloop.poll() => self.process_notification(notification).await,
+                Some(upload) = self.uploads_d2c.recv() => self.process_upload(upload),
             }
         }
+
+        // Let the remover delete the messages acknowledged last
+        self.removable_d2c = None;
+        if let Some(remover_task) = remover_task {
+            _ = remover_task.await;
+        }
+    }
+
+    fn start_remover(&mut self) -> Option<JoinHandle<()>> {
+        let acknowledger = self.acknowledger.take()?;
+        let (removable_sender, removable_receiver) = watch::channel(HashMap::new());
+        self.removable_d2c = Some(removable_sender);
+        Some(tokio::spawn(remove_acknowledged(
+            acknowledger,
+            removable_receiver,
+        )))
     }
 
     async fn process_notification(&mut self, notification: Result<Event, ConnectionError>) {
@@ -166,6 +206,11 @@ impl EventLoop {
                     log::info!("Shutting down during errored state because of cancellation.");
                     return;
                 }
+                self.metrics.reconnect.record_failed_attempt();
+                if self.connected {
+                    self.connected = false;
+                    self.disconnected_since = Some(Instant::now());
+                }
                 // This panics if the TokenHandler has already failed
                 if self
                     .registration_watch
@@ -206,9 +251,12 @@ impl EventLoop {
                             ),
                         }
                     }
-                    log::debug!("5 second backoff for eventloop to self-heal.");
-                    // We will wait and hope everything will sort itself out
-                    tokio::time::sleep(Duration::from_secs(5)).await;
+                    let delay = self.backoff.next_delay();
+                    log::debug!("Reconnecting in {delay:?}.");
+                    select! {
+                        () = self.cancellation.cancelled() => {}
+                        () = tokio::time::sleep(delay) => {}
+                    }
                 }
             }
         }
@@ -241,13 +289,16 @@ impl EventLoop {
                 );
             }
             Packet::PubAck(ack) => {
-                if self.pending_d2c.contains(&ack.pkid) {
-                    // We are going to assume that IoT Hub confirms messages in order.
-                    // This seems to not be a hard requirement by MQTT but seems to be safe to do.
-                    // We are sending messages in order they were saved in SQLite and we depend on AUTOINCREMEMNT.
-                    log::trace!("Got acknowledgment for device-to-cloud message");
-                    if let Err(e) = self.acknowledger.remove_oldest().await {
-                        log::error!("Unable to remove acknowledged device-to-cloud message. This or subsequent messages may be duplicated and received at a later time. Inner: {}", e);
+                if let Some(acknowledged) = self.pending_d2c.acknowledge(ack.pkid) {
+                    log::trace!(
+                        "Got acknowledgment for device-to-cloud message {}",
+                        acknowledged.id
+                    );
+                    self.metrics
+                        .puback_round_trip
+                        .record_since(acknowledged.sent);
+                    if let Some(removable) = acknowledged.removable {
+                        self.remove_d2c_until(acknowledged.priority, removable);
                     }
                 }
                 // Else we got PUBACK for stuff like reported properties update -- we can ignore these here
@@ -275,13 +326,43 @@ impl EventLoop {
                 unreachable!("Only the client can subscribe to topics")
             }
             Packet::Disconnect => unreachable!("Only the client sends disconnect"),
-            // Packet::ConnAck(_) => {}, // Ignore ConnAck; rumqttc will handle everything for us
+            Packet::ConnAck(_) => self.on_connected(),
             // Packet::PingReq => {},
             // Packet::PingResp => {},
             _ => {}
         }
     }
 
+    fn on_connected(&mut self) {
+        self.connected = true;
+        self.backoff.reset();
+
+        if let Some(disconnected_since) = self.disconnected_since.take() {
+            let outage = disconnected_since.elapsed();
+            self.metrics.reconnect.record_reconnect(outage);
+            // rumqttc keeps the unacknowledged messages and resends them with their packet IDs right after connecting,
+            // so they stay tracked in `pending_d2c` and the stored messages don't need to be read again
+            log::debug!(
+                "Reconnected after {outage:?}, resuming {} unacknowledged device-to-cloud messages",
+                self.pending_d2c.len()
+            );
+        }
+    }
+
+    fn process_upload(&mut self, upload: Upload) {
+        if let Some((priority, removable)) = self.pending_d2c.upload(upload) {
+            self.remove_d2c_until(priority, removable);
+        }
+    }
+
+    fn remove_d2c_until(&self, priority: Priority, id: i32) {
+        if let Some(removable_d2c) = &self.removable_d2c {
+            let mut removable_ids = removable_d2c.borrow().clone();
+            removable_ids.insert(priority, id);
+            removable_d2c.send_replace(removable_ids);
+        }
+    }
+
     fn process_outgoing_message(&mut self, packet: Outgoing) {
         log::trace!("Sending = {:?}", packet);
         match packet {
@@ -291,9 +372,23 @@ impl EventLoop {
                 log::debug!("Stopping MQTT because of disconnect packet");
                 self.cancellation.cancel();
             }
-            Outgoing::Publish(publish, topic) => {
-                if topic.starts_with(&topics::publish_topic(&self.device_id)) {
-                    self.pending_d2c.insert(publish);
+            Outgoing::Publish(pkid, topic) => {
+                // Messages resent after a reconnect keep their packet IDs so they're already tracked
+                if topic.starts_with(&topics::publish_topic(&self.device_id))
+                    && !self.pending_d2c.is_pending(pkid)
+                {
+                    // The uploads started before the message was published must be tracked before its PUBACK arrives
+                    while let Ok(upload) = self.uploads_d2c.try_recv() {
+                        self.process_upload(upload);
+                    }
+                    match self.published_d2c.try_recv() {
+                        Ok((priority, id)) => {
+                            self.pending_d2c.sent(pkid, priority, id);
+                        }
+                        Err(_) => log::warn!(
+                            "Sending device-to-cloud message with packet ID {pkid} that was not published by the SDK"
+                        ),
+                    }
                 }
                 // Else this is request-response type of exchange such as reported properties update
                 // We do not care about packet IDs or anything like that
@@ -314,3 +409,38 @@ impl EventLoop {
         }
     }
 }
+
+// Only the latest removable ID of each priority is kept in the watch, so all the messages acknowledged while the
+// previous ones were being removed are removed by a single statement per priority
+async fn remove_acknowledged(
+    acknowledger: Acknowledger,
+    mut removable_d2c: watch::Receiver<HashMap<Priority, i32>>,
+) {
+    let mut removed = HashMap::new();
+    while removable_d2c.changed().await.is_ok() {
+        let removable = removable_d2c.borrow_and_update().clone();
+        remove_newly_removable(&acknowledger, &removable, &mut removed).await;
+    }
+
+    let removable = removable_d2c.borrow().clone();
+    remove_newly_removable(&acknowledger, &removable, &mut removed).await;
+}
+
+async fn remove_newly_removable(
+    acknowledger: &Acknowledger,
+    removable: &HashMap<Priority, i32>,
+    removed: &mut HashMap<Priority, i32>,
+) {
+    for (&priority, &id) in removable {
+        if removed.get(&priority).map_or(true, |&removed| id > removed) {
+            remove_until(acknowledger, priority, id).await;
+            removed.insert(priority, id);
+        }
+    }
+}
+
+async fn remove_until(acknowledger: &Acknowledger, priority: Priority, id: i32) {
+    if let Err(e) = acknowledger.remove_until(priority, id).await {
+        log::error!("Unable to remove acknowledged device-to-cloud messages. They may be duplicated and received at a later time. Inner: {}", e);
+    }
+}
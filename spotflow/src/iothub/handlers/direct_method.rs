@@ -1,73 +1,184 @@
 use std::{
     panic::{catch_unwind, RefUnwindSafe},
-    sync::mpsc::{self, TrySendError},
+    sync::{
+        mpsc::{self, TrySendError},
+        Arc, Mutex,
+    },
     thread::{self, JoinHandle},
+    time::Duration,
 };
 
 use rumqttc::{AsyncClient, Publish, QoS};
+use tokio::{runtime::Handle, sync::oneshot};
 
 use super::super::query;
 use super::super::topics;
 
 use super::Handler;
 
+/// The default number of direct method calls that are handled at the same time.
+pub(crate) const DEFAULT_METHOD_CONCURRENCY: usize = 1;
+
+// The number of direct method calls that can wait for a free worker before new ones are ignored
+const MAX_WAITING_INVOCATIONS: usize = 50;
+
+// The status reported to the caller when the handler doesn't finish in time
+const TIMEOUT_STATUS: i32 = 504;
+
+/// The options of handling the direct method calls.
+#[derive(Clone, Copy, Debug)]
+pub(crate) struct MethodOptions {
+    /// The maximum number of direct method calls handled at the same time, each of them on a separate thread.
+    pub(crate) concurrency: usize,
+    /// How long the handler can run before the call is answered with a timeout, `None` waits indefinitely.
+    pub(crate) timeout: Option<Duration>,
+}
+
+impl Default for MethodOptions {
+    fn default() -> Self {
+        Self {
+            concurrency: DEFAULT_METHOD_CONCURRENCY,
+            timeout: None,
+        }
+    }
+}
+
 struct Invocation {
     publish: Publish,
     method_name: String,
-    request_id: String,
+    response: oneshot::Sender<(i32, Vec<u8>)>,
 }
 
 pub(crate) struct DirectMethodHandler {
+    client: AsyncClient,
+    runtime: Handle,
+    timeout: Option<Duration>,
     sender: Option<mpsc::SyncSender<Invocation>>,
-    thread: Option<JoinHandle<()>>,
+    threads: Vec<JoinHandle<()>>,
 }
 
 impl DirectMethodHandler {
-    pub(crate) fn new<F>(client: AsyncClient, method_handler: F) -> Self
+    pub(crate) fn new<F>(
+        client: AsyncClient,
+        runtime: Handle,
+        method_handler: F,
+        options: MethodOptions,
+    ) -> Self
     where
-        F: Fn(String, &[u8]) -> (i32, Vec<u8>) + Send + RefUnwindSafe + 'static,
+        F: Fn(String, &[u8]) -> (i32, Vec<u8>) + Send + Sync + RefUnwindSafe + 'static,
     {
-        let (sender, receiver) = mpsc::sync_channel::<Invocation>(50);
-
-        log::debug!("Starting direct method processing thread");
-        // This is thread and not a simple Tokio task because the handler could potentially block
-        // The thread ends when the channel sender is dropped (and all methods are done).
-        let thread = thread::spawn({
-            move || {
-                while let Ok(msg) = receiver.recv() {
-                    let result = catch_unwind(|| {
-                        // We ignore the error becasue in the worst case we just do not send the ack.
-                        // In that case the message will be redelivered again anyway because AtLeastOnce QoS
-                        // We want to acknowledge first and then run and return result. These are not retryable.
-                        _ = client.try_ack(&msg.publish);
-                        method_handler(msg.method_name, msg.publish.payload.as_ref())
-                    });
-                    match result {
-                        Err(cause) => {
-                            if let Some(s) = cause.downcast_ref::<&'static str>() {
-                                log::error!("Direct method processing failed with panic: {}", s);
-                            }
-                            if let Some(s) = cause.downcast_ref::<String>() {
-                                log::error!(
-                                    "Direct method message processing failed with panic: {}",
-                                    s
-                                );
-                            }
-                        }
-                        Ok((status, payload)) => {
-                            let topic = topics::response_topic(status, &msg.request_id);
-                            _ = client.try_publish(topic, QoS::AtLeastOnce, false, payload);
-                        }
+        let (sender, receiver) = mpsc::sync_channel::<Invocation>(MAX_WAITING_INVOCATIONS);
+        let receiver = Arc::new(Mutex::new(receiver));
+        let method_handler = Arc::new(method_handler);
+
+        let concurrency = options.concurrency.max(1);
+        log::debug!("Starting {concurrency} direct method processing threads");
+        // These are threads and not simple Tokio tasks because the handler could potentially block.
+        // The threads end when the channel sender is dropped (and all methods are done).
+        let threads = (0..concurrency)
+            .map(|_| {
+                let client = client.clone();
+                let receiver = Arc::clone(&receiver);
+                let method_handler = Arc::clone(&method_handler);
+                thread::spawn(move || {
+                    loop {
+                        // The lock is released before the handler runs so that the other threads can take the next calls
+                        let received = receiver
+                            .lock()
+                            .expect("Direct method receiver lock is poisoned")
+                            .recv();
+                        let Ok(msg) = received else {
+                            break;
+                        };
+                        invoke(&client, &*method_handler, msg);
                     }
-                }
 
-                log::debug!("Direct method handler is stopping.");
-            }
-        });
+                    log::debug!("Direct method handler is stopping.");
+                })
+            })
+            .collect();
 
         DirectMethodHandler {
+            client,
+            runtime,
+            timeout: options.timeout,
             sender: Some(sender),
-            thread: Some(thread),
+            threads,
+        }
+    }
+
+    /// Publish the response once the handler returns, or a timeout response if it runs too long. The response is
+    /// published by a task so that neither the event loop nor the handler threads wait for it.
+    fn respond(
+        &self,
+        method_name: String,
+        request_id: String,
+        response: oneshot::Receiver<(i32, Vec<u8>)>,
+    ) {
+        let client = self.client.clone();
+        let timeout = self.timeout;
+        self.runtime.spawn(async move {
+            let result = match timeout {
+                None => response.await,
+                Some(timeout) => match tokio::time::timeout(timeout, response).await {
+                    Ok(result) => result,
+                    Err(_) => {
+                        log::warn!("Direct method {method_name} with request ID {request_id} timed out after {timeout:?}.");
+                        let payload = format!(
+                            r#"{{"error":"The direct method didn't finish in {} ms."}}"#,
+                            timeout.as_millis()
+                        );
+                        Ok((TIMEOUT_STATUS, payload.into_bytes()))
+                    }
+                },
+            };
+
+            // The sender is dropped without a response only if the handler panicked, that was already logged
+            let Ok((status, payload)) = result else {
+                return;
+            };
+
+            let topic = topics::response_topic(status, &request_id);
+            if let Err(e) = client
+                .publish(topic, QoS::AtLeastOnce, false, payload)
+                .await
+            {
+                log::warn!("Unable to publish the response to direct method {method_name} with request ID {request_id}: {e}");
+            }
+        });
+    }
+}
+
+fn invoke<F>(client: &AsyncClient, method_handler: &F, msg: Invocation)
+where
+    F: Fn(String, &[u8]) -> (i32, Vec<u8>) + RefUnwindSafe,
+{
+    // We ignore the error becasue in the worst case we just do not send the ack.
+    // In that case the message will be redelivered again anyway because AtLeastOnce QoS
+    // We want to acknowledge first and then run and return result. These are not retryable.
+    _ = client.try_ack(&msg.publish);
+
+    if msg.response.is_closed() {
+        log::debug!(
+            "Skipping direct method {} because it has already timed out.",
+            msg.method_name
+        );
+        return;
+    }
+
+    let result = catch_unwind(|| method_handler(msg.method_name, msg.publish.payload.as_ref()));
+    match result {
+        Err(cause) => {
+            if let Some(s) = cause.downcast_ref::<&'static str>() {
+                log::error!("Direct method processing failed with panic: {}", s);
+            }
+            if let Some(s) = cause.downcast_ref::<String>() {
+                log::error!("Direct method message processing failed with panic: {}", s);
+            }
+        }
+        Ok(response) => {
+            // The caller isn't waiting for the response anymore if it has timed out
+            _ = msg.response.send(response);
         }
     }
 }
@@ -116,47 +227,48 @@ impl Handler for DirectMethodHandler {
 
         log::debug!("Invoking method named {method_name}");
 
-        match self
+        let (response_sender, response_receiver) = oneshot::channel();
+        let result = self
             .sender
             .as_mut()
             .expect("The sender is wrapped in Option only to be able to drop it explicitly")
             .try_send(Invocation {
                 publish: publish.clone(),
                 method_name: method_name.to_owned(),
-                request_id: request_id.to_owned(),
-            }) {
+                response: response_sender,
+            });
+        match result {
                 Err(TrySendError::Full(invocation)) =>
-                    log::warn!("Received unexpectedly many direct method calls before they could be processed. Ignoring call to {} with request ID {}.", invocation.method_name, invocation.request_id),
+                    log::warn!("Received unexpectedly many direct method calls before they could be processed. Ignoring call to {} with request ID {}.", invocation.method_name, request_id),
                 Err(TrySendError::Disconnected(invocation)) =>
-                    log::error!("Received direct method call after processor shut down. Ignoring call to {} with request ID {}.", invocation.method_name, invocation.request_id),
-                Ok(()) => {},
+                    log::error!("Received direct method call after processor shut down. Ignoring call to {} with request ID {}.", invocation.method_name, request_id),
+                Ok(()) => self.respond(method_name.to_owned(), request_id.to_owned(), response_receiver),
         }
     }
 }
 
 impl Drop for DirectMethodHandler {
     fn drop(&mut self) {
-        // We need to drop the sender so that the thread stops waiting for more method calls
+        // We need to drop the sender so that the threads stop waiting for more method calls
         drop(self.sender.take());
-        join(&mut self.thread);
+        for handle in self.threads.drain(..) {
+            join(handle);
+        }
     }
 }
 
-fn join<T>(handle: &mut Option<JoinHandle<T>>) {
-    let handle = handle.take();
-    if let Some(handle) = handle {
-        let thread = handle.thread();
-        let id = thread.id();
-        let name = thread.name().map(ToString::to_string).unwrap_or_default();
-        log::trace!("Joining thread {:?} named `{}`", id, name);
-        if let Err(cause) = handle.join() {
-            if let Some(s) = cause.downcast_ref::<&'static str>() {
-                log::error!("Thread `{}` failed with panic: {}", name, s,);
-            } else if let Some(s) = cause.downcast_ref::<String>() {
-                log::error!("Thread `{}` failed with panic: {}", name, s,);
-            } else {
-                log::error!("Thread `{}` failed with panic that is not a string.", name,);
-            }
+fn join<T>(handle: JoinHandle<T>) {
+    let thread = handle.thread();
+    let id = thread.id();
+    let name = thread.name().map(ToString::to_string).unwrap_or_default();
+    log::trace!("Joining thread {:?} named `{}`", id, name);
+    if let Err(cause) = handle.join() {
+        if let Some(s) = cause.downcast_ref::<&'static str>() {
+            log::error!("Thread `{}` failed with panic: {}", name, s,);
+        } else if let Some(s) = cause.downcast_ref::<String>() {
+            log::error!("Thread `{}` failed with panic: {}", name, s,);
+        } else {
+            log::error!("Thread `{}` failed with panic that is not a string.", name,);
         }
     }
 }
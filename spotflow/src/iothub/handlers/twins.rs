@@ -12,11 +12,17 @@ use tokio::{
 use tokio_util::sync::CancellationToken;
 
 use super::super::query;
-use super::super::{json_diff, State};
-use super::super::{topics, twins::IotHubTwinsClient};
+use super::super::State;
+use super::super::{
+    topics,
+    twins::{reported_properties_requests, single_reported_properties_patch, IotHubTwinsClient},
+};
 use super::AsyncHandler;
 use crate::persistence::sqlite_channel;
-use crate::persistence::twins::{ReportedPropertiesUpdate, ReportedPropertiesUpdateType, Twins};
+use crate::persistence::twins::{ReportedPropertiesUpdate, Twins};
+
+// The updates of Reported Properties that are waiting to be sent are merged into a single patch of at most this many
+const MAX_COALESCED_UPDATES: usize = 32;
 
 pub(crate) struct TwinsHandler {
     response_channel: mpsc::Sender<Publish>,
@@ -63,7 +69,7 @@ impl AsyncHandler for TwinsHandler {
 
 #[derive(Debug)]
 enum ResponseType {
-    PatchReportedProperties(ReportedPropertiesUpdate),
+    PatchReportedProperties(Vec<ReportedPropertiesUpdate>),
     GetTwins,
 }
 
@@ -130,8 +136,8 @@ impl TwinsMiddleware {
                 Some(()) = self.get_twins.recv() => {
                     self.get_twins().await.context("Receiving complete twins failed")
                 }
-                Ok(msg) = self.reported_properties_updates.recv(&None) => {
-                    self.update_reported_properties(msg).await.context("Updating reported properties failed")
+                Ok(updates) = self.reported_properties_updates.recv_batch(MAX_COALESCED_UPDATES, &None) => {
+                    self.update_reported_properties(updates).await.context("Updating reported properties failed")
                 }
                 Some(update) = self.desired_properties_updates.recv() => {
                     self.update_desired_properties_handler(&update).await.context("Updating desired properties failed")
@@ -161,25 +167,38 @@ impl TwinsMiddleware {
         Ok(())
     }
 
-    async fn update_reported_properties(&self, update: ReportedPropertiesUpdate) -> Result<()> {
-        let patch = match update.update_type {
-            ReportedPropertiesUpdateType::Patch => update.patch.to_string(),
-            ReportedPropertiesUpdateType::Full => {
-                let current = self
-                    .twins
-                    .get_reported_properties()
-                    .await
-                    .unwrap_or_else(|| String::from("{}"));
-                json_diff::diff(&current, &update.patch.to_string())?
-            }
+    async fn update_reported_properties(
+        &self,
+        updates: Vec<ReportedPropertiesUpdate>,
+    ) -> Result<()> {
+        // The current properties are copied only if they are needed to merge the updates
+        let current = match single_reported_properties_patch(&updates) {
+            Some(_) => None,
+            None => self.twins.get_reported_properties_value().await,
         };
+
+        for (patch, updates) in reported_properties_requests(current, updates)? {
+            self.patch_reported_properties(&patch.to_string(), updates).await?;
+        }
+
+        Ok(())
+    }
+
+    async fn patch_reported_properties(
+        &self,
+        patch: &str,
+        updates: Vec<ReportedPropertiesUpdate>,
+    ) -> Result<()> {
         let rid = uuid::Uuid::new_v4().to_string();
+        log::debug!(
+            "Updating reported properties with {} pending updates with request ID {rid}",
+            updates.len()
+        );
         self.requests
             .lock()
             .await
-            .insert(rid.clone(), ResponseType::PatchReportedProperties(update));
+            .insert(rid.clone(), ResponseType::PatchReportedProperties(updates));
 
-        log::debug!("Updating reported properties with request ID {rid}");
         self.mqtt_client
             .try_publish(
                 topics::patch_reported_properties(&rid),
@@ -189,7 +208,7 @@ impl TwinsMiddleware {
             )
             .context("Unable to enqueue publish to update reported properties")?;
 
-        if let Err(e) = self.twins.update_reported_properties(&patch).await {
+        if let Err(e) = self.twins.update_reported_properties(patch).await {
             log::warn!("There was an error during updating local copy of reported properties. Requesting full copy. Original error: {:?}", e);
             self.get_twins().await.context("Error during requesting full twin update because of failed local reported properties update")?;
         }
@@ -314,9 +333,9 @@ impl TwinsMiddleware {
                 .set_twins(publish.payload.as_ref())
                 .await
                 .context("Failed setting twins")?,
-            Some(ResponseType::PatchReportedProperties(update)) => self
+            Some(ResponseType::PatchReportedProperties(updates)) => self
                 .reported_properties_updates
-                .ack(&update)
+                .ack_many(&updates)
                 .await
                 .context("Failed removing reported properties update request")?,
         }
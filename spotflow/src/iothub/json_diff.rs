@@ -6,11 +6,18 @@ pub(crate) fn diff(original: &str, desired: &str) -> Result<String> {
         .context("Unable to deserialize original object")?;
     let desired = serde_json::from_str::<serde_json::Value>(desired)
         .context("Unable to deserialize desired object")?;
-    let patch = diff_objects(&original, &desired)?.unwrap_or_else(|| json!({}));
+    let patch = diff_values(&original, &desired)?;
 
     serde_json::to_string(&patch).context("Unable to serialize resulting patch")
 }
 
+pub(crate) fn diff_values(
+    original: &serde_json::Value,
+    desired: &serde_json::Value,
+) -> Result<serde_json::Value> {
+    Ok(diff_objects(original, desired)?.unwrap_or_else(|| json!({})))
+}
+
 fn diff_objects(
     original: &serde_json::Value,
     desired: &serde_json::Value,
@@ -18,14 +18,23 @@ use tokio::{
 use tokio_util::sync::CancellationToken;
 
 use eventloop::EventLoop;
+pub(crate) use handlers::direct_method::{MethodOptions, DEFAULT_METHOD_CONCURRENCY};
 use handlers::{
     c2d::CloudToDeviceHandler,
     direct_method::DirectMethodHandler,
     twins::{TwinsHandler, TwinsMiddleware},
 };
+#[cfg(feature = "bench")]
+pub(crate) use json_diff::diff as json_diff;
+pub(crate) use reconnect::ReconnectMetrics;
+pub use reconnect::{ReconnectPolicy, ReconnectStatistics};
+#[cfg(feature = "bench")]
+pub(crate) use sender::prepare_message;
 use sender::Sender;
+pub(crate) use sender::SenderOptions;
 use topics::publish_topic;
 
+use crate::metrics::MetricsRegistry;
 use crate::persistence::{
     sqlite::SqliteStore, sqlite_channel, twins::ReportedPropertiesUpdate, Acknowledger,
     CloudToDeviceMessage, Consumer, TwinsStore,
@@ -33,10 +42,12 @@ use crate::persistence::{
 // use spotflow_connection::twins::TwinsClient;
 use twins::IotHubTwinsClient;
 
+mod acknowledgments;
 mod eventloop;
 mod handlers;
 mod json_diff;
 mod query;
+mod reconnect;
 mod sender;
 pub mod token_handler;
 mod topics;
@@ -65,8 +76,12 @@ pub struct IotHubConnection<F> {
     twins_store: TwinsStore,
     registration_watch: Receiver<Option<RegistrationResponse>>,
     registration_command_sender: RegistrationCommandSender,
+    sender_options: SenderOptions,
+    reconnect_policy: ReconnectPolicy,
+    metrics: Arc<MetricsRegistry>,
     cancellation: CancellationToken,
     method_handler: Option<F>,
+    method_options: MethodOptions,
     desired_properties_updated_callback: Option<Box<dyn DesiredPropertiesUpdatedCallback>>,
 
     connection_receiver: Option<oneshot::Receiver<OnlineConnection>>,
@@ -85,7 +100,11 @@ impl<F> IotHubConnection<F> {
         registration_watch: Receiver<Option<RegistrationResponse>>,
         registration_command_sender: mpsc::UnboundedSender<RegistrationCommand>,
         method_handler: Option<F>,
+        method_options: MethodOptions,
         desired_properties_updated_callback: Option<Box<dyn DesiredPropertiesUpdatedCallback>>,
+        sender_options: SenderOptions,
+        reconnect_policy: ReconnectPolicy,
+        metrics: Arc<MetricsRegistry>,
         cancellation: CancellationToken,
     ) -> Self
     where
@@ -100,8 +119,12 @@ impl<F> IotHubConnection<F> {
             twins_store,
             registration_watch,
             registration_command_sender,
+            sender_options,
+            reconnect_policy,
+            metrics,
             cancellation,
             method_handler,
+            method_options,
             desired_properties_updated_callback,
 
             connection_receiver: None,
@@ -111,6 +134,7 @@ impl<F> IotHubConnection<F> {
 
     async fn connect_iothub(
         registration_watch: &mut watch::Receiver<Option<RegistrationResponse>>,
+        max_inflight_messages: u16,
     ) -> Result<(AsyncClient, rumqttc::EventLoop)> {
         while registration_watch.borrow_and_update().is_none() {
             log::trace!("Awaiting first registration");
@@ -145,15 +169,17 @@ impl<F> IotHubConnection<F> {
             .context("Unable to parse SAS token from DRS response")?;
         // let password = format!("{}", registration.connection_string);
 
-        let mut options = MqttOptions::new(device_id, iothub, 8883);
+        let (host, port, transport) = broker_endpoint(iothub);
+        let mut options = MqttOptions::new(device_id, host, port);
         options.set_keep_alive(Duration::from_secs(5 * 60));
         options.set_credentials(username, password);
-        options.set_transport(Transport::Tls(TlsConfiguration::Native));
+        options.set_transport(transport);
         options.set_clean_session(false);
         options.set_manual_acks(true);
         // We cannot guarantee data won't be sent twice because IoT Hub supports only MQTT QoS 1.
-        // Ingress cannot currently deduplicate messages that aren't next to each other
-        options.set_inflight(1);
+        // Ingress cannot currently deduplicate messages that aren't next to each other,
+        // so allowing more messages in flight is a tradeoff between throughput and the distance of duplicates
+        options.set_inflight(max_inflight_messages.max(1));
 
         Ok(AsyncClient::new(options, 10))
     }
@@ -170,6 +196,16 @@ impl<F> IotHubConnection<F> {
     }
 }
 
+// The benchmarks replace IoT Hub with a fake broker listening on a local port without TLS
+fn broker_endpoint(iothub: &str) -> (&str, u16, Transport) {
+    #[cfg(feature = "bench")]
+    if let Some(endpoint) = crate::bench::fake_broker_endpoint(iothub) {
+        return endpoint;
+    }
+
+    (iothub, 8883, Transport::Tls(TlsConfiguration::Native))
+}
+
 impl<F: Fn(String, &[u8]) -> (i32, Vec<u8>) + Send + Sync + RefUnwindSafe + 'static>
     ConnectionImplementation for IotHubConnection<F>
 {
@@ -199,13 +235,24 @@ impl<F: Fn(String, &[u8]) -> (i32, Vec<u8>) + Send + Sync + RefUnwindSafe + 'sta
             let mut registration_watch = self.registration_watch.clone();
             let registration_command_sender = self.registration_command_sender.clone();
             let method_handler = self.method_handler.take();
+            let method_options = self.method_options;
+            let runtime = self.runtime.clone();
             let d2c_acknowledger = self.d2c_acknowledger.take().unwrap();
+            let sender_acknowledger = d2c_acknowledger.clone();
             let d2c_consumer = self.d2c_consumer.take().unwrap();
             let c2d_producer = self.c2d_producer.take().unwrap();
+            let sender_options = self.sender_options;
+            let reconnect_policy = self.reconnect_policy;
+            let metrics = Arc::clone(&self.metrics);
+            let (published_d2c_sender, published_d2c_receiver) = mpsc::unbounded_channel();
+            let (uploads_d2c_sender, uploads_d2c_receiver) = mpsc::unbounded_channel();
             async move {
                 log::debug!("Registering to the platform");
-                let (client, rumqttc_eventloop) =
-                    Self::connect_iothub(&mut registration_watch).await?;
+                let (client, rumqttc_eventloop) = Self::connect_iothub(
+                    &mut registration_watch,
+                    sender_options.max_inflight_messages,
+                )
+                .await?;
                 log::debug!("Getting device ID");
                 let device_id = rumqttc_eventloop.options.client_id();
 
@@ -216,6 +263,10 @@ impl<F: Fn(String, &[u8]) -> (i32, Vec<u8>) + Send + Sync + RefUnwindSafe + 'sta
                     registration_watch.clone(),
                     registration_command_sender,
                     d2c_acknowledger,
+                    published_d2c_receiver,
+                    uploads_d2c_receiver,
+                    reconnect_policy,
+                    Arc::clone(&metrics),
                     cancellation.clone(),
                 );
 
@@ -230,7 +281,12 @@ impl<F: Fn(String, &[u8]) -> (i32, Vec<u8>) + Send + Sync + RefUnwindSafe + 'sta
                 ingress_eventloop.register_async_handler(c2d_handler);
 
                 if let Some(method_handler) = method_handler {
-                    let method_handler = DirectMethodHandler::new(client.clone(), method_handler);
+                    let method_handler = DirectMethodHandler::new(
+                        client.clone(),
+                        runtime,
+                        method_handler,
+                        method_options,
+                    );
                     ingress_eventloop.register_handler(method_handler);
                 }
 
@@ -279,6 +335,11 @@ impl<F: Fn(String, &[u8]) -> (i32, Vec<u8>) + Send + Sync + RefUnwindSafe + 'sta
                     registration_watch.clone(),
                     publish_topic,
                     d2c_consumer,
+                    sender_acknowledger,
+                    published_d2c_sender,
+                    uploads_d2c_sender,
+                    sender_options,
+                    metrics,
                     cancellation.child_token(),
                 );
 
@@ -0,0 +1,189 @@
+use std::{
+    collections::hash_map::RandomState,
+    hash::{BuildHasher, Hasher},
+    sync::atomic::{AtomicU64, Ordering},
+    time::Duration,
+};
+
+/// Specifies how the client reconnects to the Platform after the connection is lost.
+///
+/// The delay before each attempt grows exponentially from `initial_delay` up to `max_delay` until the client
+/// connects again. Many Devices losing the connection at the same time, for example, when a cell tower goes down,
+/// then don't try to reconnect all at once if `jitter` is enabled.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct ReconnectPolicy {
+    /// Whether the first attempt is made right after the connection is lost, so that a single dropped packet doesn't
+    /// delay the communication.
+    pub immediate_first_retry: bool,
+    /// The delay before the first delayed attempt, doubled after each failed attempt.
+    pub initial_delay: Duration,
+    /// The longest delay between two attempts.
+    pub max_delay: Duration,
+    /// Whether each delay is randomly shortened by up to a half.
+    pub jitter: bool,
+}
+
+impl Default for ReconnectPolicy {
+    fn default() -> Self {
+        Self {
+            immediate_first_retry: true,
+            initial_delay: Duration::from_secs(1),
+            max_delay: Duration::from_secs(60),
+            jitter: true,
+        }
+    }
+}
+
+/// Computes the delays between the reconnection attempts according to the [`ReconnectPolicy`].
+#[derive(Debug)]
+pub(crate) struct Backoff {
+    policy: ReconnectPolicy,
+    failed_attempts: u32,
+}
+
+impl Backoff {
+    pub(crate) fn new(policy: ReconnectPolicy) -> Self {
+        Self {
+            policy,
+            failed_attempts: 0,
+        }
+    }
+
+    /// Get the delay before the next attempt and count the last one as failed.
+    pub(crate) fn next_delay(&mut self) -> Duration {
+        let mut attempt = self.failed_attempts;
+        self.failed_attempts = self.failed_attempts.saturating_add(1);
+
+        if self.policy.immediate_first_retry {
+            if attempt == 0 {
+                return Duration::ZERO;
+            }
+            attempt -= 1;
+        }
+
+        let delay = self
+            .policy
+            .initial_delay
+            .saturating_mul(2u32.saturating_pow(attempt))
+            .min(self.policy.max_delay);
+
+        if self.policy.jitter {
+            with_jitter(delay)
+        } else {
+            delay
+        }
+    }
+
+    /// Start counting the attempts from the beginning once the connection is established.
+    pub(crate) fn reset(&mut self) {
+        self.failed_attempts = 0;
+    }
+}
+
+// Pick a random delay between a half and the whole of the provided one. The standard library doesn't have a random
+// number generator, but each `RandomState` is seeded differently, which is random enough to spread the attempts.
+fn with_jitter(delay: Duration) -> Duration {
+    let half = delay / 2;
+    let range = u64::try_from(half.as_nanos()).unwrap_or(u64::MAX);
+    if range == 0 {
+        return delay;
+    }
+
+    let random = RandomState::new().build_hasher().finish();
+    half + Duration::from_nanos(random % range)
+}
+
+/// The statistics of the reconnections of a [`DeviceClient`](crate::DeviceClient) since it was started.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct ReconnectStatistics {
+    /// The number of times the client connected again after losing the connection.
+    pub reconnects: u64,
+    /// The number of connection attempts that failed, including the ones before the first connection.
+    pub failed_attempts: u64,
+    /// How long the client was disconnected the last time it lost the connection, `None` if it never reconnected.
+    pub last_outage: Option<Duration>,
+    /// How long the client was disconnected in total, not including the time before the first connection.
+    pub total_outage: Duration,
+}
+
+/// The counters behind [`ReconnectStatistics`] updated by the event loop.
+#[derive(Debug, Default)]
+pub(crate) struct ReconnectMetrics {
+    reconnects: AtomicU64,
+    failed_attempts: AtomicU64,
+    last_outage_us: AtomicU64,
+    total_outage_us: AtomicU64,
+}
+
+impl ReconnectMetrics {
+    pub(crate) fn record_failed_attempt(&self) {
+        self.failed_attempts.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub(crate) fn record_reconnect(&self, outage: Duration) {
+        let outage_us = u64::try_from(outage.as_micros()).unwrap_or(u64::MAX);
+        self.last_outage_us.store(outage_us, Ordering::Relaxed);
+        self.total_outage_us.fetch_add(outage_us, Ordering::Relaxed);
+        self.reconnects.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub(crate) fn snapshot(&self) -> ReconnectStatistics {
+        let reconnects = self.reconnects.load(Ordering::Relaxed);
+        ReconnectStatistics {
+            reconnects,
+            failed_attempts: self.failed_attempts.load(Ordering::Relaxed),
+            last_outage: (reconnects > 0)
+                .then(|| Duration::from_micros(self.last_outage_us.load(Ordering::Relaxed))),
+            total_outage: Duration::from_micros(self.total_outage_us.load(Ordering::Relaxed)),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::{Backoff, ReconnectPolicy};
+
+    fn policy(immediate_first_retry: bool, jitter: bool) -> ReconnectPolicy {
+        ReconnectPolicy {
+            immediate_first_retry,
+            initial_delay: Duration::from_secs(1),
+            max_delay: Duration::from_secs(10),
+            jitter,
+        }
+    }
+
+    #[test]
+    fn delays_grow_exponentially_up_to_the_cap() {
+        let mut backoff = Backoff::new(policy(true, false));
+        let delays = (0..7).map(|_| backoff.next_delay()).collect::<Vec<_>>();
+        let expected = [0, 1, 2, 4, 8, 10, 10].map(Duration::from_secs);
+        assert_eq!(delays, expected);
+    }
+
+    #[test]
+    fn first_retry_can_be_delayed() {
+        let mut backoff = Backoff::new(policy(false, false));
+        assert_eq!(backoff.next_delay(), Duration::from_secs(1));
+        assert_eq!(backoff.next_delay(), Duration::from_secs(2));
+    }
+
+    #[test]
+    fn reset_starts_from_the_beginning() {
+        let mut backoff = Backoff::new(policy(true, false));
+        backoff.next_delay();
+        backoff.next_delay();
+        backoff.reset();
+        assert_eq!(backoff.next_delay(), Duration::ZERO);
+    }
+
+    #[test]
+    fn jitter_shortens_delay_by_up_to_a_half() {
+        let mut backoff = Backoff::new(policy(false, true));
+        for expected in [1, 2, 4, 8, 10].map(Duration::from_secs) {
+            let delay = backoff.next_delay();
+            assert!(delay >= expected / 2 && delay <= expected, "{delay:?}");
+        }
+    }
+}
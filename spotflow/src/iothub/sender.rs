@@ -1,193 +1,715 @@
-use std::sync::Arc;
+use std::{
+    collections::HashMap,
+    fs::File,
+    io::Read,
+    sync::{Arc, Mutex},
+    time::Duration,
+};
 
-use crate::cloud::drs::RegistrationResponse;
-use crate::persistence::{CloseOption, Compression, Consumer, DeviceMessage};
+use super::acknowledgments::Upload as UploadEvent;
+use crate::cloud::{api_core, drs::RegistrationResponse};
+use crate::metrics::MetricsRegistry;
+use crate::persistence::{
+    compression, Acknowledger, CloseOption, Compression, Consumer, DeviceMessage, Priority,
+};
 use anyhow::{bail, Context, Result};
-use brotli::{enc::BrotliEncoderParams, BrotliCompress};
 use rumqttc::{AsyncClient, QoS};
 use serde::Deserialize;
 use serde_json::json;
-use tokio::{select, sync::watch};
+use tokio::{
+    runtime::Handle,
+    select,
+    sync::{mpsc, watch},
+    task::{JoinError, JoinHandle},
+    time::Instant,
+};
 use tokio_util::sync::CancellationToken;
+use urlencoding::Encoded;
 use uuid::Uuid;
 
+// The limit is 256 KiB for telemetry messages including headers
+// This is coarse but should work well enough
+const MAX_MESSAGE_SIZE: usize = 250_000;
+
+const FILE_UPLOAD_MIN_BACKOFF: Duration = Duration::from_secs(1);
+const FILE_UPLOAD_MAX_BACKOFF: Duration = Duration::from_secs(60);
+
+// How many messages are prepared ahead of the one being published. The preparation doesn't depend on the
+// acknowledgments, so the window is independent of the number of messages in flight. Each prepared message takes at
+// most the size limit of a message in memory.
+const MAX_PREPARED_MESSAGES: usize = 16;
+
+// Each upload occupies a blocking thread for its whole duration
+const MAX_CONCURRENT_UPLOADS: usize = 4;
+
+// Devices usually send messages to only a few streams, the prefixes of the others are built again when needed
+const MAX_CACHED_TOPIC_PREFIXES: usize = 16;
+
+// Enough for the IDs and flags of a typical message so that its topic is allocated only once
+const MESSAGE_PROPERTIES_CAPACITY: usize = 128;
+
+/// The options of sending the device-to-cloud messages.
+#[derive(Clone, Copy, Debug)]
+pub(crate) struct SenderOptions {
+    /// The maximum number of messages waiting for acknowledgment.
+    pub(crate) max_inflight_messages: u16,
+    /// How long a message can wait for the following ones to be packed together with it, `None` disables packing.
+    pub(crate) max_coalescing_delay: Option<Duration>,
+}
+
 #[derive(Debug)]
 pub(super) struct Sender {
     mqtt: AsyncClient,
-    registration_watch: watch::Receiver<Option<RegistrationResponse>>,
-    topic: String,
+    preparer: Preparer,
     message_queue: Consumer,
+    acknowledger: Acknowledger,
+    published: mpsc::UnboundedSender<(Priority, i32)>,
+    uploads: mpsc::UnboundedSender<UploadEvent>,
+    options: SenderOptions,
+    metrics: Arc<MetricsRegistry>,
     cancellation: CancellationToken,
 }
 
+/// Packs consecutive messages with the same properties into a single message, separating their payloads by new lines.
+#[derive(Debug)]
+struct Coalescer {
+    max_delay: Option<Duration>,
+    next: Option<DeviceMessage>,
+}
+
+/// Turns the stored messages into MQTT publish packets. This includes the compression and the file upload, so it's
+/// done on a blocking thread.
+#[derive(Clone, Debug)]
+struct Preparer {
+    registration_watch: watch::Receiver<Option<RegistrationResponse>>,
+    topics: Arc<TopicPrefixes>,
+    // Shared by all the file uploads so that the connections are reused
+    agent: ureq::Agent,
+    metrics: Arc<MetricsRegistry>,
+    cancellation: CancellationToken,
+}
+
+/// The beginnings of the message topics, each of them containing the encoded properties that are the same for all the
+/// messages sent with the same [`MessageContext`](crate::MessageContext). Only the properties specific to each message
+/// are then encoded when the message is sent.
+#[derive(Debug)]
+struct TopicPrefixes {
+    topic: String,
+    // Ordered from the most recently used one, so that the prefix for the current stream is usually found first
+    prefixes: Mutex<Vec<TopicPrefix>>,
+}
+
+#[derive(Debug)]
+struct TopicPrefix {
+    site_id: Option<String>,
+    stream_group: Option<String>,
+    stream: Option<String>,
+    topic: MessageTopic,
+}
+
+/// The topic of a message with its properties separated by `&`.
+#[derive(Clone, Debug)]
+struct MessageTopic {
+    topic: String,
+    has_properties: bool,
+}
+
+#[derive(Debug)]
+struct PreparedMessage {
+    id: i32,
+    priority: Priority,
+    batch_id: Option<String>,
+    topic: String,
+    content: Vec<u8>,
+}
+
+/// A message whose content is uploaded as a file before the message with the link to it is published.
+#[derive(Debug)]
+struct Upload {
+    id: i32,
+    priority: Priority,
+    batch_id: Option<String>,
+    topic: String,
+    content: UploadContent,
+}
+
+/// The result of an upload running aside from the publishing.
+#[derive(Debug)]
+struct Uploaded {
+    priority: Priority,
+    batch_id: Option<String>,
+    prepared: std::result::Result<Prepared, JoinError>,
+}
+
+/// The batches with files being uploaded. The following messages of these batches are published only after the uploads
+/// finish, so that, for example, the message completing a batch isn't published before the rest of the batch.
+#[derive(Debug, Default)]
+struct InflightUploads {
+    count: usize,
+    batches: HashMap<String, usize>,
+}
+
+#[derive(Debug)]
+enum UploadContent {
+    File { path: String, length: u64 },
+    // The content is too large for a single message even after it was compressed
+    Memory(Vec<u8>),
+}
+
+#[derive(Debug)]
+enum Prepared {
+    Message(PreparedMessage),
+    Upload(Upload),
+    // The message cannot be sent, for example, because its file was removed
+    Skipped(i32),
+    // The client is stopping, the message stays stored and is sent after the next start
+    Cancelled(i32),
+}
+
 impl Sender {
     pub(super) fn new(
         mqtt: AsyncClient,
         registration_watch: watch::Receiver<Option<RegistrationResponse>>,
         topic: String,
         message_queue: Consumer,
+        acknowledger: Acknowledger,
+        published: mpsc::UnboundedSender<(Priority, i32)>,
+        uploads: mpsc::UnboundedSender<UploadEvent>,
+        options: SenderOptions,
+        metrics: Arc<MetricsRegistry>,
         cancellation: CancellationToken,
     ) -> Self {
+        let agent = api_core::agent().clone();
+
         Self {
             mqtt,
-            registration_watch,
-            topic,
+            preparer: Preparer {
+                registration_watch,
+                topics: Arc::new(TopicPrefixes::new(topic)),
+                agent,
+                metrics: Arc::clone(&metrics),
+                cancellation: cancellation.clone(),
+            },
             message_queue,
+            acknowledger,
+            published,
+            uploads,
+            options,
+            metrics,
             cancellation,
         }
     }
 
     pub(super) async fn process_saved(&mut self) {
-        loop {
-            select!(
-                () = self.cancellation.cancelled() => break,
-                // At this point we panic. I don't know what else to do as this is core functionality.
-                // In a better world I will let the user know that the SDK stopped working and they need to restart or something.
-                // For now this should panic on our own thread (not on user's thread) and cascade to the SDK itself which will probably return Error when the user tries to send more messages.
-                Some(msg) = self.message_queue.get_message() => self.publish_iothub(msg).await.unwrap(),
-            );
+        let Self {
+            ref mqtt,
+            ref preparer,
+            ref mut message_queue,
+            ref acknowledger,
+            ref published,
+            ref uploads,
+            options,
+            ref metrics,
+            ref cancellation,
+        } = *self;
+
+        // The following messages are prepared while the previous ones are being published. The order of the messages
+        // is kept because they're published in the same order in which their preparation started.
+        let (prepared_sender, mut prepared_receiver) =
+            mpsc::channel::<JoinHandle<Result<Prepared>>>(MAX_PREPARED_MESSAGES);
+
+        let mut coalescer = Coalescer {
+            max_delay: options.max_coalescing_delay,
+            next: None,
+        };
+
+        let preparing = async move {
+            loop {
+                let msg = select! {
+                    msg = coalescer.next(message_queue) => msg,
+                    () = prepared_sender.closed() => None,
+                };
+                let Some(msg) = msg else {
+                    break;
+                };
+
+                let preparer = preparer.clone();
+                let task = tokio::task::spawn_blocking(move || preparer.prepare(msg));
+                if prepared_sender.send(task).await.is_err() {
+                    break;
+                }
+            }
+        };
+
+        // Uploading a file takes much longer than preparing a message, so the files are uploaded aside and the messages
+        // with their links are published once the uploads finish. The following messages don't wait for them unless
+        // they belong to the same batch, the acknowledgments are paired with the messages of each priority in any order.
+        let (uploaded_sender, mut uploaded_receiver) = mpsc::unbounded_channel::<Uploaded>();
+
+        let publishing = async {
+            let mut inflight_uploads = InflightUploads::default();
+            // The message waiting for the uploads of its batch, nothing else is published before it
+            let mut held: Option<Prepared> = None;
+            loop {
+                let prepared = match held.take() {
+                    Some(prepared) if !inflight_uploads.holds(&prepared) => prepared,
+                    waiting => {
+                        held = waiting;
+                        select! {
+                            biased;
+                            Some(uploaded) = uploaded_receiver.recv() => {
+                                inflight_uploads.finish(uploaded.batch_id.as_deref());
+                                match uploaded.prepared {
+                                    Ok(Prepared::Skipped(id)) => {
+                                        remove_skipped(acknowledger, id).await;
+                                        // Nothing receives the result only if the event loop has already stopped
+                                        _ = uploads.send(UploadEvent::Skipped(uploaded.priority, id));
+                                        continue;
+                                    }
+                                    Ok(prepared) => prepared,
+                                    Err(e) if e.is_cancelled() => break,
+                                    Err(e) => std::panic::resume_unwind(e.into_panic()),
+                                }
+                            }
+                            task = prepared_receiver.recv(), if held.is_none() && inflight_uploads.count < MAX_CONCURRENT_UPLOADS => {
+                                let Some(task) = task else {
+                                    break;
+                                };
+                                // The messages that aren't published stay stored, so they're sent after the client
+                                // starts again
+                                match task.await {
+                                    Ok(Ok(prepared)) => prepared,
+                                    Ok(Err(e)) => {
+                                        log::error!(
+                                            "Unable to prepare a device-to-cloud message for sending, the sender is stopping: {e:?}"
+                                        );
+                                        break;
+                                    }
+                                    Err(e) if e.is_cancelled() => break,
+                                    Err(e) => std::panic::resume_unwind(e.into_panic()),
+                                }
+                            }
+                        }
+                    }
+                };
+
+                if inflight_uploads.holds(&prepared) {
+                    held = Some(prepared);
+                    continue;
+                }
+
+                match prepared {
+                    Prepared::Message(prepared) => {
+                        if let Err(e) =
+                            publish_iothub(mqtt, published, metrics, cancellation, prepared).await
+                        {
+                            log::error!("Unable to publish a device-to-cloud message, the sender is stopping: {e:?}");
+                            break;
+                        }
+                    }
+                    Prepared::Upload(upload) => {
+                        inflight_uploads.start(upload.batch_id.as_deref());
+                        // The event loop must not remove the message before it's published, although the following
+                        // messages with the same priority can be acknowledged meanwhile
+                        _ = uploads.send(UploadEvent::Started(upload.priority, upload.id));
+
+                        let (priority, batch_id) = (upload.priority, upload.batch_id.clone());
+                        let preparer = preparer.clone();
+                        let uploaded_sender = uploaded_sender.clone();
+                        tokio::spawn(async move {
+                            let prepared =
+                                tokio::task::spawn_blocking(move || preparer.upload(upload)).await;
+                            // Nothing receives the result only if the sender has already stopped
+                            _ = uploaded_sender.send(Uploaded {
+                                priority,
+                                batch_id,
+                                prepared,
+                            });
+                        });
+                    }
+                    Prepared::Cancelled(id) => {
+                        log::debug!("Preparing message {id} was cancelled, the sender is stopping");
+                        break;
+                    }
+                    Prepared::Skipped(id) => remove_skipped(acknowledger, id).await,
+                }
+            }
+
+            // Nothing more is prepared once the publishing stops
+            prepared_receiver.close();
+        };
+
+        select!(
+            () = cancellation.cancelled() => {},
+            _ = async { tokio::join!(preparing, publishing) } => {},
+        );
+    }
+}
+
+impl InflightUploads {
+    fn start(&mut self, batch_id: Option<&str>) {
+        self.count += 1;
+        if let Some(batch_id) = batch_id {
+            *self.batches.entry(batch_id.to_owned()).or_default() += 1;
         }
     }
 
-    async fn publish_iothub(&self, msg: DeviceMessage) -> Result<()> {
-        fn encode_property(key: &str, value: &str) -> String {
-            let value = urlencoding::encode(value);
-            format!("{key}={value}")
+    fn finish(&mut self, batch_id: Option<&str>) {
+        self.count -= 1;
+        if let Some(batch_id) = batch_id {
+            if let Some(count) = self.batches.get_mut(batch_id) {
+                *count -= 1;
+                if *count == 0 {
+                    self.batches.remove(batch_id);
+                }
+            }
         }
+    }
 
-        let id = msg
-            .id
-            .expect("We have a saved message without an ID. This should never happen.");
+    /// Whether the message must wait until the files of its batch are uploaded.
+    fn holds(&self, prepared: &Prepared) -> bool {
+        let batch_id = match prepared {
+            Prepared::Message(prepared) => prepared.batch_id.as_deref(),
+            Prepared::Upload(upload) => upload.batch_id.as_deref(),
+            Prepared::Skipped(_) | Prepared::Cancelled(_) => None,
+        };
+        batch_id.is_some_and(|batch_id| self.batches.contains_key(batch_id))
+    }
+}
+
+impl Coalescer {
+    async fn next(&mut self, message_queue: &mut Consumer) -> Option<DeviceMessage> {
+        let mut msg = match self.next.take() {
+            Some(msg) => msg,
+            None => message_queue.get_message().await?,
+        };
 
-        let mut properties = Vec::new();
+        let Some(max_delay) = self.max_delay else {
+            return Some(msg);
+        };
 
-        if let Some(stream_group) = &msg.stream_group {
-            properties.push(encode_property("stream-group-name", stream_group));
-        } else {
-            log::info!(
-                "The Stream Group of Message {} is not specified, \
-                the default Stream Group of the current Workspace will be filled in by the Platform.",
-                id
-            );
+        if !can_coalesce(&msg) {
+            return Some(msg);
         }
 
-        if let Some(stream) = &msg.stream {
-            properties.push(encode_property("stream-name", stream));
-        } else {
-            log::info!(
-                "The Stream of Message {} is not specified, \
-                the default Stream of the current Stream Group will be filled in by the Platform.",
-                id
+        let deadline = Instant::now() + max_delay;
+        while let Ok(Some(following)) =
+            tokio::time::timeout_at(deadline, message_queue.get_message()).await
+        {
+            if !can_coalesce(&following)
+                || !have_same_properties(&msg, &following)
+                || msg.content.len() + 1 + following.content.len() > MAX_MESSAGE_SIZE
+            {
+                self.next = Some(following);
+                break;
+            }
+
+            log::trace!(
+                "Packing message {:?} together with the previous ones",
+                following.id
             );
+            msg.content.push(b'\n');
+            msg.content.extend_from_slice(&following.content);
+            // The acknowledgment of the packed message acknowledges all the messages up to the last one
+            msg.id = following.id;
         }
 
-        if let Some(site_id) = &msg.site_id {
-            properties.push(encode_property("site-id", site_id));
+        Some(msg)
+    }
+}
+
+// Messages that are identified by the Platform or that close batches must be sent on their own. So must the messages
+// whose payloads contain a new line, otherwise the Platform would split them at the separator into several records.
+fn can_coalesce(msg: &DeviceMessage) -> bool {
+    matches!(msg.close_option, CloseOption::None)
+        && msg.message_id.is_none()
+        && msg.chunk_id.is_none()
+        && msg.compression != Compression::BrotliCompressed
+        && msg.file_path.is_none()
+        && !msg.content.contains(&b'\n')
+}
+
+fn have_same_properties(first: &DeviceMessage, second: &DeviceMessage) -> bool {
+    first.site_id == second.site_id
+        && first.stream_group == second.stream_group
+        && first.stream == second.stream
+        && first.batch_id == second.batch_id
+        && first.batch_slice_id == second.batch_slice_id
+        && first.compression == second.compression
+        && first.priority == second.priority
+}
+
+async fn remove_skipped(acknowledger: &Acknowledger, id: i32) {
+    if let Err(e) = acknowledger.remove(id).await {
+        log::error!("Unable to remove skipped device-to-cloud message {id}: {e:?}");
+    }
+}
+
+async fn publish_iothub(
+    mqtt: &AsyncClient,
+    published: &mpsc::UnboundedSender<(Priority, i32)>,
+    metrics: &MetricsRegistry,
+    cancellation: &CancellationToken,
+    prepared: PreparedMessage,
+) -> Result<()> {
+    let id = prepared.id;
+
+    // The event loop pairs the ID with the packet ID once rumqttc sends the message
+    if published.send((prepared.priority, id)).is_err() {
+        log::trace!("Message not sent because the event loop has stopped");
+        return Ok(());
+    }
+
+    log::trace!("Sending message {}", id);
+    let size = prepared.topic.len() + prepared.content.len();
+    let res = mqtt
+        .publish(prepared.topic, QoS::AtLeastOnce, false, prepared.content)
+        .await;
+
+    if res.is_err() {
+        // We were not able to send the message.
+        // This should only happen when MQTT AsyncClient has already closed its eventloop, which in turn should only happen during ingress shutdown
+        // The following if should never be true
+        if !cancellation.is_cancelled() {
+            log::error!("Unable to publish message even though the client is not stopping");
+            bail!("rumqttc event loop has closed its request queue even though the client has not cancelled its own token.");
         }
+        log::trace!("Message not sent during shutdown");
+        return Ok(());
+    }
+
+    log::trace!("Message sent {}", id);
+    metrics.record_sent(size);
+    metrics.record_published(id);
+
+    Ok(())
+}
+
+/// Build the topic and the content of the publish packet of a stored message the same way as the [`Sender`] does.
+#[cfg(feature = "bench")]
+pub(crate) fn prepare_message(
+    device_id: &str,
+    msg: DeviceMessage,
+    metrics: Arc<MetricsRegistry>,
+) -> Result<(String, Vec<u8>)> {
+    let (_, registration_watch) = watch::channel(None);
+    let preparer = Preparer {
+        registration_watch,
+        topics: Arc::new(TopicPrefixes::new(super::topics::publish_topic(device_id))),
+        agent: api_core::agent().clone(),
+        metrics,
+        cancellation: CancellationToken::new(),
+    };
+
+    let prepared = match preparer.prepare(msg)? {
+        Prepared::Upload(upload) => preparer.upload(upload),
+        prepared => prepared,
+    };
+
+    match prepared {
+        Prepared::Message(prepared) => Ok((prepared.topic, prepared.content)),
+        Prepared::Upload(upload) => bail!("Message {} was not uploaded", upload.id),
+        Prepared::Skipped(id) => bail!("Message {id} cannot be sent"),
+        Prepared::Cancelled(id) => bail!("Preparing message {id} was cancelled"),
+    }
+}
+
+impl Preparer {
+    fn prepare(&self, msg: DeviceMessage) -> Result<Prepared> {
+        let id = msg
+            .id
+            .expect("We have a saved message without an ID. This should never happen.");
+
+        let mut topic = self.topics.start(id, &msg);
 
         if let Some(batch_id) = &msg.batch_id {
-            properties.push(encode_property("batch-id", batch_id));
+            topic.push_property("batch-id", batch_id);
         }
 
         if let Some(batch_slice_id) = &msg.batch_slice_id {
-            properties.push(encode_property("batch-slice-id", batch_slice_id));
+            topic.push_property("batch-slice-id", batch_slice_id);
         }
 
         if let Some(message_id) = &msg.message_id {
-            properties.push(encode_property("message-id", message_id));
+            topic.push_property("message-id", message_id);
         }
 
         if let Some(chunk_id) = &msg.chunk_id {
-            properties.push(encode_property("chunk-id", chunk_id));
+            topic.push_property("chunk-id", chunk_id);
         }
 
-        let content = match (
-            msg.content.is_empty(),
-            get_compression_quality(msg.compression),
-        ) {
-            (false, Some(compression_quality)) => {
-                log::trace!("Compressing message {}", id);
-                let compressed_content = compress_message(&msg.content, compression_quality)?;
-
-                if compressed_content.len() < msg.content.len() {
-                    properties.push(String::from("content-encoding=br"));
-                    compressed_content
-                } else {
-                    log::trace!(
-                        "Compressing message {} would not decrease its size (original: {}B, compressed: {}B), sending uncompressed",
-                        id, msg.content.len(), compressed_content.len());
-                    msg.content
-                }
-            }
-            _ => msg.content,
-        };
-
-        let content = if is_file_upload(&content) {
-            log::trace!("Sending message {} through file upload", id);
-            properties.push(String::from("has-externalized-payload=true"));
-            let blob_name = loop {
-                match self.publish_file(content.as_ref()) {
-                    Ok(name) => break name,
-                    Err(e) => log::error!("Failed uploading file: {:?}", e),
+        let content = if let Some(path) = msg.file_path {
+            let length = match std::fs::metadata(&path) {
+                Ok(metadata) => metadata.len(),
+                Err(e) => {
+                    log::error!(
+                        "Skipping message {id} because its file {path} cannot be read: {e:?}"
+                    );
+                    return Ok(Prepared::Skipped(id));
                 }
             };
-            format!(r#"{{"link":"{blob_name}"}}"#).into_bytes()
+
+            topic.push_flag("has-externalized-payload=true");
+            Err(UploadContent::File { path, length })
         } else {
-            content
+            self.prepare_content(id, msg.content, msg.compression, &mut topic)?
         };
 
         match &msg.close_option {
             CloseOption::None => {}
             CloseOption::Close => {
-                properties.push(String::from("complete-batch=true"));
+                topic.push_flag("complete-batch=true");
             }
             CloseOption::CloseOnly => {
-                properties.push(String::from("complete-batch=true"));
-                properties.push(String::from("ignore-payload=true"));
+                topic.push_flag("complete-batch=true");
+                topic.push_flag("ignore-payload=true");
             }
             CloseOption::CloseMessageOnly => {
-                properties.push(String::from("complete-message=true"));
-                properties.push(String::from("ignore-payload=true"));
+                topic.push_flag("complete-message=true");
+                topic.push_flag("ignore-payload=true");
             }
         }
 
-        let properties = properties.join("&");
+        Ok(match content {
+            Ok(content) => Prepared::Message(PreparedMessage {
+                id,
+                priority: msg.priority,
+                batch_id: msg.batch_id,
+                topic: topic.topic,
+                content,
+            }),
+            Err(content) => Prepared::Upload(Upload {
+                id,
+                priority: msg.priority,
+                batch_id: msg.batch_id,
+                topic: topic.topic,
+                content,
+            }),
+        })
+    }
 
-        let topic = format!("{}{}", &self.topic, properties);
+    // Returns the content that must be uploaded as a file instead of being published as an error
+    fn prepare_content(
+        &self,
+        id: i32,
+        content: Vec<u8>,
+        compression: Compression,
+        topic: &mut MessageTopic,
+    ) -> Result<std::result::Result<Vec<u8>, UploadContent>> {
+        let content = match compression {
+            Compression::BrotliCompressed => {
+                topic.push_flag("content-encoding=br");
+                content
+            }
+            Compression::None => content,
+            compression => {
+                log::trace!("Compressing message {}", id);
+                match compression::compress(&content, compression, &self.metrics)? {
+                    Some(compressed_content) => {
+                        topic.push_flag("content-encoding=br");
+                        compressed_content
+                    }
+                    None => content,
+                }
+            }
+        };
 
-        log::trace!("Sending message {}", id);
-        let res = self
-            .mqtt
-            .publish(topic.to_string(), QoS::AtLeastOnce, false, content)
-            .await;
+        if is_file_upload(&content) {
+            topic.push_flag("has-externalized-payload=true");
+            Ok(Err(UploadContent::Memory(content)))
+        } else {
+            Ok(Ok(content))
+        }
+    }
 
-        if res.is_err() {
-            // We were not able to send the message.
-            // This should only happen when MQTT AsyncClient has already closed its eventloop, which in turn should only happen during ingress shutdown
-            // The following if should never be true
-            if !self.cancellation.is_cancelled() {
-                log::error!("Unable to publish message even though the client is not stopping");
-                bail!("rumqttc event loop has closed its request queue even though the client has not cancelled its own token.");
+    /// Upload the content of the message and build the message with the link to it. The message is skipped if the
+    /// upload cannot succeed however many times it's retried.
+    fn upload(&self, upload: Upload) -> Prepared {
+        let Upload {
+            id,
+            priority,
+            batch_id,
+            topic,
+            content,
+        } = upload;
+
+        let uploaded = match &content {
+            UploadContent::File { path, length } => {
+                log::trace!("Sending message {id} from file {path} through file upload");
+                self.publish_file_with_retries(|| File::open(path), *length)
+            }
+            UploadContent::Memory(content) => {
+                log::trace!("Sending message {id} through file upload");
+                self.publish_file_with_retries(|| Ok(content.as_slice()), content.len() as u64)
+            }
+        };
+
+        match uploaded {
+            Ok(Some(blob_name)) => Prepared::Message(PreparedMessage {
+                id,
+                priority,
+                batch_id,
+                topic,
+                content: format!(r#"{{"link":"{blob_name}"}}"#).into_bytes(),
+            }),
+            Ok(None) => Prepared::Cancelled(id),
+            Err(e) => {
+                log::error!("Skipping message {id} because its content cannot be uploaded: {e:?}");
+                Prepared::Skipped(id)
             }
-            log::trace!("Message not sent during shutdown");
-            return Ok(());
         }
+    }
+
+    // The content is read again from the beginning on every attempt. Returns `None` if the client stopped before the
+    // file was uploaded and an error if retrying the upload cannot help.
+    fn publish_file_with_retries<R: Read>(
+        &self,
+        content: impl Fn() -> std::io::Result<R>,
+        length: u64,
+    ) -> Result<Option<String>> {
+        let mut backoff = FILE_UPLOAD_MIN_BACKOFF;
+        loop {
+            let published = content()
+                .context("Unable to open the content of the file")
+                .and_then(|content| self.publish_file(content, length));
+            match published {
+                Ok(name) => return Ok(Some(name)),
+                Err(e) if is_permanent_upload_error(&e) => return Err(e),
+                Err(e) => log::error!("Failed uploading file, retrying in {backoff:?}: {e:?}"),
+            }
 
-        log::trace!("Message sent {}", id);
+            let cancelled = Handle::current().block_on(async {
+                select! {
+                    () = self.cancellation.cancelled() => true,
+                    () = tokio::time::sleep(backoff) => false,
+                }
+            });
+            if cancelled {
+                log::debug!("File upload was cancelled");
+                return Ok(None);
+            }
 
-        Ok(())
+            backoff = (backoff * 2).min(FILE_UPLOAD_MAX_BACKOFF);
+        }
     }
 
-    fn publish_file(&self, content: &[u8]) -> Result<String> {
-        let registration = self.registration_watch.borrow();
-        let registration = registration
-            .as_ref()
-            .expect("Registration worker must not send None");
-        let host_name = &registration.iot_hub_host_name;
-        let device_id = &registration.iot_hub_device_id()?;
-        let auth_header = &registration
-            .sas()
-            .context("Unable to parse SAS token during file upload")?;
+    fn publish_file(&self, content: impl Read, length: u64) -> Result<String> {
+        // Don't hold the lock of the registration for the whole upload so that it can be renewed meanwhile
+        let (host_name, device_id, auth_header) = {
+            let registration = self.registration_watch.borrow();
+            let registration = registration
+                .as_ref()
+                .expect("Registration worker must not send None");
+            (
+                registration.iot_hub_host_name.clone(),
+                registration.iot_hub_device_id()?.to_owned(),
+                registration
+                    .sas()
+                    .context("Unable to parse SAS token during file upload")?
+                    .to_owned(),
+            )
+        };
+        let auth_header = &auth_header;
 
         let init_uri =
             format!("https://{host_name}/devices/{device_id}/files?api-version=2020-03-13");
@@ -195,9 +717,7 @@ impl Sender {
             "https://{host_name}/devices/{device_id}/files/notifications?api-version=2020-03-13"
         );
 
-        let connector =
-            Arc::new(native_tls::TlsConnector::new().expect("Unable to build TLS connector"));
-        let agent = ureq::AgentBuilder::new().tls_connector(connector).build();
+        let agent = &self.agent;
 
         let blob_name = Uuid::new_v4().to_string();
 
@@ -220,7 +740,9 @@ impl Sender {
         agent
             .put(&blob_sas)
             .set("x-ms-blob-type", "BlockBlob")
-            .send_bytes(content)
+            // The content is streamed, the length must be known upfront because Azure Blob Storage doesn't support chunked transfer encoding
+            .set("Content-Length", &length.to_string())
+            .send(content)
             .context("Failed uploading file to blob")?;
 
         agent
@@ -239,34 +761,122 @@ impl Sender {
     }
 }
 
-fn get_compression_quality(compression: Compression) -> Option<i32> {
-    match compression {
-        Compression::None => None,
-        Compression::BrotliFastest => Some(1),
-        Compression::BrotliSmallestSize => Some(11),
+impl TopicPrefixes {
+    fn new(topic: String) -> Self {
+        Self {
+            topic,
+            prefixes: Mutex::new(Vec::with_capacity(MAX_CACHED_TOPIC_PREFIXES)),
+        }
+    }
+
+    /// Start the topic of the message with the properties that are shared by all the messages of its stream.
+    fn start(&self, id: i32, msg: &DeviceMessage) -> MessageTopic {
+        let mut prefixes = self
+            .prefixes
+            .lock()
+            .expect("Topic prefixes lock is poisoned");
+
+        let position = prefixes.iter().position(|prefix| {
+            prefix.site_id == msg.site_id
+                && prefix.stream_group == msg.stream_group
+                && prefix.stream == msg.stream
+        });
+
+        match position {
+            Some(position) => prefixes[..=position].rotate_right(1),
+            None => {
+                prefixes.truncate(MAX_CACHED_TOPIC_PREFIXES - 1);
+                prefixes.insert(0, TopicPrefix::new(&self.topic, id, msg));
+            }
+        }
+
+        let prefix = &prefixes[0].topic;
+        let mut topic = String::with_capacity(prefix.topic.len() + MESSAGE_PROPERTIES_CAPACITY);
+        topic.push_str(&prefix.topic);
+
+        MessageTopic {
+            topic,
+            has_properties: prefix.has_properties,
+        }
     }
 }
 
-fn compress_message(content: &Vec<u8>, quality: i32) -> Result<Vec<u8>, anyhow::Error> {
-    let brotli_params = BrotliEncoderParams {
-        quality,
-        ..Default::default()
-    };
+impl TopicPrefix {
+    fn new(publish_topic: &str, id: i32, msg: &DeviceMessage) -> Self {
+        let mut topic = MessageTopic {
+            topic: publish_topic.to_owned(),
+            has_properties: false,
+        };
+
+        if let Some(stream_group) = &msg.stream_group {
+            topic.push_property("stream-group-name", stream_group);
+        } else {
+            log::info!(
+                "The Stream Group of Message {} is not specified, \
+                the default Stream Group of the current Workspace will be filled in by the Platform.",
+                id
+            );
+        }
+
+        if let Some(stream) = &msg.stream {
+            topic.push_property("stream-name", stream);
+        } else {
+            log::info!(
+                "The Stream of Message {} is not specified, \
+                the default Stream of the current Stream Group will be filled in by the Platform.",
+                id
+            );
+        }
 
-    let mut compressed_content = Vec::new();
-    BrotliCompress(
-        &mut content.as_slice(),
-        &mut compressed_content,
-        &brotli_params,
-    )?;
+        if let Some(site_id) = &msg.site_id {
+            topic.push_property("site-id", site_id);
+        }
 
-    Ok(compressed_content)
+        Self {
+            site_id: msg.site_id.clone(),
+            stream_group: msg.stream_group.clone(),
+            stream: msg.stream.clone(),
+            topic,
+        }
+    }
+}
+
+impl MessageTopic {
+    fn push_property(&mut self, key: &str, value: &str) {
+        self.push_separator();
+        self.topic.push_str(key);
+        self.topic.push('=');
+        Encoded::str(value).append_to(&mut self.topic);
+    }
+
+    fn push_flag(&mut self, property: &str) {
+        self.push_separator();
+        self.topic.push_str(property);
+    }
+
+    fn push_separator(&mut self) {
+        if self.has_properties {
+            self.topic.push('&');
+        }
+        self.has_properties = true;
+    }
 }
 
 fn is_file_upload(content: &[u8]) -> bool {
-    // The limit is 256 KiB for telemetry messages including headers
-    // This is coarse but should work well enough
-    content.len() > 250_000
+    content.len() > MAX_MESSAGE_SIZE
+}
+
+// Retrying cannot help if the file was removed or if the request itself was rejected. Rejected authorization is retried
+// because the registration can be renewed meanwhile.
+fn is_permanent_upload_error(e: &anyhow::Error) -> bool {
+    if let Some(ureq::Error::Status(status, _)) = e.downcast_ref::<ureq::Error>() {
+        return (400..500).contains(status) && !matches!(*status, 401 | 403 | 408 | 429);
+    }
+
+    matches!(
+        e.downcast_ref::<std::io::Error>(),
+        Some(e) if e.kind() == std::io::ErrorKind::NotFound
+    )
 }
 
 #[derive(Deserialize)]
@@ -278,3 +888,499 @@ struct FileUploadInit {
     blob_name: String,
     sas_token: String,
 }
+
+#[cfg(test)]
+mod tests {
+    use std::borrow::Cow;
+
+    use rumqttc::{EventLoop, MqttOptions, Publish, Request};
+    use tokio::time::timeout;
+
+    use super::*;
+    use crate::persistence::sqlite::SqliteStore;
+    use crate::persistence::test_support::{
+        acknowledger, new_message, open_store, store_message, stored_messages, TestFile,
+    };
+
+    fn message(stream: &str, message_id: Option<&str>) -> DeviceMessage {
+        DeviceMessage {
+            id: Some(1),
+            site_id: None,
+            stream_group: Some(String::from("group")),
+            stream: Some(String::from(stream)),
+            batch_id: Some(String::from("batch 1")),
+            message_id: message_id.map(String::from),
+            content: Vec::new(),
+            close_option: CloseOption::None,
+            compression: Compression::None,
+            batch_slice_id: None,
+            chunk_id: None,
+            file_path: None,
+            priority: Priority::Normal,
+        }
+    }
+
+    #[test]
+    fn topic_contains_encoded_properties() {
+        let topics = TopicPrefixes::new(String::from("devices/device/messages/events/"));
+        let msg = message("a&b", Some("m"));
+
+        let mut topic = topics.start(1, &msg);
+        topic.push_property("message-id", "m");
+        topic.push_flag("complete-batch=true");
+
+        assert_eq!(
+            topic.topic,
+            "devices/device/messages/events/stream-group-name=group&stream-name=a%26b&message-id=m&complete-batch=true"
+        );
+    }
+
+    #[test]
+    fn topic_without_properties_has_no_separator() {
+        let topics = TopicPrefixes::new(String::from("devices/device/messages/events/"));
+        let mut msg = message("stream", None);
+        msg.stream_group = None;
+        msg.stream = None;
+
+        let mut topic = topics.start(1, &msg);
+        topic.push_property("batch-id", "batch 1");
+
+        assert_eq!(
+            topic.topic,
+            "devices/device/messages/events/batch-id=batch%201"
+        );
+    }
+
+    #[test]
+    fn topic_prefixes_are_reused() {
+        let topics = TopicPrefixes::new(String::from("topic/"));
+
+        topics.start(1, &message("first", None));
+        topics.start(2, &message("second", None));
+        let topic = topics.start(3, &message("first", None));
+
+        assert_eq!(
+            topic.topic,
+            "topic/stream-group-name=group&stream-name=first"
+        );
+        let prefixes = topics.prefixes.lock().unwrap();
+        assert_eq!(prefixes.len(), 2);
+        assert_eq!(prefixes[0].stream.as_deref(), Some("first"));
+    }
+
+    #[test]
+    fn topic_prefixes_are_bounded() {
+        let topics = TopicPrefixes::new(String::from("topic/"));
+
+        for i in 0..MAX_CACHED_TOPIC_PREFIXES + 5 {
+            topics.start(1, &message(&i.to_string(), None));
+        }
+
+        assert_eq!(
+            topics.prefixes.lock().unwrap().len(),
+            MAX_CACHED_TOPIC_PREFIXES
+        );
+    }
+
+    fn status_error(status: u16) -> anyhow::Error {
+        let response = ureq::Response::new(status, "Status", "").unwrap();
+        anyhow::Error::new(ureq::Error::Status(status, response))
+            .context("Failed sending request to initiate file upload")
+    }
+
+    #[test]
+    fn only_rejected_uploads_are_not_retried() {
+        assert!(is_permanent_upload_error(&status_error(400)));
+        assert!(is_permanent_upload_error(&status_error(404)));
+        assert!(is_permanent_upload_error(&status_error(413)));
+        for status in [401, 403, 408, 429, 500, 503] {
+            assert!(!is_permanent_upload_error(&status_error(status)));
+        }
+
+        let removed = anyhow::Error::new(std::io::Error::from(std::io::ErrorKind::NotFound))
+            .context("Unable to open the content of the file");
+        assert!(is_permanent_upload_error(&removed));
+        let interrupted =
+            anyhow::Error::new(std::io::Error::from(std::io::ErrorKind::ConnectionReset));
+        assert!(!is_permanent_upload_error(&interrupted));
+    }
+
+    fn numbered(id: i32, stream: &str, content: &[u8]) -> DeviceMessage {
+        DeviceMessage {
+            id: Some(id),
+            content: content.to_vec(),
+            ..message(stream, None)
+        }
+    }
+
+    /// Pack all the messages, which are already stored, so that the coalescer never waits for the following ones.
+    async fn coalesce(messages: Vec<DeviceMessage>) -> Vec<DeviceMessage> {
+        let (sender, receiver) = mpsc::channel(messages.len().max(1));
+        for msg in messages {
+            sender.send(msg).await.unwrap();
+        }
+        drop(sender);
+
+        let mut consumer = Consumer::from_channel(receiver);
+        let mut coalescer = Coalescer {
+            max_delay: Some(Duration::from_secs(60)),
+            next: None,
+        };
+        let mut coalesced = Vec::new();
+        while let Some(msg) = coalescer.next(&mut consumer).await {
+            coalesced.push(msg);
+        }
+        coalesced
+    }
+
+    fn ids_and_contents(messages: &[DeviceMessage]) -> Vec<(i32, &[u8])> {
+        messages
+            .iter()
+            .map(|msg| (msg.id.unwrap(), msg.content.as_slice()))
+            .collect()
+    }
+
+    #[tokio::test]
+    async fn packed_message_is_acknowledged_by_the_last_id() {
+        let coalesced = coalesce(vec![
+            numbered(1, "stream", b"a"),
+            numbered(2, "stream", b"b"),
+            numbered(3, "stream", b"c"),
+        ])
+        .await;
+
+        assert_eq!(ids_and_contents(&coalesced), [(3, &b"a\nb\nc"[..])]);
+    }
+
+    #[tokio::test]
+    async fn message_with_other_properties_is_held_for_the_next_pack() {
+        let (sender, receiver) = mpsc::channel(3);
+        for msg in [
+            numbered(1, "first", b"a"),
+            numbered(2, "second", b"b"),
+            numbered(3, "second", b"c"),
+        ] {
+            sender.send(msg).await.unwrap();
+        }
+        drop(sender);
+        let mut consumer = Consumer::from_channel(receiver);
+        let mut coalescer = Coalescer {
+            max_delay: Some(Duration::from_secs(60)),
+            next: None,
+        };
+
+        let first = coalescer.next(&mut consumer).await.unwrap();
+        assert_eq!((first.id, first.content.as_slice()), (Some(1), &b"a"[..]));
+        assert_eq!(coalescer.next.as_ref().and_then(|msg| msg.id), Some(2));
+
+        let second = coalescer.next(&mut consumer).await.unwrap();
+        assert_eq!(
+            (second.id, second.content.as_slice()),
+            (Some(3), &b"b\nc"[..])
+        );
+        assert!(coalescer.next(&mut consumer).await.is_none());
+    }
+
+    #[tokio::test]
+    async fn packs_stop_at_the_message_size_limit() {
+        let half = MAX_MESSAGE_SIZE / 2;
+        let fitting = coalesce(vec![
+            numbered(1, "stream", &vec![b'a'; half]),
+            numbered(2, "stream", &vec![b'b'; MAX_MESSAGE_SIZE - half - 1]),
+        ])
+        .await;
+        assert_eq!(fitting.len(), 1);
+        assert_eq!(fitting[0].content.len(), MAX_MESSAGE_SIZE);
+
+        let exceeding = coalesce(vec![
+            numbered(1, "stream", &vec![b'a'; half]),
+            numbered(2, "stream", &vec![b'b'; MAX_MESSAGE_SIZE - half]),
+            numbered(3, "stream", b"c"),
+        ])
+        .await;
+        let ids = exceeding
+            .iter()
+            .map(|msg| msg.id.unwrap())
+            .collect::<Vec<_>>();
+        assert_eq!(ids, [1, 3]);
+        assert_eq!(exceeding[0].content.len(), half);
+        assert_eq!(exceeding[1].content.len(), MAX_MESSAGE_SIZE - half + 2);
+    }
+
+    #[tokio::test]
+    async fn payloads_with_new_lines_are_sent_on_their_own() {
+        let coalesced = coalesce(vec![
+            numbered(1, "stream", b"a"),
+            numbered(2, "stream", b"b\nc"),
+            numbered(3, "stream", b"d"),
+            numbered(4, "stream", b"e"),
+        ])
+        .await;
+
+        assert_eq!(
+            ids_and_contents(&coalesced),
+            [(1, &b"a"[..]), (2, &b"b\nc"[..]), (4, &b"d\ne"[..])]
+        );
+    }
+
+    #[test]
+    fn only_plain_messages_can_be_coalesced() {
+        assert!(can_coalesce(&numbered(1, "stream", b"a")));
+
+        let mut with_message_id = numbered(1, "stream", b"a");
+        with_message_id.message_id = Some(String::from("m"));
+        let mut with_chunk_id = numbered(1, "stream", b"a");
+        with_chunk_id.chunk_id = Some(String::from("c"));
+        let mut closing = numbered(1, "stream", b"a");
+        closing.close_option = CloseOption::Close;
+        let mut compressed = numbered(1, "stream", b"a");
+        compressed.compression = Compression::BrotliCompressed;
+        let mut from_file = numbered(1, "stream", b"");
+        from_file.file_path = Some(String::from("file.bin"));
+        let with_new_line = numbered(1, "stream", b"a\nb");
+
+        for msg in [
+            with_message_id,
+            with_chunk_id,
+            closing,
+            compressed,
+            from_file,
+            with_new_line,
+        ] {
+            assert!(!can_coalesce(&msg), "{msg:?} must not be coalesced");
+        }
+    }
+
+    fn registration() -> RegistrationResponse {
+        // Nothing listens on the port, so every file upload fails and is retried
+        serde_json::from_value(json!({
+            "connectionString": "HostName=127.0.0.1:1;DeviceId=device;SharedAccessSignature=signature",
+            "iotHubHostName": "127.0.0.1:1",
+            "connectionStringType": "SharedAccessSignature",
+        }))
+        .unwrap()
+    }
+
+    /// The ends of a [`Sender`]. The event loop of its MQTT client is never polled, so the published messages are read
+    /// from its requests instead of being sent to a broker.
+    struct Pipeline {
+        messages: mpsc::Sender<DeviceMessage>,
+        mqtt: EventLoop,
+        published: mpsc::UnboundedReceiver<(Priority, i32)>,
+        uploads: mpsc::UnboundedReceiver<UploadEvent>,
+        cancellation: CancellationToken,
+    }
+
+    impl Pipeline {
+        /// The preparation has a separate cancellation token so that it can be cancelled while the sender isn't.
+        fn new(store: &SqliteStore, preparation: CancellationToken) -> (Sender, Self) {
+            let (mqtt, eventloop) =
+                AsyncClient::new(MqttOptions::new("device", "localhost", 8883), 10);
+            let (_, registration_watch) = watch::channel(Some(registration()));
+            let (messages, receiver) = mpsc::channel(100);
+            let (published_sender, published) = mpsc::unbounded_channel();
+            let (uploads_sender, uploads) = mpsc::unbounded_channel();
+            let metrics = Arc::new(MetricsRegistry::new());
+            let cancellation = CancellationToken::new();
+
+            let sender = Sender {
+                mqtt,
+                preparer: Preparer {
+                    registration_watch,
+                    topics: Arc::new(TopicPrefixes::new(String::from("topic/"))),
+                    agent: api_core::agent().clone(),
+                    metrics: Arc::clone(&metrics),
+                    cancellation: preparation,
+                },
+                message_queue: Consumer::from_channel(receiver),
+                acknowledger: acknowledger(store),
+                published: published_sender,
+                uploads: uploads_sender,
+                options: SenderOptions {
+                    max_inflight_messages: 4,
+                    max_coalescing_delay: None,
+                },
+                metrics,
+                cancellation: cancellation.clone(),
+            };
+
+            let pipeline = Self {
+                messages,
+                mqtt: eventloop,
+                published,
+                uploads,
+                cancellation,
+            };
+
+            (sender, pipeline)
+        }
+
+        async fn send(&self, msg: DeviceMessage) {
+            self.messages.send(msg).await.unwrap();
+        }
+
+        /// Wait for the next message published by the sender and return its ID in the database.
+        async fn next_published(&mut self) -> (i32, Publish) {
+            let request = timeout(Duration::from_secs(10), self.mqtt.requests_rx.recv())
+                .await
+                .expect("No message was published")
+                .unwrap();
+            let Request::Publish(publish) = request else {
+                panic!("Unexpected request {request:?}");
+            };
+            // The ID is handed to the event loop before the message is published
+            let (_, id) = self.published.try_recv().unwrap();
+            (id, publish)
+        }
+    }
+
+    fn start(mut sender: Sender) -> JoinHandle<()> {
+        tokio::spawn(async move { sender.process_saved().await })
+    }
+
+    #[tokio::test(flavor = "multi_thread")]
+    async fn messages_are_published_in_the_order_of_their_preparation() {
+        let file = TestFile::new();
+        let store = open_store(&file).await;
+        let (sender, mut pipeline) = Pipeline::new(&store, CancellationToken::new());
+
+        // The small messages are prepared while the large ones are still being compressed
+        let mut expected = Vec::new();
+        for i in 0..MAX_PREPARED_MESSAGES * 2 {
+            let mut msg = new_message("stream");
+            if i % 2 == 0 {
+                msg.content = Cow::Owned(format!("message {i} ").repeat(10_000).into_bytes());
+                msg.compression = Compression::BrotliSmallestSize;
+            }
+            let msg = store_message(&store, msg).await;
+            expected.push((msg.id.unwrap(), i % 2 == 0));
+            pipeline.send(msg).await;
+        }
+
+        let sending = start(sender);
+
+        for (expected_id, compressed) in expected {
+            let (id, publish) = pipeline.next_published().await;
+            assert_eq!(id, expected_id);
+            assert_eq!(publish.topic.contains("content-encoding=br"), compressed);
+        }
+
+        pipeline.cancellation.cancel();
+        sending.await.unwrap();
+    }
+
+    #[tokio::test(flavor = "multi_thread")]
+    async fn skipped_message_is_removed() {
+        let file = TestFile::new();
+        let store = open_store(&file).await;
+        let (sender, mut pipeline) = Pipeline::new(&store, CancellationToken::new());
+
+        // The file of the message is never created
+        let missing = TestFile::new();
+        let mut from_file = new_message("stream");
+        from_file.content = Cow::Borrowed(b"");
+        from_file.file_path = Some(missing.0.to_string_lossy().into_owned());
+        let skipped = store_message(&store, from_file).await;
+        let sent = store_message(&store, new_message("stream")).await;
+        let sent_id = sent.id;
+        pipeline.send(skipped).await;
+        pipeline.send(sent).await;
+
+        let sending = start(sender);
+
+        // The skipped message is removed before the following one is published
+        let (id, _) = pipeline.next_published().await;
+        assert_eq!(Some(id), sent_id);
+        let stored = stored_messages(&store).await;
+        assert_eq!(
+            stored.iter().map(|msg| msg.id).collect::<Vec<_>>(),
+            [sent_id]
+        );
+
+        pipeline.cancellation.cancel();
+        sending.await.unwrap();
+    }
+
+    #[tokio::test(flavor = "multi_thread")]
+    async fn cancelled_upload_stops_the_sender() {
+        let file = TestFile::new();
+        let store = open_store(&file).await;
+        let preparation = CancellationToken::new();
+        let (sender, mut pipeline) = Pipeline::new(&store, preparation.clone());
+
+        // The content is too large for a single message, so it's uploaded as a file, which never succeeds
+        let mut large = new_message("stream");
+        large.content = Cow::Owned(vec![b'a'; MAX_MESSAGE_SIZE + 1]);
+        let uploaded = store_message(&store, large).await;
+        let sent = store_message(&store, new_message("stream")).await;
+        let (uploaded_id, sent_id) = (uploaded.id, sent.id);
+        pipeline.send(uploaded).await;
+        pipeline.send(sent).await;
+
+        let sending = start(sender);
+
+        // The following message doesn't wait for the upload
+        let (id, _) = pipeline.next_published().await;
+        assert_eq!(Some(id), sent_id);
+
+        preparation.cancel();
+        timeout(Duration::from_secs(10), sending)
+            .await
+            .expect("The sender must stop when the upload is cancelled")
+            .unwrap();
+        assert!(!pipeline.cancellation.is_cancelled());
+        assert!(pipeline.mqtt.requests_rx.is_empty());
+
+        // The message stays stored, so it's sent after the client starts again
+        let stored = stored_messages(&store).await;
+        assert!(stored.iter().any(|msg| msg.id == uploaded_id));
+    }
+
+    #[tokio::test(flavor = "multi_thread")]
+    async fn upload_is_tracked_and_holds_back_its_batch() {
+        let file = TestFile::new();
+        let store = open_store(&file).await;
+        let preparation = CancellationToken::new();
+        let (sender, mut pipeline) = Pipeline::new(&store, preparation.clone());
+
+        let mut large = new_message("stream");
+        large.batch_id = Some(String::from("batch"));
+        large.content = Cow::Owned(vec![b'a'; MAX_MESSAGE_SIZE + 1]);
+        let uploaded = store_message(&store, large).await;
+        let sent = store_message(&store, new_message("stream")).await;
+        let mut closing = new_message("stream");
+        closing.batch_id = Some(String::from("batch"));
+        closing.close_option = CloseOption::CloseOnly;
+        let closing = store_message(&store, closing).await;
+        let (uploaded_id, sent_id, closing_id) = (uploaded.id, sent.id, closing.id);
+        pipeline.send(uploaded).await;
+        pipeline.send(sent).await;
+        pipeline.send(closing).await;
+
+        let sending = start(sender);
+
+        // The event loop learns about the upload before the following message can be acknowledged, so the PUBACK of
+        // the following message cannot remove the message being uploaded
+        let (id, _) = pipeline.next_published().await;
+        assert_eq!(Some(id), sent_id);
+        let Ok(UploadEvent::Started(Priority::Normal, started)) = pipeline.uploads.try_recv() else {
+            panic!("The upload must be tracked before the following message is published");
+        };
+        assert_eq!(Some(started), uploaded_id);
+
+        // The message completing the batch waits for the upload
+        tokio::time::sleep(Duration::from_millis(200)).await;
+        assert!(pipeline.mqtt.requests_rx.is_empty());
+
+        preparation.cancel();
+        timeout(Duration::from_secs(10), sending)
+            .await
+            .expect("The sender must stop when the upload is cancelled")
+            .unwrap();
+        assert!(pipeline.mqtt.requests_rx.is_empty());
+
+        let stored = stored_messages(&store).await;
+        assert!(stored.iter().any(|msg| msg.id == uploaded_id));
+        assert!(stored.iter().any(|msg| msg.id == closing_id));
+    }
+}
@@ -3,6 +3,7 @@ use std::time::{Duration, Instant};
 use anyhow::{anyhow, Result};
 use chrono::{DateTime, Utc};
 use http::Uri;
+use tokio::runtime::Handle;
 use tokio::select;
 use tokio::sync::{mpsc, watch};
 
@@ -44,16 +45,15 @@ struct ConnectionToken {
 }
 
 impl TokenHandler {
-    pub async fn init(
+    // Both tokens have already been stored together with the rest of the configuration when the store was created
+    pub fn init(
+        runtime: &Handle,
         instance_url: Uri,
         provisioning_token: ProvisioningToken,
         registration_token: RegistrationToken,
         store: ConfigurationStore,
         initial_registration_response: Option<RegistrationResponse>,
-    ) -> Result<(RegistrationWatch, RegistrationCommandSender)> {
-        store.save_provisioning_token(&provisioning_token).await?;
-        store.save_registration_token(&registration_token).await?;
-
+    ) -> (RegistrationWatch, RegistrationCommandSender) {
         let cache = TokenCache {
             provisioning_token,
             registration_token: RegistrationToken {
@@ -79,11 +79,11 @@ impl TokenHandler {
             last_registration_refresh_attempt: Instant::now(),
         };
 
-        tokio::spawn(async {
+        runtime.spawn(async {
             handler.refresh_tokens(initial_registration_response).await;
         });
 
-        Ok((registration_receiver, command_sender))
+        (registration_receiver, command_sender)
     }
 
     async fn refresh_tokens(mut self, initial_registration_response: Option<RegistrationResponse>) {
@@ -1,6 +1,9 @@
 use std::{collections::VecDeque, sync::Arc};
 
-use crate::connection::twins::{DesiredProperties, DesiredPropertiesUpdatedCallback, TwinsClient};
+use crate::connection::twins::{
+    DesiredProperties, DesiredPropertiesChange, DesiredPropertiesChangedCallback,
+    DesiredPropertiesUpdatedCallback, SharedDesiredProperties, TwinsClient,
+};
 use crate::persistence::twins::{
     ReportedPropertiesUpdate, ReportedPropertiesUpdateType, Twin, TwinUpdate, Twins,
 };
@@ -13,8 +16,11 @@ use tokio::sync::{mpsc, watch, Mutex};
 use crate::persistence::{sqlite_channel, TwinsStore};
 
 use super::handlers::twins::PropertiesUpdateError;
+use super::json_diff;
 
-use self::update_callback_dispatcher::DesiredPropertiesUpdatedCallbackDispatcher;
+use self::update_callback_dispatcher::{
+    DesiredPropertiesChangedCallbackDispatcher, DesiredPropertiesUpdatedCallbackDispatcher,
+};
 
 mod update_callback_dispatcher;
 
@@ -49,12 +55,16 @@ impl InitializationWaiter {
 pub(crate) struct DeviceTwin {
     store: TwinsStore,
     desired: Option<Twin>,
+    // The JSON serialization of `desired`, it's updated only when a new version is received
+    desired_serialized: Option<SharedDesiredProperties>,
     reported: Option<Twin>,
     desired_properties_updates: VecDeque<TwinUpdate>,
     desired_initialized_tx: watch::Sender<bool>,
     reported_initialized_tx: watch::Sender<bool>,
     desired_properties_update_callback_dispatcher:
         Option<DesiredPropertiesUpdatedCallbackDispatcher>,
+    desired_properties_change_callback_dispatcher:
+        Option<DesiredPropertiesChangedCallbackDispatcher>,
 }
 
 impl DeviceTwin {
@@ -71,14 +81,18 @@ impl DeviceTwin {
         let desired_properties_update_callback_dispatcher = desired_properties_updated_callback
             .map(DesiredPropertiesUpdatedCallbackDispatcher::new);
 
+        let desired_serialized = desired.as_ref().map(share_properties);
+
         DeviceTwin {
             store,
             desired,
+            desired_serialized,
             reported,
             desired_properties_updates: VecDeque::new(),
             desired_initialized_tx,
             reported_initialized_tx,
             desired_properties_update_callback_dispatcher,
+            desired_properties_change_callback_dispatcher: None,
         }
     }
 
@@ -132,7 +146,7 @@ impl DeviceTwin {
         }
 
         log::debug!("Setting desired properties to version {version}");
-        self.desired = Some(Twin {
+        let previous = self.desired.replace(Twin {
             version,
             properties,
         });
@@ -149,7 +163,16 @@ impl DeviceTwin {
 
         self.store.save_desired_properties(desired).await?;
 
-        self.notify_desired_properties_updated()?;
+        // The paths are compared only if anyone is interested in them
+        let changed_paths = match &self.desired_properties_change_callback_dispatcher {
+            None => Vec::new(),
+            Some(_) => {
+                let previous = previous.map_or_else(|| serde_json::json!({}), |t| t.properties);
+                changed_paths(&json_diff::diff_values(&previous, &desired.properties)?)
+            }
+        };
+
+        self.notify_desired_properties_updated(changed_paths)?;
 
         Ok(())
     }
@@ -183,7 +206,7 @@ impl DeviceTwin {
 
                     self.store.save_desired_properties(twin).await?;
 
-                    self.notify_desired_properties_updated()?;
+                    self.notify_desired_properties_updated(changed_paths(&update.patch))?;
                 } else {
                     log::info!("Unable to apply Desired Properties patch of version {} because we are at {}.", version, twin.version);
                     return Err(PropertiesUpdateError::PatchVersionMismatch {
@@ -222,21 +245,32 @@ impl DeviceTwin {
         Ok(())
     }
 
-    fn notify_desired_properties_updated(&self) -> Result<()> {
+    fn notify_desired_properties_updated(&mut self, changed_paths: Vec<String>) -> Result<()> {
+        let desired = share_properties(
+            self.desired
+                .as_ref()
+                .expect("Desired Properties should have been initialized"),
+        );
+        self.desired_serialized = Some(desired.clone());
+
         self.desired_initialized_tx.send_replace(true);
 
         if let Some(dispatcher) = &self.desired_properties_update_callback_dispatcher {
-            let desired = self
-                .desired
-                .as_ref()
-                .expect("Desired Properties should have been initialized");
-
             dispatcher.dispatch(DesiredProperties {
                 version: desired.version,
-                values: desired.properties.to_string(),
+                values: desired.values.to_string(),
             })?;
         }
 
+        if let Some(dispatcher) = &self.desired_properties_change_callback_dispatcher {
+            if !changed_paths.is_empty() {
+                dispatcher.dispatch(DesiredPropertiesChange {
+                    changed_paths,
+                    properties: desired,
+                })?;
+            }
+        }
+
         Ok(())
     }
 
@@ -244,8 +278,16 @@ impl DeviceTwin {
         self.reported_initialized_tx.send_replace(true);
     }
 
-    pub(super) fn desired_properties(&self) -> &Option<Twin> {
-        &self.desired
+    pub(super) fn desired_properties(&self) -> &Option<SharedDesiredProperties> {
+        &self.desired_serialized
+    }
+
+    pub(super) fn subscribe_desired_properties_changes(
+        &mut self,
+        callback: Box<dyn DesiredPropertiesChangedCallback>,
+    ) {
+        self.desired_properties_change_callback_dispatcher =
+            Some(DesiredPropertiesChangedCallbackDispatcher::new(callback));
     }
 
     pub(super) fn reported_properties(&self) -> &Option<Twin> {
@@ -310,6 +352,17 @@ impl TwinsClient for IotHubTwinsClient {
         Ok(())
     }
 
+    async fn set_reported_property(&self, path: &str, value: &str) -> Result<()> {
+        let value = serde_json::from_str(value)
+            .context("Unable to deserialize JSON representation of the reported property")?;
+        self.patch_reported_property(path, value).await
+    }
+
+    async fn remove_reported_property(&self, path: &str) -> Result<()> {
+        self.patch_reported_property(path, serde_json::Value::Null)
+            .await
+    }
+
     async fn get_desired_properties(&self) -> Result<DesiredProperties> {
         self.desired_properties_changed
             .lock()
@@ -322,7 +375,7 @@ impl TwinsClient for IotHubTwinsClient {
             .as_ref()
             .map(|t| DesiredProperties {
                 version: t.version,
-                values: t.properties.to_string(),
+                values: t.values.to_string(),
             })
             .ok_or_else(|| {
                 anyhow!(
@@ -345,7 +398,7 @@ impl TwinsClient for IotHubTwinsClient {
                 if t.version > version {
                     Some(DesiredProperties {
                         version: t.version,
-                        values: t.properties.to_string(),
+                        values: t.values.to_string(),
                     })
                 } else {
                     None
@@ -353,6 +406,33 @@ impl TwinsClient for IotHubTwinsClient {
             })
     }
 
+    async fn get_shared_desired_properties(&self) -> Result<SharedDesiredProperties> {
+        self.desired_properties_changed
+            .lock()
+            .await
+            .borrow_and_update();
+        self.twins
+            .lock()
+            .await
+            .desired_properties()
+            .clone()
+            .ok_or_else(|| {
+                anyhow!(
+                    "Desired Properties haven't been initialized yet, although they should have."
+                )
+            })
+    }
+
+    async fn subscribe_desired_properties_changes(
+        &self,
+        callback: Box<dyn DesiredPropertiesChangedCallback>,
+    ) {
+        self.twins
+            .lock()
+            .await
+            .subscribe_desired_properties_changes(callback);
+    }
+
     async fn get_reported_properties(&self) -> Option<String> {
         self.twins
             .lock()
@@ -380,7 +460,7 @@ impl TwinsClient for IotHubTwinsClient {
 
         Ok(DesiredProperties {
             version: desired.version,
-            values: desired.properties.to_string(),
+            values: desired.values.to_string(),
         })
     }
 
@@ -432,6 +512,27 @@ impl IotHubTwinsClient {
             .await
     }
 
+    async fn patch_reported_property(&self, path: &str, value: serde_json::Value) -> Result<()> {
+        let patch = ReportedPropertiesUpdate {
+            id: None,
+            update_type: ReportedPropertiesUpdateType::Patch,
+            patch: property_patch(path, value)?,
+        };
+
+        self.reported_properties_updates.send(&patch).await?;
+
+        Ok(())
+    }
+
+    pub(crate) async fn get_reported_properties_value(&self) -> Option<serde_json::Value> {
+        self.twins
+            .lock()
+            .await
+            .reported_properties()
+            .as_ref()
+            .map(|t| t.properties.clone())
+    }
+
     pub(crate) async fn update_reported_properties(&self, patch: &str) -> Result<()> {
         self.twins
             .lock()
@@ -457,9 +558,393 @@ impl Clone for IotHubTwinsClient {
         }
     }
 }
+fn share_properties(twin: &Twin) -> SharedDesiredProperties {
+    SharedDesiredProperties {
+        version: twin.version,
+        values: Arc::from(twin.properties.to_string()),
+    }
+}
+
+/// Get the JSON Pointers of all the properties that are changed by the JSON Merge Patch.
+fn changed_paths(patch: &serde_json::Value) -> Vec<String> {
+    fn collect(value: &serde_json::Value, prefix: &mut String, paths: &mut Vec<String>) {
+        match value.as_object() {
+            Some(object) if !object.is_empty() => {
+                for (name, child) in object {
+                    let length = prefix.len();
+                    prefix.push('/');
+                    prefix.push_str(&name.replace('~', "~0").replace('/', "~1"));
+                    collect(child, prefix, paths);
+                    prefix.truncate(length);
+                }
+            }
+            // An empty object at the top level changes nothing
+            _ if prefix.is_empty() => {}
+            _ => paths.push(prefix.clone()),
+        }
+    }
+
+    let mut paths = Vec::new();
+    collect(patch, &mut String::new(), &mut paths);
+    paths
+}
+
+/// Create a JSON Merge Patch that sets the property on the provided path to `value`, or removes it if `value` is
+/// `null`. The path is a JSON Pointer (RFC 6901), for example `/sensors/temperature/unit`.
+fn property_patch(path: &str, value: serde_json::Value) -> Result<serde_json::Value> {
+    let Some(path) = path.strip_prefix('/') else {
+        bail!("The property path `{path}` must start with `/`");
+    };
+
+    let mut patch = value;
+    for segment in path.rsplit('/') {
+        if segment.is_empty() {
+            bail!("The property path `/{path}` must not contain empty segments");
+        }
+        let name = segment.replace("~1", "/").replace("~0", "~");
+        patch = serde_json::Value::Object(serde_json::Map::from_iter([(name, patch)]));
+    }
+
+    Ok(patch)
+}
+
+/// Get the patch that can be sent instead of the `updates` without knowing the current properties, which is the case
+/// of a single partial update. The common case then doesn't need to copy nor compare the whole properties.
+pub(crate) fn single_reported_properties_patch(
+    updates: &[ReportedPropertiesUpdate],
+) -> Option<&serde_json::Value> {
+    match updates {
+        [ReportedPropertiesUpdate {
+            update_type: ReportedPropertiesUpdateType::Patch,
+            patch,
+            ..
+        }] => Some(patch),
+        _ => None,
+    }
+}
+
+/// Split the `updates` into the patches sent in separate requests, each with the updates it applies. The updates are
+/// coalesced into a single patch only if the `current` properties are known, otherwise they are sent one by one.
+pub(crate) fn reported_properties_requests(
+    current: Option<serde_json::Value>,
+    updates: Vec<ReportedPropertiesUpdate>,
+) -> Result<Vec<(serde_json::Value, Vec<ReportedPropertiesUpdate>)>> {
+    if let Some(patch) = single_reported_properties_patch(&updates) {
+        return Ok(vec![(patch.clone(), updates)]);
+    }
+
+    match current {
+        Some(current) => {
+            let patch = coalesce_reported_properties_updates(current, &updates)?;
+            Ok(vec![(patch, updates)])
+        }
+        // Without the local copy, the properties removed by the updates cannot be told from the ones that were never
+        // reported, so each update is sent as is
+        None => updates
+            .into_iter()
+            .map(|update| {
+                let patch = match update.update_type {
+                    ReportedPropertiesUpdateType::Patch => update.patch.clone(),
+                    ReportedPropertiesUpdateType::Full => {
+                        json_diff::diff_values(&serde_json::json!({}), &update.patch)?
+                    }
+                };
+                Ok((patch, vec![update]))
+            })
+            .collect(),
+    }
+}
+
+/// Compute the single patch that has the same effect on the `current` properties as applying all the `updates` in
+/// order.
+fn coalesce_reported_properties_updates(
+    current: serde_json::Value,
+    updates: &[ReportedPropertiesUpdate],
+) -> Result<serde_json::Value> {
+    // Merge patches cannot be composed without the document they are applied to, so they are applied to a copy and
+    // the result is compared with the original
+    let mut target = current.clone();
+    for update in updates {
+        match update.update_type {
+            ReportedPropertiesUpdateType::Patch => merge(&mut target, &update.patch),
+            ReportedPropertiesUpdateType::Full => target = update.patch.clone(),
+        }
+    }
+
+    let mut patch = json_diff::diff_values(&current, &target)?;
+
+    // The diff removes only the properties contained in the local copy, which can miss some of the reported ones, so
+    // the removals requested since the last full update are kept unless a later update sets the property again
+    let since_full = updates
+        .iter()
+        .rposition(|update| matches!(update.update_type, ReportedPropertiesUpdateType::Full))
+        .map_or(0, |position| position + 1);
+    let mut removed = Vec::new();
+    for update in updates[since_full..].iter().rev() {
+        removed_paths(&update.patch, &mut Vec::new(), &mut removed);
+    }
+    for path in &removed {
+        if property(&target, path).is_none() {
+            keep_removal(&mut patch, &target, path);
+        }
+    }
+
+    Ok(patch)
+}
+
+/// Collect the paths of the properties that the merge patch removes.
+fn removed_paths<'a>(
+    patch: &'a serde_json::Value,
+    prefix: &mut Vec<&'a str>,
+    paths: &mut Vec<Vec<&'a str>>,
+) {
+    match patch {
+        serde_json::Value::Object(object) => {
+            for (name, child) in object {
+                prefix.push(name);
+                removed_paths(child, prefix, paths);
+                prefix.pop();
+            }
+        }
+        serde_json::Value::Null if !prefix.is_empty() => paths.push(prefix.clone()),
+        _ => {}
+    }
+}
+
+fn property<'a>(
+    properties: &'a serde_json::Value,
+    path: &[&str],
+) -> Option<&'a serde_json::Value> {
+    path.iter()
+        .try_fold(properties, |value, name| value.as_object()?.get(*name))
+}
+
+/// Add the removal of the property to the patch unless the patch already replaces or removes one of its parents.
+fn keep_removal(patch: &mut serde_json::Value, target: &serde_json::Value, path: &[&str]) {
+    let Some((name, parents)) = path.split_last() else {
+        return;
+    };
+
+    let mut patch = patch;
+    for (depth, parent) in parents.iter().enumerate() {
+        let Some(object) = patch.as_object_mut() else {
+            return;
+        };
+        if !object.contains_key(*parent) {
+            // A parent that is kept as it is cannot contain the property unless it's an object
+            if property(target, &path[..=depth]).is_some_and(|value| !value.is_object()) {
+                return;
+            }
+            object.insert((*parent).to_owned(), serde_json::json!({}));
+        }
+        patch = &mut object[*parent];
+    }
+
+    if let Some(object) = patch.as_object_mut() {
+        object
+            .entry((*name).to_owned())
+            .or_insert(serde_json::Value::Null);
+    }
+}
+
 #[cfg(test)]
 mod tests {
-    use crate::persistence::twins::{TwinUpdate, Twins};
+    use serde_json::json;
+
+    use super::{
+        changed_paths, coalesce_reported_properties_updates, property_patch,
+        reported_properties_requests, single_reported_properties_patch,
+    };
+    use crate::persistence::twins::{
+        ReportedPropertiesUpdate, ReportedPropertiesUpdateType, TwinUpdate, Twins,
+    };
+
+    fn update(
+        update_type: ReportedPropertiesUpdateType,
+        patch: serde_json::Value,
+    ) -> ReportedPropertiesUpdate {
+        ReportedPropertiesUpdate {
+            id: None,
+            update_type,
+            patch,
+        }
+    }
+
+    #[test]
+    fn property_patch_nested() {
+        let patch = property_patch("/a/b~1c/d~0e", json!(42)).unwrap();
+        assert_eq!(patch, json!({"a": {"b/c": {"d~e": 42}}}));
+    }
+
+    #[test]
+    fn property_patch_invalid_path() {
+        assert!(property_patch("a/b", json!(1)).is_err());
+        assert!(property_patch("/a//b", json!(1)).is_err());
+        assert!(property_patch("/", json!(1)).is_err());
+    }
+
+    #[test]
+    fn changed_paths_of_patch() {
+        let patch = json!({"a": {"b": 1, "c/d": null}, "e": {}, "f": [1, 2]});
+        let mut paths = changed_paths(&patch);
+        paths.sort();
+        assert_eq!(paths, ["/a/b", "/a/c~1d", "/e", "/f"]);
+        assert!(changed_paths(&json!({})).is_empty());
+    }
+
+    fn patches(
+        requests: &[(serde_json::Value, Vec<ReportedPropertiesUpdate>)],
+    ) -> Vec<&serde_json::Value> {
+        requests.iter().map(|(patch, _)| patch).collect()
+    }
+
+    #[test]
+    fn single_patch_is_sent_as_is() {
+        let patch = json!({"a": null});
+        let updates = vec![update(ReportedPropertiesUpdateType::Patch, patch.clone())];
+        let requests = reported_properties_requests(None, updates).unwrap();
+        assert_eq!(patches(&requests), [&patch]);
+    }
+
+    #[test]
+    fn removals_without_current_properties_are_sent_one_by_one() {
+        let updates = vec![
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                property_patch("/a", json!(null)).unwrap(),
+            ),
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                property_patch("/b/c", json!(null)).unwrap(),
+            ),
+        ];
+
+        let requests = reported_properties_requests(None, updates).unwrap();
+
+        assert_eq!(
+            patches(&requests),
+            [&json!({"a": null}), &json!({"b": {"c": null}})]
+        );
+        assert!(requests.iter().all(|(_, updates)| updates.len() == 1));
+    }
+
+    #[test]
+    fn coalesce_keeps_removals_missing_from_current_properties() {
+        let current = json!({"a": 1, "d": 2});
+        let updates = [
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                json!({"b": null, "c": {"e": null}}),
+            ),
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                json!({"a": null, "d": 3, "f": null}),
+            ),
+            update(ReportedPropertiesUpdateType::Patch, json!({"f": 4})),
+        ];
+
+        let coalesced = coalesce_reported_properties_updates(current, &updates).unwrap();
+        assert_eq!(
+            coalesced,
+            json!({"a": null, "b": null, "c": {"e": null}, "d": 3, "f": 4})
+        );
+    }
+
+    #[test]
+    fn coalesce_does_not_remove_from_replaced_properties() {
+        let current = json!({});
+        let updates = [
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                json!({"a": {"b": null}}),
+            ),
+            update(ReportedPropertiesUpdateType::Patch, json!({"a": null})),
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                json!({"c": {"d": null}}),
+            ),
+            update(ReportedPropertiesUpdateType::Patch, json!({"c": 1})),
+        ];
+
+        let coalesced = coalesce_reported_properties_updates(current, &updates).unwrap();
+        assert_eq!(coalesced, json!({"a": null, "c": 1}));
+    }
+
+    #[test]
+    fn coalesce_patches_replacing_objects() {
+        let current = json!({"a": {"b": 5}, "c": 1});
+        let updates = [
+            update(ReportedPropertiesUpdateType::Patch, json!({"a": 1})),
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                json!({"a": {"d": 2}, "c": null}),
+            ),
+        ];
+
+        let coalesced =
+            coalesce_reported_properties_updates(current.clone(), &updates).unwrap();
+
+        let mut patched = current;
+        json_patch::merge(&mut patched, &coalesced);
+        assert_eq!(patched, json!({"a": {"d": 2}}));
+    }
+
+    #[test]
+    fn coalesce_full_and_patch() {
+        let current = json!({"a": 1, "b": 2});
+        let updates = [
+            update(ReportedPropertiesUpdateType::Full, json!({"a": 3})),
+            update(ReportedPropertiesUpdateType::Patch, json!({"c": 4})),
+        ];
+
+        let coalesced = coalesce_reported_properties_updates(current, &updates).unwrap();
+        assert_eq!(coalesced, json!({"a": 3, "b": null, "c": 4}));
+    }
+
+    #[test]
+    fn coalesce_full_and_path_updates() {
+        let current = json!({"a": {"b": 1, "c": 2}, "d": 3});
+        let updates = [
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                property_patch("/a/b", json!(null)).unwrap(),
+            ),
+            update(
+                ReportedPropertiesUpdateType::Full,
+                json!({"a": {"c": 2}, "e": {"f": 1}}),
+            ),
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                property_patch("/e/f", json!(null)).unwrap(),
+            ),
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                property_patch("/g/h", json!(5)).unwrap(),
+            ),
+            update(
+                ReportedPropertiesUpdateType::Patch,
+                property_patch("/d", json!(null)).unwrap(),
+            ),
+        ];
+        assert!(single_reported_properties_patch(&updates).is_none());
+
+        let coalesced =
+            coalesce_reported_properties_updates(current.clone(), &updates).unwrap();
+
+        let mut patched = current;
+        json_patch::merge(&mut patched, &coalesced);
+        assert_eq!(patched, json!({"a": {"c": 2}, "e": {}, "g": {"h": 5}}));
+    }
+
+    #[test]
+    fn single_patch_needs_no_current_properties() {
+        let patch = property_patch("/a/b", json!(null)).unwrap();
+        let updates = [update(ReportedPropertiesUpdateType::Patch, patch.clone())];
+        assert_eq!(single_reported_properties_patch(&updates), Some(&patch));
+
+        let updates = [update(ReportedPropertiesUpdateType::Full, patch)];
+        assert!(single_reported_properties_patch(&updates).is_none());
+    }
 
     #[test]
     fn deserialize_twins() {
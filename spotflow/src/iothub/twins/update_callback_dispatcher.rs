@@ -1,16 +1,41 @@
 use anyhow::{Context, Result};
-use std::{panic::catch_unwind, sync::mpsc, thread::JoinHandle};
+use std::{
+    fmt,
+    panic::{catch_unwind, RefUnwindSafe, UnwindSafe},
+    sync::mpsc,
+    thread::JoinHandle,
+};
 
-use crate::connection::twins::{DesiredProperties, DesiredPropertiesUpdatedCallback};
+use crate::connection::twins::{
+    DesiredProperties, DesiredPropertiesChange, DesiredPropertiesChangedCallback,
+    DesiredPropertiesUpdatedCallback,
+};
 
-#[derive(Debug)]
-pub struct DesiredPropertiesUpdatedCallbackDispatcher {
-    sender: Option<mpsc::Sender<DesiredProperties>>,
-    thread: Option<JoinHandle<()>>,
-}
+pub type DesiredPropertiesUpdatedCallbackDispatcher = CallbackDispatcher<DesiredProperties>;
+pub type DesiredPropertiesChangedCallbackDispatcher = CallbackDispatcher<DesiredPropertiesChange>;
 
 impl DesiredPropertiesUpdatedCallbackDispatcher {
     pub fn new(callback: Box<dyn DesiredPropertiesUpdatedCallback>) -> Self {
+        Self::start(move |properties| callback.properties_updated(properties))
+    }
+}
+
+impl DesiredPropertiesChangedCallbackDispatcher {
+    pub fn new(callback: Box<dyn DesiredPropertiesChangedCallback>) -> Self {
+        Self::start(move |change| callback.properties_changed(change))
+    }
+}
+
+pub struct CallbackDispatcher<T> {
+    sender: Option<mpsc::Sender<T>>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl<T: Send + UnwindSafe + 'static> CallbackDispatcher<T> {
+    fn start<F>(callback: F) -> Self
+    where
+        F: Fn(T) -> Result<()> + Send + RefUnwindSafe + 'static,
+    {
         let (sender, receiver) = mpsc::channel();
 
         log::debug!("Starting properties updated processing thread.");
@@ -19,7 +44,7 @@ impl DesiredPropertiesUpdatedCallbackDispatcher {
         let thread = std::thread::spawn(move || {
             while let Ok(properties) = receiver.recv() {
                 let result = catch_unwind(|| {
-                    if let Err(e) = callback.properties_updated(properties) {
+                    if let Err(e) = callback(properties) {
                         log::error!("Properties updated processing callback failed: {}", e);
                     }
                 });
@@ -48,8 +73,10 @@ impl DesiredPropertiesUpdatedCallbackDispatcher {
             thread: Some(thread),
         }
     }
+}
 
-    pub fn dispatch(&self, properties: DesiredProperties) -> Result<()> {
+impl<T> CallbackDispatcher<T> {
+    pub fn dispatch(&self, properties: T) -> Result<()> {
         self.sender
             .as_ref()
             .expect("Sender unexpectedly empty")
@@ -58,7 +85,15 @@ impl DesiredPropertiesUpdatedCallbackDispatcher {
     }
 }
 
-impl Drop for DesiredPropertiesUpdatedCallbackDispatcher {
+impl<T> fmt::Debug for CallbackDispatcher<T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("CallbackDispatcher")
+            .field("thread", &self.thread)
+            .finish_non_exhaustive()
+    }
+}
+
+impl<T> Drop for CallbackDispatcher<T> {
     fn drop(&mut self) {
         // We need to drop the sender so that the thread stops waiting for more method calls
         drop(self.sender.take());
@@ -31,22 +31,28 @@
 
 use anyhow::Result;
 
+#[cfg(feature = "bench")]
+#[doc(hidden)]
+pub mod bench;
 mod cloud;
 mod connection;
 mod ingress;
 mod iothub;
+mod metrics;
 mod persistence;
 
 #[doc(hidden)]
 pub use ingress::CloudToDeviceMessage;
 
 pub use ingress::{
-    Compression, DesiredProperties, DesiredPropertiesUpdatedCallback, DeviceClient,
-    DeviceClientBuilder, MessageContext, ProvisioningOperation,
-    ProvisioningOperationDisplayHandler,
+    Compression, DesiredProperties, DesiredPropertiesChange, DesiredPropertiesChangedCallback,
+    DesiredPropertiesUpdatedCallback, DeviceClient, DeviceClientBuilder, Durability,
+    EnqueueCompletedCallback, Gateway, MessageContext, OutgoingMessage, OverflowPolicy, Priority,
+    ProvisioningOperation, ProvisioningOperationDisplayHandler, QueueLimit, ReconnectPolicy,
+    ReconnectStatistics, SharedDesiredProperties, StorageProfile, SubmissionQueueFull,
+    MIN_WORKER_THREADS,
 };
-
-pub(crate) mod utils;
+pub use metrics::{CompressionStatistics, LatencyHistogram, Metrics, LATENCY_HISTOGRAM_BUCKETS};
 
 /// Checks if a system signal requested the process to stop.
 ///
@@ -0,0 +1,320 @@
+use std::{
+    sync::atomic::{AtomicU64, Ordering},
+    time::{Duration, Instant},
+};
+
+use crate::iothub::{ReconnectMetrics, ReconnectStatistics};
+use crate::persistence::Compression;
+
+/// The number of buckets of each [`LatencyHistogram`].
+pub const LATENCY_HISTOGRAM_BUCKETS: usize = 32;
+
+// The times of the most recently stored messages are kept in a fixed number of slots so that they can be looked up
+// when the messages are published without any locking or allocation
+const STORED_TIME_SLOTS: usize = 4096;
+
+/// The snapshot of the metrics of a [`DeviceClient`](crate::DeviceClient) since it was started, see
+/// [`DeviceClient::metrics`](crate::DeviceClient::metrics).
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct Metrics {
+    /// The number of [Messages](https://docs.spotflow.io/send-data/#message) waiting to be sent.
+    pub pending_messages: usize,
+    /// How long the calls enqueuing Messages took, one sample per call.
+    pub enqueue_latency: LatencyHistogram,
+    /// How long the Messages waited in the local database file before they were sent. Only the Messages stored
+    /// since the client was started are measured, and only if fewer than 4096 Messages were stored while they waited.
+    pub time_in_queue: LatencyHistogram,
+    /// How long it took the Platform to acknowledge the sent Messages.
+    pub puback_round_trip: LatencyHistogram,
+    /// How long the statements storing, reading, and removing Messages in the local database file took.
+    pub sqlite_statement_latency: LatencyHistogram,
+    /// The compression of the Messages using [`Compression::Fastest`](crate::Compression::Fastest).
+    pub compression_fastest: CompressionStatistics,
+    /// The compression of the Messages using [`Compression::SmallestSize`](crate::Compression::SmallestSize).
+    pub compression_smallest_size: CompressionStatistics,
+    /// The compression of the Messages using [`Compression::SmallMessages`](crate::Compression::SmallMessages).
+    pub compression_small_messages: CompressionStatistics,
+    /// The number of MQTT messages published to the Platform. Messages packed together by
+    /// [`DeviceClientBuilder::with_message_coalescing`](crate::DeviceClientBuilder::with_message_coalescing) count as one.
+    pub messages_sent: u64,
+    /// The number of bytes of the topics and the payloads of the published MQTT messages.
+    pub bytes_sent: u64,
+    /// The statistics of the reconnections to the Platform.
+    pub reconnects: ReconnectStatistics,
+}
+
+/// The distribution of durations. The bucket with index `i` counts the durations shorter than `2^i` microseconds that
+/// don't fit into the previous buckets, the last bucket counts all the longer durations.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct LatencyHistogram {
+    /// The number of recorded durations.
+    pub count: u64,
+    /// The sum of the recorded durations.
+    pub sum: Duration,
+    /// The number of recorded durations in each bucket.
+    pub buckets: [u64; LATENCY_HISTOGRAM_BUCKETS],
+}
+
+impl LatencyHistogram {
+    /// The exclusive upper bound of the bucket with the provided index, `None` for the last bucket.
+    #[must_use]
+    pub fn bucket_upper_bound(index: usize) -> Option<Duration> {
+        if index + 1 >= LATENCY_HISTOGRAM_BUCKETS {
+            return None;
+        }
+        Some(Duration::from_micros(1 << index))
+    }
+}
+
+/// The statistics of compressing the [Messages](https://docs.spotflow.io/send-data/#message) with one compression mode.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct CompressionStatistics {
+    /// The number of compressed Messages.
+    pub messages: u64,
+    /// The total size of the Messages before compression.
+    pub uncompressed_bytes: u64,
+    /// The total size of the Messages after compression. The Messages that wouldn't get smaller are sent uncompressed
+    /// and count with their original size.
+    pub compressed_bytes: u64,
+    /// How long the compression of each Message took.
+    pub duration: LatencyHistogram,
+}
+
+/// The lock-free counters behind [`Metrics`] shared by the components of a client.
+#[derive(Debug)]
+pub(crate) struct MetricsRegistry {
+    pub(crate) enqueue_latency: Histogram,
+    pub(crate) time_in_queue: Histogram,
+    pub(crate) puback_round_trip: Histogram,
+    pub(crate) sqlite_statement_latency: Histogram,
+    compression: [CompressionCounters; 3],
+    messages_sent: AtomicU64,
+    bytes_sent: AtomicU64,
+    pub(crate) reconnect: ReconnectMetrics,
+    started: Instant,
+    // The ID of each message in the upper half and the milliseconds since `started` when it was stored in the lower one
+    stored_times: Box<[AtomicU64]>,
+}
+
+impl MetricsRegistry {
+    pub(crate) fn new() -> Self {
+        Self {
+            enqueue_latency: Histogram::default(),
+            time_in_queue: Histogram::default(),
+            puback_round_trip: Histogram::default(),
+            sqlite_statement_latency: Histogram::default(),
+            compression: Default::default(),
+            messages_sent: AtomicU64::new(0),
+            bytes_sent: AtomicU64::new(0),
+            reconnect: ReconnectMetrics::default(),
+            started: Instant::now(),
+            stored_times: (0..STORED_TIME_SLOTS).map(|_| AtomicU64::new(0)).collect(),
+        }
+    }
+
+    pub(crate) fn record_compression(
+        &self,
+        compression: Compression,
+        uncompressed_bytes: usize,
+        compressed_bytes: usize,
+        duration: Duration,
+    ) {
+        let Some(counters) = self.compression_counters(compression) else {
+            return;
+        };
+
+        counters.messages.fetch_add(1, Ordering::Relaxed);
+        counters
+            .uncompressed_bytes
+            .fetch_add(to_u64(uncompressed_bytes), Ordering::Relaxed);
+        counters
+            .compressed_bytes
+            .fetch_add(to_u64(compressed_bytes), Ordering::Relaxed);
+        counters.duration.record(duration);
+    }
+
+    pub(crate) fn record_sent(&self, bytes: usize) {
+        self.messages_sent.fetch_add(1, Ordering::Relaxed);
+        self.bytes_sent.fetch_add(to_u64(bytes), Ordering::Relaxed);
+    }
+
+    pub(crate) fn record_stored(&self, ids: &[i32]) {
+        let now = self.millis_since_start();
+        for &id in ids {
+            if let Some((slot, id)) = self.stored_time_slot(id) {
+                slot.store((u64::from(id) << 32) | u64::from(now), Ordering::Relaxed);
+            }
+        }
+    }
+
+    pub(crate) fn record_published(&self, id: i32) {
+        let Some((slot, id)) = self.stored_time_slot(id) else {
+            return;
+        };
+
+        let value = slot.load(Ordering::Relaxed);
+        if value >> 32 != u64::from(id) || value == 0 {
+            // The slot has been reused by a newer message or the message was stored before the client was started
+            return;
+        }
+
+        let stored = u32::try_from(value & u64::from(u32::MAX)).unwrap_or_default();
+        let waited = self.millis_since_start().wrapping_sub(stored);
+        self.time_in_queue
+            .record(Duration::from_millis(u64::from(waited)));
+    }
+
+    pub(crate) fn snapshot(&self, pending_messages: usize) -> Metrics {
+        let [fastest, smallest_size, small_messages] = &self.compression;
+        Metrics {
+            pending_messages,
+            enqueue_latency: self.enqueue_latency.snapshot(),
+            time_in_queue: self.time_in_queue.snapshot(),
+            puback_round_trip: self.puback_round_trip.snapshot(),
+            sqlite_statement_latency: self.sqlite_statement_latency.snapshot(),
+            compression_fastest: fastest.snapshot(),
+            compression_smallest_size: smallest_size.snapshot(),
+            compression_small_messages: small_messages.snapshot(),
+            messages_sent: self.messages_sent.load(Ordering::Relaxed),
+            bytes_sent: self.bytes_sent.load(Ordering::Relaxed),
+            reconnects: self.reconnect.snapshot(),
+        }
+    }
+
+    fn compression_counters(&self, compression: Compression) -> Option<&CompressionCounters> {
+        let [fastest, smallest_size, small_messages] = &self.compression;
+        match compression {
+            Compression::None | Compression::BrotliCompressed => None,
+            Compression::BrotliFastest => Some(fastest),
+            Compression::BrotliSmallestSize => Some(smallest_size),
+            Compression::BrotliSmallMessages => Some(small_messages),
+        }
+    }
+
+    fn stored_time_slot(&self, id: i32) -> Option<(&AtomicU64, u32)> {
+        let id = u32::try_from(id).ok()?;
+        let index = usize::try_from(id).ok()? % STORED_TIME_SLOTS;
+        Some((self.stored_times.get(index)?, id))
+    }
+
+    // Wraps around after 49 days, which is only a problem for the messages waiting for longer than that
+    fn millis_since_start(&self) -> u32 {
+        let millis = self.started.elapsed().as_millis() % (u128::from(u32::MAX) + 1);
+        u32::try_from(millis).unwrap_or_default()
+    }
+}
+
+/// A lock-free histogram of durations with the buckets described by [`LatencyHistogram`].
+#[derive(Debug, Default)]
+pub(crate) struct Histogram {
+    count: AtomicU64,
+    sum_us: AtomicU64,
+    buckets: [AtomicU64; LATENCY_HISTOGRAM_BUCKETS],
+}
+
+impl Histogram {
+    pub(crate) fn record(&self, duration: Duration) {
+        let us = u64::try_from(duration.as_micros()).unwrap_or(u64::MAX);
+        let index = usize::try_from(u64::BITS - us.leading_zeros())
+            .unwrap_or(usize::MAX)
+            .min(LATENCY_HISTOGRAM_BUCKETS - 1);
+
+        if let Some(bucket) = self.buckets.get(index) {
+            bucket.fetch_add(1, Ordering::Relaxed);
+        }
+        self.sum_us.fetch_add(us, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Record the time elapsed since `start`.
+    pub(crate) fn record_since(&self, start: Instant) {
+        self.record(start.elapsed());
+    }
+
+    fn snapshot(&self) -> LatencyHistogram {
+        let mut buckets = [0; LATENCY_HISTOGRAM_BUCKETS];
+        for (snapshot, bucket) in buckets.iter_mut().zip(&self.buckets) {
+            *snapshot = bucket.load(Ordering::Relaxed);
+        }
+
+        LatencyHistogram {
+            count: self.count.load(Ordering::Relaxed),
+            sum: Duration::from_micros(self.sum_us.load(Ordering::Relaxed)),
+            buckets,
+        }
+    }
+}
+
+#[derive(Debug, Default)]
+struct CompressionCounters {
+    messages: AtomicU64,
+    uncompressed_bytes: AtomicU64,
+    compressed_bytes: AtomicU64,
+    duration: Histogram,
+}
+
+impl CompressionCounters {
+    fn snapshot(&self) -> CompressionStatistics {
+        CompressionStatistics {
+            messages: self.messages.load(Ordering::Relaxed),
+            uncompressed_bytes: self.uncompressed_bytes.load(Ordering::Relaxed),
+            compressed_bytes: self.compressed_bytes.load(Ordering::Relaxed),
+            duration: self.duration.snapshot(),
+        }
+    }
+}
+
+fn to_u64(value: usize) -> u64 {
+    u64::try_from(value).unwrap_or(u64::MAX)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::{Histogram, LatencyHistogram, MetricsRegistry, LATENCY_HISTOGRAM_BUCKETS};
+
+    #[test]
+    fn durations_fall_into_power_of_two_buckets() {
+        let histogram = Histogram::default();
+        histogram.record(Duration::ZERO);
+        histogram.record(Duration::from_micros(1));
+        histogram.record(Duration::from_micros(3));
+        histogram.record(Duration::from_secs(100_000));
+
+        let snapshot = histogram.snapshot();
+        assert_eq!(snapshot.count, 4);
+        assert_eq!(snapshot.buckets[0], 1);
+        assert_eq!(snapshot.buckets[1], 1);
+        assert_eq!(snapshot.buckets[2], 1);
+        assert_eq!(snapshot.buckets[LATENCY_HISTOGRAM_BUCKETS - 1], 1);
+    }
+
+    #[test]
+    fn bucket_upper_bounds() {
+        assert_eq!(
+            LatencyHistogram::bucket_upper_bound(0),
+            Some(Duration::from_micros(1))
+        );
+        assert_eq!(
+            LatencyHistogram::bucket_upper_bound(10),
+            Some(Duration::from_micros(1024))
+        );
+        assert_eq!(
+            LatencyHistogram::bucket_upper_bound(LATENCY_HISTOGRAM_BUCKETS - 1),
+            None
+        );
+    }
+
+    #[test]
+    fn time_in_queue_is_recorded_only_for_known_messages() {
+        let metrics = MetricsRegistry::new();
+        metrics.record_stored(&[1, 2]);
+        metrics.record_published(1);
+        // The slot of message 3 is empty and message 4098 reuses the slot of message 2
+        metrics.record_published(3);
+        metrics.record_published(4098);
+
+        assert_eq!(metrics.time_in_queue.snapshot().count, 1);
+    }
+}
@@ -1,9 +1,17 @@
+use std::collections::HashMap;
+
 use anyhow::Result;
 use async_trait::async_trait;
-use sqlx::{Connection, SqliteConnection};
+use sqlx::{Connection, QueryBuilder, Row, Sqlite, SqliteConnection};
 
 use super::{sqlite_channel::Storable, CloudToDeviceMessage};
 
+// Each property binds 3 parameters and SQLite versions before 3.32 allow at most 999 parameters in a statement
+const PROPERTIES_PER_INSERT: usize = 300;
+
+// Also bounded by the number of parameters allowed in a statement
+const IDS_PER_DELETE: usize = 900;
+
 #[derive(Debug)]
 struct CloudToDeviceMessageDb {
     id: Option<i32>,
@@ -12,6 +20,9 @@ struct CloudToDeviceMessageDb {
 
 #[async_trait]
 impl Storable for CloudToDeviceMessage {
+    // The messages are received in bursts and each of them is removed only by the channel
+    const PREFETCH: usize = 64;
+
     fn id(&self) -> i32 {
         // This is only ever called on a retrieved object which has to have an ID
         self.id
@@ -31,15 +42,15 @@ impl Storable for CloudToDeviceMessage {
 
         log::debug!("Saved C2D message with ID {}", record.id);
 
-        for (k, v) in &self.properties {
-            sqlx::query!(
-                r#"INSERT INTO CloudToDeviceProperties (message_id, key, value) VALUES (?, ?, ?);"#,
-                record.id,
-                k,
-                v,
-            )
-            .execute(&mut *transaction)
-            .await?;
+        let properties = self.properties.iter().collect::<Vec<_>>();
+        for chunk in properties.chunks(PROPERTIES_PER_INSERT) {
+            let mut query = QueryBuilder::<Sqlite>::new(
+                "INSERT INTO CloudToDeviceProperties (message_id, key, value) ",
+            );
+            query.push_values(chunk, |mut row, (k, v)| {
+                row.push_bind(record.id).push_bind(*k).push_bind(*v);
+            });
+            query.build().execute(&mut *transaction).await?;
         }
 
         transaction.commit().await?;
@@ -73,6 +84,74 @@ impl Storable for CloudToDeviceMessage {
         }))
     }
 
+    async fn load_many(
+        conn: &mut SqliteConnection,
+        minimum_id: i32,
+        limit: usize,
+    ) -> Result<Vec<Self>> {
+        let limit = i64::try_from(limit).unwrap_or(i64::MAX);
+
+        // The messages are loaded together with their properties, a message without properties has a single row with
+        // the property columns set to NULL
+        let rows = sqlx::query(
+            r#"SELECT m.id AS id, m.content AS content, p.key AS key, p.value AS value
+            FROM (SELECT id, content FROM CloudToDeviceMessages WHERE id > ? ORDER BY id LIMIT ?) AS m
+            LEFT JOIN CloudToDeviceProperties AS p ON p.message_id = m.id
+            ORDER BY m.id"#,
+        )
+        .bind(minimum_id)
+        .bind(limit)
+        .fetch_all(conn)
+        .await?;
+
+        let mut messages: Vec<CloudToDeviceMessage> = Vec::new();
+        for row in rows {
+            let id: i32 = row.try_get("id")?;
+            let key: Option<String> = row.try_get("key")?;
+            let value: Option<String> = row.try_get("value")?;
+
+            let message = match messages.last_mut() {
+                Some(message) if message.id == Some(id) => message,
+                _ => {
+                    messages.push(CloudToDeviceMessage {
+                        id: Some(id),
+                        content: row.try_get("content")?,
+                        properties: HashMap::new(),
+                    });
+                    messages.last_mut().expect("The message was just pushed")
+                }
+            };
+
+            if let (Some(key), Some(value)) = (key, value) {
+                message.properties.insert(key, value);
+            }
+        }
+
+        Ok(messages)
+    }
+
+    async fn remove_many(conn: &mut SqliteConnection, ids: &[i32]) -> Result<()> {
+        let mut transaction = conn.begin().await?;
+
+        for chunk in ids.chunks(IDS_PER_DELETE) {
+            for table in [
+                "DELETE FROM CloudToDeviceProperties WHERE message_id IN (",
+                "DELETE FROM CloudToDeviceMessages WHERE id IN (",
+            ] {
+                let mut query = QueryBuilder::<Sqlite>::new(table);
+                let mut separated = query.separated(", ");
+                for id in chunk {
+                    separated.push_bind(*id);
+                }
+                query.push(")");
+                query.build().execute(&mut *transaction).await?;
+            }
+        }
+
+        transaction.commit().await?;
+        Ok(())
+    }
+
     async fn remove(conn: &mut SqliteConnection, id: i32) -> Result<()> {
         sqlx::query!(
             "DELETE FROM CloudToDeviceProperties WHERE message_id = ?;
@@ -94,3 +173,149 @@ impl Storable for CloudToDeviceMessage {
         Ok(res.cnt.try_into().unwrap_or_default())
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::super::sqlite::SqliteStore;
+    use super::super::sqlite_channel;
+    use super::super::test_support::{open_store_with_profile, TestFile};
+    use super::super::StorageProfile;
+    use super::*;
+
+    fn message(content: &str, properties: &[(&str, &str)]) -> CloudToDeviceMessage {
+        CloudToDeviceMessage::new(
+            content.as_bytes().to_vec(),
+            properties
+                .iter()
+                .map(|(key, value)| ((*key).to_owned(), (*value).to_owned()))
+                .collect(),
+        )
+    }
+
+    async fn save(store: &SqliteStore, msg: &CloudToDeviceMessage) -> i32 {
+        msg.store(&mut *store.connection().await).await.unwrap()
+    }
+
+    async fn load_all(store: &SqliteStore) -> Vec<CloudToDeviceMessage> {
+        CloudToDeviceMessage::load_many(&mut *store.connection().await, i32::MIN, usize::MAX)
+            .await
+            .unwrap()
+    }
+
+    fn ids(messages: &[CloudToDeviceMessage]) -> Vec<i32> {
+        messages.iter().map(Storable::id).collect()
+    }
+
+    // Storing many messages one by one is faster without waiting for every commit to be flushed to the disk
+    async fn open(file: &TestFile) -> SqliteStore {
+        open_store_with_profile(file, StorageProfile::Throughput).await
+    }
+
+    #[tokio::test]
+    async fn message_without_properties_is_loaded_from_a_single_row() {
+        let file = TestFile::new();
+        let store = open(&file).await;
+        let id = save(&store, &message("content", &[])).await;
+
+        let loaded = load_all(&store).await;
+
+        assert_eq!(ids(&loaded), [id]);
+        assert_eq!(loaded[0].content, b"content");
+        assert!(loaded[0].properties.is_empty());
+    }
+
+    #[tokio::test]
+    async fn messages_are_loaded_in_order_with_their_properties() {
+        let file = TestFile::new();
+        let store = open(&file).await;
+        let first = message("first", &[("a", "1"), ("b", "2"), ("c", "3")]);
+        let second = message("second", &[]);
+        let third = message("third", &[("a", "4"), ("d", "5")]);
+        let mut expected = Vec::new();
+        for msg in [&first, &second, &third] {
+            expected.push(save(&store, msg).await);
+        }
+
+        let loaded = load_all(&store).await;
+
+        assert_eq!(ids(&loaded), expected);
+        for (loaded, stored) in loaded.iter().zip([&first, &second, &third]) {
+            assert_eq!(loaded.content, stored.content);
+            assert_eq!(loaded.properties, stored.properties);
+        }
+
+        // The limit counts the messages, not the rows of their properties
+        let limited =
+            CloudToDeviceMessage::load_many(&mut *store.connection().await, expected[0], 1)
+                .await
+                .unwrap();
+        assert_eq!(ids(&limited), [expected[1]]);
+        let limited = CloudToDeviceMessage::load_many(&mut *store.connection().await, i32::MIN, 1)
+            .await
+            .unwrap();
+        assert_eq!(ids(&limited), [expected[0]]);
+        assert_eq!(limited[0].properties, first.properties);
+    }
+
+    #[tokio::test]
+    async fn removes_more_messages_than_fit_into_a_single_statement() {
+        let file = TestFile::new();
+        let store = open(&file).await;
+        let mut stored = Vec::new();
+        for i in 0..IDS_PER_DELETE + 10 {
+            let id = i.to_string();
+            stored.push(save(&store, &message(&id, &[("id", id.as_str())])).await);
+        }
+
+        let (removed, kept) = stored.split_at(stored.len() - 1);
+        CloudToDeviceMessage::remove_many(&mut *store.connection().await, removed)
+            .await
+            .unwrap();
+
+        let loaded = load_all(&store).await;
+        assert_eq!(ids(&loaded), kept);
+        assert_eq!(
+            loaded[0].properties.get("id").map(String::as_str),
+            Some((IDS_PER_DELETE + 9).to_string().as_str())
+        );
+        let properties: i64 = sqlx::query_scalar("SELECT COUNT(*) FROM CloudToDeviceProperties")
+            .fetch_one(&mut *store.connection().await)
+            .await
+            .unwrap();
+        assert_eq!(properties, 1);
+    }
+
+    #[tokio::test]
+    async fn acknowledged_prefetched_messages_are_not_received_again() {
+        let file = TestFile::new();
+        let store = open(&file).await;
+        let (sender, mut receiver) = sqlite_channel::channel::<CloudToDeviceMessage>(store);
+        for content in ["first", "second", "third"] {
+            sender
+                .send(&message(content, &[("p", content)]))
+                .await
+                .unwrap();
+        }
+
+        // All three messages are loaded at once, the last one waits in memory
+        let batch = receiver.recv_batch(2, &None).await.unwrap();
+        assert_eq!(batch.len(), 2);
+        receiver.ack_many(&batch).await.unwrap();
+
+        let batch = receiver.recv_batch(10, &None).await.unwrap();
+        assert_eq!(batch.len(), 1);
+        assert_eq!(batch[0].content, b"third");
+        assert_eq!(
+            batch[0].properties.get("p").map(String::as_str),
+            Some("third")
+        );
+        receiver.ack_many(&batch).await.unwrap();
+        assert_eq!(receiver.count().await.unwrap(), 0);
+
+        // The following message is loaded from the database again
+        sender.send(&message("fourth", &[])).await.unwrap();
+        let batch = receiver.recv_batch(10, &None).await.unwrap();
+        assert_eq!(batch.len(), 1);
+        assert_eq!(batch[0].content, b"fourth");
+    }
+}
@@ -0,0 +1,199 @@
+use std::{borrow::Cow, mem, num::NonZeroUsize, sync::Arc, thread, time::Instant};
+
+use anyhow::Result;
+use brotli::{
+    enc::{backward_references::BrotliEncoderMode, BrotliEncoderParams},
+    BrotliCompress,
+};
+use tokio::sync::Semaphore;
+
+use crate::metrics::MetricsRegistry;
+
+use super::{Compression, NewDeviceMessage};
+
+/// Compress the content using the requested compression. Returns `None` if the content shouldn't be compressed or if
+/// compressing it wouldn't decrease its size. The compression is recorded in the provided metrics.
+pub(crate) fn compress(
+    content: &[u8],
+    compression: Compression,
+    metrics: &MetricsRegistry,
+) -> Result<Option<Vec<u8>>> {
+    let Some(brotli_params) = get_brotli_params(compression, content.len()) else {
+        return Ok(None);
+    };
+
+    if content.is_empty() {
+        return Ok(None);
+    }
+
+    // The compressed content is used only if it's smaller, so it should fit without reallocating
+    let start = Instant::now();
+    let mut compressed_content = Vec::with_capacity(content.len());
+    let mut input = content;
+    BrotliCompress(&mut input, &mut compressed_content, &brotli_params)?;
+
+    metrics.record_compression(
+        compression,
+        content.len(),
+        compressed_content.len().min(content.len()),
+        start.elapsed(),
+    );
+
+    if compressed_content.len() < content.len() {
+        Ok(Some(compressed_content))
+    } else {
+        log::trace!(
+            "Compressing message would not decrease its size (original: {}B, compressed: {}B), keeping it uncompressed",
+            content.len(),
+            compressed_content.len()
+        );
+        Ok(None)
+    }
+}
+
+fn get_brotli_params(compression: Compression, size: usize) -> Option<BrotliEncoderParams> {
+    let params = match compression {
+        Compression::None | Compression::BrotliCompressed => return None,
+        Compression::BrotliFastest => BrotliEncoderParams {
+            quality: 1,
+            ..Default::default()
+        },
+        Compression::BrotliSmallestSize => BrotliEncoderParams {
+            quality: 11,
+            ..Default::default()
+        },
+        // The fastest qualities don't search the built-in dictionary of common words and tokens, which is where most of
+        // the savings on short textual messages such as JSON come from
+        Compression::BrotliSmallMessages => BrotliEncoderParams {
+            quality: SMALL_MESSAGES_QUALITY,
+            mode: BrotliEncoderMode::BROTLI_MODE_TEXT,
+            size_hint: size,
+            ..Default::default()
+        },
+    };
+
+    Some(params)
+}
+
+const SMALL_MESSAGES_QUALITY: i32 = 9;
+
+impl NewDeviceMessage<'_> {
+    fn needs_compression(&self) -> bool {
+        !self.content.is_empty()
+            && get_brotli_params(self.compression, self.content.len()).is_some()
+    }
+
+    /// Replace the content with the compressed one, or mark the message as uncompressed if there's none.
+    fn apply_compression(&mut self, compressed_content: Option<Vec<u8>>) {
+        match compressed_content {
+            Some(compressed_content) => {
+                self.content = Cow::Owned(compressed_content);
+                self.compression = Compression::BrotliCompressed;
+            }
+            None => {
+                if self.compression != Compression::BrotliCompressed {
+                    self.compression = Compression::None;
+                }
+            }
+        }
+    }
+}
+
+/// Compresses the messages before they're stored so that they're not compressed again every time they're sent. At most
+/// one message per available core is compressed at a time. Owned messages are compressed on the blocking thread pool
+/// of the runtime, borrowed ones on the enqueuing thread so that they don't have to be copied, and neither blocks the
+/// workers of the runtime.
+#[derive(Debug)]
+pub(crate) struct CompressionPool {
+    permits: Arc<Semaphore>,
+    metrics: Arc<MetricsRegistry>,
+}
+
+impl CompressionPool {
+    pub(crate) fn new(metrics: Arc<MetricsRegistry>) -> Self {
+        let workers = thread::available_parallelism().map_or(1, NonZeroUsize::get);
+        Self {
+            permits: Arc::new(Semaphore::new(workers)),
+            metrics,
+        }
+    }
+
+    /// Compress the messages in place. Must be called from within the runtime.
+    pub(crate) async fn compress_messages(&self, msgs: &mut [NewDeviceMessage<'_>]) -> Result<()> {
+        let mut tasks = Vec::new();
+        for (index, msg) in msgs.iter_mut().enumerate() {
+            if !msg.needs_compression() {
+                msg.apply_compression(None);
+                continue;
+            }
+
+            let permit = Arc::clone(&self.permits).acquire_owned().await?;
+
+            // Borrowed content cannot be moved to the blocking thread pool without being copied, so it's compressed on
+            // the current thread instead and stays borrowed if the compressed content isn't used
+            if let Cow::Borrowed(content) = msg.content {
+                let compressed_content = tokio::task::block_in_place(|| {
+                    let _permit = permit;
+                    compress(content, msg.compression, &self.metrics)
+                });
+                msg.apply_compression(compressed_content?);
+                continue;
+            }
+
+            let content = mem::take(&mut msg.content).into_owned();
+            let compression = msg.compression;
+            let metrics = Arc::clone(&self.metrics);
+            let task = tokio::task::spawn_blocking(move || {
+                let _permit = permit;
+                let compressed_content = compress(&content, compression, &metrics);
+                (content, compressed_content)
+            });
+            tasks.push((index, task));
+        }
+
+        for (index, task) in tasks {
+            let (content, compressed_content) = task.await?;
+            let msg = &mut msgs[index];
+            msg.content = Cow::Owned(content);
+            msg.apply_compression(compressed_content?);
+        }
+
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::persistence::test_support::new_message;
+
+    #[tokio::test(flavor = "multi_thread")]
+    async fn borrowed_content_is_copied_only_when_compressed() {
+        let pool = CompressionPool::new(Arc::new(MetricsRegistry::new()));
+        let compressible = b"temperature ".repeat(100);
+        // Pseudo-random bytes don't shrink when compressed
+        let mut state = 0x2545_f491_u32;
+        let incompressible = (0..1000)
+            .map(|_| {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                state.to_le_bytes()[0]
+            })
+            .collect::<Vec<_>>();
+
+        let mut msgs = [new_message("a"), new_message("a")];
+        msgs[0].content = Cow::Borrowed(&compressible);
+        msgs[1].content = Cow::Borrowed(&incompressible);
+        for msg in &mut msgs {
+            msg.compression = Compression::BrotliFastest;
+        }
+
+        pool.compress_messages(&mut msgs).await.unwrap();
+
+        assert!(matches!(msgs[0].content, Cow::Owned(_)));
+        assert_eq!(msgs[0].compression, Compression::BrotliCompressed);
+        assert!(matches!(msgs[1].content, Cow::Borrowed(_)));
+        assert_eq!(msgs[1].compression, Compression::None);
+    }
+}
@@ -0,0 +1,530 @@
+use std::{
+    collections::HashMap,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc,
+    },
+    time::Duration,
+};
+
+use tokio::{
+    select,
+    sync::{
+        mpsc::{self, error::TryRecvError},
+        oneshot, watch,
+    },
+    time::Instant,
+};
+use tokio_util::sync::CancellationToken;
+
+use super::{sqlite::SqliteStore, DeviceMessage, NewDeviceMessage, Priority};
+
+/// The maximum number of stored messages that can wait in memory to be sent.
+/// When the window is full, the messages are read back from the database instead.
+pub(super) const HANDOFF_CAPACITY: usize = 1000;
+
+/// The maximum total size of the contents of the stored messages that can wait in memory to be sent, so that a window
+/// full of large messages doesn't hold too much memory.
+pub(super) const HANDOFF_CAPACITY_BYTES: usize = 16 * 1024 * 1024;
+
+#[derive(Debug)]
+pub(super) struct HandoffMessage {
+    // The ID of the message handed over right before this one, used to detect messages that didn't fit into the window
+    previous_id: Option<i32>,
+    message: DeviceMessage,
+}
+
+/// Create the window of at most `capacity` messages with contents of at most `capacity_bytes` in total.
+pub(super) fn handoff(capacity: usize, capacity_bytes: usize) -> (Handoff, HandoffReceiver) {
+    let (sender, receiver) = mpsc::channel(capacity);
+    let bytes = Arc::new(AtomicUsize::new(0));
+    let handoff = Handoff {
+        sender,
+        last_id: None,
+        bytes: bytes.clone(),
+        capacity_bytes,
+    };
+    (handoff, HandoffReceiver { receiver, bytes })
+}
+
+/// Hands over the freshly stored messages to the sender directly from memory.
+#[derive(Debug)]
+pub(super) struct Handoff {
+    sender: mpsc::Sender<HandoffMessage>,
+    last_id: Option<i32>,
+    // The total size of the contents of the messages in the window
+    bytes: Arc<AtomicUsize>,
+    capacity_bytes: usize,
+}
+
+impl Handoff {
+    /// Must be called in the same order in which the messages were stored.
+    pub(super) fn push(&mut self, message: DeviceMessage) {
+        let id = message
+            .id
+            .expect("ID is not empty after being stored in store");
+        let previous_id = self.last_id.replace(id);
+
+        let size = message.content.len();
+        let fits = self
+            .bytes
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |bytes| {
+                Some(bytes + size).filter(|&total| total <= self.capacity_bytes)
+            })
+            .is_ok();
+
+        if !fits {
+            log::trace!("Message {id} is too large for the memory window, it will be read from the database");
+            return;
+        }
+
+        if self
+            .sender
+            .try_send(HandoffMessage {
+                previous_id,
+                message,
+            })
+            .is_err()
+        {
+            self.bytes.fetch_sub(size, Ordering::AcqRel);
+            log::trace!("Message {id} doesn't fit into the memory window, it will be read from the database");
+        }
+    }
+}
+
+/// Receives the messages handed over by [`Handoff`].
+#[derive(Debug)]
+pub(super) struct HandoffReceiver {
+    receiver: mpsc::Receiver<HandoffMessage>,
+    bytes: Arc<AtomicUsize>,
+}
+
+impl HandoffReceiver {
+    fn try_recv(&mut self) -> Result<HandoffMessage, TryRecvError> {
+        self.receiver.try_recv().map(|msg| self.received(msg))
+    }
+
+    async fn recv(&mut self) -> Option<HandoffMessage> {
+        let msg = self.receiver.recv().await?;
+        Some(self.received(msg))
+    }
+
+    fn received(&self, msg: HandoffMessage) -> HandoffMessage {
+        self.bytes
+            .fetch_sub(msg.message.content.len(), Ordering::AcqRel);
+        msg
+    }
+}
+
+#[derive(Debug)]
+pub(super) enum GroupCommitCommand {
+    Store(Vec<NewDeviceMessage<'static>>),
+    Flush(oneshot::Sender<()>),
+}
+
+/// Collects messages in memory and stores them in a single transaction once enough of them accumulate or the oldest
+/// of them waits for too long.
+pub(super) struct GroupCommitter {
+    pub(super) sqlite: SqliteStore,
+    pub(super) handoff: Handoff,
+    pub(super) notifier: watch::Sender<i32>,
+    pub(super) buffered: Arc<AtomicUsize>,
+    pub(super) max_delay: Duration,
+    pub(super) max_messages: usize,
+}
+
+impl GroupCommitter {
+    pub(super) async fn run(mut self, mut commands: mpsc::Receiver<GroupCommitCommand>) {
+        let mut group = Vec::new();
+        let mut deadline = Instant::now();
+
+        loop {
+            let command = if group.is_empty() {
+                commands.recv().await
+            } else if let Ok(command) = tokio::time::timeout_at(deadline, commands.recv()).await {
+                command
+            } else {
+                if !self.commit(&mut group).await {
+                    deadline = Instant::now() + self.max_delay;
+                }
+                continue;
+            };
+
+            match command {
+                Some(GroupCommitCommand::Store(mut msgs)) => {
+                    if group.is_empty() {
+                        deadline = Instant::now() + self.max_delay;
+                    }
+                    group.append(&mut msgs);
+                    if group.len() >= self.max_messages && !self.commit(&mut group).await {
+                        deadline = Instant::now() + self.max_delay;
+                    }
+                }
+                Some(GroupCommitCommand::Flush(done)) => {
+                    self.commit(&mut group).await;
+                    // The caller might have stopped waiting, that's fine
+                    _ = done.send(());
+                }
+                None => {
+                    // All the producers are gone, store what's left and finish
+                    self.commit(&mut group).await;
+                    return;
+                }
+            }
+        }
+    }
+
+    // Returns `false` if the group could not be stored and must be retried later
+    async fn commit(&mut self, group: &mut Vec<NewDeviceMessage<'static>>) -> bool {
+        if group.is_empty() {
+            return true;
+        }
+
+        let start = Instant::now();
+        let ids = match self.sqlite.store_messages(group).await {
+            Ok(ids) => ids,
+            Err(e) => {
+                log::error!(
+                    "Unable to store {} device to cloud messages, will retry: {e:?}",
+                    group.len()
+                );
+                return false;
+            }
+        };
+
+        let count = group.len();
+        let last_id = ids.last().copied();
+        log::trace!(
+            "Stored {count} device to cloud messages in a single transaction in {:?}",
+            start.elapsed()
+        );
+
+        for (msg, id) in group.drain(..).zip(ids) {
+            self.handoff.push(msg.into_device_message(id));
+        }
+
+        self.buffered.fetch_sub(count, Ordering::AcqRel);
+
+        if let Some(id) = last_id {
+            if self.notifier.send(id).is_err() {
+                log::debug!("There is no one listening for stored messages.");
+            }
+        }
+
+        true
+    }
+}
+
+/// Sends all the stored messages to the consumer, the messages with higher priority first and the messages with the
+/// same priority in order. The messages are read from the database, unless they're handed over from memory.
+pub(super) async fn forward_stored_messages(
+    sqlite: SqliteStore,
+    message_sender: mpsc::Sender<DeviceMessage>,
+    mut latest_msg_id_receiver: watch::Receiver<i32>,
+    mut handoff_receiver: Option<HandoffReceiver>,
+    cancellation_token: CancellationToken,
+) {
+    // All the messages up to this ID were either forwarded or removed
+    let mut last_id = -1;
+    // The ID of the last forwarded message of each priority
+    let mut last_ids = HashMap::new();
+    loop {
+        let latest_id = *latest_msg_id_receiver.borrow_and_update();
+
+        let messages = list_highest_priority_messages(&sqlite, &last_ids).await;
+
+        if let Some(last) = messages.last() {
+            log::trace!(
+                "At least {} messages with priority {:?} were persisted and are ready to be sent",
+                messages.len(),
+                last.priority
+            );
+            let id = last
+                .id
+                .expect("ID is not empty after being stored in store");
+            last_ids.insert(last.priority, id);
+
+            for msg in messages {
+                if !forward(&message_sender, msg, &cancellation_token).await {
+                    return;
+                }
+            }
+
+            continue;
+        }
+
+        // Nothing with a lower ID is left in the database
+        last_id = last_id.max(latest_id);
+
+        if let Some(handoff_receiver) = &mut handoff_receiver {
+            // All the messages in the database were forwarded, take the following ones directly from memory until
+            // some of them don't fit into the window
+            loop {
+                let handed_off = match handoff_receiver.try_recv() {
+                    Ok(handed_off) => handed_off,
+                    Err(TryRecvError::Disconnected) => return,
+                    Err(TryRecvError::Empty) => {
+                        // A message is added to the window before the notification is sent
+                        if *latest_msg_id_receiver.borrow_and_update() > last_id {
+                            log::trace!("Some messages didn't fit into the memory window, reading them from the database");
+                            break;
+                        }
+
+                        select!(
+                            () = cancellation_token.cancelled() => return,
+                            handed_off = handoff_receiver.recv() => match handed_off {
+                                Some(handed_off) => handed_off,
+                                None => return,
+                            },
+                            changed = latest_msg_id_receiver.changed() => {
+                                if changed.is_err() {
+                                    // No more updates are coming
+                                    return;
+                                }
+                                continue;
+                            },
+                        )
+                    }
+                };
+
+                let id = handed_off
+                    .message
+                    .id
+                    .expect("ID is not empty after being stored in store");
+
+                if id <= last_id {
+                    // Already read from the database
+                    continue;
+                }
+
+                if handed_off.previous_id != Some(last_id) {
+                    log::trace!("Some messages didn't fit into the memory window, reading them from the database");
+                    break;
+                }
+
+                // The messages are handed over only when nothing is waiting in the database, so they're forwarded in
+                // the order in which they were stored regardless of their priority
+                last_ids.insert(handed_off.message.priority, id);
+                if !forward(&message_sender, handed_off.message, &cancellation_token).await {
+                    return;
+                }
+                last_id = id;
+            }
+        } else {
+            select!(
+                () = cancellation_token.cancelled() => {
+                    // Cancelled
+                    return;
+                },
+                read = latest_msg_id_receiver.changed() => {
+                    if read.is_err() {
+                        // No more updates are coming
+                        return;
+                    }
+                    // else we start running the loop again
+                },
+            );
+        }
+    }
+}
+
+// Returns the following messages with the highest priority that has any, or an empty vector if there are none
+async fn list_highest_priority_messages(
+    sqlite: &SqliteStore,
+    last_ids: &HashMap<Priority, i32>,
+) -> Vec<DeviceMessage> {
+    for priority in Priority::DESCENDING {
+        let after = last_ids.get(&priority).copied().unwrap_or(-1);
+        let messages = sqlite
+            .list_messages_after(priority, after)
+            .await
+            .expect("Unable to load saved device messages");
+
+        if !messages.is_empty() {
+            return messages;
+        }
+    }
+
+    Vec::new()
+}
+
+// Returns `false` if the forwarding should stop
+async fn forward(
+    message_sender: &mpsc::Sender<DeviceMessage>,
+    msg: DeviceMessage,
+    cancellation_token: &CancellationToken,
+) -> bool {
+    select!(
+        () = cancellation_token.cancelled() => {
+            // Cancelled
+            false
+        },
+        sent = message_sender.send(msg) => {
+            if sent.is_err() {
+                // No more receivers
+                log::debug!("There is no one listening for messages to be sent. Finishing sender publisher.");
+                return false;
+            }
+            true
+        },
+    )
+}
+
+#[cfg(test)]
+mod tests {
+    use std::borrow::Cow;
+
+    use super::super::test_support::{new_message, open_store, stored_messages, TestFile};
+    use super::*;
+
+    const TIMEOUT: Duration = Duration::from_secs(10);
+
+    // Store the messages and hand them over the same way as the producer with in-memory handoff, stopping to receive
+    // them after each round so that the window overflows
+    async fn forward_in_order(capacity: usize, capacity_bytes: usize) {
+        let file = TestFile::new();
+        let sqlite = open_store(&file).await;
+        let (mut handoff, handoff_receiver) = handoff(capacity, capacity_bytes);
+        let (notifier, latest_msg_id_receiver) = watch::channel(-1);
+        let (message_sender, mut message_receiver) = mpsc::channel(1);
+        let cancellation_token = CancellationToken::new();
+        let forwarder = tokio::spawn(forward_stored_messages(
+            sqlite.clone(),
+            message_sender,
+            latest_msg_id_receiver,
+            Some(handoff_receiver),
+            cancellation_token.clone(),
+        ));
+
+        let mut stored = Vec::new();
+        for round in 0u8..3 {
+            let mut round_ids = Vec::new();
+            for i in 0..10 {
+                let mut msg = new_message("stream");
+                if i == 5 {
+                    // A single message larger than some of the windows
+                    msg.content = Cow::Owned(vec![round; 1024]);
+                }
+                let id = sqlite.store_message(&msg).await.unwrap();
+                handoff.push(msg.into_device_message(id));
+                notifier.send_replace(id);
+                round_ids.push(id);
+            }
+
+            for &id in &round_ids {
+                let msg = tokio::time::timeout(TIMEOUT, message_receiver.recv())
+                    .await
+                    .expect("The message must be forwarded")
+                    .unwrap();
+                assert_eq!(msg.id, Some(id));
+            }
+            stored.extend(round_ids);
+        }
+
+        assert_eq!(stored, (1..=30).collect::<Vec<_>>());
+        cancellation_token.cancel();
+        forwarder.await.unwrap();
+        assert!(message_receiver.try_recv().is_err());
+    }
+
+    #[tokio::test]
+    async fn handoff_count_overflow_is_read_from_database() {
+        forward_in_order(2, HANDOFF_CAPACITY_BYTES).await;
+    }
+
+    #[tokio::test]
+    async fn handoff_bytes_overflow_is_read_from_database() {
+        forward_in_order(HANDOFF_CAPACITY, 64).await;
+    }
+
+    #[test]
+    fn handoff_releases_bytes_of_received_messages() {
+        let (mut handoff, mut handoff_receiver) = handoff(HANDOFF_CAPACITY, 16);
+        for id in 1..=3 {
+            let mut msg = new_message("stream").into_device_message(id);
+            msg.content = vec![0; 8];
+            handoff.push(msg);
+        }
+        // The third message didn't fit, the next one follows the gap
+        assert_eq!(handoff_receiver.try_recv().unwrap().previous_id, None);
+        assert_eq!(handoff_receiver.try_recv().unwrap().previous_id, Some(1));
+        assert!(handoff_receiver.try_recv().is_err());
+
+        let mut msg = new_message("stream").into_device_message(4);
+        msg.content = vec![0; 16];
+        handoff.push(msg);
+        let handed_off = handoff_receiver.try_recv().unwrap();
+        assert_eq!(handed_off.message.id, Some(4));
+        assert_eq!(handed_off.previous_id, Some(3));
+    }
+
+    #[tokio::test]
+    async fn group_commit_retries_failed_commit() {
+        let file = TestFile::new();
+        let sqlite = open_store(&file).await;
+        sqlx::query(
+            "CREATE TRIGGER FailInserts BEFORE INSERT ON Messages BEGIN SELECT RAISE(ABORT, 'disk full'); END",
+        )
+        .execute(&mut *sqlite.connection().await)
+        .await
+        .unwrap();
+
+        let (handoff, mut handoff_receiver) = handoff(HANDOFF_CAPACITY, HANDOFF_CAPACITY_BYTES);
+        let (notifier, mut latest_msg_id_receiver) = watch::channel(-1);
+        let buffered = Arc::new(AtomicUsize::new(3));
+        let committer = GroupCommitter {
+            sqlite: sqlite.clone(),
+            handoff,
+            notifier,
+            buffered: buffered.clone(),
+            max_delay: Duration::from_millis(10),
+            max_messages: 2,
+        };
+        let (commands, commands_receiver) = mpsc::channel(10);
+        let committer = tokio::spawn(committer.run(commands_receiver));
+
+        let msgs = ["a", "b", "c"].map(new_message).to_vec();
+        commands
+            .send(GroupCommitCommand::Store(msgs))
+            .await
+            .unwrap();
+
+        // The full group fails to be stored right away and then after each delay, the messages stay buffered
+        tokio::time::sleep(Duration::from_millis(100)).await;
+        assert_eq!(sqlite.message_count(), 0);
+        assert_eq!(buffered.load(Ordering::Acquire), 3);
+        assert!(handoff_receiver.try_recv().is_err());
+
+        sqlx::query("DROP TRIGGER FailInserts")
+            .execute(&mut *sqlite.connection().await)
+            .await
+            .unwrap();
+
+        tokio::time::timeout(TIMEOUT, async {
+            while *latest_msg_id_receiver.borrow_and_update() < 3 {
+                latest_msg_id_receiver.changed().await.unwrap();
+            }
+        })
+        .await
+        .expect("The messages must be stored once the database recovers");
+
+        assert_eq!(buffered.load(Ordering::Acquire), 0);
+        let messages = stored_messages(&sqlite).await;
+        let ids = messages
+            .iter()
+            .map(|msg| msg.id.unwrap())
+            .collect::<Vec<_>>();
+        let streams = messages
+            .into_iter()
+            .map(|msg| msg.stream.unwrap())
+            .collect::<Vec<_>>();
+        assert_eq!(ids, [1, 2, 3]);
+        assert_eq!(streams, ["a", "b", "c"]);
+        for id in 1..=3 {
+            assert_eq!(handoff_receiver.try_recv().unwrap().message.id, Some(id));
+        }
+
+        drop(commands);
+        committer.await.unwrap();
+    }
+}
@@ -1,25 +1,40 @@
+use std::borrow::Cow;
 use std::collections::HashMap;
+use std::sync::{
+    atomic::{AtomicUsize, Ordering},
+    Arc,
+};
+use std::time::Duration;
 use std::{path::Path, str::FromStr};
 
 use crate::cloud::dps::{ProvisioningToken, RegistrationToken};
-use anyhow::{Context, Result};
+use crate::metrics::MetricsRegistry;
+use anyhow::{anyhow, bail, Context, Result};
+use d2c::{GroupCommitCommand, GroupCommitter, Handoff};
 use http::Uri;
+use queue_limit::{QueueLimiter, Room};
 use sqlite::SdkConfiguration;
 use sqlite_channel::{Receiver, Sender};
-use tokio::{
-    select,
-    sync::{mpsc, watch},
-};
+use sqlx::SqliteConnection;
+use tokio::sync::{mpsc, oneshot, watch, Mutex};
 use tokio_util::sync::CancellationToken;
 use twins::Twin;
 
 use self::sqlite::SqliteStore;
 
 pub mod c2d;
+pub mod compression;
+mod d2c;
+mod queue_limit;
 pub mod sqlite;
 pub mod sqlite_channel;
+#[cfg(test)]
+pub(crate) mod test_support;
 pub mod twins;
 
+pub(crate) use queue_limit::QueueFull;
+pub use queue_limit::{OverflowPolicy, QueueLimit};
+
 pub struct Store {
     pub store: SqliteStore,
     pub d2c_producer: Producer,
@@ -34,7 +49,21 @@ pub struct Store {
 #[derive(Debug)]
 pub struct Producer {
     inner: SqliteStore,
-    sender: watch::Sender<i32>,
+    mode: ProducerMode,
+    limiter: Option<QueueLimiter>,
+}
+
+#[derive(Debug)]
+enum ProducerMode {
+    Immediate {
+        notifier: watch::Sender<i32>,
+        // Held while storing a message so that the messages are handed over in the order they were stored
+        handoff: Option<Mutex<Handoff>>,
+    },
+    GroupCommit {
+        commands: mpsc::Sender<GroupCommitCommand>,
+        buffered: Arc<AtomicUsize>,
+    },
 }
 
 #[derive(Debug)]
@@ -42,7 +71,7 @@ pub struct Consumer {
     receiver: mpsc::Receiver<DeviceMessage>,
 }
 
-#[derive(Debug)]
+#[derive(Clone, Debug)]
 pub struct Acknowledger {
     inner: SqliteStore,
 }
@@ -54,22 +83,178 @@ pub struct ConfigurationStore {
 }
 
 impl Producer {
-    pub async fn add(&self, mut msg: DeviceMessage) -> Result<()> {
-        let id = self
-            .inner
-            .store_message(&msg)
+    pub async fn add(&self, msg: NewDeviceMessage<'_>) -> Result<()> {
+        let (fitting, _room) = self.make_room(std::slice::from_ref(&msg)).await?;
+        if fitting == 0 {
+            return self.overflow(1);
+        }
+
+        match &self.mode {
+            ProducerMode::Immediate { notifier, handoff } => {
+                let mut handoff = match handoff {
+                    Some(handoff) => Some(handoff.lock().await),
+                    None => None,
+                };
+
+                let id = self
+                    .inner
+                    .store_message(&msg)
+                    .await
+                    .context("Unable to store device to cloud message")?;
+
+                if let Some(handoff) = &mut handoff {
+                    handoff.push(msg.into_device_message(id));
+                }
+
+                notifier
+                    .send(id)
+                    .context("Unable to send notification of new message")?;
+            }
+            ProducerMode::GroupCommit { .. } => {
+                self.add_to_group(vec![msg.into_owned()]).await?;
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Store all the messages in a single transaction and notify the consumer only once. Returns how many of the
+    /// first messages were stored, the remaining ones didn't fit into the queue limit and were dropped or rejected.
+    pub async fn add_many(&self, msgs: Vec<NewDeviceMessage<'_>>) -> Result<usize> {
+        self.store_many(msgs, false).await
+    }
+
+    /// Store all the messages in a single transaction, or none of them if some don't fit into the queue limit. Returns
+    /// how many messages were stored, the messages that weren't stored were dropped or rejected.
+    pub async fn add_all(&self, msgs: Vec<NewDeviceMessage<'_>>) -> Result<usize> {
+        self.store_many(msgs, true).await
+    }
+
+    async fn store_many(&self, mut msgs: Vec<NewDeviceMessage<'_>>, all: bool) -> Result<usize> {
+        let (mut fitting, _room) = self.make_room(&msgs).await?;
+        if all && fitting < msgs.len() {
+            fitting = 0;
+        }
+        msgs.truncate(fitting);
+
+        match &self.mode {
+            ProducerMode::Immediate { notifier, handoff } => {
+                let mut handoff = match handoff {
+                    Some(handoff) => Some(handoff.lock().await),
+                    None => None,
+                };
+
+                let ids = self
+                    .inner
+                    .store_messages(&msgs)
+                    .await
+                    .context("Unable to store device to cloud messages")?;
+
+                let Some(&last_id) = ids.last() else {
+                    return Ok(0);
+                };
+
+                if let Some(handoff) = &mut handoff {
+                    for (msg, id) in msgs.into_iter().zip(ids) {
+                        handoff.push(msg.into_device_message(id));
+                    }
+                }
+
+                notifier
+                    .send(last_id)
+                    .context("Unable to send notification of new messages")?;
+            }
+            ProducerMode::GroupCommit { .. } => {
+                if !msgs.is_empty() {
+                    self.add_to_group(msgs.into_iter().map(NewDeviceMessage::into_owned).collect())
+                        .await?;
+                }
+            }
+        }
+
+        Ok(fitting)
+    }
+
+    // Returns how many of the first messages fit into the queue limit, and the room reserved for them until they're
+    // stored if there is any limit. The buffered messages of the group commit count only into the number of messages
+    // until they're stored.
+    async fn make_room(&self, msgs: &[NewDeviceMessage<'_>]) -> Result<(usize, Option<Room<'_>>)> {
+        match &self.limiter {
+            Some(limiter) => {
+                let room = limiter.make_room(msgs, || self.count()).await?;
+                Ok((room.fitting, Some(room)))
+            }
+            None => Ok((msgs.len(), None)),
+        }
+    }
+
+    /// Handle the messages that were not stored because they didn't fit into the queue limit. Returns an error if the
+    /// queue limit rejects them instead of dropping them.
+    pub fn overflow(&self, count: usize) -> Result<()> {
+        match &self.limiter {
+            Some(limiter) => limiter.overflow(count),
+            None => Ok(()),
+        }
+    }
+
+    async fn add_to_group(&self, msgs: Vec<NewDeviceMessage<'static>>) -> Result<()> {
+        let ProducerMode::GroupCommit { commands, buffered } = &self.mode else {
+            unreachable!("Messages can be grouped only in the group commit mode");
+        };
+
+        let count = msgs.len();
+        buffered.fetch_add(count, Ordering::AcqRel);
+
+        if commands
+            .send(GroupCommitCommand::Store(msgs))
             .await
-            .context("Unable to store device to cloud message")?;
-        msg.id = Some(id);
-        self.sender
-            .send(id)
-            .context("Unable to send notification of new message")?;
+            .is_err()
+        {
+            buffered.fetch_sub(count, Ordering::AcqRel);
+            bail!("Unable to store device to cloud messages because the storing task has stopped");
+        }
+
+        Ok(())
+    }
+
+    /// Make sure that all the messages added so far are stored in the database.
+    pub async fn flush(&self) -> Result<()> {
+        if let ProducerMode::GroupCommit { commands, .. } = &self.mode {
+            let (done_sender, done_receiver) = oneshot::channel();
+            commands
+                .send(GroupCommitCommand::Flush(done_sender))
+                .await
+                .map_err(|_| anyhow!("The task storing device to cloud messages has stopped"))?;
+            done_receiver
+                .await
+                .context("The task storing device to cloud messages has stopped")?;
+        }
 
         Ok(())
     }
 
-    pub async fn count(&self) -> Result<usize> {
-        self.inner.message_count().await
+    pub fn count(&self) -> usize {
+        let stored = self.inner.message_count();
+
+        let buffered = match &self.mode {
+            ProducerMode::Immediate { .. } => 0,
+            ProducerMode::GroupCommit { buffered, .. } => buffered.load(Ordering::Acquire),
+        };
+
+        stored + buffered
+    }
+
+    /// Wait until all the messages added so far are removed after being sent.
+    pub async fn wait_all_removed(&self) {
+        loop {
+            // The buffered messages are counted as stored before they stop being counted as buffered, so waiting only
+            // for the stored ones to change is enough
+            let changed = self.inner.message_count_changed();
+            if self.count() == 0 {
+                return;
+            }
+            changed.await;
+        }
     }
 }
 
@@ -77,11 +262,23 @@ impl Consumer {
     pub async fn get_message(&mut self) -> Option<DeviceMessage> {
         self.receiver.recv().await
     }
+
+    /// Consume the messages sent to the channel instead of the stored ones.
+    #[cfg(test)]
+    pub(crate) fn from_channel(receiver: mpsc::Receiver<DeviceMessage>) -> Self {
+        Self { receiver }
+    }
 }
 
 impl Acknowledger {
-    pub async fn remove_oldest(&self) -> Result<()> {
-        self.inner.remove_oldest_message().await
+    /// Remove all the messages with the priority up to the provided ID (inclusive) after they were acknowledged.
+    pub async fn remove_until(&self, priority: Priority, id: i32) -> Result<()> {
+        self.inner.remove_messages_until(priority, id).await
+    }
+
+    /// Remove a single message that cannot be sent.
+    pub async fn remove(&self, id: i32) -> Result<()> {
+        self.inner.remove_message(id).await
     }
 }
 
@@ -158,81 +355,91 @@ impl TwinsStore {
 
 pub async fn create(
     store_path: &Path,
+    connection: Option<SqliteConnection>,
     config: &SdkConfiguration,
+    durability: Durability,
+    storage_profile: StorageProfile,
+    queue_limit: Option<QueueLimit>,
+    metrics: Arc<MetricsRegistry>,
     cancellation_token: CancellationToken,
 ) -> Result<Store> {
-    let sqlite = SqliteStore::init(store_path, config).await?;
-
-    Ok(start(sqlite, config, cancellation_token))
+    let sqlite =
+        SqliteStore::init(store_path, connection, config, storage_profile, metrics).await?;
+
+    Ok(start(
+        sqlite,
+        config,
+        durability,
+        queue_limit,
+        cancellation_token,
+    ))
 }
 
 fn start(
     sqlite: SqliteStore,
     config: &SdkConfiguration,
+    durability: Durability,
+    queue_limit: Option<QueueLimit>,
     cancellation_token: CancellationToken,
 ) -> Store {
-    let (message_sender, message_receiver) = mpsc::channel(100);
-    let (latest_msg_id_sender, mut latest_msg_id_receiver) = watch::channel(-1);
+    if sqlite.is_migrating() {
+        tokio::spawn(sqlite.clone().finish_migration());
+    }
 
-    {
-        let sqlite = sqlite.clone();
+    let (message_sender, message_receiver) = mpsc::channel(100);
+    let (latest_msg_id_sender, latest_msg_id_receiver) = watch::channel(-1);
+
+    let (handoff, handoff_receiver) = match durability {
+        Durability::Full => (None, None),
+        Durability::InMemoryHandoff | Durability::GroupCommit { .. } => {
+            let (handoff, handoff_receiver) =
+                d2c::handoff(d2c::HANDOFF_CAPACITY, d2c::HANDOFF_CAPACITY_BYTES);
+            (Some(handoff), Some(handoff_receiver))
+        }
+    };
 
-        tokio::spawn(async move {
-            let mut last_id = -1;
-            loop {
-                let messages = sqlite
-                    .list_messages_after(last_id)
-                    .await
-                    .expect("Unable to load saved device messages");
-
-                if !messages.is_empty() {
-                    log::trace!(
-                        "At least {} messages were persisted and are ready to be sent",
-                        messages.len()
-                    );
-                    last_id = messages
-                        .last()
-                        .expect("We checked that the vec is not empty")
-                        .id
-                        .expect("ID is not empty after being stored in store");
-
-                    for msg in messages {
-                        select!(
-                            () = cancellation_token.cancelled() => {
-                                // Cancelled
-                                return;
-                            },
-                            sent = message_sender.send(msg) => {
-                                if sent.is_err() {
-                                    // No more receivers
-                                    log::debug!("There is no one listening for messages to be sent. Finishing sender publisher.");
-                                    return;
-                                }
-                            },
-                        );
-                    }
-                } else if *latest_msg_id_receiver.borrow_and_update() == last_id {
-                    select!(
-                        () = cancellation_token.cancelled() => {
-                            // Cancelled
-                            return;
-                        },
-                        read = latest_msg_id_receiver.changed() => {
-                            if read.is_err() {
-                                // No more updates are coming
-                                return;
-                            }
-                            // else we start running the loop again
-                        },
-                    );
-                }
+    tokio::spawn(d2c::forward_stored_messages(
+        sqlite.clone(),
+        message_sender,
+        latest_msg_id_receiver,
+        handoff_receiver,
+        cancellation_token,
+    ));
+
+    let mode = match durability {
+        Durability::GroupCommit {
+            max_delay,
+            max_messages,
+        } => {
+            let (commands_sender, commands_receiver) = mpsc::channel(100);
+            let buffered = Arc::new(AtomicUsize::new(0));
+
+            let committer = GroupCommitter {
+                sqlite: sqlite.clone(),
+                handoff: handoff.expect("Group commit always hands over messages from memory"),
+                notifier: latest_msg_id_sender,
+                buffered: buffered.clone(),
+                max_delay,
+                max_messages: max_messages.max(1),
+            };
+
+            tokio::spawn(committer.run(commands_receiver));
+
+            ProducerMode::GroupCommit {
+                commands: commands_sender,
+                buffered,
             }
-        });
-    }
+        }
+        Durability::Full | Durability::InMemoryHandoff => ProducerMode::Immediate {
+            notifier: latest_msg_id_sender,
+            handoff: handoff.map(Mutex::new),
+        },
+    };
 
     let producer = Producer {
         inner: sqlite.clone(),
-        sender: latest_msg_id_sender,
+        mode,
+        limiter: queue_limit.map(|limit| QueueLimiter::new(sqlite.clone(), limit)),
     };
 
     let consumer = Consumer {
@@ -266,6 +473,66 @@ fn start(
     }
 }
 
+/// The priority of a [Message](https://docs.spotflow.io/send-data/#message). The Messages waiting to be sent are sent in
+/// the order of their priority, the Messages with the same priority are sent in the order in which they were enqueued.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, PartialOrd, Ord, Hash, sqlx::Type)]
+#[repr(i32)]
+pub enum Priority {
+    /// The Messages are sent only when there are no Messages with higher priority waiting to be sent, for example,
+    /// bulk telemetry that can be delayed.
+    Low = 0,
+    /// The priority of the Messages unless specified otherwise.
+    #[default]
+    Normal = 1,
+    /// The Messages are sent before all the Messages with lower priority waiting to be sent, for example, alarms.
+    High = 2,
+}
+
+impl Priority {
+    /// All the priorities, starting with the highest one.
+    pub(crate) const DESCENDING: [Priority; 3] = [Priority::High, Priority::Normal, Priority::Low];
+}
+
+/// Specifies how the local database file is configured.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum StorageProfile {
+    /// The local database file uses the rollback journal with the `FULL` synchronization level, which are the default
+    /// settings of SQLite, even if it used write-ahead logging before. Every transaction is fully written to the disk
+    /// before it's committed, and a single connection to the local database file is shared by all the operations.
+    #[default]
+    Durable,
+    /// The local database file uses write-ahead logging with the `NORMAL` synchronization level and a larger page
+    /// cache. Reading the Messages to be sent uses a separate connection, so enqueuing Messages doesn't wait for it.
+    ///
+    /// The local database file cannot become corrupted, but the transactions committed shortly before a power loss
+    /// might be rolled back. The write-ahead log is stored in additional files next to the local database file.
+    Throughput,
+}
+
+/// Specifies how the outgoing [Messages](https://docs.spotflow.io/send-data/#message) are written to the local database
+/// file and how they are handed over to the background thread that sends them to the Platform.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum Durability {
+    /// Each Message is written to the local database file before the enqueue method returns. The background thread
+    /// then reads it back from the file before sending it.
+    #[default]
+    Full,
+    /// Each Message is written to the local database file before the enqueue method returns, but the background thread
+    /// receives it directly from memory. The file is read only after a restart or when too many Messages are waiting
+    /// to be sent. The enqueue methods copy the payload into memory if it's borrowed.
+    InMemoryHandoff,
+    /// The Messages are kept in memory and written to the local database file in a single transaction once
+    /// `max_messages` of them accumulate or the oldest of them has waited for `max_delay`. The enqueue methods return
+    /// before the Messages are written, so the Messages from this window are lost if the process crashes.
+    /// The background thread receives the Messages directly from memory after they are written.
+    GroupCommit {
+        /// The longest time a Message can wait in memory before it's written to the local database file.
+        max_delay: Duration,
+        /// The number of Messages that are written to the local database file at once.
+        max_messages: usize,
+    },
+}
+
 #[derive(Debug)]
 pub struct DeviceMessage {
     pub id: Option<i32>,
@@ -279,6 +546,63 @@ pub struct DeviceMessage {
     pub compression: Compression,
     pub batch_slice_id: Option<String>,
     pub chunk_id: Option<String>,
+    pub file_path: Option<String>,
+    pub priority: Priority,
+}
+
+/// A device to cloud message that is about to be stored. The content can be borrowed from the caller so that it isn't
+/// copied before it's passed to the database driver.
+#[derive(Debug)]
+pub struct NewDeviceMessage<'a> {
+    pub site_id: Option<String>,
+    pub stream_group: Option<String>,
+    pub stream: Option<String>,
+    pub batch_id: Option<String>,
+    pub message_id: Option<String>,
+    pub content: Cow<'a, [u8]>,
+    pub close_option: CloseOption,
+    pub compression: Compression,
+    pub batch_slice_id: Option<String>,
+    pub chunk_id: Option<String>,
+    pub file_path: Option<String>,
+    pub priority: Priority,
+}
+
+impl NewDeviceMessage<'_> {
+    fn into_owned(self) -> NewDeviceMessage<'static> {
+        NewDeviceMessage {
+            site_id: self.site_id,
+            stream_group: self.stream_group,
+            stream: self.stream,
+            batch_id: self.batch_id,
+            message_id: self.message_id,
+            content: Cow::Owned(self.content.into_owned()),
+            close_option: self.close_option,
+            compression: self.compression,
+            batch_slice_id: self.batch_slice_id,
+            chunk_id: self.chunk_id,
+            file_path: self.file_path,
+            priority: self.priority,
+        }
+    }
+
+    fn into_device_message(self, id: i32) -> DeviceMessage {
+        DeviceMessage {
+            id: Some(id),
+            site_id: self.site_id,
+            stream_group: self.stream_group,
+            stream: self.stream,
+            batch_id: self.batch_id,
+            message_id: self.message_id,
+            content: self.content.into_owned(),
+            close_option: self.close_option,
+            compression: self.compression,
+            batch_slice_id: self.batch_slice_id,
+            chunk_id: self.chunk_id,
+            file_path: self.file_path,
+            priority: self.priority,
+        }
+    }
 }
 
 /// **Warning**: Don't use, the interface for Cloud-to-Device Messages hasn't been finalized yet.
@@ -301,17 +625,24 @@ impl CloudToDeviceMessage {
     }
 }
 
+// The values are stored in the local database file, so they must not change
 #[derive(Copy, Clone, Debug, sqlx::Type)]
+#[repr(i32)]
 pub enum CloseOption {
-    None,
-    Close,
-    CloseOnly,
-    CloseMessageOnly,
+    None = 0,
+    Close = 1,
+    CloseOnly = 2,
+    CloseMessageOnly = 3,
 }
 
-#[derive(Copy, Clone, Debug, sqlx::Type)]
+// The values are stored in the local database file, so they must not change
+#[derive(Copy, Clone, Debug, PartialEq, Eq, sqlx::Type)]
+#[repr(i32)]
 pub enum Compression {
-    None,
-    BrotliFastest,
-    BrotliSmallestSize,
+    None = 0,
+    BrotliFastest = 1,
+    BrotliSmallestSize = 2,
+    BrotliSmallMessages = 3,
+    /// The content was already compressed by Brotli when it was enqueued.
+    BrotliCompressed = 4,
 }
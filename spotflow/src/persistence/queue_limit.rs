@@ -0,0 +1,549 @@
+use anyhow::Result;
+use tokio::sync::{Mutex, MutexGuard};
+
+use super::{sqlite::SqliteStore, NewDeviceMessage};
+
+/// Limits how many [Messages](https://docs.spotflow.io/send-data/#message) can wait in the local database file to be
+/// sent to the Platform, for example while the device is offline.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct QueueLimit {
+    /// The maximum number of Messages waiting to be sent, `None` for no limit.
+    pub max_messages: Option<usize>,
+    /// The maximum total size in bytes of the payloads of the Messages waiting to be sent, `None` for no limit. The
+    /// local database file is larger by the properties of the Messages, the indexes, and the rest of the data of the
+    /// client, such as the Device Twins and the Cloud-to-Device Messages waiting to be processed. The space freed by
+    /// removing Messages is returned to the file system if the local database file was created by this version of the
+    /// SDK. Files created by older versions are never rebuilt, which would need as much free space as the file itself,
+    /// so they keep their size and reuse the freed space for new Messages instead.
+    pub max_bytes: Option<u64>,
+    /// What happens to the Messages that don't fit into the limit.
+    pub policy: OverflowPolicy,
+}
+
+/// Specifies what happens when a [Message](https://docs.spotflow.io/send-data/#message) is enqueued but the
+/// [`QueueLimit`] has been reached.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum OverflowPolicy {
+    /// Remove the oldest Messages waiting to be sent to make room for the new one.
+    #[default]
+    DropOldest,
+    /// Discard the new Message.
+    DropNewest,
+    /// Fail to enqueue the new Message.
+    Reject,
+    /// Remove every other of the oldest Messages waiting to be sent to the same Stream as the new one, so that the
+    /// Stream keeps covering the whole period with a lower resolution. If there are no such Messages, the oldest
+    /// Messages are removed instead.
+    Downsample,
+}
+
+/// The error reported for the [Messages](https://docs.spotflow.io/send-data/#message) that were dropped or rejected
+/// because they didn't fit into the [`QueueLimit`].
+#[derive(Debug, thiserror::Error)]
+#[error("Unable to enqueue the Message because the queue of Messages waiting to be sent is full")]
+pub(crate) struct QueueFull;
+
+// Once the limit is reached, this share of the allowed Messages is removed at once so that the Messages aren't removed
+// one by one on every enqueue
+const EVICTION_FRACTION: usize = 20;
+
+// The maximum number of Messages removed by a single statement so that the database isn't locked for too long
+const EVICTION_BATCH_SIZE: usize = 1000;
+
+#[derive(Debug)]
+pub(super) struct QueueLimiter {
+    sqlite: SqliteStore,
+    limit: QueueLimit,
+    // Held from checking the limit until the incoming messages are stored, so that concurrent producers don't fill the
+    // same room
+    room: Mutex<()>,
+}
+
+/// The room made for the incoming messages. It stays reserved for them until it's dropped, so it must be held until
+/// the fitting messages are stored.
+#[must_use]
+pub(super) struct Room<'a> {
+    /// How many of the first incoming messages fit, the remaining ones must be dropped or rejected instead.
+    pub(super) fitting: usize,
+    _reserved: MutexGuard<'a, ()>,
+}
+
+impl QueueLimiter {
+    pub(super) fn new(sqlite: SqliteStore, limit: QueueLimit) -> Self {
+        Self {
+            sqlite,
+            limit,
+            room: Mutex::new(()),
+        }
+    }
+
+    /// Remove the stored messages that prevent the incoming ones from fitting into the limit. The number of the
+    /// pending messages is read only after the other producers have stored their messages.
+    pub(super) async fn make_room(
+        &self,
+        incoming: &[NewDeviceMessage<'_>],
+        pending: impl FnOnce() -> usize,
+    ) -> Result<Room<'_>> {
+        let reserved = self.room.lock().await;
+        let fitting = self.evict(incoming, pending()).await?;
+
+        Ok(Room {
+            fitting,
+            _reserved: reserved,
+        })
+    }
+
+    async fn evict(&self, incoming: &[NewDeviceMessage<'_>], pending: usize) -> Result<usize> {
+        let incoming_bytes = incoming.iter().map(message_bytes).sum::<u64>();
+
+        let mut excess_messages = self
+            .limit
+            .max_messages
+            .map_or(0, |max| (pending + incoming.len()).saturating_sub(max));
+        let mut excess_bytes = self.excess_bytes(incoming_bytes);
+
+        if excess_messages == 0 && excess_bytes == 0 {
+            return Ok(incoming.len());
+        }
+
+        if matches!(
+            self.limit.policy,
+            OverflowPolicy::DropNewest | OverflowPolicy::Reject
+        ) {
+            let fitting =
+                fitting_messages(incoming, pending, self.sqlite.message_bytes(), &self.limit);
+            log::warn!(
+                "The queue of Messages waiting to be sent is full, {} new Messages don't fit into it",
+                incoming.len() - fitting
+            );
+            return Ok(fitting);
+        }
+
+        if let Some(max) = self.limit.max_messages {
+            if excess_messages > 0 {
+                excess_messages = excess_messages.max(max.div_ceil(EVICTION_FRACTION));
+            }
+        }
+        if let Some(max) = self.limit.max_bytes {
+            if excess_bytes > 0 {
+                excess_bytes = excess_bytes.max(max.div_ceil(EVICTION_FRACTION as u64));
+            }
+        }
+
+        let stream = incoming
+            .first()
+            .map(|msg| (msg.stream_group.as_deref(), msg.stream.as_deref()));
+
+        let mut removed_total = 0;
+        while excess_messages > 0 || excess_bytes > 0 {
+            let batch = excess_messages
+                .max(self.messages_holding(excess_bytes))
+                .min(EVICTION_BATCH_SIZE);
+
+            let stored_bytes = self.sqlite.message_bytes();
+            let removed = self.remove(batch, stream).await?;
+            if removed == 0 {
+                // There is nothing else to remove, the incoming messages are stored anyway
+                break;
+            }
+
+            removed_total += removed;
+            excess_messages = excess_messages.saturating_sub(removed);
+            excess_bytes = excess_bytes
+                .saturating_sub(stored_bytes.saturating_sub(self.sqlite.message_bytes()));
+        }
+
+        if self.limit.max_bytes.is_some() && removed_total > 0 {
+            self.sqlite.release_free_pages().await?;
+        }
+
+        log::warn!(
+            "The queue of Messages waiting to be sent is full, removed {removed_total} stored Messages to make room for new ones"
+        );
+
+        Ok(incoming.len())
+    }
+
+    /// Handle the incoming messages that didn't fit into the limit, they're an error only if they're rejected.
+    pub(super) fn overflow(&self, count: usize) -> Result<()> {
+        if count == 0 || self.limit.policy != OverflowPolicy::Reject {
+            return Ok(());
+        }
+
+        Err(QueueFull.into())
+    }
+
+    // Only the contents of the messages count, the rest of the local database file is out of the control of the limit
+    fn excess_bytes(&self, incoming_bytes: u64) -> u64 {
+        let Some(max) = self.limit.max_bytes else {
+            return 0;
+        };
+
+        (self.sqlite.message_bytes() + incoming_bytes).saturating_sub(max)
+    }
+
+    // Estimate how many of the stored messages hold the bytes from the average size of their contents
+    fn messages_holding(&self, bytes: u64) -> usize {
+        if bytes == 0 {
+            return 0;
+        }
+
+        let count = self.sqlite.message_count().max(1) as u64;
+        let average = (self.sqlite.message_bytes() / count).max(1);
+        usize::try_from(bytes.div_ceil(average)).unwrap_or(usize::MAX)
+    }
+
+    async fn remove(
+        &self,
+        count: usize,
+        stream: Option<(Option<&str>, Option<&str>)>,
+    ) -> Result<usize> {
+        if self.limit.policy == OverflowPolicy::Downsample {
+            if let Some((stream_group, stream)) = stream {
+                let removed = self
+                    .sqlite
+                    .remove_every_other_stream_message(stream_group, stream, count)
+                    .await?;
+                if removed > 0 {
+                    return Ok(removed);
+                }
+            }
+        }
+
+        self.sqlite.remove_oldest_messages(count).await
+    }
+}
+
+fn message_bytes(msg: &NewDeviceMessage<'_>) -> u64 {
+    u64::try_from(msg.content.len()).unwrap_or(u64::MAX)
+}
+
+// The number of the first incoming messages that fit into the limit without removing any stored ones
+fn fitting_messages(
+    incoming: &[NewDeviceMessage<'_>],
+    pending: usize,
+    stored_bytes: u64,
+    limit: &QueueLimit,
+) -> usize {
+    let mut fitting = limit
+        .max_messages
+        .map_or(incoming.len(), |max| max.saturating_sub(pending))
+        .min(incoming.len());
+
+    if let Some(max) = limit.max_bytes {
+        let mut free = max.saturating_sub(stored_bytes);
+        fitting = incoming[..fitting]
+            .iter()
+            .take_while(|msg| {
+                let bytes = message_bytes(msg);
+                let fits = bytes <= free;
+                free = free.saturating_sub(bytes);
+                fits
+            })
+            .count();
+    }
+
+    fitting
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{borrow::Cow, time::Duration};
+
+    use tokio_util::sync::CancellationToken;
+
+    use super::super::test_support::{config, new_message, open_store, stored_messages, TestFile};
+    use super::super::{Durability, Priority};
+    use super::*;
+
+    // Fill the store with `count` Messages alternating between the Streams `a` and `b`, the fifth of them with a low
+    // priority
+    async fn filled_store(file: &TestFile, count: i32) -> SqliteStore {
+        let sqlite = open_store(file).await;
+        for id in 1..=count {
+            let mut msg = new_message(if id % 2 == 1 { "a" } else { "b" });
+            if id == 5 {
+                msg.priority = Priority::Low;
+            }
+            sqlite.store_message(&msg).await.unwrap();
+        }
+        sqlite
+    }
+
+    async fn stored_ids(sqlite: &SqliteStore) -> Vec<i32> {
+        let mut ids = stored_messages(sqlite)
+            .await
+            .iter()
+            .map(|msg| msg.id.unwrap())
+            .collect::<Vec<_>>();
+        ids.sort_unstable();
+        ids
+    }
+
+    fn limiter(sqlite: &SqliteStore, max_messages: usize, policy: OverflowPolicy) -> QueueLimiter {
+        QueueLimiter::new(
+            sqlite.clone(),
+            QueueLimit {
+                max_messages: Some(max_messages),
+                max_bytes: None,
+                policy,
+            },
+        )
+    }
+
+    fn incoming(stream: &str, count: usize) -> Vec<NewDeviceMessage<'static>> {
+        (0..count).map(|_| new_message(stream)).collect()
+    }
+
+    #[tokio::test]
+    async fn messages_fitting_into_limit_are_stored() {
+        let file = TestFile::new();
+        let sqlite = filled_store(&file, 10).await;
+
+        for policy in [
+            OverflowPolicy::DropOldest,
+            OverflowPolicy::DropNewest,
+            OverflowPolicy::Reject,
+            OverflowPolicy::Downsample,
+        ] {
+            let limiter = limiter(&sqlite, 12, policy);
+            let fitting = limiter
+                .make_room(&incoming("a", 2), || sqlite.message_count())
+                .await
+                .unwrap()
+                .fitting;
+            assert_eq!(fitting, 2);
+            assert_eq!(sqlite.message_count(), 10);
+        }
+    }
+
+    #[tokio::test]
+    async fn drop_oldest_removes_lowest_priority_first() {
+        let file = TestFile::new();
+        let sqlite = filled_store(&file, 40).await;
+        let limiter = limiter(&sqlite, 40, OverflowPolicy::DropOldest);
+
+        let fitting = limiter
+            .make_room(&incoming("a", 1), || sqlite.message_count())
+            .await
+            .unwrap()
+            .fitting;
+
+        // A twentieth of the limit is removed at once
+        assert_eq!(fitting, 1);
+        let expected = (2..=40).filter(|&id| id != 5).collect::<Vec<_>>();
+        assert_eq!(stored_ids(&sqlite).await, expected);
+        assert!(limiter.overflow(0).is_ok());
+    }
+
+    #[tokio::test]
+    async fn drop_newest_keeps_stored_messages() {
+        let file = TestFile::new();
+        let sqlite = filled_store(&file, 9).await;
+        let limiter = limiter(&sqlite, 10, OverflowPolicy::DropNewest);
+
+        let fitting = limiter
+            .make_room(&incoming("a", 3), || sqlite.message_count())
+            .await
+            .unwrap()
+            .fitting;
+
+        assert_eq!(fitting, 1);
+        assert_eq!(stored_ids(&sqlite).await, (1..=9).collect::<Vec<_>>());
+        // The dropped Messages are not an error
+        assert!(limiter.overflow(2).is_ok());
+    }
+
+    #[tokio::test]
+    async fn reject_fails_only_messages_that_do_not_fit() {
+        let file = TestFile::new();
+        let sqlite = filled_store(&file, 9).await;
+        let limiter = limiter(&sqlite, 10, OverflowPolicy::Reject);
+
+        let fitting = limiter
+            .make_room(&incoming("a", 3), || sqlite.message_count())
+            .await
+            .unwrap()
+            .fitting;
+
+        assert_eq!(fitting, 1);
+        assert_eq!(stored_ids(&sqlite).await, (1..=9).collect::<Vec<_>>());
+        assert!(limiter.overflow(0).is_ok());
+        let error = limiter.overflow(2).unwrap_err();
+        assert!(error.is::<QueueFull>());
+    }
+
+    #[tokio::test]
+    async fn batch_is_stored_whole_or_not_at_all() {
+        let file = TestFile::new();
+        let sqlite = filled_store(&file, 9).await;
+        let store = super::super::start(
+            sqlite.clone(),
+            &config(),
+            Durability::Full,
+            Some(QueueLimit {
+                max_messages: Some(10),
+                max_bytes: None,
+                policy: OverflowPolicy::Reject,
+            }),
+            CancellationToken::new(),
+        );
+
+        let stored = store
+            .d2c_producer
+            .add_all(incoming("a", 3))
+            .await
+            .unwrap();
+        assert_eq!(stored, 0);
+        assert_eq!(stored_ids(&sqlite).await, (1..=9).collect::<Vec<_>>());
+        assert!(store.d2c_producer.overflow(3).unwrap_err().is::<QueueFull>());
+
+        // The messages are stored separately only if they can be
+        let stored = store
+            .d2c_producer
+            .add_many(incoming("a", 3))
+            .await
+            .unwrap();
+        assert_eq!(stored, 1);
+        assert_eq!(sqlite.message_count(), 10);
+    }
+
+    #[tokio::test]
+    async fn downsample_removes_every_other_message_of_stream() {
+        let file = TestFile::new();
+        let sqlite = filled_store(&file, 40).await;
+        let limiter = limiter(&sqlite, 40, OverflowPolicy::Downsample);
+
+        let fitting = limiter
+            .make_room(&incoming("a", 1), || sqlite.message_count())
+            .await
+            .unwrap()
+            .fitting;
+
+        // The Stream `a` consists of the odd IDs, the second and the fourth of them are removed
+        assert_eq!(fitting, 1);
+        let expected = (1..=40)
+            .filter(|&id| id != 3 && id != 7)
+            .collect::<Vec<_>>();
+        assert_eq!(stored_ids(&sqlite).await, expected);
+
+        // The oldest Messages are removed if there are none of the Stream
+        let fitting = limiter
+            .make_room(&incoming("c", 3), || sqlite.message_count())
+            .await
+            .unwrap()
+            .fitting;
+
+        assert_eq!(fitting, 3);
+        let expected = (1..=40)
+            .filter(|&id| ![1, 3, 5, 7].contains(&id))
+            .collect::<Vec<_>>();
+        assert_eq!(stored_ids(&sqlite).await, expected);
+    }
+
+    #[tokio::test]
+    async fn byte_limit_counts_message_contents() {
+        let file = TestFile::new();
+        let sqlite = open_store(&file).await;
+        // The 7 bytes of the stored content count, the rest of the local database file doesn't
+        sqlite.store_message(&new_message("a")).await.unwrap();
+        let limiter = QueueLimiter::new(
+            sqlite.clone(),
+            QueueLimit {
+                max_messages: None,
+                max_bytes: Some(107),
+                policy: OverflowPolicy::DropNewest,
+            },
+        );
+
+        let mut msgs = incoming("a", 3);
+        for msg in &mut msgs {
+            msg.content = Cow::Owned(vec![0; 40]);
+        }
+        let fitting = limiter.make_room(&msgs, || 1).await.unwrap().fitting;
+
+        assert_eq!(fitting, 2);
+    }
+
+    #[tokio::test]
+    async fn byte_limit_removes_oldest_messages_until_contents_fit() {
+        let file = TestFile::new();
+        let sqlite = filled_store(&file, 10).await;
+        let limiter = QueueLimiter::new(
+            sqlite.clone(),
+            QueueLimit {
+                max_messages: None,
+                max_bytes: Some(70),
+                policy: OverflowPolicy::DropOldest,
+            },
+        );
+
+        let fitting = limiter
+            .make_room(&incoming("a", 1), || sqlite.message_count())
+            .await
+            .unwrap()
+            .fitting;
+
+        // Each Message has 7 bytes of content, so removing the one with the lowest priority is enough
+        assert_eq!(fitting, 1);
+        assert_eq!(sqlite.message_bytes(), 63);
+        let expected = (1..=10).filter(|&id| id != 5).collect::<Vec<_>>();
+        assert_eq!(stored_ids(&sqlite).await, expected);
+    }
+
+    #[tokio::test]
+    async fn stored_message_bytes_are_tracked() {
+        let file = TestFile::new();
+        let sqlite = filled_store(&file, 4).await;
+        assert_eq!(sqlite.message_bytes(), 4 * 7);
+
+        sqlite.remove_message(2).await.unwrap();
+        sqlite
+            .remove_messages_until(Priority::Normal, 3)
+            .await
+            .unwrap();
+        assert_eq!(sqlite.message_bytes(), 7);
+
+        // The size is counted again from the stored Messages after a restart
+        drop(sqlite);
+        let sqlite = open_store(&file).await;
+        assert_eq!(sqlite.message_bytes(), 7);
+    }
+
+    #[tokio::test]
+    async fn concurrent_producers_wait_for_each_other() {
+        let file = TestFile::new();
+        let sqlite = filled_store(&file, 9).await;
+        let limiter = limiter(&sqlite, 10, OverflowPolicy::DropNewest);
+
+        let first = limiter
+            .make_room(&incoming("a", 1), || sqlite.message_count())
+            .await
+            .unwrap();
+        assert_eq!(first.fitting, 1);
+
+        // The second producer checks the limit only after the first one has stored its Message
+        let msgs = incoming("a", 1);
+        let second = limiter.make_room(&msgs, || sqlite.message_count());
+        tokio::pin!(second);
+        let waiting = tokio::time::timeout(Duration::from_millis(50), &mut second).await;
+        assert!(waiting.is_err());
+
+        sqlite.store_message(&new_message("a")).await.unwrap();
+        drop(first);
+        assert_eq!(second.await.unwrap().fitting, 0);
+    }
+
+    #[tokio::test]
+    async fn new_database_can_shrink() {
+        let file = TestFile::new();
+        let sqlite = open_store(&file).await;
+
+        // 2 stands for `INCREMENTAL`
+        let mode: i64 = sqlx::query_scalar("PRAGMA auto_vacuum")
+            .fetch_one(&mut *sqlite.connection().await)
+            .await
+            .unwrap();
+        assert_eq!(mode, 2);
+    }
+}
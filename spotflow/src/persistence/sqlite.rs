@@ -3,16 +3,36 @@ use chrono::{DateTime, Utc};
 use http::Uri;
 use log::{debug, warn};
 use sqlx::{Connection, Row, SqliteConnection};
-use std::{fs::File, path::Path, str::FromStr, sync::Arc};
-use tokio::sync::{Mutex, MutexGuard};
+use std::{
+    fs::File,
+    path::Path,
+    str::FromStr,
+    sync::{
+        atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering},
+        Arc,
+    },
+    time::Instant,
+};
+use tokio::sync::{futures::Notified, Mutex, MutexGuard, Notify};
+
+use crate::metrics::MetricsRegistry;
 
 use super::{
-    CloseOption, Compression,
-    {twins::Twin, DeviceMessage},
+    CloseOption, Compression, Priority, StorageProfile,
+    {twins::Twin, DeviceMessage, NewDeviceMessage},
     {ProvisioningToken, RegistrationToken},
 };
 
-const DB_VERSION: &str = "1.2.0";
+const DB_VERSION: &str = "2.0.0";
+
+// The Messages are moved to the schema of version 2.0.0 in chunks of this size, each of them in its own transaction
+const MIGRATION_CHUNK_MESSAGES: i64 = 500;
+
+// Most devices send to only a few streams, so the IDs of all of them usually fit into the cache
+const MAX_CACHED_STREAMS: usize = 64;
+
+// In KiB, SQLite interprets negative values of `cache_size` this way
+const THROUGHPUT_CACHE_SIZE_KIB: i64 = 8 * 1024;
 
 #[derive(Debug, thiserror::Error)]
 pub enum Error {
@@ -25,6 +45,51 @@ pub enum Error {
 #[derive(Debug, Clone)]
 pub struct SqliteStore {
     conn: Arc<Mutex<SqliteConnection>>,
+    // Used to read the device to cloud messages, it's the same connection as `conn` unless a separate one is configured
+    reader: Arc<Mutex<SqliteConnection>>,
+    message_count: Arc<MessageCount>,
+    streams: Arc<StreamCache>,
+    // Set while some of the Messages stored before the update to version 2.0.0 wait in the `LegacyMessages` table
+    legacy: Arc<AtomicBool>,
+    metrics: Arc<MetricsRegistry>,
+}
+
+/// Tracks the number of stored device to cloud messages and the total size of their contents so that the table
+/// doesn't have to be scanned to count them.
+#[derive(Debug, Default)]
+struct MessageCount {
+    count: AtomicUsize,
+    bytes: AtomicU64,
+    changed: Notify,
+}
+
+impl MessageCount {
+    fn add(&self, msgs: &[NewDeviceMessage<'_>]) {
+        let bytes = msgs.iter().map(|msg| msg.content.len() as u64).sum::<u64>();
+        self.count.fetch_add(msgs.len(), Ordering::AcqRel);
+        self.bytes.fetch_add(bytes, Ordering::AcqRel);
+        self.changed.notify_waiters();
+    }
+
+    /// Subtract the removed messages, given by the lengths of their contents.
+    fn remove(&self, lengths: &[i64]) {
+        let bytes = lengths
+            .iter()
+            .map(|&length| u64::try_from(length).unwrap_or_default())
+            .sum::<u64>();
+        // The closures always return `Some`
+        _ = self
+            .count
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |current| {
+                Some(current.saturating_sub(lengths.len()))
+            });
+        _ = self
+            .bytes
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |current| {
+                Some(current.saturating_sub(bytes))
+            });
+        self.changed.notify_waiters();
+    }
 }
 
 pub struct SdkConfiguration {
@@ -58,14 +123,18 @@ impl SqliteStore {
         self.conn.lock().await
     }
 
-    pub async fn load_available_configuration(path: &Path) -> SdkConfigurationFragment {
+    /// Load the configuration stored in the local database file. The connection used for loading is returned as well, so
+    /// that [`SqliteStore::init`] doesn't have to open the file again.
+    pub async fn load_available_configuration(
+        path: &Path,
+    ) -> (SdkConfigurationFragment, Option<SqliteConnection>) {
         if !path.exists() {
             debug!(
                 "The local database file on the path '{}' doesn't exist yet.",
                 path.to_string_lossy(),
             );
 
-            return SdkConfigurationFragment::default();
+            return (SdkConfigurationFragment::default(), None);
         }
 
         debug!(
@@ -73,28 +142,50 @@ impl SqliteStore {
             path.to_string_lossy()
         );
 
-        match try_load_available_configuration(path).await {
-            Ok(fragment) => fragment,
+        let mut conn = match SqliteConnection::connect(&path.as_os_str().to_string_lossy()).await {
+            Ok(conn) => conn,
+            Err(e) => {
+                warn!(
+                    "Loading configuration from the local database file on the path '{}' was skipped \
+                    because of the following error: {e}",
+                    path.to_string_lossy(),
+                );
+                return (SdkConfigurationFragment::default(), None);
+            }
+        };
+
+        match try_load_available_configuration(&mut conn).await {
+            Ok(fragment) => (fragment, Some(conn)),
             Err(e) => {
                 warn!(
                     "Loading configuration from the local database file on the path '{}' was skipped \
                     because of the following error: {e}",
                     path.to_string_lossy(),
                 );
-                SdkConfigurationFragment::default()
+                (SdkConfigurationFragment::default(), Some(conn))
             }
         }
     }
 
     // Setup
     // ================================================================================
-    pub async fn init(path: &Path, config: &SdkConfiguration) -> Result<SqliteStore> {
-        if !Path::new(path).exists() {
+    /// Open the local database file, create or update its schema, and store the provided configuration in it.
+    /// The connection returned by [`SqliteStore::load_available_configuration`] is used if provided.
+    pub async fn init(
+        path: &Path,
+        connection: Option<SqliteConnection>,
+        config: &SdkConfiguration,
+        storage_profile: StorageProfile,
+        metrics: Arc<MetricsRegistry>,
+    ) -> Result<SqliteStore> {
+        if connection.is_none() && !Path::new(path).exists() {
             log::debug!("Creating a local database file");
             File::create(path)?;
         }
-        // let mut conn = SqliteConnection::connect(&path.as_os_str().to_string_lossy()).await?;
-        let conn = SqliteConnection::connect(&path.as_os_str().to_string_lossy()).await;
+        let conn = match connection {
+            Some(conn) => Ok(conn),
+            None => SqliteConnection::connect(&path.as_os_str().to_string_lossy()).await,
+        };
         let mut conn = match conn {
             Ok(conn) => {
                 log::debug!("Connection to SQLite established");
@@ -131,84 +222,331 @@ impl SqliteStore {
             }
         } else {
             log::debug!("Importing schema");
+            // The free pages can be returned to the file system only if the mode is set before any table is created,
+            // changing it later requires rebuilding the whole file
+            sqlx::query("PRAGMA auto_vacuum = INCREMENTAL")
+                .execute(&mut conn)
+                .await?;
             sqlx::query_file!("./db_init.sql")
                 .execute(&mut conn)
                 .await?;
         }
 
-        // In any case update the configuration with the provided values
+        // In any case update the configuration with the provided values, unless they are already stored
 
         let instance_url = config.instance_url.to_string();
 
-        log::debug!("Saving configuration");
-        sqlx::query!(
-            "INSERT OR REPLACE INTO SdkConfiguration (id, db_version, instance_url, provisioning_token, registration_token, rt_expiration, requested_device_id, workspace_id, device_id) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)",
-            0i64,
-            DB_VERSION,
-            instance_url,
-            config.provisioning_token.token,
-            config.registration_token.token,
-            config.registration_token.expiration,
-            config.requested_device_id,
-            config.workspace_id,
-            config.device_id,
-        ).execute(&mut conn)
-        .await?;
-        log::debug!("Configuration saved");
+        if is_configuration_stored(&mut conn, config, &instance_url).await {
+            log::debug!("The stored configuration is up to date");
+        } else {
+            log::debug!("Saving configuration");
+            sqlx::query!(
+                "INSERT OR REPLACE INTO SdkConfiguration (id, db_version, instance_url, provisioning_token, registration_token, rt_expiration, requested_device_id, workspace_id, device_id) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                0i64,
+                DB_VERSION,
+                instance_url,
+                config.provisioning_token.token,
+                config.registration_token.token,
+                config.registration_token.expiration,
+                config.requested_device_id,
+                config.workspace_id,
+                config.device_id,
+            )
+            .execute(&mut conn)
+            .await?;
+            log::debug!("Configuration saved");
+        }
+
+        // The messages are counted only once, the count is then kept up to date when messages are stored and removed
+        let (mut count, mut bytes): (i64, i64) =
+            sqlx::query_as("SELECT COUNT(id), COALESCE(SUM(length(content)), 0) FROM Messages")
+                .fetch_one(&mut conn)
+                .await?;
+
+        let legacy = has_legacy_messages(&mut conn).await?;
+        if legacy {
+            let (legacy_count, legacy_bytes): (i64, i64) = sqlx::query_as(
+                "SELECT COUNT(id), COALESCE(SUM(length(content)), 0) FROM LegacyMessages",
+            )
+            .fetch_one(&mut conn)
+            .await?;
+            log::debug!("{legacy_count} stored Messages are waiting to be moved to the schema of version 2.0.0");
+            count += legacy_count;
+            bytes += legacy_bytes;
+        }
+
+        // This is safe because the results cannot be negative.
+        let message_count = Arc::new(MessageCount {
+            count: AtomicUsize::new(count.try_into().unwrap_or_default()),
+            bytes: AtomicU64::new(bytes.try_into().unwrap_or_default()),
+            changed: Notify::new(),
+        });
+
+        let conn = Arc::new(Mutex::new(conn));
+
+        let reader = match storage_profile {
+            StorageProfile::Durable => {
+                apply_durable_profile(&mut *conn.lock().await).await?;
+                conn.clone()
+            }
+            StorageProfile::Throughput => {
+                log::debug!("Applying the throughput storage profile");
+                apply_throughput_profile(&mut *conn.lock().await).await?;
+
+                let mut reader =
+                    SqliteConnection::connect(&path.as_os_str().to_string_lossy()).await?;
+                set_cache_size(&mut reader).await?;
+                Arc::new(Mutex::new(reader))
+            }
+        };
 
         Ok(SqliteStore {
-            conn: Arc::new(Mutex::new(conn)),
+            conn,
+            reader,
+            message_count,
+            streams: Arc::new(StreamCache::default()),
+            legacy: Arc::new(AtomicBool::new(legacy)),
+            metrics,
         })
     }
 
+    // Migration
+    // ================================================================================
+    /// Whether some of the Messages stored before the update to version 2.0.0 haven't been moved to the new table yet.
+    pub(crate) fn is_migrating(&self) -> bool {
+        self.legacy.load(Ordering::Acquire)
+    }
+
+    /// Move the Messages stored before the update to version 2.0.0 to the new table. Each chunk holds the connection
+    /// only for a moment, so the Messages are stored and sent meanwhile. If the process stops, the next start
+    /// continues with the Messages that haven't been moved yet.
+    pub(crate) async fn finish_migration(self) {
+        loop {
+            match self.move_legacy_chunk().await {
+                Ok(true) => tokio::task::yield_now().await,
+                Ok(false) => return,
+                Err(e) => {
+                    log::error!("Unable to move the stored Messages to the schema of version 2.0.0, the next start will continue: {e:?}");
+                    return;
+                }
+            }
+        }
+    }
+
+    // Returns `false` once all the Messages were moved
+    pub(super) async fn move_legacy_chunk(&self) -> Result<bool> {
+        if !self.is_migrating() {
+            return Ok(false);
+        }
+
+        let mut conn = self.conn.lock().await;
+        if let Some(last_id) = move_legacy_messages(&mut conn).await? {
+            log::debug!("Moved Messages up to ID {last_id} to the schema of version 2.0.0");
+            return Ok(true);
+        }
+        drop(conn);
+
+        // The old table is read only while the flag is set, so the reader is locked to wait for the running queries
+        let reader = if Arc::ptr_eq(&self.reader, &self.conn) {
+            None
+        } else {
+            Some(self.reader.lock().await)
+        };
+        let mut conn = self.conn.lock().await;
+        self.legacy.store(false, Ordering::Release);
+        sqlx::query("DROP TABLE LegacyMessages")
+            .execute(&mut *conn)
+            .await?;
+        drop(reader);
+
+        log::debug!("All the stored Messages were moved to the schema of version 2.0.0");
+        Ok(false)
+    }
+
     // Device to Cloud Messages
     // ================================================================================
-    pub async fn store_message(&self, msg: &DeviceMessage) -> Result<i32> {
+    pub async fn store_message(&self, msg: &NewDeviceMessage<'_>) -> Result<i32> {
         let mut conn = self.conn.lock().await;
-        let record = sqlx::query!(
-            r#"INSERT INTO Messages (site_id, stream_group, stream, batch_id, message_id, content, close_option, compression, batch_slice_id, chunk_id) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?);
-            SELECT last_insert_rowid() as id"#,
-            msg.site_id,
-            msg.stream_group,
-            msg.stream,
-            msg.batch_id,
-            msg.message_id,
-            msg.content,
-            msg.close_option as _,
-            msg.compression as _,
-            msg.batch_slice_id,
-            msg.chunk_id,
-        ).fetch_one(&mut *conn).await?;
-
-        Ok(record.id)
-    }
-
-    pub(crate) async fn list_messages_after(&self, after: i32) -> Result<Vec<DeviceMessage>> {
+        let start = Instant::now();
+        let mut streams = StreamLookup::new(&self.streams);
+        let id = insert_message(&mut conn, &mut streams, msg).await?;
+        streams.committed();
+        self.metrics.sqlite_statement_latency.record_since(start);
+        self.metrics.record_stored(&[id]);
+        self.message_count.add(std::slice::from_ref(msg));
+        Ok(id)
+    }
+
+    /// Store all the messages in a single transaction and return their IDs.
+    pub async fn store_messages(&self, msgs: &[NewDeviceMessage<'_>]) -> Result<Vec<i32>> {
         let mut conn = self.conn.lock().await;
+        let start = Instant::now();
+        let mut transaction = conn.begin().await?;
+        let mut streams = StreamLookup::new(&self.streams);
 
-        sqlx::query_as!(
+        let mut ids = Vec::with_capacity(msgs.len());
+        for msg in msgs {
+            ids.push(insert_message(&mut transaction, &mut streams, msg).await?);
+        }
+
+        transaction.commit().await?;
+        streams.committed();
+        self.metrics.sqlite_statement_latency.record_since(start);
+        self.metrics.record_stored(&ids);
+        self.message_count.add(msgs);
+
+        Ok(ids)
+    }
+
+    pub(crate) async fn list_messages_after(
+        &self,
+        priority: Priority,
+        after: i32,
+    ) -> Result<Vec<DeviceMessage>> {
+        let mut conn = self.reader.lock().await;
+        let start = Instant::now();
+
+        if self.is_migrating() {
+            let messages = list_messages_with_legacy(&mut conn, priority, after).await?;
+            self.metrics.sqlite_statement_latency.record_since(start);
+            return Ok(messages);
+        }
+
+        let messages = sqlx::query_as!(
             DeviceMessage,
-            r#"SELECT id AS "id?: i32", site_id, stream_group, stream, batch_id, message_id, content, close_option AS "close_option!: CloseOption", compression AS "compression!: Compression", batch_slice_id, chunk_id FROM Messages WHERE id > ? ORDER BY id LIMIT 100"#, after,
-        ).fetch_all(&mut *conn).await.map_err(anyhow::Error::from)
+            r#"SELECT m.id AS "id?: i32", s.site_id, s.stream_group, s.stream, m.batch_id, m.message_id, m.content, m.close_option AS "close_option!: CloseOption", m.compression AS "compression!: Compression", m.batch_slice_id, m.chunk_id, m.file_path, m.priority AS "priority!: Priority" FROM Messages AS m JOIN Streams AS s ON s.id = m.stream_id WHERE m.priority = ? AND m.id > ? ORDER BY m.id LIMIT 100"#, priority, after,
+        ).fetch_all(&mut *conn).await?;
+
+        self.metrics.sqlite_statement_latency.record_since(start);
+        Ok(messages)
     }
 
-    pub async fn message_count(&self) -> Result<usize> {
+    pub async fn remove_message(&self, id: i32) -> Result<()> {
         let mut conn = self.conn.lock().await;
-        let res = sqlx::query!("SELECT COUNT(id) as cnt FROM Messages")
-            .fetch_one(&mut *conn)
+        let start = Instant::now();
+        let mut removed: Vec<i64> =
+            sqlx::query_scalar("DELETE FROM Messages WHERE id = ? RETURNING length(content)")
+                .bind(id)
+                .fetch_all(&mut *conn)
+                .await?;
+        if self.is_migrating() {
+            let legacy: Vec<i64> = sqlx::query_scalar(
+                "DELETE FROM LegacyMessages WHERE id = ? RETURNING length(content)",
+            )
+            .bind(id)
+            .fetch_all(&mut *conn)
+            .await?;
+            removed.extend(legacy);
+        }
+        self.metrics.sqlite_statement_latency.record_since(start);
+        self.message_count.remove(&removed);
+
+        Ok(())
+    }
+
+    pub fn message_count(&self) -> usize {
+        self.message_count.count.load(Ordering::Acquire)
+    }
+
+    /// The total size of the contents of the stored messages.
+    pub fn message_bytes(&self) -> u64 {
+        self.message_count.bytes.load(Ordering::Acquire)
+    }
+
+    /// Completes when the number of stored messages changes after this method was called, even if the returned future
+    /// wasn't polled yet.
+    pub(crate) fn message_count_changed(&self) -> Notified<'_> {
+        self.message_count.changed.notified()
+    }
+
+    pub async fn remove_messages_until(&self, priority: Priority, id: i32) -> Result<()> {
+        let mut conn = self.conn.lock().await;
+        let start = Instant::now();
+        let mut removed: Vec<i64> = sqlx::query_scalar(
+            "DELETE FROM Messages WHERE priority = ? AND id <= ? RETURNING length(content)",
+        )
+        .bind(priority)
+        .bind(id)
+        .fetch_all(&mut *conn)
+        .await?;
+        if self.is_migrating() {
+            let legacy: Vec<i64> = sqlx::query_scalar(
+                "DELETE FROM LegacyMessages WHERE priority = ? AND id <= ? RETURNING length(content)",
+            )
+            .bind(priority)
+            .bind(id)
+            .fetch_all(&mut *conn)
             .await?;
+            removed.extend(legacy);
+        }
+        self.metrics.sqlite_statement_latency.record_since(start);
+        self.message_count.remove(&removed);
 
-        // This is safe because the result cannot be negative.
-        Ok(res.cnt.try_into().unwrap_or_default())
+        Ok(())
     }
 
-    pub async fn remove_oldest_message(&self) -> Result<()> {
+    /// Remove the oldest stored messages with the lowest priority and return how many of them were removed. The
+    /// messages that haven't been moved to the schema of version 2.0.0 yet are the oldest ones, so they're removed
+    /// first.
+    pub async fn remove_oldest_messages(&self, count: usize) -> Result<usize> {
+        let mut count = i64::try_from(count).unwrap_or(i64::MAX);
         let mut conn = self.conn.lock().await;
-        sqlx::query!(
-            "DELETE FROM Messages WHERE id = (SELECT id FROM Messages ORDER BY id LIMIT 1)"
+        let start = Instant::now();
+        let mut removed: Vec<i64> = Vec::new();
+        if self.is_migrating() {
+            removed = sqlx::query_scalar(
+                "DELETE FROM LegacyMessages WHERE id IN (SELECT id FROM LegacyMessages ORDER BY priority, id LIMIT ?) RETURNING length(content)",
+            )
+            .bind(count)
+            .fetch_all(&mut *conn)
+            .await?;
+            count = count.saturating_sub(i64::try_from(removed.len()).unwrap_or(i64::MAX));
+        }
+        if count > 0 {
+            let current: Vec<i64> = sqlx::query_scalar(
+                "DELETE FROM Messages WHERE id IN (SELECT id FROM Messages ORDER BY priority, id LIMIT ?) RETURNING length(content)",
+            )
+            .bind(count)
+            .fetch_all(&mut *conn)
+            .await?;
+            removed.extend(current);
+        }
+        self.metrics.sqlite_statement_latency.record_since(start);
+        self.message_count.remove(&removed);
+
+        Ok(removed.len())
+    }
+
+    /// Remove every other of the oldest stored messages of the stream and return how many of them were removed.
+    pub async fn remove_every_other_stream_message(
+        &self,
+        stream_group: Option<&str>,
+        stream: Option<&str>,
+        count: usize,
+    ) -> Result<usize> {
+        let count = i64::try_from(count).unwrap_or(i64::MAX);
+        let mut conn = self.conn.lock().await;
+        let start = Instant::now();
+        let removed: Vec<i64> = sqlx::query_scalar(
+            "DELETE FROM Messages WHERE id IN (SELECT id FROM (SELECT id, ROW_NUMBER() OVER (ORDER BY id) AS position FROM Messages WHERE stream_id IN (SELECT id FROM Streams WHERE stream_group IS ? AND stream IS ?)) WHERE position % 2 = 0 ORDER BY id LIMIT ?) RETURNING length(content)",
         )
-        .execute(&mut *conn)
+        .bind(stream_group)
+        .bind(stream)
+        .bind(count)
+        .fetch_all(&mut *conn)
         .await?;
+        self.metrics.sqlite_statement_latency.record_since(start);
+        self.message_count.remove(&removed);
+
+        Ok(removed.len())
+    }
+
+    /// Return the free pages to the file system.
+    pub async fn release_free_pages(&self) -> Result<()> {
+        let mut conn = self.conn.lock().await;
+        sqlx::query("PRAGMA incremental_vacuum")
+            .execute(&mut *conn)
+            .await?;
 
         Ok(())
     }
@@ -253,10 +591,13 @@ impl SqliteStore {
     async fn save_twin_properties(&self, twin_type: &str, twin: &Twin) -> Result<()> {
         let mut conn = self.conn.lock().await;
         let json = serde_json::to_string(twin).context("Unable to deserialize twin")?;
+        // Only the latest version of each twin is ever loaded, so the older ones are removed right away
         sqlx::query!(
-            r#"INSERT INTO Twins (type, properties) VALUES (?, ?);"#,
+            r#"INSERT INTO Twins (type, properties) VALUES (?, ?);
+            DELETE FROM Twins WHERE type = ? AND id < last_insert_rowid();"#,
             twin_type,
             json,
+            twin_type,
         )
         .execute(&mut *conn)
         .await
@@ -387,10 +728,241 @@ impl SqliteStore {
     }
 }
 
-async fn try_load_available_configuration(path: &Path) -> Result<SdkConfigurationFragment> {
-    let mut conn = SqliteConnection::connect(&path.as_os_str().to_string_lossy()).await?;
+// The journal mode is persistent, so it's always set explicitly to switch back a file that used the other profile before
+async fn apply_durable_profile(conn: &mut SqliteConnection) -> Result<()> {
+    set_journal_mode(conn, "delete").await?;
+    sqlx::query("PRAGMA synchronous = FULL")
+        .execute(&mut *conn)
+        .await?;
+    Ok(())
+}
+
+async fn apply_throughput_profile(conn: &mut SqliteConnection) -> Result<()> {
+    // The journal mode is persistent, the other settings are per connection
+    set_journal_mode(conn, "wal").await?;
+    sqlx::query("PRAGMA synchronous = NORMAL")
+        .execute(&mut *conn)
+        .await?;
+    set_cache_size(conn).await
+}
+
+async fn set_journal_mode(conn: &mut SqliteConnection, mode: &str) -> Result<()> {
+    // SQLite returns the mode that is in effect, which stays unchanged if it cannot be switched
+    let current: String = sqlx::query_scalar(&format!("PRAGMA journal_mode = {mode}"))
+        .fetch_one(&mut *conn)
+        .await?;
+    if !current.eq_ignore_ascii_case(mode) {
+        warn!("Unable to switch the journal mode of the local database file to `{mode}`, it stays `{current}`");
+    }
+    Ok(())
+}
+
+async fn set_cache_size(conn: &mut SqliteConnection) -> Result<()> {
+    sqlx::query(&format!("PRAGMA cache_size = -{THROUGHPUT_CACHE_SIZE_KIB}"))
+        .execute(conn)
+        .await?;
+    Ok(())
+}
+
+// The Messages are read from both tables in the order of their IDs, the moved ones are already in the new table
+async fn list_messages_with_legacy(
+    conn: &mut SqliteConnection,
+    priority: Priority,
+    after: i32,
+) -> Result<Vec<DeviceMessage>> {
+    let rows = sqlx::query(
+        r#"SELECT m.id, s.site_id, s.stream_group, s.stream, m.batch_id, m.message_id, m.content, m.close_option, m.compression, m.batch_slice_id, m.chunk_id, m.file_path, m.priority
+            FROM Messages AS m JOIN Streams AS s ON s.id = m.stream_id WHERE m.priority = ?1 AND m.id > ?2
+        UNION ALL
+        SELECT id, site_id, stream_group, stream, batch_id, message_id, content,
+            CASE close_option
+                WHEN 'None' THEN 0 WHEN 'Close' THEN 1 WHEN 'CloseOnly' THEN 2 WHEN 'CloseMessageOnly' THEN 3
+            END,
+            CASE compression
+                WHEN 'None' THEN 0 WHEN 'BrotliFastest' THEN 1 WHEN 'BrotliSmallestSize' THEN 2
+                WHEN 'BrotliSmallMessages' THEN 3 WHEN 'BrotliCompressed' THEN 4
+            END,
+            batch_slice_id, chunk_id, file_path, priority
+            FROM LegacyMessages WHERE priority = ?1 AND id > ?2
+        ORDER BY 1 LIMIT 100"#,
+    )
+    .bind(priority)
+    .bind(after)
+    .fetch_all(conn)
+    .await?;
+
+    rows.iter()
+        .map(|row| {
+            Ok(DeviceMessage {
+                id: Some(row.try_get(0)?),
+                site_id: row.try_get(1)?,
+                stream_group: row.try_get(2)?,
+                stream: row.try_get(3)?,
+                batch_id: row.try_get(4)?,
+                message_id: row.try_get(5)?,
+                content: row.try_get(6)?,
+                close_option: row.try_get(7)?,
+                compression: row.try_get(8)?,
+                batch_slice_id: row.try_get(9)?,
+                chunk_id: row.try_get(10)?,
+                file_path: row.try_get(11)?,
+                priority: row.try_get(12)?,
+            })
+        })
+        .collect()
+}
+
+// The content is bound as a borrowed slice, so sqlx copies it only once when it sends the statement to its worker thread
+async fn insert_message(
+    conn: &mut SqliteConnection,
+    streams: &mut StreamLookup<'_>,
+    msg: &NewDeviceMessage<'_>,
+) -> Result<i32> {
+    let stream_id = streams.stream_id(&mut *conn, msg).await?;
+    let record = sqlx::query!(
+        r#"INSERT INTO Messages (stream_id, batch_id, message_id, content, close_option, compression, batch_slice_id, chunk_id, file_path, priority) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?);
+            SELECT last_insert_rowid() as id"#,
+        stream_id,
+        msg.batch_id,
+        msg.message_id,
+        &*msg.content,
+        msg.close_option as _,
+        msg.compression as _,
+        msg.batch_slice_id,
+        msg.chunk_id,
+        msg.file_path,
+        msg.priority as _,
+    )
+    .fetch_one(conn)
+    .await?;
+
+    Ok(record.id)
+}
+
+/// The IDs of the recently used streams, so that storing a message usually doesn't have to look its stream up. The
+/// streams are never removed, so a cached ID stays valid.
+#[derive(Debug, Default)]
+struct StreamCache {
+    // Ordered from the most recently used one, so that the stream of the current message is usually found first
+    streams: std::sync::Mutex<Vec<CachedStream>>,
+}
+
+#[derive(Debug)]
+struct CachedStream {
+    site_id: Option<String>,
+    stream_group: Option<String>,
+    stream: Option<String>,
+    id: i64,
+}
+
+impl CachedStream {
+    fn new(msg: &NewDeviceMessage<'_>, id: i64) -> Self {
+        Self {
+            site_id: msg.site_id.clone(),
+            stream_group: msg.stream_group.clone(),
+            stream: msg.stream.clone(),
+            id,
+        }
+    }
+
+    fn matches(&self, msg: &NewDeviceMessage<'_>) -> bool {
+        self.site_id == msg.site_id
+            && self.stream_group == msg.stream_group
+            && self.stream == msg.stream
+    }
+}
+
+impl StreamCache {
+    fn get(&self, msg: &NewDeviceMessage<'_>) -> Option<i64> {
+        let mut streams = self.streams.lock().expect("Stream cache lock is poisoned");
+        let position = streams.iter().position(|stream| stream.matches(msg))?;
+        streams[..=position].rotate_right(1);
+        Some(streams[0].id)
+    }
+
+    fn extend(&self, committed: Vec<CachedStream>) {
+        let mut streams = self.streams.lock().expect("Stream cache lock is poisoned");
+        for stream in committed {
+            streams.truncate(MAX_CACHED_STREAMS - 1);
+            streams.insert(0, stream);
+        }
+    }
+}
+
+/// Looks up the streams of the messages stored by a single statement or transaction. The streams that weren't cached
+/// are added to the cache only once they're committed, because the ID of a stream inserted by a transaction that is
+/// rolled back would be invalid.
+struct StreamLookup<'a> {
+    cache: &'a StreamCache,
+    uncommitted: Vec<CachedStream>,
+}
+
+impl<'a> StreamLookup<'a> {
+    fn new(cache: &'a StreamCache) -> Self {
+        Self {
+            cache,
+            uncommitted: Vec::new(),
+        }
+    }
+
+    async fn stream_id(
+        &mut self,
+        conn: &mut SqliteConnection,
+        msg: &NewDeviceMessage<'_>,
+    ) -> Result<i64> {
+        if let Some(id) = self.cache.get(msg) {
+            return Ok(id);
+        }
+
+        if let Some(stream) = self.uncommitted.iter().find(|stream| stream.matches(msg)) {
+            return Ok(stream.id);
+        }
+
+        let id = load_or_insert_stream(conn, msg).await?;
+        self.uncommitted.push(CachedStream::new(msg, id));
+        Ok(id)
+    }
+
+    fn committed(self) {
+        self.cache.extend(self.uncommitted);
+    }
+}
+
+// The streams are only ever added, so the lookup almost always finds the stream of the message
+async fn load_or_insert_stream(
+    conn: &mut SqliteConnection,
+    msg: &NewDeviceMessage<'_>,
+) -> Result<i64> {
+    let stream_id = sqlx::query_scalar!(
+        "SELECT id FROM Streams WHERE stream_group IS ? AND stream IS ? AND site_id IS ?",
+        msg.stream_group,
+        msg.stream,
+        msg.site_id,
+    )
+    .fetch_optional(&mut *conn)
+    .await?;
+
+    if let Some(stream_id) = stream_id {
+        return Ok(stream_id);
+    }
 
-    let row = load_configuration_row(&mut conn).await?;
+    let record = sqlx::query!(
+        r#"INSERT INTO Streams (site_id, stream_group, stream) VALUES (?, ?, ?);
+            SELECT last_insert_rowid() as id"#,
+        msg.site_id,
+        msg.stream_group,
+        msg.stream,
+    )
+    .fetch_one(conn)
+    .await?;
+
+    Ok(record.id.into())
+}
+
+async fn try_load_available_configuration(
+    conn: &mut SqliteConnection,
+) -> Result<SdkConfigurationFragment> {
+    let row = load_configuration_row(conn).await?;
 
     let db_version: String = row.try_get("db_version")?;
 
@@ -509,6 +1081,24 @@ async fn try_update_version(
         if current_db_version == "1.1.0" {
             known_version = true;
             update_version_to_1_2_0(conn, values).await?;
+            current_db_version = "1.2.0";
+        }
+
+        if current_db_version == "1.2.0" {
+            known_version = true;
+            update_version_to_1_3_0(conn).await?;
+            current_db_version = "1.3.0";
+        }
+
+        if current_db_version == "1.3.0" {
+            known_version = true;
+            update_version_to_1_4_0(conn).await?;
+            current_db_version = "1.4.0";
+        }
+
+        if current_db_version == "1.4.0" {
+            known_version = true;
+            update_version_to_2_0_0(conn).await?;
         }
 
         if !known_version {
@@ -620,6 +1210,174 @@ async fn update_version_to_1_2_0(
     Ok(())
 }
 
+async fn update_version_to_1_3_0(conn: &mut SqliteConnection) -> Result<(), anyhow::Error> {
+    log::debug!("Updating database schema from version 1.2.0 to 1.3.0");
+
+    sqlx::query(
+        r#"BEGIN TRANSACTION;
+        ALTER TABLE Messages ADD file_path TEXT;
+        UPDATE SdkConfiguration SET db_version = '1.3.0' WHERE id = "0";
+        COMMIT"#,
+    )
+    .execute(conn)
+    .await?;
+
+    log::debug!("Database schema updated to version 1.3.0");
+    Ok(())
+}
+
+async fn update_version_to_1_4_0(conn: &mut SqliteConnection) -> Result<(), anyhow::Error> {
+    log::debug!("Updating database schema from version 1.3.0 to 1.4.0");
+
+    sqlx::query(
+        r#"BEGIN TRANSACTION;
+        ALTER TABLE Messages ADD priority INTEGER NOT NULL DEFAULT 1;
+        CREATE INDEX IF NOT EXISTS MessagesByPriority ON Messages (priority, id);
+        UPDATE SdkConfiguration SET db_version = '1.4.0' WHERE id = "0";
+        COMMIT"#,
+    )
+    .execute(conn)
+    .await?;
+
+    log::debug!("Database schema updated to version 1.4.0");
+    Ok(())
+}
+
+// Only the empty tables are created here so that the start doesn't wait for a long queue to be copied. The stored
+// Messages stay in the `LegacyMessages` table, which is read together with the new one, and they're moved to the new
+// table in the background by `SqliteStore::finish_migration`.
+async fn update_version_to_2_0_0(conn: &mut SqliteConnection) -> Result<(), anyhow::Error> {
+    log::debug!("Updating database schema from version 1.4.0 to 2.0.0");
+
+    // The sequence of the new table continues from the old one so that the IDs of the stored Messages aren't reused.
+    // The index of the old table is kept while its Messages are read.
+    sqlx::query(
+        r#"BEGIN TRANSACTION;
+        CREATE TABLE Streams (
+            id                  INTEGER PRIMARY KEY,
+            site_id             TEXT,
+            stream_group        TEXT,
+            stream              TEXT
+        ) STRICT;
+        CREATE INDEX StreamsByName ON Streams (stream_group, stream, site_id);
+
+        ALTER TABLE Messages RENAME TO LegacyMessages;
+        CREATE TABLE Messages (
+            id                  INTEGER PRIMARY KEY AUTOINCREMENT,
+            stream_id           INTEGER NOT NULL,
+            batch_id            TEXT,
+            message_id          TEXT,
+            content             BLOB NOT NULL,
+            close_option        INTEGER NOT NULL, -- CloseOption enum
+            compression         INTEGER NOT NULL, -- Compression enum
+            batch_slice_id      TEXT,
+            chunk_id            TEXT,
+            file_path           TEXT,
+            priority            INTEGER NOT NULL DEFAULT 1,
+
+            FOREIGN KEY(stream_id) REFERENCES Streams(id)
+        ) STRICT;
+        CREATE INDEX MessagesInSendOrder ON Messages (priority, id);
+        CREATE INDEX MessagesByStream ON Messages (stream_id, id);
+        INSERT INTO sqlite_sequence (name, seq) SELECT 'Messages', seq FROM sqlite_sequence WHERE name = 'LegacyMessages';
+
+        CREATE INDEX TwinsByType ON Twins (type, id);
+        UPDATE SdkConfiguration SET db_version = '2.0.0' WHERE id = "0";
+        COMMIT"#,
+    )
+    .execute(conn)
+    .await?;
+
+    log::debug!("Database schema updated to version 2.0.0, the stored Messages will be moved in the background");
+    Ok(())
+}
+
+async fn has_legacy_messages(conn: &mut SqliteConnection) -> Result<bool> {
+    let count: i64 = sqlx::query_scalar(
+        "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'LegacyMessages'",
+    )
+    .fetch_one(conn)
+    .await?;
+    Ok(count > 0)
+}
+
+// Moves the next chunk of the Messages to the new table and returns the ID of the last of them, `None` if there are none
+async fn move_legacy_messages(conn: &mut SqliteConnection) -> Result<Option<i64>> {
+    // The ID of the last Message of the chunk is used so that all the statements work with the same Messages
+    let last_id: Option<i64> = sqlx::query_scalar(
+        "SELECT MAX(id) FROM (SELECT id FROM LegacyMessages ORDER BY id LIMIT ?)",
+    )
+    .bind(MIGRATION_CHUNK_MESSAGES)
+    .fetch_one(&mut *conn)
+    .await?;
+
+    let Some(last_id) = last_id else {
+        return Ok(None);
+    };
+
+    sqlx::query(
+        r#"BEGIN TRANSACTION;
+        INSERT INTO Streams (site_id, stream_group, stream)
+            SELECT DISTINCT m.site_id, m.stream_group, m.stream FROM LegacyMessages AS m
+            WHERE m.id <= ? AND NOT EXISTS (
+                SELECT 1 FROM Streams AS s
+                WHERE s.stream_group IS m.stream_group AND s.stream IS m.stream AND s.site_id IS m.site_id
+            );
+        INSERT INTO Messages (id, stream_id, batch_id, message_id, content, close_option, compression, batch_slice_id, chunk_id, file_path, priority)
+            SELECT
+                m.id,
+                (SELECT s.id FROM Streams AS s WHERE s.stream_group IS m.stream_group AND s.stream IS m.stream AND s.site_id IS m.site_id),
+                m.batch_id,
+                m.message_id,
+                m.content,
+                CASE m.close_option
+                    WHEN 'None' THEN 0 WHEN 'Close' THEN 1 WHEN 'CloseOnly' THEN 2 WHEN 'CloseMessageOnly' THEN 3
+                END,
+                CASE m.compression
+                    WHEN 'None' THEN 0 WHEN 'BrotliFastest' THEN 1 WHEN 'BrotliSmallestSize' THEN 2
+                    WHEN 'BrotliSmallMessages' THEN 3 WHEN 'BrotliCompressed' THEN 4
+                END,
+                m.batch_slice_id,
+                m.chunk_id,
+                m.file_path,
+                m.priority
+            FROM LegacyMessages AS m WHERE m.id <= ? ORDER BY m.id;
+        DELETE FROM LegacyMessages WHERE id <= ?;
+        COMMIT"#,
+    )
+    .bind(last_id)
+    .bind(last_id)
+    .bind(last_id)
+    .execute(&mut *conn)
+    .await?;
+
+    Ok(Some(last_id))
+}
+
+// Rewriting the configuration when it hasn't changed would make every start wait for the write to reach the disk
+async fn is_configuration_stored(
+    conn: &mut SqliteConnection,
+    config: &SdkConfiguration,
+    instance_url: &str,
+) -> bool {
+    let Ok(row) = load_configuration_row(conn).await else {
+        return false;
+    };
+
+    let text = |column: &str| row.try_get::<Option<String>, _>(column).ok().flatten();
+
+    text("db_version").as_deref() == Some(DB_VERSION)
+        && text("instance_url").as_deref() == Some(instance_url)
+        && text("provisioning_token").as_ref() == Some(&config.provisioning_token.token)
+        && text("registration_token").as_ref() == Some(&config.registration_token.token)
+        && row
+            .try_get::<Option<DateTime<Utc>>, _>("rt_expiration")
+            .is_ok_and(|expiration| expiration == config.registration_token.expiration)
+        && text("requested_device_id") == config.requested_device_id
+        && text("workspace_id").as_ref() == Some(&config.workspace_id)
+        && text("device_id").as_ref() == Some(&config.device_id)
+}
+
 async fn load_configuration_row(
     conn: &mut SqliteConnection,
 ) -> Result<sqlx::sqlite::SqliteRow, anyhow::Error> {
@@ -661,3 +1419,314 @@ fn convert_dps_url_to_instance_url(dps_url: &str) -> Result<String, anyhow::Erro
 
     Ok(instance_uri)
 }
+
+#[cfg(test)]
+mod tests {
+    use super::super::test_support::{
+        new_message, open_store, open_store_with_profile, stored_messages, TestFile,
+    };
+    use super::*;
+
+    // The tables of the schema of version 1.4.0 that are used when the Device Client starts
+    const VERSION_1_4_0_SCHEMA: &str = r#"
+        CREATE TABLE Messages (
+            id                  INTEGER PRIMARY KEY AUTOINCREMENT,
+            site_id             TEXT,
+            stream_group        TEXT,
+            stream              TEXT,
+            batch_id            TEXT,
+            message_id          TEXT,
+            content             BLOB NOT NULL,
+            close_option        TEXT NOT NULL,
+            compression         TEXT NOT NULL,
+            batch_slice_id      TEXT,
+            chunk_id            TEXT,
+            file_path           TEXT,
+            priority            INTEGER NOT NULL DEFAULT 1
+        ) STRICT;
+
+        CREATE INDEX MessagesByPriority ON Messages (priority, id);
+
+        CREATE TABLE Twins (
+            id                  INTEGER PRIMARY KEY AUTOINCREMENT,
+            type                TEXT NOT NULL,
+            properties          TEXT NOT NULL
+        ) STRICT;
+
+        CREATE TABLE SdkConfiguration (
+            id                  INTEGER PRIMARY KEY,
+            db_version          TEXT NOT NULL,
+            instance_url        TEXT NOT NULL,
+            provisioning_token  TEXT NOT NULL,
+            registration_token  TEXT NOT NULL,
+            rt_expiration       TEXT,
+            requested_device_id TEXT,
+            workspace_id        TEXT NOT NULL,
+            device_id           TEXT NOT NULL
+        ) STRICT;
+
+        INSERT INTO SdkConfiguration VALUES (0, '1.4.0', 'https://localhost/', 'provisioning', 'registration', NULL, NULL, 'workspace', 'device');
+    "#;
+
+    const CLOSE_OPTIONS: [(&str, CloseOption); 4] = [
+        ("None", CloseOption::None),
+        ("Close", CloseOption::Close),
+        ("CloseOnly", CloseOption::CloseOnly),
+        ("CloseMessageOnly", CloseOption::CloseMessageOnly),
+    ];
+
+    const COMPRESSIONS: [(&str, Compression); 5] = [
+        ("None", Compression::None),
+        ("BrotliFastest", Compression::BrotliFastest),
+        ("BrotliSmallestSize", Compression::BrotliSmallestSize),
+        ("BrotliSmallMessages", Compression::BrotliSmallMessages),
+        ("BrotliCompressed", Compression::BrotliCompressed),
+    ];
+
+    // The migrated database contains the Messages 1 to `KEPT_MESSAGES`, the following ones were already removed
+    const KEPT_MESSAGES: i32 = 1200;
+    const STORED_MESSAGES: i32 = 1205;
+
+    // The properties of the Message with the provided ID, each of them cycles through the possible values
+    fn site_id(id: i32) -> Option<String> {
+        (id % 2 == 0).then(|| String::from("site"))
+    }
+
+    fn stream(id: i32) -> Option<String> {
+        (id % 3 != 0).then(|| format!("stream-{}", id % 3))
+    }
+
+    fn close_option(id: i32) -> (&'static str, CloseOption) {
+        CLOSE_OPTIONS[usize::try_from(id).unwrap() % CLOSE_OPTIONS.len()]
+    }
+
+    fn compression(id: i32) -> (&'static str, Compression) {
+        COMPRESSIONS[usize::try_from(id).unwrap() % COMPRESSIONS.len()]
+    }
+
+    fn priority(id: i32) -> Priority {
+        Priority::DESCENDING[usize::try_from(id).unwrap() % Priority::DESCENDING.len()]
+    }
+
+    async fn create_version_1_4_0(file: &TestFile) -> SqliteConnection {
+        File::create(&file.0).unwrap();
+        let mut conn = SqliteConnection::connect(&file.0.to_string_lossy())
+            .await
+            .unwrap();
+        sqlx::query(VERSION_1_4_0_SCHEMA)
+            .execute(&mut conn)
+            .await
+            .unwrap();
+
+        let mut transaction = conn.begin().await.unwrap();
+        for id in 1..=STORED_MESSAGES {
+            sqlx::query(
+                "INSERT INTO Messages (site_id, stream_group, stream, batch_id, content, close_option, compression, priority) VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+            )
+            .bind(site_id(id))
+            .bind("group")
+            .bind(stream(id))
+            .bind(format!("batch-{id}"))
+            .bind(id.to_le_bytes().to_vec())
+            .bind(close_option(id).0)
+            .bind(compression(id).0)
+            .bind(priority(id) as i32)
+            .execute(&mut *transaction)
+            .await
+            .unwrap();
+        }
+        transaction.commit().await.unwrap();
+
+        sqlx::query("DELETE FROM Messages WHERE id > ?")
+            .bind(KEPT_MESSAGES)
+            .execute(&mut conn)
+            .await
+            .unwrap();
+
+        conn
+    }
+
+    // Check that the Messages with the expected IDs are stored, the ones stored before the migration unchanged
+    async fn assert_messages(store: &SqliteStore, expected_ids: impl IntoIterator<Item = i32>) {
+        let messages = stored_messages(store).await;
+
+        let mut ids = messages
+            .iter()
+            .map(|msg| msg.id.unwrap())
+            .collect::<Vec<_>>();
+        ids.sort_unstable();
+        assert_eq!(ids, expected_ids.into_iter().collect::<Vec<_>>());
+        assert_eq!(store.message_count(), messages.len());
+
+        // Listed from the highest priority, the Messages of each priority in the order in which they were stored
+        for pair in messages.windows(2) {
+            assert!(
+                pair[0].priority > pair[1].priority
+                    || (pair[0].priority == pair[1].priority && pair[0].id < pair[1].id)
+            );
+        }
+
+        for msg in messages.iter().filter(|msg| msg.id <= Some(KEPT_MESSAGES)) {
+            let id = msg.id.unwrap();
+            assert_eq!(msg.site_id, site_id(id));
+            assert_eq!(msg.stream_group.as_deref(), Some("group"));
+            assert_eq!(msg.stream, stream(id));
+            assert_eq!(msg.batch_id, Some(format!("batch-{id}")));
+            assert_eq!(msg.content, id.to_le_bytes());
+            assert_eq!(msg.close_option as i32, close_option(id).1 as i32);
+            assert_eq!(msg.compression, compression(id).1);
+            assert_eq!(msg.priority, priority(id));
+        }
+
+        let db_version: String =
+            sqlx::query_scalar(r#"SELECT db_version FROM SdkConfiguration WHERE id = "0""#)
+                .fetch_one(&mut *store.connection().await)
+                .await
+                .unwrap();
+        assert_eq!(db_version, DB_VERSION);
+    }
+
+    async fn assert_migration_finished(store: &SqliteStore, expected_streams: i64) {
+        assert!(!store.is_migrating());
+
+        let mut conn = store.connection().await;
+        assert!(!has_legacy_messages(&mut conn).await.unwrap());
+
+        // Each combination of the site and the stream is stored once
+        let streams: i64 = sqlx::query_scalar("SELECT COUNT(*) FROM Streams")
+            .fetch_one(&mut *conn)
+            .await
+            .unwrap();
+        assert_eq!(streams, expected_streams);
+    }
+
+    #[tokio::test]
+    async fn migrates_version_1_4_0() {
+        let file = TestFile::new();
+        create_version_1_4_0(&file).await.close().await.unwrap();
+
+        let store = open_store(&file).await;
+        assert!(store.is_migrating());
+        store.clone().finish_migration().await;
+
+        assert_migration_finished(&store, 6).await;
+        assert_messages(&store, 1..=KEPT_MESSAGES).await;
+
+        // The IDs of the Messages removed before the migration are not reused
+        let id = store.store_message(&new_message("new")).await.unwrap();
+        assert_eq!(id, STORED_MESSAGES + 1);
+    }
+
+    #[tokio::test]
+    async fn stores_and_sends_messages_before_migration_finishes() {
+        let file = TestFile::new();
+        create_version_1_4_0(&file).await.close().await.unwrap();
+
+        // The start doesn't wait for the stored Messages to be moved
+        let store = open_store(&file).await;
+        assert!(store.is_migrating());
+        assert_eq!(
+            store.message_count(),
+            usize::try_from(KEPT_MESSAGES).unwrap()
+        );
+
+        let new_id = store.store_message(&new_message("new")).await.unwrap();
+        assert_eq!(new_id, STORED_MESSAGES + 1);
+        let expected = || (2..=KEPT_MESSAGES).chain([new_id]);
+
+        // The Messages are listed for sending and removed once acknowledged from both tables
+        store.remove_message(1).await.unwrap();
+        assert_messages(&store, expected()).await;
+
+        assert!(store.move_legacy_chunk().await.unwrap());
+        assert!(store.is_migrating());
+        assert_messages(&store, expected()).await;
+
+        store.clone().finish_migration().await;
+        assert_migration_finished(&store, 7).await;
+        assert_messages(&store, expected()).await;
+    }
+
+    #[tokio::test]
+    async fn resumes_interrupted_migration() {
+        let file = TestFile::new();
+        create_version_1_4_0(&file).await.close().await.unwrap();
+
+        // The process stops after the first chunk of the Messages is moved
+        let store = open_store(&file).await;
+        assert!(store.move_legacy_chunk().await.unwrap());
+        drop(store);
+
+        let store = open_store(&file).await;
+        assert!(store.is_migrating());
+        assert_messages(&store, 1..=KEPT_MESSAGES).await;
+
+        store.clone().finish_migration().await;
+        assert_migration_finished(&store, 6).await;
+        assert_messages(&store, 1..=KEPT_MESSAGES).await;
+
+        let id = store.store_message(&new_message("new")).await.unwrap();
+        assert_eq!(id, STORED_MESSAGES + 1);
+    }
+
+    #[tokio::test]
+    async fn stores_each_stream_once() {
+        let file = TestFile::new();
+        let store = open_store(&file).await;
+
+        store
+            .store_messages(&[
+                new_message("first"),
+                new_message("first"),
+                new_message("second"),
+            ])
+            .await
+            .unwrap();
+        store.store_message(&new_message("first")).await.unwrap();
+        store.store_message(&new_message("second")).await.unwrap();
+
+        let streams = stored_messages(&store)
+            .await
+            .into_iter()
+            .map(|msg| msg.stream.unwrap())
+            .collect::<Vec<_>>();
+        assert_eq!(streams, ["first", "first", "second", "first", "second"]);
+
+        let count: i64 = sqlx::query_scalar("SELECT COUNT(*) FROM Streams")
+            .fetch_one(&mut *store.connection().await)
+            .await
+            .unwrap();
+        assert_eq!(count, 2);
+    }
+
+    async fn journal_mode(store: &SqliteStore) -> String {
+        sqlx::query_scalar("PRAGMA journal_mode")
+            .fetch_one(&mut *store.connection().await)
+            .await
+            .unwrap()
+    }
+
+    #[tokio::test]
+    async fn durable_profile_switches_off_write_ahead_log() {
+        let file = TestFile::new();
+        File::create(&file.0).unwrap();
+        let mut conn = SqliteConnection::connect(&file.0.to_string_lossy())
+            .await
+            .unwrap();
+        sqlx::query("PRAGMA journal_mode = WAL")
+            .execute(&mut conn)
+            .await
+            .unwrap();
+        conn.close().await.unwrap();
+
+        let store = open_store(&file).await;
+        assert_eq!(journal_mode(&store).await, "delete");
+    }
+
+    #[tokio::test]
+    async fn throughput_profile_uses_write_ahead_log() {
+        let file = TestFile::new();
+        let store = open_store_with_profile(&file, StorageProfile::Throughput).await;
+        assert_eq!(journal_mode(&store).await, "wal");
+    }
+}
@@ -5,7 +5,7 @@
 
 // To use this channel for d2c messages we would need to implement acknowledge last. Or the callsite would have to considerably change
 
-use std::{marker::PhantomData, sync::Arc};
+use std::{collections::VecDeque, marker::PhantomData, sync::Arc};
 
 use anyhow::{Context, Result};
 use async_trait::async_trait;
@@ -25,12 +25,41 @@ use super::sqlite::SqliteStore;
 /// If the channel is closed any unacknowledged messages will be delivered again starting from the lowest ID.
 /// The store operations must create IDs higher than the last received value. This is trivially done by returning ascending series by using SQLite AUTOINCREMENT.
 #[async_trait]
-pub trait Storable: Sized {
+pub trait Storable: Sized + Send {
+    /// How many objects the receiver loads at once. The objects that are loaded ahead wait in memory until they are
+    /// received, so their rows must not be changed by anything else than the channel in the meantime.
+    const PREFETCH: usize = 1;
+
     fn id(&self) -> i32;
     async fn store(&self, conn: &mut SqliteConnection) -> Result<i32>;
     async fn load(conn: &mut SqliteConnection, minimum_id: i32) -> Result<Option<Self>>;
     async fn remove(conn: &mut SqliteConnection, id: i32) -> Result<()>;
     async fn count(conn: &mut SqliteConnection) -> Result<usize>;
+
+    /// Load up to `limit` objects with IDs higher than `minimum_id` in an ascending order.
+    async fn load_many(
+        conn: &mut SqliteConnection,
+        minimum_id: i32,
+        limit: usize,
+    ) -> Result<Vec<Self>> {
+        let mut objs = Vec::new();
+        let mut minimum_id = minimum_id;
+        while objs.len() < limit {
+            let Some(obj) = Self::load(&mut *conn, minimum_id).await? else {
+                break;
+            };
+            minimum_id = obj.id();
+            objs.push(obj);
+        }
+        Ok(objs)
+    }
+
+    async fn remove_many(conn: &mut SqliteConnection, ids: &[i32]) -> Result<()> {
+        for &id in ids {
+            Self::remove(&mut *conn, id).await?;
+        }
+        Ok(())
+    }
 }
 
 pub fn channel<T: Storable>(store: SqliteStore) -> (Sender<T>, Receiver<T>) {
@@ -45,6 +74,7 @@ pub fn channel<T: Storable>(store: SqliteStore) -> (Sender<T>, Receiver<T>) {
             store,
             last_saved: watch_rx,
             last_received: None,
+            prefetched: VecDeque::new(),
             phantom: PhantomData,
         },
     )
@@ -61,7 +91,9 @@ pub struct Sender<T> {
 pub struct Receiver<T> {
     store: SqliteStore,
     last_saved: watch::Receiver<Option<i32>>,
+    // The ID of the last object loaded from the database, which might still wait in `prefetched`
     last_received: Option<i32>,
+    prefetched: VecDeque<T>,
     phantom: PhantomData<T>,
 }
 
@@ -92,21 +124,52 @@ impl<T: Storable + Sync> Sender<T> {
 
 impl<T: Storable + Send + Sync> Receiver<T> {
     pub async fn recv(&mut self, cancellation: &Option<CancellationToken>) -> Result<T> {
-        let last_inserted = self.wait_new(cancellation).await?;
+        if let Some(obj) = self.prefetched.pop_front() {
+            return Ok(obj);
+        }
 
-        let mut conn = self.store.connection().await;
+        let last_inserted = self.wait_new(cancellation).await?;
 
-        let obj = T::load(&mut conn, self.last_received.unwrap_or(i32::MIN))
+        let objs = {
+            let mut conn = self.store.connection().await;
+            T::load_many(
+                &mut conn,
+                self.last_received.unwrap_or(i32::MIN),
+                T::PREFETCH.max(1),
+            )
             .await?
-            .ok_or_else(|| {
-                anyhow::anyhow!(
-                    "Unable to retrieve object with ID {:?} that should have already been stored.",
-                    last_inserted
-                )
-            })?;
-        self.last_received = Some(obj.id());
-
-        Ok(obj)
+        };
+
+        let Some(last) = objs.last() else {
+            anyhow::bail!(
+                "Unable to retrieve object with ID {:?} that should have already been stored.",
+                last_inserted
+            );
+        };
+        self.last_received = Some(last.id());
+        self.prefetched.extend(objs);
+
+        Ok(self
+            .prefetched
+            .pop_front()
+            .expect("At least one object was just loaded"))
+    }
+
+    /// Wait for at least one object and return it together with up to `max - 1` other objects that are already
+    /// loaded in memory.
+    pub async fn recv_batch(
+        &mut self,
+        max: usize,
+        cancellation: &Option<CancellationToken>,
+    ) -> Result<Vec<T>> {
+        let first = self.recv(cancellation).await?;
+
+        let available = self.prefetched.len().min(max.saturating_sub(1));
+        let mut objs = Vec::with_capacity(available + 1);
+        objs.push(first);
+        objs.extend(self.prefetched.drain(..available));
+
+        Ok(objs)
     }
 
     async fn wait_new(&mut self, cancellation: &Option<CancellationToken>) -> Result<i32> {
@@ -138,6 +201,17 @@ impl<T: Storable + Send + Sync> Receiver<T> {
         T::remove(&mut conn, obj.id()).await
     }
 
+    /// Acknowledge all the objects while holding the connection only once.
+    pub async fn ack_many(&self, objs: &[T]) -> Result<()> {
+        if objs.is_empty() {
+            return Ok(());
+        }
+
+        let ids = objs.iter().map(Storable::id).collect::<Vec<_>>();
+        let mut conn = self.store.connection().await;
+        T::remove_many(&mut conn, &ids).await
+    }
+
     pub async fn count(&self) -> Result<usize> {
         let mut conn = self.store.connection().await;
         T::count(&mut conn).await
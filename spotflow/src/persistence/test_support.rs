@@ -0,0 +1,114 @@
+use std::{borrow::Cow, path::PathBuf, sync::Arc};
+
+use http::Uri;
+
+use crate::metrics::MetricsRegistry;
+
+use super::{
+    sqlite::{SdkConfiguration, SqliteStore},
+    Acknowledger, CloseOption, Compression, DeviceMessage, NewDeviceMessage, Priority,
+    ProvisioningToken, RegistrationToken, StorageProfile,
+};
+
+/// A local database file that is removed when the test finishes.
+pub(crate) struct TestFile(pub(crate) PathBuf);
+
+impl TestFile {
+    pub(crate) fn new() -> Self {
+        Self(std::env::temp_dir().join(format!("spotflow-test-{}.db", uuid::Uuid::new_v4())))
+    }
+}
+
+impl Drop for TestFile {
+    fn drop(&mut self) {
+        _ = std::fs::remove_file(&self.0);
+        // The files of the write-ahead log
+        for suffix in ["-wal", "-shm"] {
+            let mut path = self.0.clone().into_os_string();
+            path.push(suffix);
+            _ = std::fs::remove_file(path);
+        }
+    }
+}
+
+pub(crate) fn config() -> SdkConfiguration {
+    SdkConfiguration {
+        instance_url: Uri::from_static("https://localhost/"),
+        provisioning_token: ProvisioningToken {
+            token: String::from("provisioning"),
+        },
+        registration_token: RegistrationToken {
+            token: String::from("registration"),
+            expiration: None,
+        },
+        requested_device_id: None,
+        workspace_id: String::from("workspace"),
+        device_id: String::from("device"),
+        site_id: None,
+    }
+}
+
+pub(crate) async fn open_store(file: &TestFile) -> SqliteStore {
+    open_store_with_profile(file, StorageProfile::Durable).await
+}
+
+pub(crate) async fn open_store_with_profile(
+    file: &TestFile,
+    storage_profile: StorageProfile,
+) -> SqliteStore {
+    SqliteStore::init(
+        &file.0,
+        None,
+        &config(),
+        storage_profile,
+        Arc::new(MetricsRegistry::new()),
+    )
+    .await
+    .unwrap()
+}
+
+pub(crate) fn new_message(stream: &str) -> NewDeviceMessage<'static> {
+    NewDeviceMessage {
+        site_id: None,
+        stream_group: Some(String::from("group")),
+        stream: Some(String::from(stream)),
+        batch_id: None,
+        message_id: None,
+        content: Cow::Owned(b"content".to_vec()),
+        close_option: CloseOption::None,
+        compression: Compression::None,
+        batch_slice_id: None,
+        chunk_id: None,
+        file_path: None,
+        priority: Priority::Normal,
+    }
+}
+
+/// Store the Message and return it the way the consumer reads it.
+pub(crate) async fn store_message(store: &SqliteStore, msg: NewDeviceMessage<'_>) -> DeviceMessage {
+    let id = store.store_message(&msg).await.unwrap();
+    msg.into_device_message(id)
+}
+
+pub(crate) fn acknowledger(store: &SqliteStore) -> Acknowledger {
+    Acknowledger {
+        inner: store.clone(),
+    }
+}
+
+/// Read all the stored Messages in the order in which they are sent.
+pub(crate) async fn stored_messages(store: &SqliteStore) -> Vec<DeviceMessage> {
+    let mut messages = Vec::new();
+    for priority in Priority::DESCENDING {
+        let mut after = -1;
+        loop {
+            let listed = store.list_messages_after(priority, after).await.unwrap();
+            let Some(last) = listed.last() else {
+                break;
+            };
+            after = last.id.unwrap();
+            messages.extend(listed);
+        }
+    }
+    messages
+}
@@ -2,10 +2,13 @@ use anyhow::{bail, Context, Result};
 use async_trait::async_trait;
 use json_patch::merge;
 use serde::{Deserialize, Serialize};
-use sqlx::SqliteConnection;
+use sqlx::{QueryBuilder, Row, Sqlite, SqliteConnection};
 
 use super::sqlite_channel::Storable;
 
+// Bounded by the number of parameters allowed in a statement by SQLite versions before 3.32
+const IDS_PER_DELETE: usize = 900;
+
 #[derive(Deserialize, Debug)]
 pub struct Twins {
     pub reported: Twin,
@@ -79,6 +82,9 @@ struct ReportedPropertiesUpdateDb {
 
 #[async_trait]
 impl Storable for ReportedPropertiesUpdate {
+    // The pending updates are coalesced into a single patch before they are sent
+    const PREFETCH: usize = 32;
+
     fn id(&self) -> i32 {
         // This is only ever called on a retrieved object which has to have an ID
         self.id
@@ -128,6 +134,52 @@ impl Storable for ReportedPropertiesUpdate {
         Ok(update)
     }
 
+    async fn load_many(
+        conn: &mut SqliteConnection,
+        minimum_id: i32,
+        limit: usize,
+    ) -> Result<Vec<Self>> {
+        let limit = i64::try_from(limit).unwrap_or(i64::MAX);
+
+        let rows = sqlx::query(
+            "SELECT id, patch, update_type FROM ReportedPropertiesUpdates WHERE id > ? ORDER BY id LIMIT ?",
+        )
+        .bind(minimum_id)
+        .bind(limit)
+        .fetch_all(conn)
+        .await
+        .context("Unable to load reported properties updates")?;
+
+        rows.into_iter()
+            .map(|row| {
+                let id: i32 = row.try_get("id")?;
+                let patch: String = row.try_get("patch")?;
+                let patch = serde_json::from_str(&patch)
+                    .context(format!("Malformed reported properties update with ID {id}"))?;
+                Ok(ReportedPropertiesUpdate {
+                    id: Some(id),
+                    update_type: row.try_get("update_type")?,
+                    patch,
+                })
+            })
+            .collect()
+    }
+
+    async fn remove_many(conn: &mut SqliteConnection, ids: &[i32]) -> Result<()> {
+        for chunk in ids.chunks(IDS_PER_DELETE) {
+            let mut query =
+                QueryBuilder::<Sqlite>::new("DELETE FROM ReportedPropertiesUpdates WHERE id IN (");
+            let mut separated = query.separated(", ");
+            for id in chunk {
+                separated.push_bind(*id);
+            }
+            query.push(")");
+            query.build().execute(&mut *conn).await?;
+        }
+
+        Ok(())
+    }
+
     async fn remove(conn: &mut SqliteConnection, id: i32) -> Result<()> {
         sqlx::query!("DELETE FROM ReportedPropertiesUpdates WHERE id = ?", id,)
             .execute(conn)
@@ -1 +0,0 @@
-pub(crate) mod thread;